@@ -1100,10 +1100,16 @@ namespace crow
             return (std::filesystem::path(path) / fname).string();
         }
 
+        /// Uppercases an ASCII letter without consulting any locale, leaves every other byte as is.
+        inline static char ascii_toupper(char c)
+        {
+            return (c >= 'a' && c <= 'z') ? static_cast<char>(c - ('a' - 'A')) : c;
+        }
+
         /**
          * @brief Checks two string for equality.
          * Always returns false if strings differ in size.
-         * Defaults to case-insensitive comparison.
+         * Defaults to case-insensitive (ASCII) comparison.
          */
         inline static bool string_equals(const std::string_view l, const std::string_view r, bool case_sensitive = false)
         {
@@ -1119,7 +1125,7 @@ namespace crow
                 }
                 else
                 {
-                    if (std::toupper(l[i]) != std::toupper(r[i]))
+                    if (ascii_toupper(l[i]) != ascii_toupper(r[i]))
                         return false;
                 }
             }
@@ -1326,6 +1332,19 @@ namespace crow
             f(error_code());
         }
 
+        /// The protocol negotiated through ALPN, plain TCP connections never have one.
+        std::string alpn_protocol()
+        {
+            return {};
+        }
+
+        /// Call `f` once there's data to read (or the connection was closed), without reading any of it.
+        template<typename F>
+        void async_wait_readable(F f)
+        {
+            socket_.async_wait(tcp::socket::wait_read, f);
+        }
+
         tcp::socket socket_;
     };
 
@@ -1409,6 +1428,24 @@ namespace crow
                                          });
         }
 
+        /// Call `f` right away, there's no telling whether the SSL stream already holds decrypted data without reading.
+        template<typename F>
+        void async_wait_readable(F f)
+        {
+            f(error_code());
+        }
+
+        /// The protocol negotiated through ALPN during the handshake, empty if none was.
+        std::string alpn_protocol()
+        {
+            const unsigned char* protocol = nullptr;
+            unsigned int length = 0;
+            SSL_get0_alpn_selected(ssl_socket_->native_handle(), &protocol, &length);
+            if (!protocol)
+                return {};
+            return std::string(reinterpret_cast<const char*>(protocol), length);
+        }
+
         std::unique_ptr<asio::ssl::stream<tcp::socket>> ssl_socket_;
     };
 #endif
@@ -1426,9 +1463,14 @@ namespace crow
         virtual std::string dump() const = 0;
 
         returnable(std::string ctype):
-          content_type{ctype}
+          content_type{std::move(ctype)}
         {}
 
+        returnable(const returnable&) = default;
+        returnable(returnable&&) noexcept = default;
+        returnable& operator=(const returnable&) = default;
+        returnable& operator=(returnable&&) = default;
+
         virtual ~returnable(){};
     };
 } // namespace crow
@@ -2055,12 +2097,25 @@ namespace crow
 
 
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace crow
 {
@@ -2083,12 +2138,26 @@ namespace crow
         Critical,
     };
 
+    /// Formats of the access log, which has a line for every response.
+    enum class AccessLogFormat
+    {
+        None, ///< No access log (the default), responses are only logged at the Info level.
+        JSON, ///< JSON lines.
+        TSV,  ///< Tab separated values.
+    };
+
     class ILogHandler
     {
     public:
         virtual ~ILogHandler() = default;
 
         virtual void log(std::string message, LogLevel level) = 0;
+
+        /// Write a formatted access log line (without a line break), logged as an Info message unless overridden.
+        virtual void log_access(std::string line)
+        {
+            log(std::move(line), LogLevel::Info);
+        }
     };
 
     class CerrLogHandler : public ILogHandler
@@ -2115,7 +2184,15 @@ namespace crow
                     prefix = "CRITICAL";
                     break;
             }
-            std::cerr << std::string("(") + timestamp() + std::string(") [") + prefix + std::string("] ") + message << std::endl;
+            // std::cerr flushes after every output operation, a single one is a single write
+            std::string line = std::string("(") + timestamp() + std::string(") [") + prefix + std::string("] ") + message + '\n';
+            std::cerr.write(line.data(), line.size());
+        }
+
+        void log_access(std::string line) override
+        {
+            line += '\n';
+            std::cerr.write(line.data(), line.size());
         }
 
     private:
@@ -2145,21 +2222,299 @@ namespace crow
         }
     };
 
+    namespace detail
+    {
+        class log_writer;
+
+        /// The arguments of a log message in binary form, formatted only when (and where) the message is written.
+
+        ///
+        /// Numbers, characters, strings and pointers are stored as they are, anything else is formatted right away with `operator<<`.
+        /// Arguments are kept in place up to `record_capacity` bytes and on the heap beyond that. Records queued for the \ref log_writer are limited
+        /// to `record_capacity`, whatever doesn't fit is cut off and marked with `...`.
+        class log_arguments
+        {
+        public:
+            static constexpr size_t record_capacity = 480;
+
+            log_arguments() = default;
+
+            /// Arguments limited to `limit` bytes.
+            explicit log_arguments(size_t limit):
+              limit_(limit)
+            {}
+
+            log_arguments(const log_arguments&) = delete;
+            log_arguments& operator=(const log_arguments&) = delete;
+
+            enum class tag : uint8_t
+            {
+                Signed,
+                Unsigned,
+                Floating,
+                Character,
+                String,
+                Pointer,
+                Truncated,
+            };
+
+            /// A single decoded argument.
+            struct value
+            {
+                tag type{};
+                int64_t i{};
+                uint64_t u{};
+                double d{};
+                char c{};
+                std::string_view s;
+            };
+
+            template<typename T>
+            void append(const T& v)
+            {
+                using U = std::decay_t<T>;
+                if constexpr (std::is_same<U, char>::value || std::is_same<U, signed char>::value || std::is_same<U, unsigned char>::value)
+                    append_value(tag::Character, static_cast<char>(v));
+                else if constexpr (std::is_same<U, bool>::value)
+                    append_value(tag::Unsigned, static_cast<uint64_t>(v));
+                else if constexpr (std::is_integral<U>::value && std::is_signed<U>::value)
+                    append_value(tag::Signed, static_cast<int64_t>(v));
+                else if constexpr (std::is_integral<U>::value)
+                    append_value(tag::Unsigned, static_cast<uint64_t>(v));
+                else if constexpr (std::is_floating_point<U>::value)
+                    append_value(tag::Floating, static_cast<double>(v));
+                else if constexpr (std::is_convertible<const T&, std::string_view>::value)
+                    append_string(std::string_view(v));
+                else if constexpr (std::is_pointer<U>::value)
+                    append_value(tag::Pointer, reinterpret_cast<uintptr_t>(v));
+                else
+                {
+                    thread_local std::ostringstream stream;
+                    stream.str(std::string());
+                    stream.clear();
+                    stream << v;
+                    append_string(stream.str());
+                }
+            }
+
+            const char* data() const
+            {
+                return data_;
+            }
+
+            size_t size() const
+            {
+                return size_;
+            }
+
+            /// Append the arguments of `data` (as encoded by another log_arguments), cutting them off where they don't fit.
+            void append_encoded(const char* data, size_t size)
+            {
+                const char* end = data + size;
+                value v;
+                while (!truncated_ && next(data, end, v))
+                {
+                    switch (v.type)
+                    {
+                        case tag::Signed: append_value(tag::Signed, v.i); break;
+                        case tag::Unsigned: append_value(tag::Unsigned, v.u); break;
+                        case tag::Floating: append_value(tag::Floating, v.d); break;
+                        case tag::Character: append_value(tag::Character, v.c); break;
+                        case tag::String: append_string(v.s); break;
+                        case tag::Pointer: append_value(tag::Pointer, v.u); break;
+                        case tag::Truncated: truncate(); break;
+                    }
+                }
+            }
+
+            /// Decode the next argument of `data`, returns false once there are none left.
+            static bool next(const char*& data, const char* end, value& out)
+            {
+                if (data >= end)
+                    return false;
+
+                out.type = static_cast<tag>(*data++);
+                switch (out.type)
+                {
+                    case tag::Signed: read(data, out.i); break;
+                    case tag::Unsigned: read(data, out.u); break;
+                    case tag::Floating: read(data, out.d); break;
+                    case tag::Character: read(data, out.c); break;
+                    case tag::Pointer: read(data, out.u); break;
+                    case tag::String:
+                    {
+                        uint32_t length;
+                        read(data, length);
+                        out.s = std::string_view(data, length);
+                        data += length;
+                        break;
+                    }
+                    case tag::Truncated: break;
+                }
+                return true;
+            }
+
+            /// Format every argument of `data` the way `std::ostream` would, appending them to `out`.
+            static void format(const char* data, size_t size, std::string& out)
+            {
+                const char* end = data + size;
+                value v;
+                while (next(data, end, v))
+                {
+                    char number[32];
+                    switch (v.type)
+                    {
+                        case tag::Signed: out.append(number, std::to_chars(number, number + sizeof(number), v.i).ptr); break;
+                        case tag::Unsigned: out.append(number, std::to_chars(number, number + sizeof(number), v.u).ptr); break;
+                        case tag::Floating: out.append(number, snprintf(number, sizeof(number), "%g", v.d)); break;
+                        case tag::Character: out += v.c; break;
+                        case tag::String: out += v.s; break;
+                        case tag::Pointer:
+                            if (!v.u)
+                            {
+                                out += '0';
+                                break;
+                            }
+                            out += "0x";
+                            out.append(number, std::to_chars(number, number + sizeof(number), v.u, 16).ptr);
+                            break;
+                        case tag::Truncated: out += "..."; break;
+                    }
+                }
+            }
+
+        private:
+            template<typename T>
+            static void read(const char*& data, T& out)
+            {
+                std::memcpy(&out, data, sizeof(T));
+                data += sizeof(T);
+            }
+
+            /// Make room for `size` more bytes, keeping one for the truncation mark, returns false if that goes over the limit.
+            bool reserve(size_t size)
+            {
+                if (size > limit_ - 1 - size_)
+                    return false;
+                if (size_ + size + 1 > capacity_)
+                {
+                    size_t capacity = std::max(size_ + size + 1, capacity_ * 2);
+                    std::unique_ptr<char[]> heap(new char[capacity]);
+                    std::memcpy(heap.get(), data_, size_);
+                    heap_ = std::move(heap);
+                    data_ = heap_.get();
+                    capacity_ = capacity;
+                }
+                return true;
+            }
+
+            template<typename T>
+            void append_value(tag type, T v)
+            {
+                if (truncated_ || !reserve(1 + sizeof(T)))
+                    return truncate();
+                data_[size_++] = static_cast<char>(type);
+                std::memcpy(data_ + size_, &v, sizeof(T));
+                size_ += sizeof(T);
+            }
+
+            void append_string(std::string_view s)
+            {
+                if (truncated_ || !reserve(1 + sizeof(uint32_t)))
+                    return truncate();
+                uint32_t length = static_cast<uint32_t>(std::min<size_t>({s.size(), limit_ - 1 - size_ - 1 - sizeof(uint32_t), UINT32_MAX}));
+                reserve(1 + sizeof(uint32_t) + length);
+                data_[size_++] = static_cast<char>(tag::String);
+                std::memcpy(data_ + size_, &length, sizeof(length));
+                size_ += sizeof(length);
+                std::memcpy(data_ + size_, s.data(), length);
+                size_ += length;
+                if (length < s.size())
+                    truncate();
+            }
+
+            void truncate()
+            {
+                if (truncated_)
+                    return;
+                truncated_ = true;
+                data_[size_++] = static_cast<char>(tag::Truncated);
+            }
+
+            char inline_[record_capacity];
+            std::unique_ptr<char[]> heap_;
+            char* data_ = inline_;
+            size_t capacity_ = record_capacity;
+            size_t limit_ = SIZE_MAX;
+            size_t size_ = 0;
+            bool truncated_ = false;
+        };
+
+        /// Log records written by one thread and read by the \ref log_writer, without either of them locking.
+        class log_ring
+        {
+        public:
+            static constexpr size_t capacity = 1 << 16; ///< Has to be a power of 2.
+
+            log_ring():
+              buffer_(new char[capacity])
+            {}
+
+            /// Add a whole record (header and data) or nothing if it doesn't fit, only called by the owning thread.
+            bool push(const void* header, size_t header_size, const char* data, size_t size)
+            {
+                size_t head = head_.load(std::memory_order_relaxed);
+                if (capacity - (head - tail_.load(std::memory_order_acquire)) < header_size + size)
+                    return false;
+
+                copy_in(head, static_cast<const char*>(header), header_size);
+                copy_in(head + header_size, data, size);
+                head_.store(head + header_size + size, std::memory_order_release);
+                return true;
+            }
+
+            /// Bytes of complete records waiting to be read, only called by the writer.
+            size_t readable() const
+            {
+                return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_relaxed);
+            }
+
+            /// Copy out the first `size` bytes (which have to be readable), only called by the writer.
+            void peek(void* out, size_t size) const
+            {
+                size_t tail = tail_.load(std::memory_order_relaxed) & (capacity - 1);
+                size_t first = std::min(size, capacity - tail);
+                std::memcpy(out, buffer_.get() + tail, first);
+                std::memcpy(static_cast<char*>(out) + first, buffer_.get(), size - first);
+            }
+
+            void consume(size_t size)
+            {
+                tail_.store(tail_.load(std::memory_order_relaxed) + size, std::memory_order_release);
+            }
+
+        private:
+            void copy_in(size_t position, const char* data, size_t size)
+            {
+                position &= capacity - 1;
+                size_t first = std::min(size, capacity - position);
+                std::memcpy(buffer_.get() + position, data, first);
+                std::memcpy(buffer_.get(), data + first, size - first);
+            }
+
+            std::unique_ptr<char[]> buffer_;
+            std::atomic<size_t> head_{0}; ///< Only written by the owning thread.
+            std::atomic<size_t> tail_{0}; ///< Only written by the writer.
+        };
+    } // namespace detail
+
     class logger
     {
     public:
         logger(LogLevel level):
           level_(level)
         {}
-        ~logger()
-        {
-#ifdef CROW_ENABLE_LOGGING
-            if (level_ >= get_current_log_level())
-            {
-                get_handler_ref()->log(stringstream_.str(), level_);
-            }
-#endif
-        }
+        ~logger();
 
         //
         template<typename T>
@@ -2168,7 +2523,7 @@ namespace crow
 #ifdef CROW_ENABLE_LOGGING
             if (level_ >= get_current_log_level())
             {
-                stringstream_ << value;
+                arguments_.append(value);
             }
 #endif
             return *this;
@@ -2181,7 +2536,29 @@ namespace crow
 
         static LogLevel get_current_log_level() { return get_log_level_ref(); }
 
+        /// Write messages from a background thread, formatting them there too.
+        ///
+        /// Logging then only copies a message's arguments into a buffer of the logging thread, messages that don't fit
+        /// (if the handler falls behind) are dropped and reported as such. Handlers are called from the background thread.
+        static void setAsync(bool enabled);
+
+        static void setAccessLogFormat(AccessLogFormat format) { get_access_log_format_ref() = format; }
+
+        static AccessLogFormat get_access_log_format() { return get_access_log_format_ref(); }
+
+        /// Log a response in the access log, if there is one.
+        static void log_access(std::string_view remote_ip_address, std::string_view method, std::string_view url, unsigned char http_ver_major, unsigned char http_ver_minor, int code, uint64_t body_size, std::chrono::steady_clock::duration latency);
+
     private:
+        friend class detail::log_writer;
+
+        /// Record kinds besides log levels.
+        static constexpr uint8_t access_json_kind = 0xf0;
+        static constexpr uint8_t access_tsv_kind = 0xf1;
+
+        static void write(uint8_t kind, const char* data, size_t size);
+        static void dispatch(uint8_t kind, const detail::log_arguments& arguments);
+
         //
         static LogLevel& get_log_level_ref()
         {
@@ -2194,108 +2571,529 @@ namespace crow
             static ILogHandler* current_handler = &default_handler;
             return current_handler;
         }
+        static AccessLogFormat& get_access_log_format_ref()
+        {
+            static AccessLogFormat current_format = AccessLogFormat::None;
+            return current_format;
+        }
 
         //
-        std::ostringstream stringstream_;
+        detail::log_arguments arguments_;
         LogLevel level_;
     };
-} // namespace crow
-
-#define CROW_LOG_CRITICAL                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Critical) \
-    crow::logger(crow::LogLevel::Critical)
-#define CROW_LOG_ERROR                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Error) \
-    crow::logger(crow::LogLevel::Error)
-#define CROW_LOG_WARNING                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Warning) \
-    crow::logger(crow::LogLevel::Warning)
-#define CROW_LOG_INFO                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Info) \
-    crow::logger(crow::LogLevel::Info)
-#define CROW_LOG_DEBUG                                                  \
-    if (crow::logger::get_current_log_level() <= crow::LogLevel::Debug) \
-    crow::logger(crow::LogLevel::Debug)
-
-
-#ifdef CROW_USE_BOOST
-#include <boost/asio.hpp>
-#include <boost/asio/basic_waitable_timer.hpp>
-#else
-#ifndef ASIO_STANDALONE
-#define ASIO_STANDALONE
-#endif
-#include <asio.hpp>
-#include <asio/basic_waitable_timer.hpp>
-#endif
-
-#include <chrono>
-#include <functional>
-#include <map>
-#include <vector>
 
-
-namespace crow
-{
-#ifdef CROW_USE_BOOST
-    namespace asio = boost::asio;
-    using error_code = boost::system::error_code;
-#else
-    using error_code = asio::error_code;
-#endif
     namespace detail
     {
-
-        /// A class for scheduling functions to be called after a specific
-        /// amount of ticks. Ther tick length can  be handed over in constructor, 
-        /// the default tick length is equal to 1 second.
-        class task_timer
+        /// Writes the records of every thread's \ref log_ring to the log handler from a thread of its own.
+        class log_writer
         {
         public:
-            using task_type = std::function<void()>;
-            using identifier_type = size_t;
+            static log_writer& instance()
+            {
+                static log_writer writer;
+                return writer;
+            }
 
-        private:
-            using clock_type = std::chrono::steady_clock;
-            using time_type = clock_type::time_point;
-        public:
-            task_timer(asio::io_context& io_context,
-                       const std::chrono::milliseconds tick_length =
-                            std::chrono::seconds(1)) :
-              io_context_(io_context), timer_(io_context_),
-              tick_length_ms_(tick_length)
+            ~log_writer()
             {
-                timer_.expires_after(tick_length_ms_);
-                timer_.async_wait(
-                  std::bind(&task_timer::tick_handler, this,
-                  std::placeholders::_1));
+                stop();
             }
 
-            ~task_timer() { timer_.cancel(); }
+            void start()
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (thread_.joinable())
+                    return;
+                stopping_ = false;
+                thread_ = std::thread([this] {
+                    run();
+                });
+                running_.store(true, std::memory_order_release);
+            }
 
-            /// Cancel the scheduling of the given task 
-            ///
-            /// \param identifier_type task identifier of the task to cancel.
-            void cancel(identifier_type id)
+            /// Stop the thread once it has written everything queued so far.
+            void stop()
             {
-                tasks_.erase(id);
-                CROW_LOG_DEBUG << "task_timer task cancelled: " << this << ' ' << id;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (!thread_.joinable())
+                        return;
+                    running_.store(false, std::memory_order_release);
+                    stopping_ = true;
+                }
+                wake_.notify_one();
+                thread_.join();
             }
 
-            /// Schedule the given task to be executed after the default amount
-            /// of ticks.
+            bool running() const
+            {
+                return running_.load(std::memory_order_acquire);
+            }
 
-            ///
-            /// \return identifier_type Used to cancel the thread.
-            /// It is not bound to this task_timer instance and in some cases
-            /// could lead to undefined behavior if used with other task_timer
-            /// objects or after the task has been successfully executed.
-            identifier_type schedule(const task_type& task)
+            /// Whether this is the writer's own thread, which (through a handler) may log too.
+            static bool& on_writer_thread()
             {
-                return schedule(task, get_default_timeout());
+                thread_local bool value = false;
+                return value;
             }
 
-            /// Schedule the given task to be executed after the given time.
+            /// Queue a record from the calling thread, it's dropped (and counted) if that thread's ring is full.
+            void push(uint8_t kind, const log_arguments& arguments)
+            {
+                thread_local std::shared_ptr<log_ring> ring = add_ring();
+
+                if (arguments.size() > log_arguments::record_capacity)
+                {
+                    log_arguments record(log_arguments::record_capacity);
+                    record.append_encoded(arguments.data(), arguments.size());
+                    return push(kind, record);
+                }
+
+                record_header header{static_cast<uint32_t>(arguments.size()), kind};
+                if (!ring->push(&header, sizeof(header), arguments.data(), arguments.size()))
+                {
+                    dropped_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                if (sleeping_.load(std::memory_order_relaxed))
+                    wake_.notify_one();
+            }
+
+        private:
+            struct record_header
+            {
+                uint32_t size;
+                uint8_t kind;
+            };
+
+            /// How long the writer sleeps when there's nothing to write, unless it's woken up.
+            static constexpr std::chrono::milliseconds idle_wait{50};
+
+            log_writer() = default;
+
+            std::shared_ptr<log_ring> add_ring()
+            {
+                auto ring = std::make_shared<log_ring>();
+                std::lock_guard<std::mutex> lock(rings_mutex_);
+                rings_.push_back(ring);
+                return ring;
+            }
+
+            void run()
+            {
+                on_writer_thread() = true;
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (true)
+                {
+                    lock.unlock();
+                    bool written = drain();
+                    lock.lock();
+
+                    if (stopping_)
+                    {
+                        lock.unlock();
+                        drain();
+                        return;
+                    }
+                    if (!written)
+                    {
+                        sleeping_.store(true, std::memory_order_relaxed);
+                        wake_.wait_for(lock, idle_wait);
+                        sleeping_.store(false, std::memory_order_relaxed);
+                    }
+                }
+            }
+
+            /// Write every record queued so far, returns whether there were any.
+            bool drain()
+            {
+                // The handler is called without the lock, threads logging for the first time mustn't wait for it
+                {
+                    std::lock_guard<std::mutex> lock(rings_mutex_);
+                    // The thread that owned it is gone
+                    rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [](const std::shared_ptr<log_ring>& ring) {
+                                     return ring.use_count() == 1 && !ring->readable();
+                                 }),
+                                 rings_.end());
+                    draining_ = rings_;
+                }
+
+                bool written = false;
+                for (auto& ring : draining_)
+                {
+                    record_header header;
+                    while (ring->readable() >= sizeof(header))
+                    {
+                        ring->peek(&header, sizeof(header));
+                        record_.resize(sizeof(header) + header.size);
+                        ring->peek(&record_[0], record_.size());
+                        ring->consume(record_.size());
+                        logger::write(header.kind, record_.data() + sizeof(header), header.size);
+                        written = true;
+                    }
+                }
+                draining_.clear();
+
+                size_t dropped = dropped_.exchange(0, std::memory_order_relaxed);
+                if (dropped)
+                    logger::get_handler_ref()->log(std::to_string(dropped) + " log messages were dropped, the log handler can't keep up", LogLevel::Warning);
+                return written;
+            }
+
+            std::mutex mutex_; ///< Guards starting and stopping.
+            std::condition_variable wake_;
+            std::thread thread_;
+            bool stopping_ = false;
+            std::atomic<bool> running_{false};
+            std::atomic<bool> sleeping_{false};
+            std::atomic<size_t> dropped_{0};
+
+            std::mutex rings_mutex_;
+            std::vector<std::shared_ptr<log_ring>> rings_;
+            std::vector<std::shared_ptr<log_ring>> draining_; ///< The rings drain() goes through, only used by the writer.
+            std::string record_;
+        };
+
+        /// Append `s` to `out` escaped for a JSON string, or with tabs and line breaks escaped for TSV.
+        inline void append_escaped(std::string& out, std::string_view s, bool json)
+        {
+            for (char c : s)
+            {
+                switch (c)
+                {
+                    case '"':
+                        out += json ? "\\\"" : "\"";
+                        break;
+                    case '\\': out += "\\\\"; break;
+                    case '\t': out += "\\t"; break;
+                    case '\n': out += "\\n"; break;
+                    case '\r': out += "\\r"; break;
+                    default:
+                        if (static_cast<unsigned char>(c) < 0x20)
+                        {
+                            static const char hex[] = "0123456789abcdef";
+                            out += "\\u00";
+                            out += hex[(c >> 4) & 0xf];
+                            out += hex[c & 0xf];
+                        }
+                        else
+                            out += c;
+                }
+            }
+        }
+    } // namespace detail
+
+    inline logger::~logger()
+    {
+#ifdef CROW_ENABLE_LOGGING
+        if (level_ >= get_current_log_level())
+        {
+            dispatch(static_cast<uint8_t>(level_), arguments_);
+        }
+#endif
+    }
+
+    inline void logger::setAsync(bool enabled)
+    {
+        if (enabled)
+        {
+            // Make sure the default handler outlives the writer, which is destroyed (and stopped) at exit
+            get_handler_ref();
+            detail::log_writer::instance().start();
+        }
+        else
+        {
+            detail::log_writer::instance().stop();
+        }
+    }
+
+    inline void logger::log_access(std::string_view remote_ip_address, std::string_view method, std::string_view url, unsigned char http_ver_major, unsigned char http_ver_minor, int code, uint64_t body_size, std::chrono::steady_clock::duration latency)
+    {
+        AccessLogFormat format = get_access_log_format();
+        if (format == AccessLogFormat::None)
+            return;
+
+        detail::log_arguments arguments;
+        arguments.append(static_cast<int64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()));
+        arguments.append(remote_ip_address);
+        arguments.append(method);
+        arguments.append(url);
+        arguments.append(static_cast<unsigned>(http_ver_major));
+        arguments.append(static_cast<unsigned>(http_ver_minor));
+        arguments.append(code);
+        arguments.append(body_size);
+        arguments.append(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(latency).count()));
+        dispatch(format == AccessLogFormat::JSON ? access_json_kind : access_tsv_kind, arguments);
+    }
+
+    inline void logger::dispatch(uint8_t kind, const detail::log_arguments& arguments)
+    {
+        auto& writer = detail::log_writer::instance();
+        if (writer.running() && !writer.on_writer_thread())
+            writer.push(kind, arguments);
+        else
+            write(kind, arguments.data(), arguments.size());
+    }
+
+    /// Format a record and hand it to the handler, on the logging thread or the writer's.
+    inline void logger::write(uint8_t kind, const char* data, size_t size)
+    {
+        std::string message;
+        if (kind != access_json_kind && kind != access_tsv_kind)
+        {
+            detail::log_arguments::format(data, size, message);
+            get_handler_ref()->log(std::move(message), static_cast<LogLevel>(kind));
+            return;
+        }
+
+        // Time, remote address, method, URL, HTTP version, status, body size, latency
+        const char* end = data + size;
+        detail::log_arguments::value fields[10];
+        size_t count = 0;
+        while (count < 10 && detail::log_arguments::next(data, end, fields[count]))
+            count++;
+        if (count < 9)
+            return;
+
+        bool json = kind == access_json_kind;
+        char time[40];
+        time_t seconds = static_cast<time_t>(fields[0].i / 1000);
+        tm my_tm;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+        gmtime_s(&my_tm, &seconds);
+#else
+        gmtime_r(&seconds, &my_tm);
+#endif
+        size_t time_size = strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &my_tm);
+        time_size += snprintf(time + time_size, sizeof(time) - time_size, ".%03dZ", static_cast<int>(fields[0].i % 1000));
+
+        char version[16];
+        if (fields[4].u < 2)
+            snprintf(version, sizeof(version), "%u.%u", static_cast<unsigned>(fields[4].u), static_cast<unsigned>(fields[5].u));
+        else
+            snprintf(version, sizeof(version), "%u", static_cast<unsigned>(fields[4].u));
+
+        char numbers[96];
+        message.reserve(128 + fields[3].s.size());
+        if (json)
+        {
+            message += "{\"time\":\"";
+            message.append(time, time_size);
+            message += "\",\"remote\":\"";
+            detail::append_escaped(message, fields[1].s, true);
+            message += "\",\"method\":\"";
+            detail::append_escaped(message, fields[2].s, true);
+            message += "\",\"url\":\"";
+            detail::append_escaped(message, fields[3].s, true);
+            message += "\",\"version\":\"";
+            message += version;
+            message.append(numbers, snprintf(numbers, sizeof(numbers), "\",\"status\":%lld,\"bytes\":%llu,\"latency_us\":%llu}",
+                                             static_cast<long long>(fields[6].i), static_cast<unsigned long long>(fields[7].u), static_cast<unsigned long long>(fields[8].u)));
+        }
+        else
+        {
+            message.append(time, time_size);
+            message += '\t';
+            detail::append_escaped(message, fields[1].s, false);
+            message += '\t';
+            detail::append_escaped(message, fields[2].s, false);
+            message += '\t';
+            detail::append_escaped(message, fields[3].s, false);
+            message += '\t';
+            message += version;
+            message.append(numbers, snprintf(numbers, sizeof(numbers), "\t%lld\t%llu\t%llu",
+                                             static_cast<long long>(fields[6].i), static_cast<unsigned long long>(fields[7].u), static_cast<unsigned long long>(fields[8].u)));
+        }
+        get_handler_ref()->log_access(std::move(message));
+    }
+} // namespace crow
+
+#define CROW_LOG_CRITICAL                                                  \
+    if (crow::logger::get_current_log_level() <= crow::LogLevel::Critical) \
+    crow::logger(crow::LogLevel::Critical)
+#define CROW_LOG_ERROR                                                  \
+    if (crow::logger::get_current_log_level() <= crow::LogLevel::Error) \
+    crow::logger(crow::LogLevel::Error)
+#define CROW_LOG_WARNING                                                  \
+    if (crow::logger::get_current_log_level() <= crow::LogLevel::Warning) \
+    crow::logger(crow::LogLevel::Warning)
+#define CROW_LOG_INFO                                                  \
+    if (crow::logger::get_current_log_level() <= crow::LogLevel::Info) \
+    crow::logger(crow::LogLevel::Info)
+#define CROW_LOG_DEBUG                                                  \
+    if (crow::logger::get_current_log_level() <= crow::LogLevel::Debug) \
+    crow::logger(crow::LogLevel::Debug)
+
+
+#ifdef CROW_USE_BOOST
+#include <boost/asio.hpp>
+#include <boost/asio/basic_waitable_timer.hpp>
+#else
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+#include <asio/basic_waitable_timer.hpp>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <tuple>
+#include <unordered_map>
+
+
+namespace crow
+{
+#ifdef CROW_USE_BOOST
+    namespace asio = boost::asio;
+    using error_code = boost::system::error_code;
+#else
+    using error_code = asio::error_code;
+#endif
+    namespace detail
+    {
+
+        /// A class for scheduling functions to be called after a specific
+        /// amount of ticks. Ther tick length can  be handed over in constructor, 
+        /// the default tick length is equal to 1 second.
+
+        ///
+        /// Deadlines are kept in a hierarchical timing wheel whose resolution
+        /// is a tenth of a second (or the tick length if that is shorter), so
+        /// scheduling, cancelling and expiring are all O(1). A \ref node
+        /// embedded in its owner is scheduled without allocating anything,
+        /// the underlying asio timer only runs while something is scheduled.
+        class task_timer
+        {
+        public:
+            using task_type = std::function<void()>;
+            using identifier_type = size_t;
+
+        private:
+            using clock_type = std::chrono::steady_clock;
+            using time_type = clock_type::time_point;
+
+            /// Link of the circular lists the slots of the wheel are made of,
+            /// a link pointing to itself is empty (or not in any list).
+            struct link
+            {
+                link* prev = this;
+                link* next = this;
+
+                bool empty() const
+                {
+                    return next == this;
+                }
+            };
+
+        public:
+            /// A timer embedded in its owner.
+
+            ///
+            /// The node is taken off the wheel before \ref expired() is called,
+            /// which may schedule it again. Destroying a scheduled node cancels it.
+            class node : private link
+            {
+            public:
+                node() = default;
+                node(const node&) = delete;
+                node& operator=(const node&) = delete;
+
+                virtual ~node()
+                {
+                    cancel();
+                }
+
+                bool scheduled() const
+                {
+                    return timer_ != nullptr;
+                }
+
+                void cancel()
+                {
+                    if (timer_)
+                        timer_->cancel(*this);
+                }
+
+            protected:
+                virtual void expired() = 0;
+
+            private:
+                friend class task_timer;
+
+                task_timer* timer_ = nullptr;
+                uint64_t deadline_ = 0; ///< In wheel ticks.
+            };
+
+            /// A node calling a member function of its owner when it expires.
+            template<typename Owner, void (Owner::*Expired)()>
+            class member_node : public node
+            {
+            public:
+                explicit member_node(Owner& owner):
+                  owner_(owner)
+                {}
+
+            protected:
+                void expired() override
+                {
+                    (owner_.*Expired)();
+                }
+
+            private:
+                Owner& owner_;
+            };
+
+            task_timer(asio::io_context& io_context,
+                       const std::chrono::milliseconds tick_length =
+                            std::chrono::seconds(1)) :
+              io_context_(io_context), timer_(io_context_),
+              tick_length_ms_(tick_length),
+              resolution_(std::max(std::chrono::milliseconds(1), std::min(tick_length, std::chrono::milliseconds(100)))),
+              start_(clock_type::now())
+            {}
+
+            ~task_timer()
+            {
+                timer_.cancel();
+
+                // Whatever is still scheduled outlives the timer (connections
+                // destroyed along with the io_context), detach it.
+                for (auto& level : wheel_)
+                    for (auto& slot : level)
+                        while (!slot.empty())
+                        {
+                            node& n = static_cast<node&>(*slot.next);
+                            unlink(n);
+                            n.timer_ = nullptr;
+                        }
+            }
+
+            /// Cancel the scheduling of the given task 
+            ///
+            /// \param identifier_type task identifier of the task to cancel.
+            void cancel(identifier_type id)
+            {
+                tasks_.erase(id);
+                if (tasks_.empty()) highest_id_ = 0;
+                CROW_LOG_DEBUG << "task_timer task cancelled: " << this << ' ' << id;
+            }
+
+            /// Schedule the given task to be executed after the default amount
+            /// of ticks.
+
+            ///
+            /// \return identifier_type Used to cancel the thread.
+            /// It is not bound to this task_timer instance and in some cases
+            /// could lead to undefined behavior if used with other task_timer
+            /// objects or after the task has been successfully executed.
+            identifier_type schedule(const task_type& task)
+            {
+                return schedule(task, get_default_timeout());
+            }
+
+            /// Schedule the given task to be executed after the given time.
 
             ///
             /// \param timeout The amount of ticks to wait before execution.
@@ -2306,12 +3104,55 @@ namespace crow
             /// objects or after the task has been successfully executed.
             identifier_type schedule(const task_type& task, uint8_t timeout)
             {
-                tasks_.insert({++highest_id_,
-                               {clock_type::now() + (timeout * tick_length_ms_),
-                                task}});
-                CROW_LOG_DEBUG << "task_timer scheduled: " << this << ' ' <<
-                                  highest_id_;
-                return highest_id_;
+                auto id = ++highest_id_;
+                auto& entry = tasks_.emplace(std::piecewise_construct,
+                                             std::forward_as_tuple(id),
+                                             std::forward_as_tuple(*this, id, task))
+                                .first->second;
+                schedule(entry, timeout);
+                CROW_LOG_DEBUG << "task_timer scheduled: " << this << ' ' << id;
+                return id;
+            }
+
+            /// Schedule the given node to expire after the default amount of
+            /// ticks, rescheduling it if it already is.
+            void schedule(node& n)
+            {
+                schedule(n, get_default_timeout());
+            }
+
+            /// Schedule the given node to expire after the given amount of
+            /// ticks, rescheduling it if it already is.
+            void schedule(node& n, uint8_t timeout)
+            {
+                if (n.timer_)
+                    n.timer_->cancel(n);
+
+                uint64_t now = now_tick();
+                // Nothing scheduled means nothing to catch up on.
+                if (!scheduled_count_)
+                    current_ = now;
+
+                auto resolution = resolution_.count();
+                uint64_t ticks = (timeout * tick_length_ms_.count() + resolution - 1) / resolution;
+                n.deadline_ = now + std::max<uint64_t>(ticks, 1);
+                n.timer_ = this;
+                insert(n);
+                scheduled_count_++;
+
+                if (!armed_ || n.deadline_ < armed_tick_)
+                    arm();
+            }
+
+            /// Cancel the given node, nothing happens if it isn't scheduled by
+            /// this timer.
+            void cancel(node& n)
+            {
+                if (n.timer_ != this)
+                    return;
+                unlink(n);
+                n.timer_ = nullptr;
+                scheduled_count_--;
             }
 
             /// Set the default timeout for this task_timer instance.
@@ -2336,53 +3177,176 @@ namespace crow
             }
 
         private:
-            void process_tasks()
+            /// A task scheduled through the identifier based interface.
+            struct task_node : node
             {
-                time_type current_time = clock_type::now();
-                std::vector<identifier_type> finished_tasks;
+                task_node(task_timer& timer_, identifier_type id_, const task_type& task_):
+                  timer(timer_), id(id_), task(task_)
+                {}
 
-                for (const auto& task : tasks_)
+                void expired() override
                 {
-                    if (task.second.first < current_time)
-                    {
-                        (task.second.second)();
-                        finished_tasks.push_back(task.first);
-                        CROW_LOG_DEBUG << "task_timer called: " << this <<
-                                          ' ' << task.first;
-                    }
+                    // Erasing the entry destroys this node.
+                    task_type fn = std::move(task);
+                    task_timer& owner = timer;
+                    CROW_LOG_DEBUG << "task_timer called: " << &owner << ' ' << id;
+                    owner.cancel(id);
+                    fn();
                 }
 
-                for (const auto& task : finished_tasks)
-                    tasks_.erase(task);
+                task_timer& timer;
+                identifier_type id;
+                task_type task;
+            };
 
-                // If no task is currently scheduled, reset the issued ids back
-                // to 0.
-                if (tasks_.empty()) highest_id_ = 0;
-            }
+            static constexpr unsigned level_bits = 6;
+            static constexpr uint64_t slots_per_level = 1 << level_bits;
+            static constexpr uint64_t slot_mask = slots_per_level - 1;
+            static constexpr unsigned levels = 4;
 
-            void tick_handler(const error_code& ec)
+            uint64_t now_tick() const
             {
-                if (ec) return;
+                return static_cast<uint64_t>((clock_type::now() - start_) / resolution_);
+            }
 
-                process_tasks();
+            static void unlink(link& l)
+            {
+                l.prev->next = l.next;
+                l.next->prev = l.prev;
+                l.prev = l.next = &l;
+            }
 
-                timer_.expires_after(tick_length_ms_);
-                timer_.async_wait(
-                  std::bind(&task_timer::tick_handler, this, std::placeholders::_1));
+            static void push_back(link& list, link& l)
+            {
+                l.prev = list.prev;
+                l.next = &list;
+                list.prev->next = &l;
+                list.prev = &l;
             }
 
-        private:
-            asio::io_context& io_context_;
-            asio::basic_waitable_timer<clock_type> timer_;
-            std::map<identifier_type, std::pair<time_type, task_type>> tasks_;
+            /// Put the node into the lowest level whose span covers its deadline.
+            void insert(node& n)
+            {
+                uint64_t deadline = n.deadline_;
+                uint64_t delta = deadline > current_ ? deadline - current_ : 0;
 
-            // A continuously increasing number to be issued to threads to
-            // identify them. If no tasks are scheduled, it will be reset to 0.
-            identifier_type highest_id_{0};
-            std::chrono::milliseconds tick_length_ms_;
-            uint8_t default_timeout_{5};
+                unsigned level = 0;
+                while (level + 1 < levels && delta >= (uint64_t(1) << (level_bits * (level + 1))))
+                    level++;
+                // Beyond the span of the wheel, park it in the furthest slot
+                // and let the cascade place it again.
+                if (delta >> (level_bits * levels))
+                    deadline = current_ + (uint64_t(1) << (level_bits * levels)) - 1;
 
-        };
+                push_back(wheel_[level][(deadline >> (level_bits * level)) & slot_mask], n);
+            }
+
+            /// Process every tick up to (and including) the given one.
+            void advance(uint64_t target)
+            {
+                while (current_ < target)
+                {
+                    if (!scheduled_count_)
+                    {
+                        current_ = target;
+                        break;
+                    }
+
+                    current_++;
+                    // Each time a level wraps around, the next slot of the one
+                    // above is spread over the levels below.
+                    for (unsigned level = 1; level < levels; level++)
+                    {
+                        if (current_ & ((uint64_t(1) << (level_bits * level)) - 1))
+                            break;
+                        cascade(wheel_[level][(current_ >> (level_bits * level)) & slot_mask]);
+                    }
+
+                    link& slot = wheel_[0][current_ & slot_mask];
+                    while (!slot.empty())
+                    {
+                        node& n = static_cast<node&>(*slot.next);
+                        unlink(n);
+                        n.timer_ = nullptr;
+                        scheduled_count_--;
+                        n.expired();
+                    }
+                }
+            }
+
+            void cascade(link& slot)
+            {
+                if (slot.empty())
+                    return;
+
+                link pending;
+                pending.next = slot.next;
+                pending.prev = slot.prev;
+                pending.next->prev = pending.prev->next = &pending;
+                slot.next = slot.prev = &slot;
+
+                while (!pending.empty())
+                {
+                    node& n = static_cast<node&>(*pending.next);
+                    unlink(n);
+                    insert(n);
+                }
+            }
+
+            /// Wait for the next non empty slot of the lowest level, or for it
+            /// to wrap around.
+            void arm()
+            {
+                if (!scheduled_count_)
+                    return;
+
+                uint64_t ticks = slots_per_level - (current_ & slot_mask);
+                for (uint64_t i = 1; i < ticks; i++)
+                {
+                    if (!wheel_[0][(current_ + i) & slot_mask].empty())
+                    {
+                        ticks = i;
+                        break;
+                    }
+                }
+
+                armed_ = true;
+                armed_tick_ = current_ + ticks;
+                timer_.expires_at(start_ + armed_tick_ * resolution_);
+                timer_.async_wait(
+                  std::bind(&task_timer::tick_handler, this, std::placeholders::_1));
+            }
+
+            void tick_handler(const error_code& ec)
+            {
+                // Aborted waits were replaced by a new one.
+                if (ec) return;
+
+                armed_ = false;
+                advance(now_tick());
+                if (!armed_)
+                    arm();
+            }
+
+        private:
+            asio::io_context& io_context_;
+            asio::basic_waitable_timer<clock_type> timer_;
+            std::unordered_map<identifier_type, task_node> tasks_;
+
+            // A continuously increasing number to be issued to threads to
+            // identify them. If no tasks are scheduled, it will be reset to 0.
+            identifier_type highest_id_{0};
+            std::chrono::milliseconds tick_length_ms_;
+            uint8_t default_timeout_{5};
+
+            std::chrono::milliseconds resolution_;
+            time_type start_;
+            link wheel_[levels][slots_per_level];
+            uint64_t current_{0};     ///< The last tick processed.
+            uint64_t armed_tick_{0};  ///< The tick the asio timer waits for.
+            size_t scheduled_count_{0};
+            bool armed_{false};
+        };
     } // namespace detail
 } // namespace crow
 
@@ -2398,11 +3362,27 @@ namespace crow
 #endif
 #include <iostream>
 #include <algorithm>
+#include <charconv>
 #include <memory>
+#include <iterator>
 #include <vector>
 #include <cmath>
 #include <cfloat>
 
+// String and whitespace scanning and UTF-8 validation go through whole vector registers where the target has them
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CROW_JSON_SIMD_AVX2
+#define CROW_JSON_SIMD_BLOCK
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CROW_JSON_SIMD_SSE2
+#define CROW_JSON_SIMD_BLOCK
+#endif
+#if defined(CROW_JSON_SIMD_BLOCK) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 
 using std::isinf;
 using std::isnan;
@@ -2425,11 +3405,210 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             return 'a' + c - 10;
         }
 
-        inline void escape(const std::string& str, std::string& ret)
+        namespace detail
+        {
+#if defined(CROW_JSON_SIMD_AVX2)
+            /// The bytes a vectorized scan looks at in one step.
+            struct simd_block
+            {
+                static constexpr size_t size = 32;
+                static constexpr uint32_t all = 0xffffffff;
+
+                static simd_block load(const char* p)
+                {
+                    return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))};
+                }
+
+                /// One bit per byte equal to c.
+                uint32_t eq(char c) const
+                {
+                    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c))));
+                }
+
+                /// One bit per byte with its high bit set.
+                uint32_t non_ascii() const
+                {
+                    return static_cast<uint32_t>(_mm256_movemask_epi8(v));
+                }
+
+                /// One bit per byte below 0x20 (the control characters a JSON string can't hold as they are).
+                uint32_t control() const
+                {
+                    return static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v)));
+                }
+
+                __m256i v;
+            };
+#elif defined(CROW_JSON_SIMD_SSE2)
+            /// The bytes a vectorized scan looks at in one step.
+            struct simd_block
+            {
+                static constexpr size_t size = 16;
+                static constexpr uint32_t all = 0xffff;
+
+                static simd_block load(const char* p)
+                {
+                    return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))};
+                }
+
+                /// One bit per byte equal to c.
+                uint32_t eq(char c) const
+                {
+                    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c))));
+                }
+
+                /// One bit per byte with its high bit set.
+                uint32_t non_ascii() const
+                {
+                    return static_cast<uint32_t>(_mm_movemask_epi8(v));
+                }
+
+                /// One bit per byte below 0x20 (the control characters a JSON string can't hold as they are).
+                uint32_t control() const
+                {
+                    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1f)), v)));
+                }
+
+                __m128i v;
+            };
+#endif
+
+#if defined(CROW_JSON_SIMD_AVX2) || defined(CROW_JSON_SIMD_SSE2)
+            inline unsigned trailing_zeros(uint32_t mask)
+            {
+#ifdef _MSC_VER
+                unsigned long index;
+                _BitScanForward(&index, mask);
+                return index;
+#else
+                return __builtin_ctz(mask);
+#endif
+            }
+#endif
+
+            inline bool needs_escape(char c)
+            {
+                return c == '"' || c == '\\' || static_cast<unsigned char>(c) < 0x20;
+            }
+
+            /// The first character from p on that a JSON string has to escape, end if there's none.
+            inline const char* find_escape(const char* p, const char* end)
+            {
+#ifdef CROW_JSON_SIMD_BLOCK
+                while (end - p >= static_cast<ptrdiff_t>(simd_block::size))
+                {
+                    auto block = simd_block::load(p);
+                    uint32_t special = block.eq('"') | block.eq('\\') | block.control();
+                    if (special)
+                        return p + trailing_zeros(special);
+                    p += simd_block::size;
+                }
+#endif
+                while (p != end && !needs_escape(*p))
+                    p++;
+                return p;
+            }
+
+            /// The length of a string once it's escaped, without the surrounding quotes.
+            inline size_t escaped_length(const std::string& str)
+            {
+                size_t length = str.size();
+                const char* end = str.data() + str.size();
+                for (const char* p = find_escape(str.data(), end); p != end; p = find_escape(p + 1, end))
+                {
+                    char c = *p;
+                    length += c == '"' || c == '\\' || c == '\n' || c == '\b' || c == '\f' || c == '\r' || c == '\t' ? 1 : 5;
+                }
+                return length;
+            }
+
+            /// A string-like output that hands its contents to a callback whenever it holds a whole chunk.
+
+            ///
+            /// Lets \ref crow::json::wvalue::dump_to() send a document as it's serialized, rather than build all of it first.
+            /// The callback takes a `std::string&` holding at least one chunk, which is cleared afterwards. Call \ref finish()
+            /// once the document is complete to get the rest of it.
+            template<typename Flush>
+            class chunked_output
+            {
+            public:
+                chunked_output(size_t chunk_size, Flush flush):
+                  chunk_size_(chunk_size), flush_(std::move(flush))
+                {
+                    buffer_.reserve(chunk_size_ + chunk_size_ / 4);
+                }
+
+                void push_back(char c)
+                {
+                    buffer_.push_back(c);
+                    check();
+                }
+
+                chunked_output& operator+=(char c)
+                {
+                    push_back(c);
+                    return *this;
+                }
+
+                chunked_output& operator+=(const char* str)
+                {
+                    buffer_ += str;
+                    check();
+                    return *this;
+                }
+
+                void append(const char* first, const char* last)
+                {
+                    buffer_.append(first, last);
+                    check();
+                }
+
+                void append(size_t count, char c)
+                {
+                    buffer_.append(count, c);
+                    check();
+                }
+
+                void reserve(size_t) {}
+
+                size_t size() const { return buffer_.size(); }
+                size_t capacity() const { return buffer_.capacity(); }
+
+                /// The output that's left, not yet handed to the callback.
+                std::string& finish() { return buffer_; }
+
+            private:
+                void check()
+                {
+                    if (buffer_.size() >= chunk_size_)
+                    {
+                        flush_(buffer_);
+                        buffer_.clear();
+                    }
+                }
+
+                size_t chunk_size_;
+                Flush flush_;
+                std::string buffer_;
+            };
+        } // namespace detail
+
+        template<typename Output>
+        inline void escape(const std::string& str, Output& ret)
         {
-            ret.reserve(ret.size() + str.size() + str.size() / 4);
-            for (auto c : str)
+            if (ret.capacity() < ret.size() + str.size())
+                ret.reserve(ret.size() + str.size() + str.size() / 4);
+            const char* p = str.data();
+            const char* end = p + str.size();
+            for (;;)
             {
+                // Runs of characters that don't need escaping are copied in one go
+                const char* special = detail::find_escape(p, end);
+                ret.append(p, special);
+                if (special == end)
+                    break;
+                char c = *special;
+                p = special + 1;
                 switch (c)
                 {
                     case '"': ret += "\\\""; break;
@@ -2440,14 +3619,9 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                     case '\r': ret += "\\r"; break;
                     case '\t': ret += "\\t"; break;
                     default:
-                        if (c >= 0 && c < 0x20)
-                        {
-                            ret += "\\u00";
-                            ret += to_hex(c / 16);
-                            ret += to_hex(c % 16);
-                        }
-                        else
-                            ret += c;
+                        ret += "\\u00";
+                        ret += to_hex(c / 16);
+                        ret += to_hex(c % 16);
                         break;
                 }
             }
@@ -2676,6 +3850,10 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             {
                 determine_num_type();
             }
+            rvalue(type t, char* s, char* e, num_type nt) noexcept:
+              start_{s}, end_{e}, t_{t}, nt_{nt}
+            {
+            }
 
             rvalue(const rvalue& r):
               start_(r.start_), end_(r.end_), key_(r.key_), t_(r.t_), nt_(r.nt_), option_(r.option_)
@@ -2787,13 +3965,13 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 {
                     case type::Number:
                     case type::String:
-                        return utility::lexical_cast<int64_t>(start_, end_ - start_);
+                        return parse_number<int64_t>();
                     default:
                         const std::string msg = "expected number, got: " + std::string(get_type_str(t()));
                         throw std::runtime_error(msg);
                 }
 #endif
-                return utility::lexical_cast<int64_t>(start_, end_ - start_);
+                return parse_number<int64_t>();
             }
 
             /// The unsigned integer value.
@@ -2804,12 +3982,12 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 {
                     case type::Number:
                     case type::String:
-                        return utility::lexical_cast<uint64_t>(start_, end_ - start_);
+                        return parse_number<uint64_t>();
                     default:
                         throw std::runtime_error(std::string("expected number, got: ") + get_type_str(t()));
                 }
 #endif
-                return utility::lexical_cast<uint64_t>(start_, end_ - start_);
+                return parse_number<uint64_t>();
             }
 
             /// The double precision floating-point number value.
@@ -2819,7 +3997,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 if (t() != type::Number)
                     throw std::runtime_error("value is not number");
 #endif
-                return utility::lexical_cast<double>(start_, end_ - start_);
+                return parse_number<double>();
             }
 
             /// The boolean value.
@@ -3122,6 +4300,20 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 lremain_--;
             }
 
+            /// Parses the number's text as T.
+            template<typename T>
+            T parse_number() const
+            {
+#ifdef __cpp_lib_to_chars
+                T value{};
+                auto result = std::from_chars(start_, end_, value);
+                if (CROW_LIKELY(result.ec == std::errc()))
+                    return value;
+#endif
+                // Whatever from_chars doesn't take (out of range values, a negative one for an unsigned) is cast as it was before
+                return utility::lexical_cast<T>(start_, end_ - start_);
+            }
+
             /// Determines num_type from the string.
             void determine_num_type()
             {
@@ -3255,6 +4447,120 @@ namespace crow // NOTE: Already documented in "crow/app.h"
         }
 
 
+        namespace detail
+        {
+            inline bool is_whitespace(char c)
+            {
+                return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+            }
+
+            /// The first non whitespace character from p on. The input ends with a NUL at end.
+            inline char* skip_whitespace(char* p, const char* end)
+            {
+#ifdef CROW_JSON_SIMD_BLOCK
+                while (end - p >= static_cast<ptrdiff_t>(simd_block::size))
+                {
+                    auto block = simd_block::load(p);
+                    uint32_t other = ~(block.eq(' ') | block.eq('\t') | block.eq('\r') | block.eq('\n')) & simd_block::all;
+                    if (other)
+                        return p + trailing_zeros(other);
+                    p += simd_block::size;
+                }
+#else
+                (void)end;
+#endif
+                while (is_whitespace(*p))
+                    p++;
+                return p;
+            }
+
+            /// The first character from p on that ends or interrupts a string: '"', '\\' or NUL. The input ends with a NUL at end.
+            inline char* find_string_special(char* p, const char* end)
+            {
+#ifdef CROW_JSON_SIMD_BLOCK
+                while (end - p >= static_cast<ptrdiff_t>(simd_block::size))
+                {
+                    auto block = simd_block::load(p);
+                    uint32_t special = block.eq('"') | block.eq('\\') | block.eq('\0');
+                    if (special)
+                        return p + trailing_zeros(special);
+                    p += simd_block::size;
+                }
+#else
+                (void)end;
+#endif
+                while (*p != '"' && *p != '\\' && *p != '\0')
+                    p++;
+                return p;
+            }
+
+            /// The length of the UTF-8 sequence starting with a non ASCII byte, 0 if it's invalid (overlong, a surrogate, past U+10FFFF or truncated).
+            inline size_t utf8_sequence_length(const unsigned char* p, const unsigned char* end)
+            {
+                unsigned char c = p[0], low = 0x80, high = 0xbf;
+                size_t length;
+                if (c >= 0xc2 && c <= 0xdf)
+                    length = 2;
+                else if (c >= 0xe0 && c <= 0xef)
+                {
+                    length = 3;
+                    if (c == 0xe0)
+                        low = 0xa0;
+                    else if (c == 0xed)
+                        high = 0x9f;
+                }
+                else if (c >= 0xf0 && c <= 0xf4)
+                {
+                    length = 4;
+                    if (c == 0xf0)
+                        low = 0x90;
+                    else if (c == 0xf4)
+                        high = 0x8f;
+                }
+                else
+                    return 0;
+
+                if (static_cast<size_t>(end - p) < length || p[1] < low || p[1] > high)
+                    return 0;
+                for (size_t i = 2; i < length; i++)
+                    if ((p[i] & 0xc0) != 0x80)
+                        return 0;
+                return length;
+            }
+
+            /// Check that data is valid UTF-8, skipping over ASCII a whole block at a time.
+            inline bool validate_utf8(const char* data, size_t size)
+            {
+                auto p = reinterpret_cast<const unsigned char*>(data);
+                auto end = p + size;
+                while (p < end)
+                {
+#ifdef CROW_JSON_SIMD_BLOCK
+                    if (end - p >= static_cast<ptrdiff_t>(simd_block::size))
+                    {
+                        uint32_t non_ascii = simd_block::load(reinterpret_cast<const char*>(p)).non_ascii();
+                        if (!non_ascii)
+                        {
+                            p += simd_block::size;
+                            continue;
+                        }
+                        p += trailing_zeros(non_ascii);
+                    }
+#endif
+                    if (*p < 0x80)
+                    {
+                        p++;
+                        continue;
+                    }
+                    size_t length = utf8_sequence_length(p, end);
+                    if (!length)
+                        return false;
+                    p += length;
+                }
+                return true;
+            }
+        } // namespace detail
+
         inline rvalue load_nocopy_internal(char* data, size_t size)
         {
             // Defend against excessive recursion
@@ -3263,8 +4569,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             //static const char* escaped = "\"\\/\b\f\n\r\t";
             struct Parser
             {
-                Parser(char* data_, size_t /*size*/):
-                  data(data_)
+                Parser(char* data_, size_t size):
+                  data(data_), end(data_ + size)
                 {
                 }
 
@@ -3278,8 +4584,12 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 
                 void ws_skip()
                 {
-                    while (*data == ' ' || *data == '\t' || *data == '\r' || *data == '\n')
-                        ++data;
+                    // Mostly there's none, or a single space
+                    if (CROW_LIKELY(!detail::is_whitespace(*data)))
+                        return;
+                    if (!detail::is_whitespace(*++data))
+                        return;
+                    data = detail::skip_whitespace(data, end);
                 };
 
                 rvalue decode_string()
@@ -3290,11 +4600,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                     uint8_t has_escaping = 0;
                     while (1)
                     {
-                        if (CROW_LIKELY(*data != '"' && *data != '\\' && *data != '\0'))
-                        {
-                            data++;
-                        }
-                        else if (*data == '"')
+                        data = detail::find_string_special(data, end);
+                        if (*data == '"')
                         {
                             *data = 0;
                             *(start - 1) = has_escaping;
@@ -3495,10 +4802,11 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                                 break;
                             default:
                                 if (CROW_LIKELY(state == NumberParsingState::ZeroFirst ||
-                                                state == NumberParsingState::Digits ||
-                                                state == NumberParsingState::DigitsAfterPoints ||
-                                                state == NumberParsingState::DigitsAfterE))
-                                    return {type::Number, start, data};
+                                                state == NumberParsingState::Digits))
+                                    return {type::Number, start, data, *start == '-' ? num_type::Signed_integer : num_type::Unsigned_integer};
+                                else if (CROW_LIKELY(state == NumberParsingState::DigitsAfterPoints ||
+                                                     state == NumberParsingState::DigitsAfterE))
+                                    return {type::Number, start, data, num_type::Floating_point};
                                 else
                                     return {};
                         }
@@ -3637,7 +4945,10 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 }
 
                 char* data;
+                const char* end; ///< Where the terminating NUL is.
             };
+            if (!detail::validate_utf8(data, size))
+                return {};
             return Parser(data, size).parse();
         }
         inline rvalue load(const char* data, size_t size)
@@ -3663,48 +4974,429 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             return load(str.data(), str.size());
         }
 
-        struct wvalue_reader;
-
-        /// JSON write value.
-
-        ///
-        /// Value can mean any json value, including a JSON object.<br>
-        /// Write means this class is used to primarily assemble JSON objects using keys and values and export those into a string.
-        class wvalue : public returnable
+        namespace detail
         {
-            friend class crow::mustache::template_t;
-            friend struct wvalue_reader;
+            /// The members of a JSON object, in insertion order in chunks of flat storage.
 
-        public:
-            using object =
-#ifdef CROW_JSON_USE_MAP
-              std::map<std::string, wvalue>;
-#else
-              std::unordered_map<std::string, wvalue>;
-#endif
+            ///
+            /// The first chunks hold \ref initial_capacity members and each next one twice as many as all those before it.
+            /// Chunks never move, so a reference to a member stays valid while others are added (like it does in a std::unordered_map).
+            /// Erasing a member moves the ones after it.<br>
+            /// Small objects (the usual case) are searched linearly, once an object has more than \ref indexed_size
+            /// members a hash table of their positions is kept along with the chunks.
+            template<typename Value>
+            class flat_object
+            {
+                template<bool Const>
+                class basic_iterator
+                {
+                public:
+                    using iterator_category = std::random_access_iterator_tag;
+                    using value_type = std::pair<std::string, Value>;
+                    using difference_type = std::ptrdiff_t;
+                    using pointer = typename std::conditional<Const, const value_type*, value_type*>::type;
+                    using reference = typename std::conditional<Const, const value_type&, value_type&>::type;
+
+                    basic_iterator() = default;
+
+                    basic_iterator(const flat_object* owner, size_t position):
+                      owner_(owner), position_(position)
+                    {}
+
+                    // An iterator converts to a const_iterator
+                    template<bool OtherConst, typename = typename std::enable_if<Const && !OtherConst>::type>
+                    basic_iterator(const basic_iterator<OtherConst>& other):
+                      owner_(other.owner_), position_(other.position_)
+                    {}
+
+                    reference operator*() const { return owner_->entry(position_); }
+                    pointer operator->() const { return &owner_->entry(position_); }
+                    reference operator[](difference_type n) const { return owner_->entry(position_ + n); }
+
+                    basic_iterator& operator++() { ++position_; return *this; }
+                    basic_iterator operator++(int) { return basic_iterator(owner_, position_++); }
+                    basic_iterator& operator--() { --position_; return *this; }
+                    basic_iterator operator--(int) { return basic_iterator(owner_, position_--); }
+                    basic_iterator& operator+=(difference_type n) { position_ += n; return *this; }
+                    basic_iterator& operator-=(difference_type n) { position_ -= n; return *this; }
+                    basic_iterator operator+(difference_type n) const { return basic_iterator(owner_, position_ + n); }
+                    basic_iterator operator-(difference_type n) const { return basic_iterator(owner_, position_ - n); }
+                    friend basic_iterator operator+(difference_type n, const basic_iterator& it) { return it + n; }
+                    difference_type operator-(const basic_iterator& other) const { return static_cast<difference_type>(position_ - other.position_); }
+
+                    bool operator==(const basic_iterator& other) const { return position_ == other.position_; }
+                    bool operator!=(const basic_iterator& other) const { return position_ != other.position_; }
+                    bool operator<(const basic_iterator& other) const { return position_ < other.position_; }
+                    bool operator>(const basic_iterator& other) const { return position_ > other.position_; }
+                    bool operator<=(const basic_iterator& other) const { return position_ <= other.position_; }
+                    bool operator>=(const basic_iterator& other) const { return position_ >= other.position_; }
+
+                private:
+                    friend class flat_object;
+                    template<bool>
+                    friend class basic_iterator;
+
+                    const flat_object* owner_{};
+                    size_t position_{};
+                };
 
-            using list = std::vector<wvalue>;
+            public:
+                using key_type = std::string;
+                using mapped_type = Value;
+                using value_type = std::pair<std::string, Value>;
+                using iterator = basic_iterator<false>;
+                using const_iterator = basic_iterator<true>;
 
-            type t() const { return t_; }
+                /// The size of the first chunk, allocated by the first insertion and enough for most objects to never grow.
+                static constexpr size_t initial_capacity = 8;
+                static constexpr size_t indexed_size = 16;
 
-            /// Create an empty json value (outputs "{}" instead of a "null" string)
-            static crow::json::wvalue empty_object() { return crow::json::wvalue::object(); }
+                flat_object() = default;
 
-        private:
-            type t_{type::Null};         ///< The type of the value.
-            num_type nt{num_type::Null}; ///< The specific type of the number if \ref t_ is a number.
-            union number
-            {
-                double d;
-                int64_t si;
-                uint64_t ui;
+                flat_object(const flat_object& other)
+                {
+                    reserve(other.size_);
+                    for (size_t i = 0; i < other.size_; i++)
+                        append(other.entry(i).first, other.entry(i).second);
+                    index_ = other.index_;
+                }
 
-            public:
-                constexpr number() noexcept:
-                  ui() {} /* default constructor initializes unsigned integer. */
-                constexpr number(std::uint64_t value) noexcept:
-                  ui(value) {}
-                constexpr number(std::int64_t value) noexcept:
+                flat_object(flat_object&& other) noexcept:
+                  chunks_(std::move(other.chunks_)), size_(other.size_), index_(std::move(other.index_))
+                {
+                    other.chunks_.clear();
+                    other.size_ = 0;
+                }
+
+                flat_object& operator=(flat_object&& other) noexcept
+                {
+                    if (this != &other)
+                    {
+                        release();
+                        chunks_ = std::move(other.chunks_);
+                        size_ = other.size_;
+                        index_ = std::move(other.index_);
+                        other.chunks_.clear();
+                        other.size_ = 0;
+                        other.index_.clear();
+                    }
+                    return *this;
+                }
+
+                // Values might only be copy constructible
+                flat_object& operator=(const flat_object& other)
+                {
+                    if (this != &other)
+                        *this = flat_object(other);
+                    return *this;
+                }
+
+                flat_object(std::initializer_list<std::pair<std::string const, Value>> members)
+                {
+                    reserve(members.size());
+                    for (auto& member : members)
+                        emplace(member.first, member.second);
+                }
+
+                /// The members of any other map, in its order.
+                template<typename InputIterator>
+                flat_object(InputIterator first, InputIterator last)
+                {
+                    insert(first, last);
+                }
+
+                flat_object& operator=(std::initializer_list<std::pair<std::string const, Value>> members)
+                {
+                    clear();
+                    reserve(members.size());
+                    for (auto& member : members)
+                        emplace(member.first, member.second);
+                    return *this;
+                }
+
+                ~flat_object()
+                {
+                    release();
+                }
+
+                iterator begin() { return iterator(this, 0); }
+                iterator end() { return iterator(this, size_); }
+                const_iterator begin() const { return const_iterator(this, 0); }
+                const_iterator end() const { return const_iterator(this, size_); }
+
+                size_t size() const { return size_; }
+                bool empty() const { return size_ == 0; }
+
+                void reserve(size_t capacity)
+                {
+                    while (this->capacity() < capacity)
+                        add_chunk();
+                }
+
+                /// Remove every member, keeping the chunks.
+                void clear()
+                {
+                    for (size_t i = size_; i > 0; i--)
+                        entry(i - 1).~value_type();
+                    size_ = 0;
+                    index_.clear();
+                }
+
+                iterator find(std::string_view key)
+                {
+                    return iterator(this, position(key));
+                }
+
+                const_iterator find(std::string_view key) const
+                {
+                    return const_iterator(this, position(key));
+                }
+
+                size_t count(std::string_view key) const
+                {
+                    return position(key) != size_;
+                }
+
+                Value& at(std::string_view key)
+                {
+                    size_t found = position(key);
+                    if (found == size_)
+                        throw std::out_of_range("json object has no member " + std::string(key));
+                    return entry(found).second;
+                }
+
+                const Value& at(std::string_view key) const
+                {
+                    return const_cast<flat_object*>(this)->at(key);
+                }
+
+                Value& operator[](const std::string& key)
+                {
+                    return emplace(key).first->second;
+                }
+
+                Value& operator[](std::string&& key)
+                {
+                    return emplace(std::move(key)).first->second;
+                }
+
+                /// Add a member unless the key is already there, same as std::map::emplace().
+                template<typename Key, typename... Args>
+                std::pair<iterator, bool> emplace(Key&& key, Args&&... args)
+                {
+                    if constexpr (!std::is_convertible<const Key&, std::string_view>::value)
+                        return emplace(std::string(std::forward<Key>(key)), std::forward<Args>(args)...);
+                    else
+                    {
+                        size_t found = position(key);
+                        if (found != size_)
+                            return {iterator(this, found), false};
+
+                        append(std::forward<Key>(key), std::forward<Args>(args)...);
+                        if (!index_.empty())
+                            index_insert(found);
+                        else if (size_ > indexed_size)
+                            rebuild_index();
+                        return {iterator(this, found), true};
+                    }
+                }
+
+                std::pair<iterator, bool> insert(const value_type& member)
+                {
+                    return emplace(member.first, member.second);
+                }
+
+                template<typename InputIterator>
+                void insert(InputIterator first, InputIterator last)
+                {
+                    for (; first != last; ++first)
+                        emplace(first->first, first->second);
+                }
+
+                /// Remove a member, keeping the others in order.
+                iterator erase(const_iterator pos)
+                {
+                    size_t erased = pos.position_;
+                    for (size_t i = erased; i + 1 < size_; i++)
+                        entry(i) = std::move(entry(i + 1));
+                    entry(--size_).~value_type();
+                    if (!index_.empty())
+                        rebuild_index();
+                    return iterator(this, erased);
+                }
+
+                size_t erase(std::string_view key)
+                {
+                    size_t found = position(key);
+                    if (found == size_)
+                        return 0;
+                    erase(const_iterator(this, found));
+                    return 1;
+                }
+
+            private:
+                static size_t chunk_of(size_t position)
+                {
+                    size_t chunk = 0;
+                    for (size_t q = position / initial_capacity; q; q >>= 1)
+                        chunk++;
+                    return chunk;
+                }
+
+                /// The position of a chunk's first member, which is also the capacity of the chunks before it.
+                static size_t chunk_start(size_t chunk)
+                {
+                    return chunk ? initial_capacity << (chunk - 1) : 0;
+                }
+
+                size_t capacity() const
+                {
+                    return chunk_start(chunks_.size());
+                }
+
+                value_type& entry(size_t position) const
+                {
+                    if (position < initial_capacity)
+                        return chunks_[0][position];
+                    size_t chunk = chunk_of(position);
+                    return chunks_[chunk][position - chunk_start(chunk)];
+                }
+
+                void add_chunk()
+                {
+                    size_t members = chunks_.empty() ? initial_capacity : capacity();
+                    chunks_.push_back(nullptr);
+                    try
+                    {
+                        chunks_.back() = static_cast<value_type*>(::operator new(members * sizeof(value_type)));
+                    }
+                    catch (...)
+                    {
+                        chunks_.pop_back();
+                        throw;
+                    }
+                }
+
+                /// Construct a member after the last one, the key isn't looked up.
+                template<typename Key, typename... Args>
+                void append(Key&& key, Args&&... args)
+                {
+                    if (size_ == capacity())
+                        add_chunk();
+                    new (&entry(size_)) value_type(std::piecewise_construct,
+                                                   std::forward_as_tuple(std::forward<Key>(key)),
+                                                   std::forward_as_tuple(std::forward<Args>(args)...));
+                    size_++;
+                }
+
+                void release()
+                {
+                    clear();
+                    for (auto* chunk : chunks_)
+                        ::operator delete(chunk);
+                    chunks_.clear();
+                }
+
+                /// The position of a key, \ref size() if it isn't there.
+                size_t position(std::string_view key) const
+                {
+                    if (index_.empty())
+                    {
+                        for (size_t i = 0; i < size_; i++)
+                            if (entry(i).first == key)
+                                return i;
+                        return size_;
+                    }
+
+                    size_t mask = index_.size() - 1;
+                    for (size_t slot = std::hash<std::string_view>()(key) & mask; index_[slot]; slot = (slot + 1) & mask)
+                        if (entry(index_[slot] - 1).first == key)
+                            return index_[slot] - 1;
+                    return size_;
+                }
+
+                void index_insert(size_t i)
+                {
+                    // Kept at most half full
+                    if (size_ * 2 > index_.size())
+                    {
+                        rebuild_index();
+                        return;
+                    }
+                    size_t mask = index_.size() - 1;
+                    size_t slot = std::hash<std::string_view>()(entry(i).first) & mask;
+                    while (index_[slot])
+                        slot = (slot + 1) & mask;
+                    index_[slot] = static_cast<uint32_t>(i + 1);
+                }
+
+                void rebuild_index()
+                {
+                    index_.clear();
+                    if (size_ <= indexed_size)
+                        return;
+                    size_t slots = 64;
+                    while (slots < size_ * 4)
+                        slots *= 2;
+                    index_.resize(slots);
+                    size_t mask = slots - 1;
+                    for (size_t i = 0; i < size_; i++)
+                    {
+                        size_t slot = std::hash<std::string_view>()(entry(i).first) & mask;
+                        while (index_[slot])
+                            slot = (slot + 1) & mask;
+                        index_[slot] = static_cast<uint32_t>(i + 1);
+                    }
+                }
+
+                std::vector<value_type*> chunks_; ///< Raw storage, members are constructed in the first \ref size_ places.
+                size_t size_{};
+                std::vector<uint32_t> index_; ///< Positions plus one (0 is an empty slot), empty for small objects.
+            };
+        } // namespace detail
+
+        struct wvalue_reader;
+
+        /// JSON write value.
+
+        ///
+        /// Value can mean any json value, including a JSON object.<br>
+        /// Write means this class is used to primarily assemble JSON objects using keys and values and export those into a string.
+        class wvalue : public returnable
+        {
+            friend class crow::mustache::template_t;
+            friend struct wvalue_reader;
+
+        public:
+            using object =
+#ifdef CROW_JSON_USE_MAP
+              std::map<std::string, wvalue>;
+#else
+              detail::flat_object<wvalue>;
+#endif
+
+            using list = std::vector<wvalue>;
+
+            type t() const { return t_; }
+
+            /// Create an empty json value (outputs "{}" instead of a "null" string)
+            static crow::json::wvalue empty_object() { return crow::json::wvalue::object(); }
+
+        private:
+            type t_{type::Null};         ///< The type of the value.
+            num_type nt{num_type::Null}; ///< The specific type of the number if \ref t_ is a number.
+            union number
+            {
+                double d;
+                int64_t si;
+                uint64_t ui;
+
+            public:
+                constexpr number() noexcept:
+                  ui() {} /* default constructor initializes unsigned integer. */
+                constexpr number(std::uint64_t value) noexcept:
+                  ui(value) {}
+                constexpr number(std::int64_t value) noexcept:
                   si(value) {}
                 explicit constexpr number(double value) noexcept:
                   d(value) {}
@@ -3713,7 +5405,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             } num;                                      ///< Value if type is a number.
             std::string s;                              ///< Value if type is a string.
             std::unique_ptr<list> l;                    ///< Value if type is a list.
-            std::unique_ptr<object> o;                  ///< Value if type is a JSON object.
+            object o;                                   ///< Value if type is a JSON object.
             std::function<std::string(std::string&)> f; ///< Value if type is a function (C++ lambda)
 
         public:
@@ -3758,12 +5450,25 @@ namespace crow // NOTE: Already documented in "crow/app.h"
               returnable("application/json"), t_(type::String), s(std::move(value)) {}
 
             wvalue(std::initializer_list<std::pair<std::string const, wvalue>> initializer_list):
-              returnable("application/json"), t_(type::Object), o(new object(initializer_list)) {}
+              returnable("application/json"), t_(type::Object), o(initializer_list) {}
 
             wvalue(object const& value):
-              returnable("application/json"), t_(type::Object), o(new object(value)) {}
+              returnable("application/json"), t_(type::Object), o(value) {}
             wvalue(object&& value):
-              returnable("application/json"), t_(type::Object), o(new object(std::move(value))) {}
+              returnable("application/json"), t_(type::Object), o(std::move(value)) {}
+
+#ifndef CROW_JSON_USE_MAP
+            /// Objects used to be a std::unordered_map, which still converts (to members in its iteration order).
+            wvalue(std::unordered_map<std::string, wvalue> const& value):
+              returnable("application/json"), t_(type::Object), o(value.begin(), value.end()) {}
+            wvalue(std::unordered_map<std::string, wvalue>&& value):
+              returnable("application/json"), t_(type::Object)
+            {
+                o.reserve(value.size());
+                for (auto& member : value)
+                    o.emplace(member.first, std::move(member.second));
+            }
+#endif
 
             wvalue(const list& r):
               returnable("application/json")
@@ -3815,9 +5520,12 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                             l->emplace_back(*it);
                         return;
                     case type::Object:
-                        o = std::unique_ptr<object>(new object{});
+                        o = object();
+#ifndef CROW_JSON_USE_MAP
+                        o.reserve(r.size());
+#endif
                         for (auto it = r.begin(); it != r.end(); ++it)
-                            o->emplace(it->key(), *it);
+                            o.emplace(it->key(), *it);
                         return;
                 }
             }
@@ -3851,16 +5559,16 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                             l->emplace_back(*it);
                         return;
                     case type::Object:
-                        o = std::unique_ptr<object>(new object{});
-                        o->insert(r.o->begin(), r.o->end());
+                        o = r.o;
                         return;
                     case type::Function:
                         f = r.f;
                 }
             }
 
-            wvalue(wvalue&& r):
-              returnable("application/json")
+            // Doesn't throw, so that object members and list items are moved rather than copied when their storage grows
+            wvalue(wvalue&& r) noexcept:
+              returnable(std::move(r))
             {
                 *this = std::move(r);
             }
@@ -3873,6 +5581,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 s = std::move(r.s);
                 l = std::move(r.l);
                 o = std::move(r.o);
+                f = std::move(r.f);
                 return *this;
             }
 
@@ -3886,7 +5595,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             {
                 t_ = type::Null;
                 l.reset();
-                o.reset();
+                o = object();
             }
 
             wvalue& operator=(std::nullptr_t)
@@ -4051,16 +5760,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 {
                     reset();
                     t_ = type::Object;
-                    o = std::unique_ptr<object>(new object(initializer_list));
-                }
-                else
-                {
-#if defined(__APPLE__) || defined(__MACH__) || defined(__FreeBSD__) || defined(__ANDROID__) || defined(_LIBCPP_VERSION)
-                    o = std::unique_ptr<object>(new object(initializer_list));
-#else
-                    (*o) = initializer_list;
-#endif
                 }
+                o = object(initializer_list);
                 return *this;
             }
 
@@ -4070,16 +5771,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 {
                     reset();
                     t_ = type::Object;
-                    o = std::unique_ptr<object>(new object(value));
-                }
-                else
-                {
-#if defined(__APPLE__) || defined(__MACH__) || defined(__FreeBSD__) || defined(__ANDROID__) || defined(_LIBCPP_VERSION)
-                    o = std::unique_ptr<object>(new object(value));
-#else
-                    (*o) = value;
-#endif
                 }
+                o = value;
                 return *this;
             }
 
@@ -4089,15 +5782,23 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 {
                     reset();
                     t_ = type::Object;
-                    o = std::unique_ptr<object>(new object(std::move(value)));
-                }
-                else
-                {
-                    (*o) = std::move(value);
                 }
+                o = std::move(value);
                 return *this;
             }
 
+#ifndef CROW_JSON_USE_MAP
+            wvalue& operator=(std::unordered_map<std::string, wvalue> const& value)
+            {
+                return *this = wvalue(value);
+            }
+
+            wvalue& operator=(std::unordered_map<std::string, wvalue>&& value)
+            {
+                return *this = wvalue(std::move(value));
+            }
+#endif
+
             wvalue& operator=(std::function<std::string(std::string&)>&& func)
             {
                 reset();
@@ -4127,9 +5828,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             {
                 if (t_ != type::Object)
                     return 0;
-                if (!o)
-                    return 0;
-                return o->count(str);
+                return o.count(str);
             }
 
             wvalue& operator[](const std::string& str)
@@ -4137,9 +5836,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 if (t_ != type::Object)
                     reset();
                 t_ = type::Object;
-                if (!o)
-                    o = std::unique_ptr<object>(new object{});
-                return (*o)[str];
+                return o[str];
             }
 
             const wvalue& operator[](const std::string& str) const
@@ -4152,7 +5849,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 if (t_ != type::Object)
                     return {};
                 std::vector<std::string> result;
-                for (auto& kv : *o)
+                result.reserve(o.size());
+                for (auto& kv : o)
                 {
                     result.push_back(kv.first);
                 }
@@ -4174,7 +5872,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 return l->size();
             }
 
-            /// Returns an estimated size of the value in bytes.
+            /// Returns an estimated size of the value in bytes, enough to hold its dump without indentation.
             size_t estimate_length() const
             {
                 switch (t_)
@@ -4182,8 +5880,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                     case type::Null: return 4;
                     case type::False: return 5;
                     case type::True: return 4;
-                    case type::Number: return 30;
-                    case type::String: return 2 + s.size() + s.size() / 2;
+                    case type::Number: return 24;
+                    case type::String: return 2 + detail::escaped_length(s);
                     case type::List:
                     {
                         size_t sum{};
@@ -4200,14 +5898,11 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                     case type::Object:
                     {
                         size_t sum{};
-                        if (o)
+                        for (auto& kv : o)
                         {
-                            for (auto& kv : *o)
-                            {
-                                sum += 2;
-                                sum += 2 + kv.first.size() + kv.first.size() / 2;
-                                sum += kv.second.estimate_length();
-                            }
+                            sum += 2;
+                            sum += 2 + detail::escaped_length(kv.first);
+                            sum += kv.second.estimate_length();
                         }
                         return sum + 2;
                     }
@@ -4218,21 +5913,24 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             }
 
         private:
-            inline void dump_string(const std::string& str, std::string& out) const
+            template<typename Output>
+            inline void dump_string(const std::string& str, Output& out) const
             {
                 out.push_back('"');
                 escape(str, out);
                 out.push_back('"');
             }
 
-            inline void dump_indentation_part(std::string& out, const int indent, const char separator, const int indent_level) const
+            template<typename Output>
+            inline void dump_indentation_part(Output& out, const int indent, const char separator, const int indent_level) const
             {
                 out.push_back('\n');
                 out.append(indent_level * indent, separator);
             }
 
 
-            inline void dump_internal(const wvalue& v, std::string& out, const int indent, const char separator, const int indent_level = 0) const
+            template<typename Output>
+            inline void dump_internal(const wvalue& v, Output& out, const int indent, const char separator, const int indent_level = 0) const
             {
                 switch (v.t_)
                 {
@@ -4249,6 +5947,16 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                                 CROW_LOG_WARNING << "Invalid JSON value detected (" << v.num.d << "), value set to null";
                                 break;
                             }
+#ifdef __cpp_lib_to_chars
+                            if (v.nt == num_type::Double_precision_floating_point)
+                            {
+                                // The shortest digits that read back as the same double
+                                char digits[32];
+                                auto result = std::to_chars(digits, digits + sizeof(digits), v.num.d);
+                                out.append(digits, result.ptr);
+                                break;
+                            }
+#endif
                             enum
                             {
                                 start,
@@ -4313,13 +6021,11 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                                 *pos_first_trailing_0 = '\0';
                             out += outbuf;
                         }
-                        else if (v.nt == num_type::Signed_integer)
-                        {
-                            out += std::to_string(v.num.si);
-                        }
                         else
                         {
-                            out += std::to_string(v.num.ui);
+                            char digits[24];
+                            auto result = v.nt == num_type::Signed_integer ? std::to_chars(digits, digits + sizeof(digits), v.num.si) : std::to_chars(digits, digits + sizeof(digits), v.num.ui);
+                            out.append(digits, result.ptr);
                         }
                     }
                     break;
@@ -4369,30 +6075,27 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                             dump_indentation_part(out, indent, separator, indent_level + 1);
                         }
 
-                        if (v.o)
+                        bool first = true;
+                        for (auto& kv : v.o)
                         {
-                            bool first = true;
-                            for (auto& kv : *v.o)
+                            if (!first)
                             {
-                                if (!first)
-                                {
-                                    out.push_back(',');
-                                    if (indent >= 0)
-                                    {
-                                        dump_indentation_part(out, indent, separator, indent_level + 1);
-                                    }
-                                }
-                                first = false;
-                                dump_string(kv.first, out);
-                                out.push_back(':');
-
+                                out.push_back(',');
                                 if (indent >= 0)
                                 {
-                                    out.push_back(' ');
+                                    dump_indentation_part(out, indent, separator, indent_level + 1);
                                 }
+                            }
+                            first = false;
+                            dump_string(kv.first, out);
+                            out.push_back(':');
 
-                                dump_internal(kv.second, out, indent, separator, indent_level + 1);
+                            if (indent >= 0)
+                            {
+                                out.push_back(' ');
                             }
+
+                            dump_internal(kv.second, out, indent, separator, indent_level + 1);
                         }
 
                         if (indent >= 0)
@@ -4425,6 +6128,13 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 
                 return dump(DontIndent);
             }
+
+            /// Serialize into any string-like output, such as a \ref detail::chunked_output that sends the document as it's written.
+            template<typename Output>
+            void dump_to(Output& out, const int indent = -1, const char separator = ' ') const
+            {
+                dump_internal(*this, out, indent, separator);
+            }
         };
 
         // Used for accessing the internals of a wvalue
@@ -4479,6 +6189,15 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 #include <fstream>
 #include <iterator>
 #include <functional>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 namespace crow // NOTE: Already documented in "crow/app.h"
 {
@@ -4508,6 +6227,28 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 
         template_t load(const std::string& filename);
 
+        namespace detail
+        {
+            class template_cache;
+            std::shared_ptr<const template_t> load_shared(const std::string& filename);
+
+            /// The size of a template's last rendering, so that the next one can reserve its output up front.
+            struct render_size_hint
+            {
+                render_size_hint() = default;
+                render_size_hint(const render_size_hint& other):
+                  size(other.size.load(std::memory_order_relaxed)) {}
+
+                render_size_hint& operator=(const render_size_hint& other)
+                {
+                    size.store(other.size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    return *this;
+                }
+
+                std::atomic<size_t> size{0};
+            };
+        } // namespace detail
+
         /**
          * \class invalid_template_exception
          * \brief Represents compilation error of an template. Throwed
@@ -4620,6 +6361,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
          */
         class template_t
         {
+            friend class detail::template_cache;
+
         public:
             template_t(std::string body):
               body_(std::move(body))
@@ -4719,6 +6462,12 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             }
 
             bool isTagInsideObjectBlock(const int& current, const std::vector<const context*>& stack) const
+            {
+                return inside_block_[current] && (*stack.rbegin())->t() == json::type::Object;
+            }
+
+            /// Whether a tag is inside a block (which \ref isTagInsideObjectBlock() looks for), worked out once when parsing.
+            bool isTagInsideBlock(int current) const
             {
                 int openedBlock = 0;
                 for (int i = current; i > 0; --i)
@@ -4727,7 +6476,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 
                     if (action.t == ActionType::OpenBlock)
                     {
-                        if (openedBlock == 0 && (*stack.rbegin())->t() == json::type::Object)
+                        if (openedBlock == 0)
                         {
                             return true;
                         }
@@ -4762,9 +6511,9 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                         case ActionType::Partial:
                         {
                             std::string partial_name = tag_name(action);
-                            auto partial_templ = load(partial_name);
+                            auto partial_templ = detail::load_shared(partial_name);
                             int partial_indent = action.pos;
-                            partial_templ.render_internal(0, partial_templ.fragments_.size() - 1, stack, out, partial_indent ? indent + partial_indent : 0);
+                            partial_templ->render_internal(0, partial_templ->fragments_.size() - 1, stack, out, partial_indent ? indent + partial_indent : 0);
                         }
                         break;
                         case ActionType::UnescapeTag:
@@ -4908,22 +6657,16 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             rendered_template render() const
             {
                 context empty_ctx;
-                std::vector<const context*> stack;
-                stack.emplace_back(&empty_ctx);
-
                 std::string ret;
-                render_internal(0, fragments_.size() - 1, stack, ret, 0);
+                render_to(ret, empty_ctx);
                 return rendered_template(ret);
             }
 
             /// Apply the values from the context provided and output a returnable template from this mustache template
             rendered_template render(const context& ctx) const
             {
-                std::vector<const context*> stack;
-                stack.emplace_back(&ctx);
-
                 std::string ret;
-                render_internal(0, fragments_.size() - 1, stack, ret, 0);
+                render_to(ret, ctx);
                 return rendered_template(ret);
             }
 
@@ -4937,28 +6680,38 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             std::string render_string() const
             {
                 context empty_ctx;
-                std::vector<const context*> stack;
-                stack.emplace_back(&empty_ctx);
-
                 std::string ret;
-                render_internal(0, fragments_.size() - 1, stack, ret, 0);
+                render_to(ret, empty_ctx);
                 return ret;
             }
 
             /// Apply the values from the context provided and output a returnable template from this mustache template
             std::string render_string(const context& ctx) const
             {
-                std::vector<const context*> stack;
-                stack.emplace_back(&ctx);
-
                 std::string ret;
-                render_internal(0, fragments_.size() - 1, stack, ret, 0);
+                render_to(ret, ctx);
                 return ret;
             }
 
-        private:
-            void parse()
-            {
+            /// Apply the values from the context provided and append the result to out.
+
+            ///
+            /// The output is reserved up front, as big as the last rendering of this template. Passing the same string
+            /// (cleared) for each rendering reuses its storage.
+            void render_to(std::string& out, const context& ctx) const
+            {
+                std::vector<const context*> stack;
+                stack.emplace_back(&ctx);
+
+                size_t start = out.size();
+                out.reserve(start + std::max(render_size_.size.load(std::memory_order_relaxed), body_.size()));
+                render_internal(0, fragments_.size() - 1, stack, out, 0);
+                render_size_.size.store(out.size() - start, std::memory_order_relaxed);
+            }
+
+        private:
+            void parse()
+            {
                 std::string tag_open = "{{";
                 std::string tag_close = "}}";
 
@@ -5194,11 +6947,17 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                         fragment_after.first = k;
                     }
                 }
+
+                inside_block_.resize(actions_.size());
+                for (int i = 0; i < static_cast<int>(actions_.size()); i++)
+                    inside_block_[i] = (actions_[i].t == ActionType::Tag || actions_[i].t == ActionType::UnescapeTag) && isTagInsideBlock(i);
             }
 
             std::vector<std::pair<int, int>> fragments_;
             std::vector<Action> actions_;
+            std::vector<char> inside_block_; ///< Per action, see \ref isTagInsideBlock().
             std::string body_;
+            mutable detail::render_size_hint render_size_;
         };
 
         /// \brief The function that compiles a source into a mustache
@@ -5246,6 +7005,198 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 static std::function<std::string(std::string)> loader = default_loader;
                 return loader;
             }
+
+            /// Compiled templates (partials included) by path, shared by every thread.
+
+            ///
+            /// With reloading on, a template is compiled again once its file changes. On Linux inotify reports the changes,
+            /// which the cache drains (without blocking) on each lookup; elsewhere each lookup compares the file's
+            /// modification time.
+            class template_cache
+            {
+            public:
+                static template_cache& instance()
+                {
+                    static template_cache cache;
+                    return cache;
+                }
+
+                ~template_cache()
+                {
+#ifdef __linux__
+                    if (inotify_fd_ >= 0)
+                        close(inotify_fd_);
+#endif
+                }
+
+                /// The template for a file name as the loader takes it, compiled only if it isn't cached (or changed).
+                std::shared_ptr<const template_t> get(const std::string& filename)
+                {
+                    std::string path = utility::join_path(get_template_base_directory_ref(), filename);
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        if (enabled_)
+                        {
+                            if (reload_)
+                                drop_changed();
+                            auto it = entries_.find(path);
+                            if (it != entries_.end() && !(reload_ && changed(path, it->second)))
+                                return it->second.templ;
+                        }
+                    }
+
+                    // Read and compiled without the lock, a template that fails to compile throws and isn't cached
+                    entry e;
+                    e.templ = std::make_shared<const template_t>(get_loader_ref()(filename));
+                    if (e.templ->body_.empty())
+                        return e.templ; // Likely a missing file, which may yet be created
+
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    if (enabled_)
+                    {
+                        if (reload_)
+                            watch(path, e);
+                        entries_[path] = e;
+                    }
+                    return e.templ;
+                }
+
+                void enable(bool enabled)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    enabled_ = enabled;
+                    clear_entries();
+                }
+
+                void reload(bool reload)
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    reload_ = reload;
+                    clear_entries();
+                }
+
+                void clear()
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    clear_entries();
+                }
+
+            private:
+                struct entry
+                {
+                    std::shared_ptr<const template_t> templ;
+                    time_t modified = 0; ///< Modification time of the file, where there's no inotify.
+                    off_t size = 0;      ///< Size of the file, where there's no inotify.
+                };
+
+                void clear_entries()
+                {
+                    entries_.clear();
+#ifdef __linux__
+                    if (inotify_fd_ >= 0)
+                    {
+                        close(inotify_fd_);
+                        inotify_fd_ = -1;
+                    }
+                    watches_.clear();
+#endif
+                }
+
+#ifdef __linux__
+                void watch(const std::string& path, entry&)
+                {
+                    if (inotify_fd_ < 0)
+                    {
+                        inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+                        if (inotify_fd_ < 0)
+                        {
+                            CROW_LOG_WARNING << "Could not watch templates for changes (inotify_init1 failed), they won't be reloaded";
+                            return;
+                        }
+                    }
+                    int wd = inotify_add_watch(inotify_fd_, path.c_str(), IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+                    if (wd < 0)
+                        return;
+                    auto& paths = watches_[wd];
+                    if (std::find(paths.begin(), paths.end(), path) == paths.end())
+                        paths.push_back(path);
+                }
+
+                bool changed(const std::string&, const entry&)
+                {
+                    return false;
+                }
+
+                /// Drop the templates whose files inotify reported a change for.
+                void drop_changed()
+                {
+                    if (inotify_fd_ < 0)
+                        return;
+                    alignas(inotify_event) char events[4096];
+                    ssize_t size;
+                    while ((size = read(inotify_fd_, events, sizeof(events))) > 0)
+                    {
+                        for (char* p = events; p < events + size;)
+                        {
+                            auto event = reinterpret_cast<const inotify_event*>(p);
+                            auto it = watches_.find(event->wd);
+                            if (it != watches_.end())
+                            {
+                                for (auto& path : it->second)
+                                {
+                                    CROW_LOG_DEBUG << "Template " << path << " changed, it will be compiled again";
+                                    entries_.erase(path);
+                                }
+                                // Files that went away have their watch removed, the new file gets one when it's compiled
+                                if (event->mask & (IN_IGNORED | IN_MOVE_SELF | IN_DELETE_SELF))
+                                    watches_.erase(it);
+                                else
+                                    it->second.clear();
+                            }
+                            p += sizeof(inotify_event) + event->len;
+                        }
+                    }
+                }
+#else
+                void watch(const std::string& path, entry& e)
+                {
+                    struct stat info;
+                    if (stat(path.c_str(), &info) == 0)
+                    {
+                        e.modified = info.st_mtime;
+                        e.size = info.st_size;
+                    }
+                }
+
+                bool changed(const std::string& path, const entry& e)
+                {
+                    struct stat info;
+                    return stat(path.c_str(), &info) == 0 && (info.st_mtime != e.modified || info.st_size != e.size);
+                }
+
+                void drop_changed() {}
+#endif
+
+                std::mutex mutex_;
+                std::unordered_map<std::string, entry> entries_;
+                bool enabled_ = true;
+#ifdef NDEBUG
+                bool reload_ = false;
+#else
+                bool reload_ = true;
+#endif
+#ifdef __linux__
+                int inotify_fd_ = -1;
+                std::unordered_map<int, std::vector<std::string>> watches_; ///< Cached paths by inotify watch.
+#endif
+            };
+
+            inline std::shared_ptr<const template_t> load_shared(const std::string& filename)
+            {
+                std::string filename_sanitized(filename);
+                utility::sanitize_filename(filename_sanitized);
+                return template_cache::instance().get(filename_sanitized);
+            }
         } // namespace detail
 
         /// \brief Defines the templates directory path at **route
@@ -5283,6 +7234,33 @@ namespace crow // NOTE: Already documented in "crow/app.h"
         inline void set_loader(std::function<std::string(std::string)> loader)
         {
             detail::get_loader_ref() = std::move(loader);
+            detail::template_cache::instance().clear();
+        }
+
+        /// \brief Turn the cache of compiled templates on or off.
+        ///
+        /// \ref load, \ref load_unsafe and partials compile each
+        /// template once and keep it, by path. On by default.
+        inline void set_cache(bool enabled)
+        {
+            detail::template_cache::instance().enable(enabled);
+        }
+
+        /// \brief Compile cached templates again when their files
+        /// change.
+        ///
+        /// Meant for development, it's on by default unless `NDEBUG`
+        /// is defined.
+        inline void set_hot_reload(bool reload)
+        {
+            detail::template_cache::instance().reload(reload);
+        }
+
+        /// \brief Forget every compiled template, so they're read and
+        /// compiled again.
+        inline void clear_cache()
+        {
+            detail::template_cache::instance().clear();
         }
 
         /// \brief Open, read and sanitize a file but returns a
@@ -5324,11 +7302,12 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 
         /// \brief Open, read and renders a file using a mustache
         /// compiler. It also sanitize the input before compilation.
+        ///
+        /// The compiled template comes from the cache (see
+        /// \ref set_cache) when it's there.
         inline template_t load(const std::string& filename)
         {
-            std::string filename_sanitized(filename);
-            utility::sanitize_filename(filename_sanitized);
-            return compile(detail::get_loader_ref()(filename_sanitized));
+            return *detail::load_shared(filename);
         }
 
         /// \brief Open, read and renders a file using a mustache
@@ -5340,7 +7319,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
         /// **Never blindly trust your users!**
         inline template_t load_unsafe(const std::string& filename)
         {
-            return compile(detail::get_loader_ref()(filename));
+            return *detail::template_cache::instance().get(filename);
         }
     } // namespace mustache
 } // namespace crow
@@ -5360,8 +7339,13 @@ namespace crow
 }
 #ifdef CROW_ENABLE_COMPRESSION
 
+#include <memory>
 #include <string>
+#include <string_view>
 #include <zlib.h>
+#ifdef CROW_ENABLE_ZSTD
+#include <zstd.h>
+#endif
 
 // http://zlib.net/manual.html
 namespace crow // NOTE: Already documented in "crow/app.h"
@@ -5376,147 +7360,507 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             // windowBits can also be greater than 15 for optional gzip encoding.
             // Add 16 to windowBits to write a simple gzip header and trailer around the compressed data instead of a zlib wrapper.
             GZIP = 15 | 16,
+#ifdef CROW_ENABLE_ZSTD
+            // Not a windowBits value, zstd is a library of its own.
+            ZSTD = 1 << 8,
+#endif
         };
 
-        inline std::string compress_string(std::string const& str, algorithm algo)
+        /// The content coding of an algorithm, as used in the "Accept-Encoding" and "Content-Encoding" headers.
+        inline const char* encoding_name(algorithm algo)
         {
-            std::string compressed_str;
-            z_stream stream{};
-            // Initialize with the default values
-            if (::deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, algo, 8, Z_DEFAULT_STRATEGY) == Z_OK)
+            switch (algo)
             {
-                char buffer[8192];
+                case DEFLATE: return "deflate";
+                case GZIP: return "gzip";
+#ifdef CROW_ENABLE_ZSTD
+                case ZSTD: return "zstd";
+#endif
+            }
+            return "identity";
+        }
 
-                stream.avail_in = str.size();
-                // zlib does not take a const pointer. The data is not altered.
-                stream.next_in = const_cast<Bytef*>(reinterpret_cast<const Bytef*>(str.c_str()));
+        /// How an app compresses its responses.
+        struct settings
+        {
+            algorithm preferred = GZIP;        ///< Used whenever the client accepts it as much as the others.
+            int level = Z_DEFAULT_COMPRESSION; ///< zlib's level, from 1 (fastest) to 9 (smallest), -1 is zlib's default (6).
+#ifdef CROW_ENABLE_ZSTD
+            int zstd_level = 3; ///< zstd's level, from 1 to 19 (or negative for faster ones).
+#endif
+            size_t min_size = 0; ///< Smaller bodies are sent as they are, compressing them would barely pay off.
+        };
+
+        namespace detail
+        {
+            inline std::string_view trim(std::string_view v)
+            {
+                while (!v.empty() && (v.front() == ' ' || v.front() == '\t'))
+                    v.remove_prefix(1);
+                while (!v.empty() && (v.back() == ' ' || v.back() == '\t'))
+                    v.remove_suffix(1);
+                return v;
+            }
 
-                int code = Z_OK;
-                do
+            /// Parse the parameters of an "Accept-Encoding" element for its quality value, in thousandths.
+            inline int parse_quality(std::string_view parameters)
+            {
+                while (!parameters.empty())
                 {
-                    stream.avail_out = sizeof(buffer);
-                    stream.next_out = reinterpret_cast<Bytef*>(&buffer[0]);
+                    size_t end = parameters.find(';');
+                    auto parameter = trim(parameters.substr(0, end));
+                    parameters.remove_prefix(end == std::string_view::npos ? parameters.size() : end + 1);
 
-                    code = ::deflate(&stream, Z_FINISH);
-                    // Successful and non-fatal error code returned by deflate when used with Z_FINISH flush
-                    if (code == Z_OK || code == Z_STREAM_END)
+                    if (parameter.size() < 2 || (parameter[0] != 'q' && parameter[0] != 'Q') || parameter[1] != '=')
+                        continue;
+                    auto value = parameter.substr(2);
+                    // qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] )
+                    if (value.empty() || (value[0] != '0' && value[0] != '1'))
+                        return 1000;
+                    int quality = (value[0] - '0') * 1000;
+                    if (value.size() > 1 && value[1] == '.')
                     {
-                        std::copy(&buffer[0], &buffer[sizeof(buffer) - stream.avail_out], std::back_inserter(compressed_str));
+                        int scale = 100;
+                        for (size_t i = 2; i < value.size() && i < 5 && value[i] >= '0' && value[i] <= '9'; i++, scale /= 10)
+                            quality += (value[i] - '0') * scale;
                     }
+                    return std::min(quality, 1000);
+                }
+                return 1000;
+            }
+        } // namespace detail
 
-                } while (code == Z_OK);
-
-                if (code != Z_STREAM_END)
-                    compressed_str.clear();
+        /// How much a client accepts a content coding according to its "Accept-Encoding" header, from 0 (not at all) to 1000.
+        inline int accept_quality(std::string_view accept_encoding, std::string_view coding)
+        {
+            int quality = -1, wildcard = -1;
+            while (!accept_encoding.empty())
+            {
+                size_t end = accept_encoding.find(',');
+                auto element = accept_encoding.substr(0, end);
+                accept_encoding.remove_prefix(end == std::string_view::npos ? accept_encoding.size() : end + 1);
 
-                ::deflateEnd(&stream);
+                size_t semicolon = element.find(';');
+                auto name = detail::trim(element.substr(0, semicolon));
+                int q = semicolon == std::string_view::npos ? 1000 : detail::parse_quality(element.substr(semicolon + 1));
+                if (name == "*")
+                    wildcard = q;
+                else if (utility::string_equals(name, coding))
+                    quality = q;
             }
+            return quality >= 0 ? quality : std::max(wildcard, 0);
+        }
 
-            return compressed_str;
+        /// Pick the algorithm the client accepts the most, ties go to the preferred one.
+
+        ///
+        /// \return false if the client accepts none of them.
+        inline bool negotiate(std::string_view accept_encoding, algorithm preferred, algorithm& chosen)
+        {
+            static constexpr algorithm candidates[] = {
+#ifdef CROW_ENABLE_ZSTD
+              ZSTD,
+#endif
+              GZIP, DEFLATE};
+
+            int best = accept_quality(accept_encoding, encoding_name(preferred));
+            chosen = preferred;
+            for (auto candidate : candidates)
+            {
+                if (candidate == preferred)
+                    continue;
+                int quality = accept_quality(accept_encoding, encoding_name(candidate));
+                if (quality > best)
+                {
+                    best = quality;
+                    chosen = candidate;
+                }
+            }
+            return best > 0;
         }
 
-        inline std::string decompress_string(std::string const& deflated_string)
+        /// A zlib stream that is reset, rather than set up again, for each body it compresses.
+        class deflate_context
         {
-            std::string inflated_string;
-            Bytef tmp[8192];
+        public:
+            deflate_context(algorithm algo, int level):
+              level_(level)
+            {
+                ok_ = ::deflateInit2(&stream_, level, Z_DEFLATED, algo, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            }
+
+            deflate_context(const deflate_context&) = delete;
+            deflate_context& operator=(const deflate_context&) = delete;
+
+            ~deflate_context()
+            {
+                if (ok_)
+                    ::deflateEnd(&stream_);
+            }
+
+            int level() const
+            {
+                return level_;
+            }
 
-            z_stream zstream{};
-            zstream.avail_in = deflated_string.size();
-            // Nasty const_cast but zlib won't alter its contents
-            zstream.next_in = const_cast<Bytef*>(reinterpret_cast<Bytef const*>(deflated_string.c_str()));
-            // Initialize with automatic header detection, for gzip support
-            if (::inflateInit2(&zstream, MAX_WBITS | 32) == Z_OK)
+            /// Compress the next part of a body, appending whatever is ready to the output. The last part sets finish.
+            bool compress(const char* data, size_t size, std::string& output, bool finish)
             {
-                do
+                if (!ok_)
+                    return false;
+
+                // zlib does not take a const pointer. The data is not altered.
+                stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+
+                size_t written = output.size();
+                // A whole body usually fits in deflateBound() at once.
+                size_t room = finish ? ::deflateBound(&stream_, static_cast<uLong>(size)) : size / 2 + 64;
+                for (;;)
                 {
-                    zstream.avail_out = sizeof(tmp);
-                    zstream.next_out = &tmp[0];
+                    if (output.size() - written < 64)
+                        output.resize(written + room);
+                    stream_.next_out = reinterpret_cast<Bytef*>(&output[written]);
+                    stream_.avail_out = static_cast<uInt>(output.size() - written);
+
+                    int code = ::deflate(&stream_, finish ? Z_FINISH : Z_NO_FLUSH);
+                    written = output.size() - stream_.avail_out;
 
-                    auto ret = ::inflate(&zstream, Z_NO_FLUSH);
-                    if (ret == Z_OK || ret == Z_STREAM_END)
+                    if (code == Z_STREAM_END)
+                        break;
+                    if (code != Z_OK && code != Z_BUF_ERROR)
                     {
-                        std::copy(&tmp[0], &tmp[sizeof(tmp) - zstream.avail_out], std::back_inserter(inflated_string));
+                        output.resize(written);
+                        ::deflateReset(&stream_);
+                        return false;
                     }
-                    else
-                    {
-                        // Something went wrong with inflate; make sure we return an empty string
-                        inflated_string.clear();
+                    // Without finishing, the input is consumed once there's output space left.
+                    if (!finish && stream_.avail_out != 0)
                         break;
-                    }
-
-                } while (zstream.avail_out == 0);
+                    room = std::max<size_t>(room, 4096);
+                }
 
-                // Free zlib's internal memory
-                ::inflateEnd(&zstream);
+                output.resize(written);
+                if (finish)
+                    ::deflateReset(&stream_);
+                return true;
             }
 
-            return inflated_string;
-        }
-    } // namespace compression
-} // namespace crow
+            /// Drop a body that won't be finished, the next one starts a stream of its own.
+            void reset()
+            {
+                if (ok_)
+                    ::deflateReset(&stream_);
+            }
 
-#endif
+        private:
+            z_stream stream_{};
+            int level_;
+            bool ok_;
+        };
 
+#ifdef CROW_ENABLE_ZSTD
+        /// A zstd context kept for all the bodies it compresses.
+        class zstd_context
+        {
+        public:
+            explicit zstd_context(int level):
+              context_(ZSTD_createCCtx()), level_(level)
+            {
+                if (context_)
+                    ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, level);
+            }
 
-#include <vector>
-#include <string>
-#include <stdexcept>
-#include <iostream>
+            zstd_context(const zstd_context&) = delete;
+            zstd_context& operator=(const zstd_context&) = delete;
 
-namespace crow
-{
-    const char cr = '\r';
-    const char lf = '\n';
-    const std::string crlf("\r\n");
+            ~zstd_context()
+            {
+                ZSTD_freeCCtx(context_);
+            }
 
-    enum class HTTPMethod : char
-    {
-#ifndef DELETE
-        DELETE = 0,
-        GET,
-        HEAD,
-        POST,
-        PUT,
+            int level() const
+            {
+                return level_;
+            }
 
-        CONNECT,
-        OPTIONS,
-        TRACE,
+            /// Compress the next part of a body, appending whatever is ready to the output. The last part sets finish.
+            bool compress(const char* data, size_t size, std::string& output, bool finish)
+            {
+                if (!context_)
+                    return false;
 
-        PATCH,
-        PURGE,
+                ZSTD_inBuffer input{data, size, 0};
+                size_t written = output.size();
+                size_t room = finish ? ZSTD_compressBound(size) : size / 2 + 64;
+                for (;;)
+                {
+                    if (output.size() - written < 64)
+                        output.resize(written + room);
+                    ZSTD_outBuffer out{&output[0], output.size(), written};
 
-        COPY,
-        LOCK,
-        MKCOL,
-        MOVE,
-        PROPFIND,
-        PROPPATCH,
-        SEARCH,
-        UNLOCK,
-        BIND,
-        REBIND,
-        UNBIND,
-        ACL,
+                    size_t remaining = ZSTD_compressStream2(context_, &out, &input, finish ? ZSTD_e_end : ZSTD_e_continue);
+                    written = out.pos;
 
-        REPORT,
-        MKACTIVITY,
-        CHECKOUT,
-        MERGE,
+                    if (ZSTD_isError(remaining))
+                    {
+                        output.resize(written);
+                        ZSTD_CCtx_reset(context_, ZSTD_reset_session_only);
+                        return false;
+                    }
+                    if (finish ? remaining == 0 : (input.pos == input.size && out.pos < out.size))
+                        break;
+                    room = std::max<size_t>(room, ZSTD_CStreamOutSize());
+                }
 
-        MSEARCH,
-        NOTIFY,
-        SUBSCRIBE,
-        UNSUBSCRIBE,
+                output.resize(written);
+                return true;
+            }
 
-        MKCALENDAR,
+            /// Drop a body that won't be finished, the next one starts a frame of its own.
+            void reset()
+            {
+                if (context_)
+                    ZSTD_CCtx_reset(context_, ZSTD_reset_session_only);
+            }
 
-        LINK,
-        UNLINK,
+        private:
+            ZSTD_CCtx* context_;
+            int level_;
+        };
+#endif
 
-        SOURCE,
+        namespace detail
+        {
+#ifdef CROW_ENABLE_ZSTD
+            inline zstd_context& thread_zstd_context(int level)
+            {
+                thread_local std::unique_ptr<zstd_context> context;
+                if (!context || context->level() != level)
+                    context.reset(new zstd_context(level));
+                return *context;
+            }
 #endif
 
-        Delete = 0,
+            inline deflate_context& thread_deflate_context(algorithm algo, int level)
+            {
+                thread_local std::unique_ptr<deflate_context> contexts[2];
+                auto& context = contexts[algo == GZIP];
+                if (!context || context->level() != level)
+                    context.reset(new deflate_context(algo, level));
+                return *context;
+            }
+        } // namespace detail
+
+        /// Compress (a part of) a body with the calling thread's context for the algorithm, appending to the output.
+
+        ///
+        /// Contexts are created on a thread's first use and reused for all the bodies it compresses afterwards.
+        /// A body split into parts must be compressed in consecutive calls on one thread, the last one setting finish,
+        /// or be given up on with \ref reset.
+        inline bool compress(algorithm algo, const settings& options, const char* data, size_t size, std::string& output, bool finish = true)
+        {
+#ifdef CROW_ENABLE_ZSTD
+            if (algo == ZSTD)
+                return detail::thread_zstd_context(options.zstd_level).compress(data, size, output, finish);
+#endif
+            return detail::thread_deflate_context(algo, options.level).compress(data, size, output, finish);
+        }
+
+        /// Drop the body the calling thread's context for the algorithm is in the middle of, when it won't be finished.
+        inline void reset(algorithm algo, const settings& options)
+        {
+#ifdef CROW_ENABLE_ZSTD
+            if (algo == ZSTD)
+                return detail::thread_zstd_context(options.zstd_level).reset();
+#endif
+            detail::thread_deflate_context(algo, options.level).reset();
+        }
+
+        inline std::string compress_string(std::string const& str, algorithm algo)
+        {
+            std::string compressed_str;
+            if (!compress(algo, settings{}, str.data(), str.size(), compressed_str))
+                compressed_str.clear();
+            return compressed_str;
+        }
+
+        /// Whether a request body with this "Content-Encoding" can be decompressed by \ref inflate_context.
+        inline bool decodable(std::string_view content_encoding)
+        {
+            content_encoding = detail::trim(content_encoding);
+            return utility::string_equals(content_encoding, "gzip") || utility::string_equals(content_encoding, "x-gzip") ||
+                   utility::string_equals(content_encoding, "deflate");
+        }
+
+        enum class inflate_result
+        {
+            Ok,
+            Corrupt,
+            TooLarge, ///< The output would grow past its limit.
+        };
+
+        /// A zlib stream decompressing gzip or deflate data (detected from its header) as it arrives, reset between bodies.
+        class inflate_context
+        {
+        public:
+            inflate_context()
+            {
+                // Initialize with automatic header detection, for gzip support
+                ok_ = ::inflateInit2(&stream_, MAX_WBITS | 32) == Z_OK;
+            }
+
+            inflate_context(const inflate_context&) = delete;
+            inflate_context& operator=(const inflate_context&) = delete;
+
+            ~inflate_context()
+            {
+                if (ok_)
+                    ::inflateEnd(&stream_);
+            }
+
+            /// Get ready for another body.
+            void reset()
+            {
+                if (ok_)
+                    ::inflateReset(&stream_);
+                finished_ = false;
+                started_ = false;
+            }
+
+            /// Whether the data so far is a complete stream (or nothing at all), a body that isn't is truncated.
+            bool complete() const
+            {
+                return finished_ || !started_;
+            }
+
+            /// Decompress the next part of a body, appending it to the output without letting that grow past max_size.
+            inflate_result decompress(const char* data, size_t size, std::string& output, size_t max_size)
+            {
+                if (!ok_)
+                    return inflate_result::Corrupt;
+
+                // zlib does not take a const pointer. The data is not altered.
+                stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+                started_ |= size > 0;
+
+                while (stream_.avail_in > 0 || !stream_.avail_out)
+                {
+                    // Data after the end of a stream starts another gzip member
+                    if (finished_)
+                    {
+                        if (!stream_.avail_in)
+                            break;
+                        ::inflateReset(&stream_);
+                        finished_ = false;
+                    }
+
+                    size_t written = output.size();
+                    if (written >= max_size)
+                        return inflate_result::TooLarge;
+                    size_t room = std::min(max_size - written, std::max<size_t>(stream_.avail_in * 4, 16384));
+                    output.resize(written + room);
+                    stream_.next_out = reinterpret_cast<Bytef*>(&output[written]);
+                    stream_.avail_out = static_cast<uInt>(room);
+
+                    int code = ::inflate(&stream_, Z_NO_FLUSH);
+                    output.resize(output.size() - stream_.avail_out);
+
+                    if (code == Z_STREAM_END)
+                        finished_ = true;
+                    else if (code == Z_BUF_ERROR)
+                        break; // Nothing left to do until more input arrives
+                    else if (code != Z_OK)
+                        return inflate_result::Corrupt;
+                }
+                return inflate_result::Ok;
+            }
+
+        private:
+            z_stream stream_{};
+            bool ok_;
+            bool finished_{};
+            bool started_{};
+        };
+
+        inline std::string decompress_string(std::string const& deflated_string)
+        {
+            std::string inflated_string;
+            inflate_context context;
+            if (context.decompress(deflated_string.data(), deflated_string.size(), inflated_string, inflated_string.max_size()) != inflate_result::Ok)
+            {
+                // Something went wrong with inflate; make sure we return an empty string
+                inflated_string.clear();
+            }
+            return inflated_string;
+        }
+    } // namespace compression
+} // namespace crow
+
+#endif
+
+
+#include <vector>
+#include <string>
+#include <string_view>
+#include <stdexcept>
+#include <iostream>
+
+namespace crow
+{
+    const char cr = '\r';
+    const char lf = '\n';
+    const std::string crlf("\r\n");
+
+    enum class HTTPMethod : char
+    {
+#ifndef DELETE
+        DELETE = 0,
+        GET,
+        HEAD,
+        POST,
+        PUT,
+
+        CONNECT,
+        OPTIONS,
+        TRACE,
+
+        PATCH,
+        PURGE,
+
+        COPY,
+        LOCK,
+        MKCOL,
+        MOVE,
+        PROPFIND,
+        PROPPATCH,
+        SEARCH,
+        UNLOCK,
+        BIND,
+        REBIND,
+        UNBIND,
+        ACL,
+
+        REPORT,
+        MKACTIVITY,
+        CHECKOUT,
+        MERGE,
+
+        MSEARCH,
+        NOTIFY,
+        SUBSCRIBE,
+        UNSUBSCRIBE,
+
+        MKCALENDAR,
+
+        LINK,
+        UNLINK,
+
+        SOURCE,
+#endif
+
+        Delete = 0,
         Get,
         Head,
         Post,
@@ -5680,28 +8024,69 @@ namespace crow
         MAX
     };
 
+    namespace detail
+    {
+        /// A vector keeping its first N elements inline, so the common case never touches the heap.
+        ///
+        /// Only meant for trivially copyable element types, elements past N go to a regular `std::vector`.
+        template<typename T, unsigned N>
+        class small_vector
+        {
+        public:
+            void push_back(const T& value)
+            {
+                if (size_ < N)
+                    inline_[size_] = value;
+                else
+                    overflow_.push_back(value);
+                size_++;
+            }
+
+            void pop_back()
+            {
+                if (size_ > N)
+                    overflow_.pop_back();
+                size_--;
+            }
+
+            const T& operator[](size_t index) const
+            {
+                return index < N ? inline_[index] : overflow_[index - N];
+            }
+
+            size_t size() const { return size_; }
+            bool empty() const { return size_ == 0; }
+
+        private:
+            T inline_[N]{};
+            std::vector<T> overflow_;
+            size_t size_{};
+        };
+    } // namespace detail
+
     /// @cond SKIP
+    /// String parameters are views into the request's URL, which has to outlive them (it's left untouched from routing until the handler returns).
     struct routing_params
     {
-        std::vector<int64_t> int_params;
-        std::vector<uint64_t> uint_params;
-        std::vector<double> double_params;
-        std::vector<std::string> string_params;
+        detail::small_vector<int64_t, 4> int_params;
+        detail::small_vector<uint64_t, 4> uint_params;
+        detail::small_vector<double, 4> double_params;
+        detail::small_vector<std::string_view, 4> string_params;
 
         void debug_print() const
         {
             std::cerr << "routing_params" << std::endl;
-            for (auto i : int_params)
-                std::cerr << i << ", ";
+            for (size_t i = 0; i < int_params.size(); i++)
+                std::cerr << int_params[i] << ", ";
             std::cerr << std::endl;
-            for (auto i : uint_params)
-                std::cerr << i << ", ";
+            for (size_t i = 0; i < uint_params.size(); i++)
+                std::cerr << uint_params[i] << ", ";
             std::cerr << std::endl;
-            for (auto i : double_params)
-                std::cerr << i << ", ";
+            for (size_t i = 0; i < double_params.size(); i++)
+                std::cerr << double_params[i] << ", ";
             std::cerr << std::endl;
-            for (auto& i : string_params)
-                std::cerr << i << ", ";
+            for (size_t i = 0; i < string_params.size(); i++)
+                std::cerr << string_params[i] << ", ";
             std::cerr << std::endl;
         }
 
@@ -5730,28 +8115,28 @@ namespace crow
     template<>
     inline std::string routing_params::get<std::string>(unsigned index) const
     {
-        return string_params[index];
+        return std::string(string_params[index]);
     }
     /// @endcond
 
     struct routing_handle_result
     {
-        uint16_t rule_index;
+        uint16_t rule_index{};
         std::vector<uint16_t> blueprint_indices;
         routing_params r_params;
-        HTTPMethod method;
+        HTTPMethod method = HTTPMethod::InternalMethodCount;
 
         routing_handle_result() {}
 
         routing_handle_result(uint16_t rule_index_, std::vector<uint16_t> blueprint_indices_, routing_params r_params_):
           rule_index(rule_index_),
-          blueprint_indices(blueprint_indices_),
-          r_params(r_params_) {}
+          blueprint_indices(std::move(blueprint_indices_)),
+          r_params(std::move(r_params_)) {}
 
         routing_handle_result(uint16_t rule_index_, std::vector<uint16_t> blueprint_indices_, routing_params r_params_, HTTPMethod method_):
           rule_index(rule_index_),
-          blueprint_indices(blueprint_indices_),
-          r_params(r_params_),
+          blueprint_indices(std::move(blueprint_indices_)),
+          r_params(std::move(r_params_)),
           method(method_) {}
     };
 } // namespace crow
@@ -5941,6 +8326,9 @@ enum http_connection_flags // This is basically 7 booleans placed into 1 integer
   CROW_XX(STRICT, "strict mode assertion failed")                                       \
   CROW_XX(UNKNOWN, "an unknown error occurred")                                         \
   CROW_XX(INVALID_TRANSFER_ENCODING, "request has invalid transfer-encoding")           \
+                                                                                        \
+  /* Paused by a callback, parsing can be resumed after clearing the errno */           \
+  CROW_XX(PAUSED, "parser is paused")                                                   \
 
 
 /* Define CHPE_* values for each errno value above */
@@ -7826,23 +10214,23 @@ http_parser_set_max_header_size(uint32_t size) {
 // clang-format on
 
 
+#include <array>
 #include <string_view>
-#include <locale>
 #include <unordered_map>
+#include <vector>
 
 
 namespace crow
 {
-    /// Hashing function for ci_map (unordered_multimap).
+    /// Case insensitive hashing function for header keyed `unordered_multimap`s.
     struct ci_hash
     {
         size_t operator()(const std::string_view key) const
         {
             std::size_t seed = 0;
-            std::locale locale;
 
             for (auto c : key)
-                hash_combine(seed, std::toupper(c, locale));
+                hash_combine(seed, utility::ascii_toupper(c));
 
             return seed;
         }
@@ -7855,7 +10243,7 @@ namespace crow
         }
     };
 
-    /// Equals function for ci_map (unordered_multimap).
+    /// Case insensitive equals function for header keyed `unordered_multimap`s.
     struct ci_key_eq
     {
         bool operator()(const std::string_view l, const std::string_view r) const
@@ -7864,111 +10252,429 @@ namespace crow
         }
     };
 
-    using ci_map = std::unordered_multimap<std::string, std::string, ci_hash, ci_key_eq>;
-} // namespace crow
-
-
-#ifdef CROW_USE_BOOST
-#include <boost/asio.hpp>
-#else
-#ifndef ASIO_STANDALONE
-#define ASIO_STANDALONE
-#endif
-#include <asio.hpp>
-#endif
+    /// Headers Crow looks up itself, classified once when they're added to a \ref ci_map.
+    enum class known_header : uint8_t
+    {
+        Unknown = 0,
+        AcceptEncoding,
+        Connection,
+        ContentEncoding,
+        ContentLength,
+        ContentType,
+        Cookie,
+        Date,
+        Expect,
+        Host,
+        Origin,
+        SecWebSocketKey,
+        SecWebSocketProtocol,
+        Server,
+        TransferEncoding,
+        Upgrade,
+
+        InternalHeaderCount,
+    };
 
+    namespace detail
+    {
+        constexpr std::string_view known_header_names[] = {
+          "",
+          "Accept-Encoding",
+          "Connection",
+          "Content-Encoding",
+          "Content-Length",
+          "Content-Type",
+          "Cookie",
+          "Date",
+          "Expect",
+          "Host",
+          "Origin",
+          "Sec-WebSocket-Key",
+          "Sec-WebSocket-Protocol",
+          "Server",
+          "Transfer-Encoding",
+          "Upgrade",
+        };
 
-namespace crow // NOTE: Already documented in "crow/app.h"
-{
-#ifdef CROW_USE_BOOST
-    namespace asio = boost::asio;
-#endif
+        static_assert(sizeof(known_header_names) / sizeof(known_header_names[0]) == static_cast<size_t>(known_header::InternalHeaderCount), "every known header needs a name");
 
-    /// Find and return the value associated with the key. (returns an empty string if nothing is found)
-    template<typename T>
-    inline const std::string& get_header_value(const T& headers, const std::string& key)
-    {
-        if (headers.count(key))
+        /// Find which well known header (if any) a name refers to, ignoring ASCII case.
+        inline known_header classify_header(std::string_view name)
         {
-            return headers.find(key)->second;
+            // Names of another length are skipped without looking at their bytes
+            for (size_t i = 1; i < static_cast<size_t>(known_header::InternalHeaderCount); i++)
+            {
+                if (known_header_names[i].size() == name.size() && utility::string_equals(known_header_names[i], name))
+                    return static_cast<known_header>(i);
+            }
+            return known_header::Unknown;
         }
-        static std::string empty;
-        return empty;
-    }
+    } // namespace detail
 
-    /// An HTTP request.
-    struct request
+    /// A case insensitive (ASCII) multimap of headers.
+
+    ///
+    /// Entries are kept flat in insertion order. Well known headers are classified once when added and found through a slot table from then on,
+    /// other keys are compared linearly, which beats hashing for the dozen or so headers a message carries.
+    /// Cleared and erased entries keep their strings around for the next ones, so a map that's reused (as the parser does for every request on a connection)
+    /// stops allocating once it has seen a few messages.
+    /// Keys must not be modified in place, erase and emplace them instead.
+    class ci_map
     {
-        HTTPMethod method;
-        std::string raw_url;     ///< The full URL containing the `?` and URL parameters.
-        std::string url;         ///< The endpoint without any parameters.
-        query_string url_params; ///< The parameters associated with the request. (everything after the `?` in the URL)
-        ci_map headers;
-        std::string body;
-        std::string remote_ip_address; ///< The IP address from which the request was sent.
-        unsigned char http_ver_major, http_ver_minor;
-        bool keep_alive,    ///< Whether or not the server should send a `connection: Keep-Alive` header to the client.
-          close_connection, ///< Whether or not the server should shut down the TCP connection once a response is sent.
-          upgrade;          ///< Whether or noth the server should change the HTTP connection to a different connection.
+    public:
+        using key_type = std::string;
+        using mapped_type = std::string;
+        using value_type = std::pair<std::string, std::string>;
+        using size_type = std::size_t;
 
-        void* middleware_context{};
-        void* middleware_container{};
-        asio::io_context* io_context{};
+    private:
+        using container_type = std::vector<value_type>;
 
-        /// Construct an empty request. (sets the method to `GET`)
-        request():
-          method(HTTPMethod::Get)
-        {}
+    public:
+        using iterator = container_type::iterator;
+        using const_iterator = container_type::const_iterator;
 
-        /// Construct a request with all values assigned.
-        request(HTTPMethod method_, std::string raw_url_, std::string url_, query_string url_params_, ci_map headers_, std::string body_, unsigned char http_major, unsigned char http_minor, bool has_keep_alive, bool has_close_connection, bool is_upgrade):
-          method(method_), raw_url(std::move(raw_url_)), url(std::move(url_)), url_params(std::move(url_params_)), headers(std::move(headers_)), body(std::move(body_)), http_ver_major(http_major), http_ver_minor(http_minor), keep_alive(has_keep_alive), close_connection(has_close_connection), upgrade(is_upgrade)
+        /// Strings with more capacity than this aren't kept around once their entry is cleared.
+        static constexpr size_type max_retained_capacity = 1024;
+
+        ci_map() = default;
+
+        ci_map(std::initializer_list<value_type> init)
+        {
+            reserve(init.size());
+            for (auto& kv : init)
+                emplace(kv.first, kv.second);
+        }
+
+        ci_map(const ci_map& other):
+          entries_(other.begin(), other.end()),
+          ids_(other.ids_.begin(), other.ids_.begin() + other.size_),
+          slots_(other.slots_),
+          size_(other.size_)
         {}
 
-        void add_header(std::string key, std::string value)
+        ci_map(ci_map&& other) noexcept:
+          entries_(std::move(other.entries_)),
+          ids_(std::move(other.ids_)),
+          slots_(other.slots_),
+          size_(other.size_)
         {
-            headers.emplace(std::move(key), std::move(value));
+            other.entries_.clear();
+            other.ids_.clear();
+            other.slots_.fill(0);
+            other.size_ = 0;
         }
 
-        const std::string& get_header_value(const std::string& key) const
+        ci_map& operator=(const ci_map& other)
         {
-            return crow::get_header_value(headers, key);
+            if (this != &other)
+            {
+                clear();
+                for (auto& kv : other)
+                    emplace(kv.first, kv.second);
+            }
+            return *this;
         }
 
-        bool check_version(unsigned char major, unsigned char minor) const
+        ci_map& operator=(ci_map&& other) noexcept
         {
-            return http_ver_major == major && http_ver_minor == minor;
+            if (this != &other)
+            {
+                entries_ = std::move(other.entries_);
+                ids_ = std::move(other.ids_);
+                slots_ = other.slots_;
+                size_ = other.size_;
+                other.entries_.clear();
+                other.ids_.clear();
+                other.slots_.fill(0);
+                other.size_ = 0;
+            }
+            return *this;
         }
 
-        /// Get the body as parameters in QS format.
+        iterator begin() noexcept { return entries_.begin(); }
+        iterator end() noexcept { return entries_.begin() + size_; }
+        const_iterator begin() const noexcept { return entries_.begin(); }
+        const_iterator end() const noexcept { return entries_.begin() + size_; }
+        const_iterator cbegin() const noexcept { return begin(); }
+        const_iterator cend() const noexcept { return end(); }
 
-        ///
-        /// This is meant to be used with requests of type "application/x-www-form-urlencoded"
-        const query_string get_body_params() const
+        size_type size() const noexcept { return size_; }
+        bool empty() const noexcept { return size_ == 0; }
+
+        void reserve(size_type n)
         {
-            return query_string(body, false);
+            entries_.reserve(n);
+            ids_.reserve(n);
         }
 
-        /// Send data to whoever made this request with a completion handler and return immediately.
-        template<typename CompletionHandler>
-        void post(CompletionHandler handler)
+        /// Remove every entry, keeping their strings' storage for reuse.
+        void clear() noexcept
         {
-            asio::post(io_context, handler);
+            for (size_type i = 0; i < size_; i++)
+            {
+                auto& kv = entries_[i];
+                if (kv.first.capacity() > max_retained_capacity)
+                    std::string().swap(kv.first);
+                if (kv.second.capacity() > max_retained_capacity)
+                    std::string().swap(kv.second);
+            }
+            slots_.fill(0);
+            size_ = 0;
         }
 
-        /// Send data to whoever made this request with a completion handler.
-        template<typename CompletionHandler>
-        void dispatch(CompletionHandler handler)
+        template<typename K, typename V>
+        iterator emplace(K&& key, V&& value)
         {
-            asio::dispatch(io_context, handler);
+            if (size_ < entries_.size())
+            {
+                entries_[size_].first = std::forward<K>(key);
+                entries_[size_].second = std::forward<V>(value);
+            }
+            else
+            {
+                entries_.emplace_back(std::forward<K>(key), std::forward<V>(value));
+                ids_.emplace_back();
+            }
+
+            known_header id = detail::classify_header(entries_[size_].first);
+            ids_[size_] = id;
+            size_++;
+            if (id != known_header::Unknown && !slots_[static_cast<size_t>(id)])
+                slots_[static_cast<size_t>(id)] = static_cast<uint32_t>(size_);
+            return end() - 1;
         }
-    };
-} // namespace crow
 
-#include <array>
+        iterator insert(value_type kv)
+        {
+            return emplace(std::move(kv.first), std::move(kv.second));
+        }
 
-namespace crow // NOTE: Already documented in "crow/app.h"
-{
+        /// Find the first entry with the key.
+        iterator find(std::string_view key) { return begin() + index_of(key); }
+        const_iterator find(std::string_view key) const { return begin() + index_of(key); }
+        iterator find(known_header id) { return begin() + index_of(id); }
+        const_iterator find(known_header id) const { return begin() + index_of(id); }
+
+        size_type count(std::string_view key) const
+        {
+            known_header id = detail::classify_header(key);
+            if (id != known_header::Unknown)
+                return count(id);
+
+            size_type n = 0;
+            for (size_type i = 0; i < size_; i++)
+                n += ids_[i] == known_header::Unknown && utility::string_equals(entries_[i].first, key);
+            return n;
+        }
+
+        size_type count(known_header id) const
+        {
+            size_type first = slots_[static_cast<size_t>(id)];
+            if (!first)
+                return 0;
+
+            size_type n = 0;
+            for (size_type i = first - 1; i < size_; i++)
+                n += ids_[i] == id;
+            return n;
+        }
+
+        /// Remove every entry with the key, returns how many were removed.
+        size_type erase(std::string_view key)
+        {
+            known_header id = detail::classify_header(key);
+            size_type kept = 0;
+            for (size_type i = 0; i < size_; i++)
+            {
+                bool matches = id != known_header::Unknown ? ids_[i] == id : (ids_[i] == known_header::Unknown && utility::string_equals(entries_[i].first, key));
+                if (matches)
+                    continue;
+                if (kept != i)
+                {
+                    // Swap rather than move so that the removed entries' strings stay around for reuse
+                    std::swap(entries_[kept], entries_[i]);
+                    std::swap(ids_[kept], ids_[i]);
+                }
+                kept++;
+            }
+
+            size_type removed = size_ - kept;
+            if (removed)
+            {
+                size_ = kept;
+                rebuild_slots();
+            }
+            return removed;
+        }
+
+        iterator erase(const_iterator pos)
+        {
+            size_type i = pos - cbegin();
+            std::rotate(entries_.begin() + i, entries_.begin() + i + 1, end());
+            std::rotate(ids_.begin() + i, ids_.begin() + i + 1, ids_.begin() + size_);
+            size_--;
+            rebuild_slots();
+            return begin() + i;
+        }
+
+    private:
+        size_type index_of(known_header id) const
+        {
+            size_type first = slots_[static_cast<size_t>(id)];
+            return first ? first - 1 : size_;
+        }
+
+        size_type index_of(std::string_view key) const
+        {
+            known_header id = detail::classify_header(key);
+            if (id != known_header::Unknown)
+                return index_of(id);
+
+            for (size_type i = 0; i < size_; i++)
+            {
+                if (ids_[i] == known_header::Unknown && utility::string_equals(entries_[i].first, key))
+                    return i;
+            }
+            return size_;
+        }
+
+        void rebuild_slots()
+        {
+            slots_.fill(0);
+            for (size_type i = size_; i-- > 0;)
+            {
+                if (ids_[i] != known_header::Unknown)
+                    slots_[static_cast<size_t>(ids_[i])] = static_cast<uint32_t>(i + 1);
+            }
+        }
+
+    private:
+        container_type entries_; ///< The entries followed by cleared ones kept for reuse.
+        std::vector<known_header> ids_;
+        std::array<uint32_t, static_cast<size_t>(known_header::InternalHeaderCount)> slots_{}; ///< One past the index of the first entry of each known header, 0 if there's none.
+        size_type size_ = 0;
+    };
+} // namespace crow
+
+
+#ifdef CROW_USE_BOOST
+#include <boost/asio.hpp>
+#else
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+#endif
+
+
+namespace crow // NOTE: Already documented in "crow/app.h"
+{
+#ifdef CROW_USE_BOOST
+    namespace asio = boost::asio;
+#endif
+
+    /// Find and return the value associated with the key. (returns an empty string if nothing is found)
+    template<typename T>
+    inline const std::string& get_header_value(const T& headers, const std::string& key)
+    {
+        auto it = headers.find(key);
+        if (it != headers.end())
+        {
+            return it->second;
+        }
+        static std::string empty;
+        return empty;
+    }
+
+    namespace multipart
+    {
+        struct message;
+    }
+
+    /// An HTTP request.
+    struct request
+    {
+        HTTPMethod method;
+        std::string raw_url;     ///< The full URL containing the `?` and URL parameters.
+        std::string url;         ///< The endpoint without any parameters.
+        query_string url_params; ///< The parameters associated with the request. (everything after the `?` in the URL)
+        ci_map headers;          ///< Reused by the connection for its next request, copy them to keep them past the request.
+        std::string body;
+        std::string remote_ip_address; ///< The IP address from which the request was sent.
+        unsigned char http_ver_major, http_ver_minor;
+        bool keep_alive,    ///< Whether or not the server should send a `connection: Keep-Alive` header to the client.
+          close_connection, ///< Whether or not the server should shut down the TCP connection once a response is sent.
+          upgrade;          ///< Whether or noth the server should change the HTTP connection to a different connection.
+
+        void* middleware_context{};
+        void* middleware_container{};
+        asio::io_context* io_context{};
+
+        /// The parts of a `multipart/form-data` body that was parsed while it arrived (see \ref Crow::stream_multipart()), \ref body is empty then.
+        std::shared_ptr<multipart::message> multipart_message;
+
+        /// Construct an empty request. (sets the method to `GET`)
+        request():
+          method(HTTPMethod::Get), http_ver_major(0), http_ver_minor(0)
+        {}
+
+        /// Construct a request with all values assigned.
+        request(HTTPMethod method_, std::string raw_url_, std::string url_, query_string url_params_, ci_map headers_, std::string body_, unsigned char http_major, unsigned char http_minor, bool has_keep_alive, bool has_close_connection, bool is_upgrade):
+          method(method_), raw_url(std::move(raw_url_)), url(std::move(url_)), url_params(std::move(url_params_)), headers(std::move(headers_)), body(std::move(body_)), http_ver_major(http_major), http_ver_minor(http_minor), keep_alive(has_keep_alive), close_connection(has_close_connection), upgrade(is_upgrade)
+        {}
+
+        void add_header(std::string key, std::string value)
+        {
+            headers.emplace(std::move(key), std::move(value));
+        }
+
+        const std::string& get_header_value(const std::string& key) const
+        {
+            return crow::get_header_value(headers, key);
+        }
+
+        bool check_version(unsigned char major, unsigned char minor) const
+        {
+            return http_ver_major == major && http_ver_minor == minor;
+        }
+
+        /// Get the body as parameters in QS format.
+
+        ///
+        /// This is meant to be used with requests of type "application/x-www-form-urlencoded"
+        const query_string get_body_params() const
+        {
+            return query_string(body, false);
+        }
+
+        /// Send data to whoever made this request with a completion handler and return immediately.
+        template<typename CompletionHandler>
+        void post(CompletionHandler handler)
+        {
+            asio::post(io_context, handler);
+        }
+
+        /// Send data to whoever made this request with a completion handler.
+        template<typename CompletionHandler>
+        void dispatch(CompletionHandler handler)
+        {
+            asio::dispatch(io_context, handler);
+        }
+    };
+} // namespace crow
+
+#include <array>
+#include <forward_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace crow // NOTE: Already documented in "crow/app.h"
+{
 #ifdef CROW_USE_BOOST
     namespace asio = boost::asio;
     using error_code = boost::system::error_code;
@@ -8018,113 +10724,591 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             EndStatusCodes = 4999,
         };
 
-        /// A base class for websocket connection.
-        struct connection
+        /// permessage-deflate (RFC 7692) settings of a websocket route, see \ref WebSocketRule::permessage_deflate().
+        struct deflate_settings
         {
-            virtual void send_binary(std::string msg) = 0;
-            virtual void send_text(std::string msg) = 0;
-            virtual void send_ping(std::string msg) = 0;
-            virtual void send_pong(std::string msg) = 0;
-            virtual void close(std::string const& msg = "quit", uint16_t status_code = CloseStatusCode::NormalClosure) = 0;
-            virtual std::string get_remote_ip() = 0;
-            virtual std::string get_subprotocol() const = 0;
-            virtual ~connection() = default;
-
-            void userdata(void* u) { userdata_ = u; }
-            void* userdata() { return userdata_; }
-
-        private:
-            void* userdata_;
+            size_t min_size = 128;       ///< Smaller messages are sent as they are, compressing them would barely pay off.
+            int level = -1;              ///< zlib's level, from 1 (fastest) to 9 (smallest), -1 is zlib's default (6).
+            bool context_takeover = true; ///< Compress messages with the connection's previous ones as their dictionary, at the cost of keeping a zlib stream (about 256 KiB with a 15 bit window) per connection.
+            bool client_context_takeover = true; ///< Let clients do the same, or ask them not to (`client_no_context_takeover`).
+            int max_window_bits = 15;    ///< The window (2^bits bytes, 9 to 15) the server compresses with.
+            int client_max_window_bits = 15; ///< The largest window (8 to 15) clients may compress with, if they support limiting it.
         };
 
-        // Modified version of the illustration in RFC6455 Section-5.2
-        //
-        //
-        //  0               1               2               3               -byte
-        //  0 1 2 3 4 5 6 7 0 1 2 3 4 5 6 7 0 1 2 3 4 5 6 7 0 1 2 3 4 5 6 7 -bit
-        // +-+-+-+-+-------+-+-------------+-------------------------------+
-        // |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
-        // |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
-        // |N|V|V|V|       |S|             |   (if payload len==126/127)   |
-        // | |1|2|3|       |K|             |                               |
-        // +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
-        // |     Extended payload length continued, if payload len == 127  |
-        // + - - - - - - - - - - - - - - - +-------------------------------+
-        // |                               |Masking-key, if MASK set to 1  |
-        // +-------------------------------+-------------------------------+
-        // | Masking-key (continued)       |          Payload Data         |
-        // +-------------------------------- - - - - - - - - - - - - - - - +
-        // :                     Payload Data continued ...                :
-        // + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
-        // |                     Payload Data continued ...                |
-        // +---------------------------------------------------------------+
-        //
+        /// The permessage-deflate parameters agreed on with a client.
+        struct deflate_parameters
+        {
+            bool server_context_takeover = true;
+            bool client_context_takeover = true;
+            int server_window_bits = 15;
+            int client_window_bits = 15;
+        };
 
-        /// A websocket connection.
+        /// Accept the first permessage-deflate offer of a "Sec-WebSocket-Extensions" header that's valid, setting the parameters and the header's response.
 
-        template<typename Adaptor, typename Handler>
-        class Connection : public connection
-        {
-        public:
-            /// Constructor for a connection.
+        ///
+        /// \return false if there is no such offer, the connection isn't compressed then.
+        inline bool negotiate_deflate(std::string_view extensions, const deflate_settings& settings, deflate_parameters& parameters, std::string& response)
+        {
+            auto trim = [](std::string_view v) {
+                while (!v.empty() && (v.front() == ' ' || v.front() == '\t'))
+                    v.remove_prefix(1);
+                while (!v.empty() && (v.back() == ' ' || v.back() == '\t'))
+                    v.remove_suffix(1);
+                return v;
+            };
+            // A window size parameter, its value may be quoted
+            auto window_bits = [](std::string_view value, int min) {
+                if (value.size() > 2 && value.front() == '"' && value.back() == '"')
+                    value = value.substr(1, value.size() - 2);
+                if (value.size() == 1 && value[0] >= '8' && value[0] <= '9')
+                    return value[0] - '0' >= min ? value[0] - '0' : 0;
+                if (value.size() == 2 && value[0] == '1' && value[1] >= '0' && value[1] <= '5')
+                    return 10 + value[1] - '0';
+                return 0;
+            };
 
-            ///
-            /// Requires a request with an "Upgrade: websocket" header.<br>
-            /// Automatically handles the handshake.
-            Connection(const crow::request& req, Adaptor&& adaptor, Handler* handler,
-                       uint64_t max_payload, const std::vector<std::string>& subprotocols,
-                       std::function<void(crow::websocket::connection&)> open_handler,
-                       std::function<void(crow::websocket::connection&, const std::string&, bool)> message_handler,
-                       std::function<void(crow::websocket::connection&, const std::string&, uint16_t)> close_handler,
-                       std::function<void(crow::websocket::connection&, const std::string&)> error_handler,
-                       std::function<bool(const crow::request&, void**)> accept_handler,
-                       bool mirror_protocols):
-              adaptor_(std::move(adaptor)),
-              handler_(handler),
-              max_payload_bytes_(max_payload),
-              open_handler_(std::move(open_handler)),
-              message_handler_(std::move(message_handler)),
-              close_handler_(std::move(close_handler)),
-              error_handler_(std::move(error_handler)),
-              accept_handler_(std::move(accept_handler))
+            while (!extensions.empty())
             {
-                if (!utility::string_equals(req.get_header_value("upgrade"), "websocket"))
-                {
-                    adaptor_.close();
-                    handler_->remove_websocket(this);
-                    delete this;
-                    return;
-                }
+                size_t end = extensions.find(',');
+                auto offer = extensions.substr(0, end);
+                extensions.remove_prefix(end == std::string_view::npos ? extensions.size() : end + 1);
 
-                std::string requested_subprotocols_header = req.get_header_value("Sec-WebSocket-Protocol");
-                if (!subprotocols.empty() || !requested_subprotocols_header.empty())
+                size_t semicolon = offer.find(';');
+                if (!utility::string_equals(trim(offer.substr(0, semicolon)), "permessage-deflate"))
+                    continue;
+                auto params = semicolon == std::string_view::npos ? std::string_view() : offer.substr(semicolon + 1);
+
+                deflate_parameters chosen;
+                chosen.server_context_takeover = settings.context_takeover;
+                chosen.client_context_takeover = settings.client_context_takeover;
+                chosen.server_window_bits = std::min(std::max(settings.max_window_bits, 9), 15);
+                int client_limit = 0; // 0 if the client can't limit its window, -1 if it can but didn't pick a size
+                bool server_limit = false, valid = true;
+                unsigned seen = 0;
+                while (valid && !params.empty())
                 {
-                    auto requested_subprotocols = utility::split(requested_subprotocols_header, ", ");
-                    auto subprotocol = utility::find_first_of(subprotocols.begin(), subprotocols.end(), requested_subprotocols.begin(), requested_subprotocols.end());
-                    if (subprotocol != subprotocols.end())
+                    end = params.find(';');
+                    auto param = trim(params.substr(0, end));
+                    params.remove_prefix(end == std::string_view::npos ? params.size() : end + 1);
+
+                    size_t equals = param.find('=');
+                    auto name = trim(param.substr(0, equals));
+                    auto value = equals == std::string_view::npos ? std::string_view() : trim(param.substr(equals + 1));
+                    unsigned bit;
+                    if (name == "server_no_context_takeover" && equals == std::string_view::npos)
                     {
-                        subprotocol_ = *subprotocol;
+                        bit = 1;
+                        chosen.server_context_takeover = false;
+                    }
+                    else if (name == "client_no_context_takeover" && equals == std::string_view::npos)
+                    {
+                        bit = 2;
+                        chosen.client_context_takeover = false;
+                    }
+                    else if (name == "server_max_window_bits")
+                    {
+                        bit = 4;
+                        // zlib can't compress with a window of 8 bits
+                        int bits = window_bits(value, 9);
+                        valid = bits != 0;
+                        chosen.server_window_bits = std::min(chosen.server_window_bits, bits);
+                        server_limit = true;
+                    }
+                    else if (name == "client_max_window_bits")
+                    {
+                        bit = 8;
+                        client_limit = equals == std::string_view::npos ? -1 : window_bits(value, 8);
+                        valid = client_limit != 0;
                     }
+                    else
+                        valid = false;
+                    // Each parameter may appear once
+                    valid = valid && !(seen & bit);
+                    seen |= bit;
                 }
+                if (!valid)
+                    continue;
 
-                if (mirror_protocols & !requested_subprotocols_header.empty())
+                int client_max = std::min(std::max(settings.client_max_window_bits, 8), 15);
+                response = "permessage-deflate";
+                if (!chosen.server_context_takeover)
+                    response += "; server_no_context_takeover";
+                if (!chosen.client_context_takeover)
+                    response += "; client_no_context_takeover";
+                if (server_limit || chosen.server_window_bits < 15)
+                    response += "; server_max_window_bits=" + std::to_string(chosen.server_window_bits);
+                if (client_limit > 0 || (client_limit < 0 && client_max < 15))
                 {
-                    subprotocol_ = requested_subprotocols_header;
+                    chosen.client_window_bits = client_limit > 0 ? std::min(client_limit, client_max) : client_max;
+                    response += "; client_max_window_bits=" + std::to_string(chosen.client_window_bits);
                 }
+                parameters = chosen;
+                return true;
+            }
+            return false;
+        }
 
-                if (accept_handler_)
-                {
-                    void* ud = nullptr;
-                    if (!accept_handler_(req, &ud))
-                    {
-                        adaptor_.close();
-                        handler_->remove_websocket(this);
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Compresses messages into permessage-deflate payloads, as raw deflate data without the trailing `00 00 ff ff`.
+        class message_deflater
+        {
+        public:
+            message_deflater(int level, int window_bits, bool context_takeover):
+              level_(level), context_takeover_(context_takeover)
+            {
+                ok_ = ::deflateInit2(&stream_, level, Z_DEFLATED, -window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+            }
+
+            message_deflater(const message_deflater&) = delete;
+            message_deflater& operator=(const message_deflater&) = delete;
+
+            ~message_deflater()
+            {
+                if (ok_)
+                    ::deflateEnd(&stream_);
+            }
+
+            int level() const
+            {
+                return level_;
+            }
+
+            /// Forget the previous messages, the next one is compressed without them.
+            void reset()
+            {
+                if (ok_)
+                    ::deflateReset(&stream_);
+            }
+
+            /// Compress a message, replacing the output.
+            bool compress(const char* data, size_t size, std::string& output)
+            {
+                if (!ok_)
+                    return false;
+
+                // zlib does not take a const pointer. The data is not altered.
+                stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+
+                size_t written = 0;
+                output.resize(::deflateBound(&stream_, static_cast<uLong>(size)) + 16);
+                for (;;)
+                {
+                    stream_.next_out = reinterpret_cast<Bytef*>(&output[written]);
+                    stream_.avail_out = static_cast<uInt>(output.size() - written);
+                    int code = ::deflate(&stream_, Z_SYNC_FLUSH);
+                    written = output.size() - stream_.avail_out;
+                    if (code != Z_OK && code != Z_BUF_ERROR)
+                    {
+                        ::deflateReset(&stream_);
+                        return false;
+                    }
+                    // The flush is complete once there's output space left
+                    if (stream_.avail_out != 0)
+                        break;
+                    output.resize(output.size() * 2);
+                }
+
+                // A sync flush ends with an empty stored block, which the receiver adds back
+                output.resize(written >= 4 ? written - 4 : 0);
+                if (!context_takeover_)
+                    ::deflateReset(&stream_);
+                return true;
+            }
+
+        private:
+            z_stream stream_{};
+            int level_;
+            bool context_takeover_;
+            bool ok_;
+        };
+
+        /// Decompresses permessage-deflate payloads.
+        class message_inflater
+        {
+        public:
+            message_inflater(int window_bits, bool context_takeover):
+              context_takeover_(context_takeover)
+            {
+                ok_ = ::inflateInit2(&stream_, -window_bits) == Z_OK;
+            }
+
+            message_inflater(const message_inflater&) = delete;
+            message_inflater& operator=(const message_inflater&) = delete;
+
+            ~message_inflater()
+            {
+                if (ok_)
+                    ::inflateEnd(&stream_);
+            }
+
+            /// Decompress a message, replacing the output without letting that grow past max_size.
+            compression::inflate_result decompress(const std::string& payload, std::string& output, uint64_t max_size)
+            {
+                static const char tail[] = {'\x00', '\x00', '\xff', '\xff'};
+                output.clear();
+                if (!ok_)
+                    return compression::inflate_result::Corrupt;
+
+                auto result = inflate(payload.data(), payload.size(), output, max_size);
+                if (result == compression::inflate_result::Ok && !ended_)
+                    result = inflate(tail, sizeof(tail), output, max_size);
+                if (ended_ || !context_takeover_ || result != compression::inflate_result::Ok)
+                {
+                    ::inflateReset(&stream_);
+                    ended_ = false;
+                }
+                return result;
+            }
+
+        private:
+            compression::inflate_result inflate(const char* data, size_t size, std::string& output, uint64_t max_size)
+            {
+                // zlib does not take a const pointer. The data is not altered.
+                stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+                stream_.avail_in = static_cast<uInt>(size);
+                while (stream_.avail_in > 0 && !ended_)
+                {
+                    size_t written = output.size();
+                    if (written >= max_size)
+                        return compression::inflate_result::TooLarge;
+                    size_t room = static_cast<size_t>(std::min<uint64_t>(max_size - written, std::max<size_t>(stream_.avail_in * 4, 4096)));
+                    output.resize(written + room);
+                    stream_.next_out = reinterpret_cast<Bytef*>(&output[written]);
+                    stream_.avail_out = static_cast<uInt>(room);
+
+                    int code = ::inflate(&stream_, Z_SYNC_FLUSH);
+                    output.resize(output.size() - stream_.avail_out);
+                    // A final block ends the message, the tail isn't needed then
+                    if (code == Z_STREAM_END)
+                        ended_ = true;
+                    else if (code != Z_OK && code != Z_BUF_ERROR)
+                        return compression::inflate_result::Corrupt;
+                    else if (code == Z_BUF_ERROR && stream_.avail_out != 0)
+                        return compression::inflate_result::Corrupt;
+                }
+                return compression::inflate_result::Ok;
+            }
+
+            z_stream stream_{};
+            bool context_takeover_;
+            bool ok_;
+            bool ended_ = false;
+        };
+#endif
+
+        /// Generate the websocket header of an unmasked frame using an opcode and the payload size (in bytes).
+        inline std::string build_header(int opcode, size_t size)
+        {
+            char buf[2 + 8] = "\x80\x00";
+            buf[0] += opcode;
+            if (size < 126)
+            {
+                buf[1] += static_cast<char>(size);
+                return {buf, buf + 2};
+            }
+            else if (size < 0x10000)
+            {
+                buf[1] += 126;
+                *(uint16_t*)(buf + 2) = htons(static_cast<uint16_t>(size));
+                return {buf, buf + 4};
+            }
+            else
+            {
+                buf[1] += 127;
+                *reinterpret_cast<uint64_t*>(buf + 2) = ((1 == htonl(1)) ? static_cast<uint64_t>(size) : (static_cast<uint64_t>(htonl((size)&0xFFFFFFFF)) << 32) | htonl(static_cast<uint64_t>(size) >> 32));
+                return {buf, buf + 10};
+            }
+        }
+
+        /// A message framed once (header and payload in one buffer), shared by every connection it's sent to.
+        class frame
+        {
+        public:
+            frame(const std::string& msg, bool is_binary):
+              is_binary_(is_binary)
+            {
+                auto header = build_header(is_binary ? 0x2 : 0x1, msg.size());
+                header_size_ = header.size();
+                data_.reserve(header.size() + msg.size());
+                data_.append(header).append(msg);
+            }
+
+            const std::string& data() const
+            {
+                return data_;
+            }
+
+            size_t payload_size() const
+            {
+                return data_.size() - header_size_;
+            }
+
+            bool is_binary() const
+            {
+                return is_binary_;
+            }
+
+#ifdef CROW_ENABLE_COMPRESSION
+            /// The frame compressed for permessage-deflate, without context takeover and with a 15 bit window.
+
+            ///
+            /// Compressed once for each level, by the first connection that needs it (routes can use different levels).
+            /// Empty if compressing doesn't make it any smaller.
+            const std::string& deflated(int level) const
+            {
+                std::lock_guard<std::mutex> lock(deflate_mutex_);
+                for (auto& compressed : deflated_)
+                    if (compressed.first == level)
+                        return compressed.second;
+
+                std::string& result = deflated_.emplace_front(level, std::string()).second;
+                thread_local std::unique_ptr<message_deflater> deflater;
+                if (!deflater || deflater->level() != level)
+                    deflater.reset(new message_deflater(level, 15, false));
+
+                std::string payload;
+                if (!deflater->compress(data_.data() + header_size_, payload_size(), payload) || payload.size() >= payload_size())
+                    return result;
+                // RSV1 marks a compressed message
+                result = build_header(0x40 | (is_binary_ ? 0x2 : 0x1), payload.size());
+                result += payload;
+                return result;
+            }
+#endif
+
+        private:
+            std::string data_;
+            size_t header_size_;
+            bool is_binary_;
+#ifdef CROW_ENABLE_COMPRESSION
+            mutable std::mutex deflate_mutex_;
+            mutable std::forward_list<std::pair<int, std::string>> deflated_; ///< Per level, in a list so that references to them stay valid.
+#endif
+        };
+
+        using shared_frame = std::shared_ptr<const frame>;
+
+        /// Frame a message once, to send it to any number of connections with \ref connection::send_frame().
+        inline shared_frame make_frame(const std::string& msg, bool is_binary = false)
+        {
+            return std::make_shared<frame>(msg, is_binary);
+        }
+
+        /// An entry of a connection's write queue.
+
+        ///
+        /// Raw bytes (the handshake, close frames) are written as they are. Messages are framed, and compressed, once it's
+        /// their turn to be written, the ones dropped from a full queue never reach the compressor.
+        struct write_buffer
+        {
+            write_buffer(std::string data_):
+              data(std::move(data_))
+            {}
+
+            write_buffer(int opcode_, std::string payload):
+              data(std::move(payload)), opcode(opcode_)
+            {}
+
+            write_buffer(shared_frame frame_):
+              frame(std::move(frame_)), opcode(frame->is_binary() ? 0x2 : 0x1)
+            {}
+
+            /// Text and binary messages may be dropped when the queue is full, nothing else is.
+            bool is_message() const
+            {
+                return opcode == 0x1 || opcode == 0x2;
+            }
+
+            /// The bytes it takes up in the queue.
+            size_t size() const
+            {
+                return frame ? frame->data().size() : header.size() + data.size();
+            }
+
+            std::string header;
+            std::string data;
+            shared_frame frame;
+            const std::string* frame_data = nullptr; ///< The version of frame that's written
+            int opcode = 0;                          ///< 0 for raw bytes
+        };
+
+        /// What is done with a message that doesn't fit in a connection's send queue.
+        enum class overflow_policy
+        {
+            DropOldest, ///< Drop the oldest messages not being written yet, or the new one if that doesn't make enough room.
+            Disconnect, ///< Close the connection.
+        };
+
+        /// A connection's send queue, see \ref connection::send_stats().
+        struct send_queue_stats
+        {
+            uint64_t queued_bytes = 0; ///< Waiting to be written, or being written.
+            uint64_t dropped_messages = 0;
+            uint64_t dropped_bytes = 0;
+        };
+
+        /// What the send queue limit of a route did to its connections, see \ref WebSocketRule::overflow_stats().
+        struct overflow_stats
+        {
+            uint64_t dropped_messages = 0;
+            uint64_t dropped_bytes = 0;
+            uint64_t disconnects = 0;
+        };
+
+        /// The send queue limit of a websocket route, shared with its connections.
+        struct send_limit
+        {
+            send_limit(size_t max_bytes_, overflow_policy policy_):
+              max_bytes(max_bytes_), policy(policy_)
+            {}
+
+            overflow_stats stats() const
+            {
+                return {dropped_messages.load(std::memory_order_relaxed), dropped_bytes.load(std::memory_order_relaxed), disconnects.load(std::memory_order_relaxed)};
+            }
+
+            const size_t max_bytes;
+            const overflow_policy policy;
+            std::atomic<uint64_t> dropped_messages{0};
+            std::atomic<uint64_t> dropped_bytes{0};
+            std::atomic<uint64_t> disconnects{0};
+        };
+
+        struct broadcast_registry;
+
+        /// A base class for websocket connection.
+        struct connection
+        {
+            virtual void send_binary(std::string msg) = 0;
+            virtual void send_text(std::string msg) = 0;
+            virtual void send_ping(std::string msg) = 0;
+            virtual void send_pong(std::string msg) = 0;
+            virtual void send_frame(shared_frame frame) = 0;
+            virtual void close(std::string const& msg = "quit", uint16_t status_code = CloseStatusCode::NormalClosure) = 0;
+            virtual std::string get_remote_ip() = 0;
+            virtual std::string get_subprotocol() const = 0;
+            virtual asio::io_context& get_io_context() = 0;
+            /// The bytes waiting to be sent and the messages dropped to stay under the send queue limit, from any thread.
+            virtual send_queue_stats send_stats() const = 0;
+            virtual ~connection() = default;
+
+            void userdata(void* u) { userdata_ = u; }
+            void* userdata() { return userdata_; }
+
+        protected:
+            /// Leave the topics of every \ref broadcaster, once the connection is closed.
+            void leave_broadcasts();
+
+        private:
+            friend class broadcaster;
+
+            void* userdata_;
+            std::vector<std::weak_ptr<broadcast_registry>> broadcasts_;
+        };
+
+        // Modified version of the illustration in RFC6455 Section-5.2
+        //
+        //
+        //  0               1               2               3               -byte
+        //  0 1 2 3 4 5 6 7 0 1 2 3 4 5 6 7 0 1 2 3 4 5 6 7 0 1 2 3 4 5 6 7 -bit
+        // +-+-+-+-+-------+-+-------------+-------------------------------+
+        // |F|R|R|R| opcode|M| Payload len |    Extended payload length    |
+        // |I|S|S|S|  (4)  |A|     (7)     |             (16/64)           |
+        // |N|V|V|V|       |S|             |   (if payload len==126/127)   |
+        // | |1|2|3|       |K|             |                               |
+        // +-+-+-+-+-------+-+-------------+ - - - - - - - - - - - - - - - +
+        // |     Extended payload length continued, if payload len == 127  |
+        // + - - - - - - - - - - - - - - - +-------------------------------+
+        // |                               |Masking-key, if MASK set to 1  |
+        // +-------------------------------+-------------------------------+
+        // | Masking-key (continued)       |          Payload Data         |
+        // +-------------------------------- - - - - - - - - - - - - - - - +
+        // :                     Payload Data continued ...                :
+        // + - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +
+        // |                     Payload Data continued ...                |
+        // +---------------------------------------------------------------+
+        //
+
+        /// A websocket connection.
+
+        template<typename Adaptor, typename Handler>
+        class Connection : public connection
+        {
+        public:
+            /// Constructor for a connection.
+
+            ///
+            /// Requires a request with an "Upgrade: websocket" header.<br>
+            /// Automatically handles the handshake.
+            Connection(const crow::request& req, Adaptor&& adaptor, Handler* handler,
+                       uint64_t max_payload, const std::vector<std::string>& subprotocols,
+                       std::function<void(crow::websocket::connection&)> open_handler,
+                       std::function<void(crow::websocket::connection&, const std::string&, bool)> message_handler,
+                       std::function<void(crow::websocket::connection&, const std::string&, uint16_t)> close_handler,
+                       std::function<void(crow::websocket::connection&, const std::string&)> error_handler,
+                       std::function<bool(const crow::request&, void**)> accept_handler,
+                       bool mirror_protocols,
+                       const deflate_settings* deflate = nullptr,
+                       std::shared_ptr<send_limit> limit = nullptr):
+              adaptor_(std::move(adaptor)),
+              handler_(handler),
+              send_limit_(std::move(limit)),
+              max_payload_bytes_(max_payload),
+              open_handler_(std::move(open_handler)),
+              message_handler_(std::move(message_handler)),
+              close_handler_(std::move(close_handler)),
+              error_handler_(std::move(error_handler)),
+              accept_handler_(std::move(accept_handler))
+            {
+                if (!utility::string_equals(req.get_header_value("upgrade"), "websocket"))
+                {
+                    adaptor_.close();
+                    handler_->remove_websocket(this);
+                    delete this;
+                    return;
+                }
+
+                std::string requested_subprotocols_header = req.get_header_value("Sec-WebSocket-Protocol");
+                if (!subprotocols.empty() || !requested_subprotocols_header.empty())
+                {
+                    auto requested_subprotocols = utility::split(requested_subprotocols_header, ", ");
+                    auto subprotocol = utility::find_first_of(subprotocols.begin(), subprotocols.end(), requested_subprotocols.begin(), requested_subprotocols.end());
+                    if (subprotocol != subprotocols.end())
+                    {
+                        subprotocol_ = *subprotocol;
+                    }
+                }
+
+                if (mirror_protocols & !requested_subprotocols_header.empty())
+                {
+                    subprotocol_ = requested_subprotocols_header;
+                }
+
+                if (accept_handler_)
+                {
+                    void* ud = nullptr;
+                    if (!accept_handler_(req, &ud))
+                    {
+                        adaptor_.close();
+                        handler_->remove_websocket(this);
                         delete this;
                         return;
                     }
                     userdata(ud);
                 }
 
+#ifdef CROW_ENABLE_COMPRESSION
+                if (deflate)
+                {
+                    deflate_ = negotiate_deflate(req.get_header_value("Sec-WebSocket-Extensions"), *deflate, deflate_parameters_, extensions_);
+                    deflate_settings_ = *deflate;
+                }
+#else
+                (void)deflate;
+#endif
+
                 // Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==
                 // Sec-WebSocket-Version: 13
                 std::string magic = req.get_header_value("Sec-WebSocket-Key") + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -8213,15 +11397,30 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 send_data(0x1, std::move(msg));
             }
 
-            /// Send a close signal.
+            /// Send a message framed with \ref make_frame(), without copying it.
 
             ///
-            /// Sets a flag to destroy the object once the message is sent.
-            void close(std::string const& msg, uint16_t status_code) override
+            /// Queued right away when called from the connection's own thread, e.g. by a \ref broadcaster.
+            void send_frame(shared_frame frame) override
             {
-                dispatch([this, msg, status_code]() mutable {
-                    has_sent_close_ = true;
-                    if (has_recv_close_ && !is_close_handler_called_)
+                dispatch([this, frame = std::move(frame)]() mutable {
+                    // Nothing but the close frame's answer may follow it
+                    if (has_sent_close_)
+                        return;
+                    if (queue(std::move(frame)))
+                        do_write();
+                });
+            }
+
+            /// Send a close signal.
+
+            ///
+            /// Sets a flag to destroy the object once the message is sent.
+            void close(std::string const& msg, uint16_t status_code) override
+            {
+                dispatch([this, msg, status_code]() mutable {
+                    has_sent_close_ = true;
+                    if (has_recv_close_ && !is_close_handler_called_)
                     {
                         is_close_handler_called_ = true;
                         if (close_handler_)
@@ -8231,9 +11430,9 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                     char status_buf[2];
                     *(uint16_t*)(status_buf) = htons(status_code);
 
-                    write_buffers_.emplace_back(std::move(header));
-                    write_buffers_.emplace_back(std::string(status_buf, 2));
-                    write_buffers_.emplace_back(msg);
+                    queue(std::move(header));
+                    queue(std::string(status_buf, 2));
+                    queue(msg);
                     do_write();
                 });
             }
@@ -8243,6 +11442,11 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 return adaptor_.remote_endpoint().address().to_string();
             }
 
+            asio::io_context& get_io_context() override
+            {
+                return adaptor_.get_io_context();
+            }
+
             void set_max_payload_size(uint64_t payload)
             {
                 max_payload_bytes_ = payload;
@@ -8254,31 +11458,12 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 return subprotocol_;
             }
 
-        protected:
-            /// Generate the websocket headers using an opcode and the message size (in bytes).
-            std::string build_header(int opcode, size_t size)
+            send_queue_stats send_stats() const override
             {
-                char buf[2 + 8] = "\x80\x00";
-                buf[0] += opcode;
-                if (size < 126)
-                {
-                    buf[1] += static_cast<char>(size);
-                    return {buf, buf + 2};
-                }
-                else if (size < 0x10000)
-                {
-                    buf[1] += 126;
-                    *(uint16_t*)(buf + 2) = htons(static_cast<uint16_t>(size));
-                    return {buf, buf + 4};
-                }
-                else
-                {
-                    buf[1] += 127;
-                    *reinterpret_cast<uint64_t*>(buf + 2) = ((1 == htonl(1)) ? static_cast<uint64_t>(size) : (static_cast<uint64_t>(htonl((size)&0xFFFFFFFF)) << 32) | htonl(static_cast<uint64_t>(size) >> 32));
-                    return {buf, buf + 10};
-                }
+                return {queued_bytes_.load(std::memory_order_relaxed), dropped_messages_.load(std::memory_order_relaxed), dropped_bytes_.load(std::memory_order_relaxed)};
             }
 
+        protected:
             /// Send the HTTP upgrade response.
 
             ///
@@ -8290,16 +11475,22 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                   "Upgrade: websocket\r\n"
                   "Connection: Upgrade\r\n"
                   "Sec-WebSocket-Accept: ";
-                write_buffers_.emplace_back(header);
-                write_buffers_.emplace_back(std::move(hello));
-                write_buffers_.emplace_back(crlf);
+                queue(header);
+                queue(std::move(hello));
+                queue(crlf);
                 if (!subprotocol_.empty())
                 {
-                    write_buffers_.emplace_back("Sec-WebSocket-Protocol: ");
-                    write_buffers_.emplace_back(subprotocol_);
-                    write_buffers_.emplace_back(crlf);
+                    queue(std::string("Sec-WebSocket-Protocol: "));
+                    queue(subprotocol_);
+                    queue(crlf);
+                }
+                if (!extensions_.empty())
+                {
+                    queue(std::string("Sec-WebSocket-Extensions: "));
+                    queue(extensions_);
+                    queue(crlf);
                 }
-                write_buffers_.emplace_back(crlf);
+                queue(crlf);
                 do_write();
                 if (open_handler_)
                     open_handler_(*this);
@@ -8586,36 +11777,26 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                     case 0: // Continuation
                     {
                         message_ += fragment_;
-                        if (is_FIN())
-                        {
-                            if (message_handler_)
-                                message_handler_(*this, message_, is_binary_);
-                            message_.clear();
-                        }
+                        if (is_FIN() && !handle_message())
+                            return false;
                     }
                     break;
                     case 1: // Text
                     {
                         is_binary_ = false;
+                        set_deflated();
                         message_ += fragment_;
-                        if (is_FIN())
-                        {
-                            if (message_handler_)
-                                message_handler_(*this, message_, is_binary_);
-                            message_.clear();
-                        }
+                        if (is_FIN() && !handle_message())
+                            return false;
                     }
                     break;
                     case 2: // Binary
                     {
                         is_binary_ = true;
+                        set_deflated();
                         message_ += fragment_;
-                        if (is_FIN())
-                        {
-                            if (message_handler_)
-                                message_handler_(*this, message_, is_binary_);
-                            message_.clear();
-                        }
+                        if (is_FIN() && !handle_message())
+                            return false;
                     }
                     break;
                     case 0x8: // Close
@@ -8672,6 +11853,50 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 return true;
             }
 
+            /// Check the RSV1 bit of a message's first frame, which marks it as compressed.
+            void set_deflated()
+            {
+#ifdef CROW_ENABLE_COMPRESSION
+                is_deflated_ = deflate_ && (mini_header_ & 0x4000);
+#endif
+            }
+
+            /// Call the message handler with a complete message, decompressed if it has to be.
+
+            ///
+            /// \return false if the message couldn't be decompressed, the connection is closed then.
+            bool handle_message()
+            {
+#ifdef CROW_ENABLE_COMPRESSION
+                if (is_deflated_)
+                {
+                    if (!inflater_)
+                        inflater_.reset(new message_inflater(deflate_parameters_.client_window_bits, deflate_parameters_.client_context_takeover));
+                    auto result = inflater_->decompress(message_, inflated_, max_payload_bytes_);
+                    message_.clear();
+                    if (result != compression::inflate_result::Ok)
+                    {
+                        bool too_large = result == compression::inflate_result::TooLarge;
+                        close_connection_ = true;
+                        adaptor_.shutdown_readwrite();
+                        adaptor_.close();
+                        if (error_handler_)
+                            error_handler_(*this, too_large ? "Message length exceeds maximum payload." : "Message could not be decompressed.");
+                        check_destroy(too_large ? MessageTooBig : InconsistentData);
+                        return false;
+                    }
+                    if (message_handler_)
+                        message_handler_(*this, inflated_, is_binary_);
+                    inflated_.clear();
+                    return true;
+                }
+#endif
+                if (message_handler_)
+                    message_handler_(*this, message_, is_binary_);
+                message_.clear();
+                return true;
+            }
+
             /// Send the buffers' data through the socket.
 
             ///
@@ -8682,10 +11907,15 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 {
                     sending_buffers_.swap(write_buffers_);
                     std::vector<asio::const_buffer> buffers;
-                    buffers.reserve(sending_buffers_.size());
+                    buffers.reserve(sending_buffers_.size() * 2);
+                    sending_bytes_ = 0;
                     for (auto& s : sending_buffers_)
                     {
-                        buffers.emplace_back(asio::buffer(s));
+                        sending_bytes_ += s.size();
+                        prepare(s);
+                        if (!s.header.empty())
+                            buffers.emplace_back(asio::buffer(s.header));
+                        buffers.emplace_back(s.frame ? asio::buffer(*s.frame_data) : asio::buffer(static_cast<const std::string&>(s.data)));
                     }
                     auto watch = std::weak_ptr<void>{anchor_};
                     asio::async_write(
@@ -8694,6 +11924,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                           if (!ec && !close_connection_)
                           {
                               sending_buffers_.clear();
+                              queued_bytes_.store(queued_bytes_.load(std::memory_order_relaxed) - sending_bytes_, std::memory_order_relaxed);
                               if (!write_buffers_.empty())
                                   do_write();
                               if (has_sent_close_)
@@ -8705,6 +11936,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                               if (anchor == nullptr) { return; }
 
                               sending_buffers_.clear();
+                              queued_bytes_.store(queued_bytes_.load(std::memory_order_relaxed) - sending_bytes_, std::memory_order_relaxed);
                               close_connection_ = true;
                               check_destroy();
                           }
@@ -8712,6 +11944,132 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 }
             }
 
+            /// Add to the write queue, keeping messages under the send queue limit.
+
+            ///
+            /// \return false if it was dropped (or the connection closed for it).
+            bool queue(write_buffer&& buffer)
+            {
+                size_t size = buffer.size();
+                if (buffer.is_message())
+                {
+                    if (close_connection_)
+                        return false;
+                    size_t queued = queued_bytes_.load(std::memory_order_relaxed);
+                    if (send_limit_ && queued + size > send_limit_->max_bytes)
+                    {
+                        if (send_limit_->policy == overflow_policy::Disconnect)
+                        {
+                            disconnect_slow_client();
+                            return false;
+                        }
+                        if (!drop_oldest(queued + size - send_limit_->max_bytes))
+                        {
+                            count_dropped(1, size);
+                            return false;
+                        }
+                    }
+                }
+                write_buffers_.emplace_back(std::move(buffer));
+                queued_bytes_.store(queued_bytes_.load(std::memory_order_relaxed) + size, std::memory_order_relaxed);
+                return true;
+            }
+
+            /// Drop the oldest messages that aren't being written yet until excess bytes are freed, none if that's not possible.
+            bool drop_oldest(size_t excess)
+            {
+                size_t droppable = 0;
+                for (auto& buffer : write_buffers_)
+                {
+                    if (buffer.is_message() && (droppable += buffer.size()) >= excess)
+                        break;
+                }
+                if (droppable < excess)
+                    return false;
+
+                size_t freed = 0, messages = 0, kept = 0;
+                for (size_t i = 0; i < write_buffers_.size(); i++)
+                {
+                    if (freed < excess && write_buffers_[i].is_message())
+                    {
+                        freed += write_buffers_[i].size();
+                        messages++;
+                        continue;
+                    }
+                    if (kept != i)
+                        write_buffers_[kept] = std::move(write_buffers_[i]);
+                    kept++;
+                }
+                write_buffers_.erase(write_buffers_.begin() + kept, write_buffers_.end());
+                queued_bytes_.store(queued_bytes_.load(std::memory_order_relaxed) - freed, std::memory_order_relaxed);
+                count_dropped(messages, freed);
+                return true;
+            }
+
+            void count_dropped(uint64_t messages, uint64_t bytes)
+            {
+                dropped_messages_.store(dropped_messages_.load(std::memory_order_relaxed) + messages, std::memory_order_relaxed);
+                dropped_bytes_.store(dropped_bytes_.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+                send_limit_->dropped_messages.fetch_add(messages, std::memory_order_relaxed);
+                send_limit_->dropped_bytes.fetch_add(bytes, std::memory_order_relaxed);
+            }
+
+            /// Close a connection whose client doesn't keep up, the pending read or write ends with an error and destroys it.
+            void disconnect_slow_client()
+            {
+                send_limit_->disconnects.fetch_add(1, std::memory_order_relaxed);
+                CROW_LOG_WARNING << "Closing websocket " << this << ", its send queue is over " << send_limit_->max_bytes << " bytes";
+                close_connection_ = true;
+                if (error_handler_)
+                    error_handler_(*this, "Send queue limit exceeded.");
+                adaptor_.shutdown_readwrite();
+                adaptor_.close();
+            }
+
+            /// Frame (and compress) a message that's about to be written.
+            void prepare(write_buffer& buffer)
+            {
+                if (buffer.frame)
+                {
+                    buffer.frame_data = &buffer.frame->data();
+#ifdef CROW_ENABLE_COMPRESSION
+                    // The shared compressed frame needs the full window
+                    if (deflate_ && buffer.frame->payload_size() >= deflate_settings_.min_size && deflate_parameters_.server_window_bits == 15)
+                    {
+                        const auto& deflated = buffer.frame->deflated(deflate_settings_.level);
+                        if (!deflated.empty())
+                        {
+                            // The client's window now holds a message this connection's compressor didn't see
+                            if (deflater_)
+                                deflater_->reset();
+                            buffer.frame_data = &deflated;
+                        }
+                    }
+#endif
+                    return;
+                }
+                if (!buffer.opcode)
+                    return;
+
+#ifdef CROW_ENABLE_COMPRESSION
+                if (deflate_ && buffer.is_message() && buffer.data.size() >= deflate_settings_.min_size)
+                {
+                    // Set up on the first message, connections only fed shared frames never need it
+                    if (!deflater_)
+                        deflater_.reset(new message_deflater(deflate_settings_.level, deflate_parameters_.server_window_bits, deflate_parameters_.server_context_takeover));
+                    std::string compressed;
+                    if (deflater_->compress(buffer.data.data(), buffer.data.size(), compressed))
+                    {
+                        // RSV1 marks a compressed message
+                        buffer.header = build_header(0x40 | buffer.opcode, compressed.size());
+                        buffer.data = std::move(compressed);
+                        return;
+                    }
+                }
+#endif
+                buffer.header = build_header(buffer.opcode, buffer.data.size());
+            }
+
             /// Destroy the Connection.
             void check_destroy(websocket::CloseStatusCode code = CloseStatusCode::ClosedAbnormally)
             {
@@ -8720,6 +12078,7 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 if (!is_close_handler_called_)
                     if (close_handler_)
                         close_handler_(*this, "uncleanly", code);
+                leave_broadcasts();
                 handler_->remove_websocket(this);
                 if (sending_buffers_.empty() && !is_reading)
                     delete this;
@@ -8740,10 +12099,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
 
             void send_data_impl(SendMessageType* s)
             {
-                auto header = build_header(s->opcode, s->payload.size());
-                write_buffers_.emplace_back(std::move(header));
-                write_buffers_.emplace_back(std::move(s->payload));
-                do_write();
+                if (queue(write_buffer(s->opcode, std::move(s->payload))))
+                    do_write();
             }
 
             void send_data(int opcode, std::string&& msg)
@@ -8760,8 +12117,14 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             Adaptor adaptor_;
             Handler* handler_;
 
-            std::vector<std::string> sending_buffers_;
-            std::vector<std::string> write_buffers_;
+            std::vector<write_buffer> sending_buffers_;
+            std::vector<write_buffer> write_buffers_;
+            size_t sending_bytes_{0};
+            std::shared_ptr<send_limit> send_limit_;
+            // Only changed by the connection's thread, atomic for send_stats()
+            std::atomic<uint64_t> queued_bytes_{0};
+            std::atomic<uint64_t> dropped_messages_{0};
+            std::atomic<uint64_t> dropped_bytes_{0};
 
             std::array<char, 4096> buffer_;
             bool is_binary_;
@@ -8782,6 +12145,16 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             bool error_occurred_{false};
             bool pong_received_{false};
             bool is_close_handler_called_{false};
+            std::string extensions_; ///< The accepted "Sec-WebSocket-Extensions"
+#ifdef CROW_ENABLE_COMPRESSION
+            bool deflate_{false};
+            bool is_deflated_{false};
+            deflate_settings deflate_settings_;
+            deflate_parameters deflate_parameters_;
+            std::unique_ptr<message_deflater> deflater_;
+            std::unique_ptr<message_inflater> inflater_;
+            std::string inflated_;
+#endif
 
             std::shared_ptr<void> anchor_ = std::make_shared<int>(); // Value is just for placeholding
 
@@ -8791,6 +12164,174 @@ namespace crow // NOTE: Already documented in "crow/app.h"
             std::function<void(crow::websocket::connection&, const std::string&)> error_handler_;
             std::function<bool(const crow::request&, void**)> accept_handler_;
         };
+
+        /// The topics of a \ref broadcaster, shared with the connections subscribed to them and the deliveries in flight.
+        struct broadcast_registry
+        {
+            using group = std::unordered_set<connection*>;
+
+            std::mutex mutex;
+            /// Subscribers of each topic, grouped by the io_context their connection runs in.
+            std::unordered_map<std::string, std::unordered_map<asio::io_context*, group>> topics;
+            /// Topics of each subscriber, to leave them all at once.
+            std::unordered_map<connection*, std::vector<std::string>> subscriptions;
+
+            /// Remove conn from topic, the mutex must be locked.
+            void remove(connection& conn, asio::io_context* context, const std::string& topic)
+            {
+                auto found = topics.find(topic);
+                if (found == topics.end())
+                    return;
+                auto group = found->second.find(context);
+                if (group == found->second.end())
+                    return;
+                group->second.erase(&conn);
+                if (group->second.empty())
+                {
+                    found->second.erase(group);
+                    if (found->second.empty())
+                        topics.erase(found);
+                }
+            }
+
+            /// Queue frame on the subscribers of topic running in context, called from that context's thread.
+            void deliver(const std::string& topic, asio::io_context* context, const shared_frame& frame)
+            {
+                std::vector<connection*> subscribers;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    auto found = topics.find(topic);
+                    if (found == topics.end())
+                        return;
+                    auto group = found->second.find(context);
+                    if (group == found->second.end())
+                        return;
+                    subscribers.assign(group->second.begin(), group->second.end());
+                }
+
+                // Connections only leave from this thread, none of them can be gone before the loop is done
+                for (auto* conn : subscribers)
+                    conn->send_frame(frame);
+            }
+        };
+
+        /// Publishes messages to the websocket connections subscribed to a topic.
+
+        ///
+        /// A message is framed once into a buffer that all its subscribers share, and each io_context gets one task
+        /// that queues it on the connections running there.<br>
+        /// Subscribe and unsubscribe a connection from its own handlers (onopen, onmessage, ...), it leaves every topic
+        /// once it's closed.
+        class broadcaster
+        {
+        public:
+            broadcaster():
+              registry_(std::make_shared<broadcast_registry>())
+            {}
+
+            /// Subscribe conn to topic, until it's unsubscribed or closed.
+            void subscribe(connection& conn, const std::string& topic)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(registry_->mutex);
+                    if (!registry_->topics[topic][&conn.get_io_context()].insert(&conn).second)
+                        return;
+                    registry_->subscriptions[&conn].push_back(topic);
+                }
+
+                for (auto& registry : conn.broadcasts_)
+                    if (registry.lock() == registry_)
+                        return;
+                conn.broadcasts_.emplace_back(registry_);
+            }
+
+            void unsubscribe(connection& conn, const std::string& topic)
+            {
+                std::lock_guard<std::mutex> lock(registry_->mutex);
+                auto subscription = registry_->subscriptions.find(&conn);
+                if (subscription == registry_->subscriptions.end())
+                    return;
+                auto& topics = subscription->second;
+                auto found = std::find(topics.begin(), topics.end(), topic);
+                if (found == topics.end())
+                    return;
+                topics.erase(found);
+                if (topics.empty())
+                    registry_->subscriptions.erase(subscription);
+                registry_->remove(conn, &conn.get_io_context(), topic);
+            }
+
+            /// Unsubscribe conn from all topics.
+            void unsubscribe(connection& conn)
+            {
+                leave(*registry_, conn);
+            }
+
+            /// Send a message to the subscribers of topic, returns how many there are.
+            size_t publish(const std::string& topic, const std::string& msg, bool is_binary = false)
+            {
+                std::vector<asio::io_context*> contexts;
+                size_t subscribers = 0;
+                {
+                    std::lock_guard<std::mutex> lock(registry_->mutex);
+                    auto found = registry_->topics.find(topic);
+                    if (found == registry_->topics.end())
+                        return 0;
+                    for (auto& group : found->second)
+                    {
+                        contexts.push_back(group.first);
+                        subscribers += group.second.size();
+                    }
+                }
+
+                auto frame = make_frame(msg, is_binary);
+                for (auto* context : contexts)
+                {
+                    asio::post(*context, [registry = registry_, topic, context, frame] {
+                        registry->deliver(topic, context, frame);
+                    });
+                }
+                return subscribers;
+            }
+
+            /// The number of connections subscribed to topic.
+            size_t subscribers(const std::string& topic) const
+            {
+                std::lock_guard<std::mutex> lock(registry_->mutex);
+                auto found = registry_->topics.find(topic);
+                if (found == registry_->topics.end())
+                    return 0;
+                size_t count = 0;
+                for (auto& group : found->second)
+                    count += group.second.size();
+                return count;
+            }
+
+        private:
+            friend struct connection;
+
+            static void leave(broadcast_registry& registry, connection& conn)
+            {
+                std::lock_guard<std::mutex> lock(registry.mutex);
+                auto subscription = registry.subscriptions.find(&conn);
+                if (subscription == registry.subscriptions.end())
+                    return;
+                auto* context = &conn.get_io_context();
+                for (auto& topic : subscription->second)
+                    registry.remove(conn, context, topic);
+                registry.subscriptions.erase(subscription);
+            }
+
+            std::shared_ptr<broadcast_registry> registry_;
+        };
+
+        inline void connection::leave_broadcasts()
+        {
+            for (auto& registry : broadcasts_)
+                if (auto locked = registry.lock())
+                    broadcaster::leave(*locked, *this);
+            broadcasts_.clear();
+        }
     } // namespace websocket
 } // namespace crow
 
@@ -8824,8 +12365,11 @@ namespace crow
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
             self->req.raw_url.insert(self->req.raw_url.end(), at, at + length);
-            self->req.url_params = query_string(self->req.raw_url);
-            self->req.url = self->req.raw_url.substr(0, self->qs_point != 0 ? self->qs_point : std::string::npos);
+            // Most URLs have no query string to copy and parse
+            size_t query = self->req.raw_url.find('?');
+            if (query != std::string::npos)
+                self->req.url_params = query_string(self->req.raw_url);
+            self->req.url.assign(self->req.raw_url, 0, query);
 
             self->process_url();
 
@@ -8839,7 +12383,7 @@ namespace crow
                 case 0:
                     if (!self->header_value.empty())
                     {
-                        self->req.headers.emplace(std::move(self->header_field), std::move(self->header_value));
+                        self->req.headers.emplace(self->header_field, self->header_value);
                     }
                     self->header_field.assign(at, at + length);
                     self->header_building_state = 1;
@@ -8870,26 +12414,77 @@ namespace crow
             HTTPParser* self = static_cast<HTTPParser*>(self_);
             if (!self->header_field.empty())
             {
-                self->req.headers.emplace(std::move(self->header_field), std::move(self->header_value));
+                self->req.headers.emplace(self->header_field, self->header_value);
             }
 
             self->set_connection_parameters();
-
             self->process_header();
+
+            // Avoid growing the body step by step, without trusting the client with an arbitrarily large allocation
+            if (self->content_length != CROW_ULLONG_MAX && self->content_length > 0 && !self->streaming_body_)
+                self->req.body.reserve(static_cast<size_t>(CROW_MIN(self->content_length, max_body_reserve)));
             return 0;
         }
         static int on_body(http_parser* self_, const char* at, size_t length)
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
-            self->req.body.insert(self->req.body.end(), at, at + length);
+            if (self->streaming_body_)
+            {
+                if (int status = self->handler_->handle_body(at, length))
+                {
+                    self->body_error_ = status;
+                    return -1;
+                }
+                return 0;
+            }
+#ifdef CROW_ENABLE_COMPRESSION
+            if (self->decoding_body_)
+            {
+                auto result = self->inflater_->decompress(at, length, self->req.body, self->max_decoded_size_);
+                if (result != compression::inflate_result::Ok)
+                {
+                    self->body_error_ = result == compression::inflate_result::TooLarge ? 413 : 400;
+                    return -1;
+                }
+                return 0;
+            }
+#endif
+            if (!self->body_in_place)
+                self->req.body.insert(self->req.body.end(), at, at + length);
             return 0;
         }
         static int on_message_complete(http_parser* self_)
         {
             HTTPParser* self = static_cast<HTTPParser*>(self_);
+#ifdef CROW_ENABLE_COMPRESSION
+            if (self->decoding_body_)
+            {
+                if (!self->inflater_->complete())
+                {
+                    self->body_error_ = 400;
+                    return -1;
+                }
+                // The handler gets the body as if it had been sent as it is
+                self->decoding_body_ = false;
+                self->req.headers.erase("Content-Encoding");
+            }
+#endif
+            if (self->streaming_body_)
+            {
+                self->streaming_body_ = false;
+                if (int status = self->handler_->handle_body_end())
+                {
+                    self->body_error_ = status;
+                    return -1;
+                }
+            }
 
             self->message_complete = true;
             self->process_message();
+
+            // Stop at the message boundary so that pipelined requests are handled (and answered) in order.
+            if (self->http_errno == CHPE_OK)
+                self->http_errno = CHPE_PAUSED;
             return 0;
         }
         HTTPParser(Handler* handler):
@@ -8903,6 +12498,19 @@ namespace crow
         /// Parse a buffer into the different sections of an HTTP request.
         bool feed(const char* buffer, int length)
         {
+            int parsed;
+            return feed(buffer, length, parsed);
+        }
+
+        // return false on error
+        /// Parse a buffer up to the end of the first complete request in it.
+
+        ///
+        /// `parsed` is set to the number of bytes consumed, anything after that belongs to the next (pipelined) request
+        /// and should be fed again once this parser has been cleared.
+        bool feed(const char* buffer, int length, int& parsed)
+        {
+            parsed = 0;
             if (message_complete)
                 return true;
 
@@ -8918,6 +12526,11 @@ namespace crow
             };
 
             int nparsed = http_parser_execute(this, &settings_, buffer, length);
+            parsed = nparsed;
+            if (http_errno == CHPE_PAUSED)
+            {
+                return true;
+            }
             if (http_errno != CHPE_OK)
             {
                 return false;
@@ -8932,45 +12545,141 @@ namespace crow
 
         void clear()
         {
+            // Keep the storage of the headers and strings for the next request
+            ci_map headers = std::move(req.headers);
+            std::string raw_url = std::move(req.raw_url), url = std::move(req.url), remote_ip_address = std::move(req.remote_ip_address);
+            headers.clear();
+            raw_url.clear();
+            url.clear();
+            remote_ip_address.clear();
             req = crow::request();
+            req.headers = std::move(headers);
+            req.raw_url = std::move(raw_url);
+            req.url = std::move(url);
+            req.remote_ip_address = std::move(remote_ip_address);
             header_field.clear();
             header_value.clear();
             header_building_state = 0;
             qs_point = 0;
             message_complete = false;
+            streaming_body_ = false;
+            body_error_ = 0;
+#ifdef CROW_ENABLE_COMPRESSION
+            if (decoding_body_)
+                inflater_->reset();
+            decoding_body_ = false;
+#endif
             state = CROW_NEW_MESSAGE();
+            if (http_errno == CHPE_PAUSED)
+                http_errno = CHPE_OK;
         }
 
-        inline void process_url()
+        /// Prepare the parser for a new connection, \ref clear() only prepares it for the connection's next request.
+        void reset()
         {
-            handler_->handle_url();
+            http_parser_init(this);
+            clear();
         }
 
-        inline void process_header()
+        /// Whether a full request has been parsed (and handed to the handler) since the last \ref clear().
+        bool is_message_complete() const
         {
-            handler_->handle_header();
+            return message_complete;
         }
 
-        inline void process_message()
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Decompress the body of the current request as it's parsed, according to its "Content-Encoding".
+
+        ///
+        /// Parsing fails (with a \ref body_error() of 413) once the decompressed body would grow past max_size.
+        void decode_body(size_t max_size)
         {
-            handler_->handle();
+            if (!inflater_)
+                inflater_.reset(new compression::inflate_context());
+            else
+                inflater_->reset();
+            decoding_body_ = true;
+            max_decoded_size_ = max_size;
         }
+#endif
 
-        inline void set_connection_parameters()
+        /// Whether the body is being decompressed, in which case it can't be read in place.
+        bool decoding_body() const
         {
-            req.http_ver_major = http_major;
-            req.http_ver_minor = http_minor;
+#ifdef CROW_ENABLE_COMPRESSION
+            return decoding_body_;
+#else
+            return false;
+#endif
+        }
 
-            //NOTE(EDev): it seems that the problem is with crow's policy on closing the connection for HTTP_VERSION < 1.0, the behaviour for that in crow is "don't close the connection, but don't send a keep-alive either"
+        /// Hand the body of the current request to the handler's `handle_body()` as it's parsed, instead of collecting it in \ref req.body.
 
-            // HTTP1.1 = always send keep_alive, HTTP1.0 = only send if header exists, HTTP?.? = never send
-            req.keep_alive = (http_major == 1 && http_minor == 0) ?
-                               ((flags & F_CONNECTION_KEEP_ALIVE) ? true : false) :
-                               ((http_major == 1 && http_minor == 1) ? true : false);
+        ///
+        /// `handle_body_end()` is called once it's complete. Both return 0, or the status code to reject the request with.
+        void stream_body()
+        {
+            streaming_body_ = true;
+        }
 
-            // HTTP1.1 = only close if close header exists, HTTP1.0 = always close unless keep_alive header exists, HTTP?.?= never close
-            req.close_connection = (http_major == 1 && http_minor == 0) ?
-                                     ((flags & F_CONNECTION_KEEP_ALIVE) ? false : true) :
+        /// Whether the body is handed to the handler as it's parsed.
+        bool streaming_body() const
+        {
+            return streaming_body_;
+        }
+
+        /// The status code to answer a request with when parsing failed because of its body, 0 otherwise.
+        int body_error() const
+        {
+            return body_error_;
+        }
+
+        /// The number of body bytes yet to arrive, 0 unless the parser is in the middle of a Content-Length delimited body.
+        uint64_t remaining_body_length() const
+        {
+            return state == s_body_identity ? content_length : 0;
+        }
+
+        // return false on error
+        /// Parse body bytes that were read straight into the end of \ref req.body, at most \ref remaining_body_length() of them.
+        bool feed_body_in_place(size_t length)
+        {
+            body_in_place = true;
+            bool ret = feed(req.body.data() + req.body.size() - length, static_cast<int>(length));
+            body_in_place = false;
+            return ret;
+        }
+
+        inline void process_url()
+        {
+            handler_->handle_url();
+        }
+
+        inline void process_header()
+        {
+            handler_->handle_header();
+        }
+
+        inline void process_message()
+        {
+            handler_->handle();
+        }
+
+        inline void set_connection_parameters()
+        {
+            req.http_ver_major = http_major;
+            req.http_ver_minor = http_minor;
+
+            //NOTE(EDev): it seems that the problem is with crow's policy on closing the connection for HTTP_VERSION < 1.0, the behaviour for that in crow is "don't close the connection, but don't send a keep-alive either"
+
+            // HTTP1.1 = always send keep_alive, HTTP1.0 = only send if header exists, HTTP?.? = never send
+            req.keep_alive = (http_major == 1 && http_minor == 0) ?
+                               ((flags & F_CONNECTION_KEEP_ALIVE) ? true : false) :
+                               ((http_major == 1 && http_minor == 1) ? true : false);
+
+            // HTTP1.1 = only close if close header exists, HTTP1.0 = always close unless keep_alive header exists, HTTP?.?= never close
+            req.close_connection = (http_major == 1 && http_minor == 0) ?
+                                     ((flags & F_CONNECTION_KEEP_ALIVE) ? false : true) :
                                      ((http_major == 1 && http_minor == 1) ? ((flags & F_CONNECTION_CLOSE) ? true : false) : false);
             req.upgrade = static_cast<bool>(upgrade);
         }
@@ -8981,10 +12690,20 @@ namespace crow
         request req;
 
     private:
+        static constexpr uint64_t max_body_reserve = 1024 * 1024;
+
         int header_building_state = 0;
         bool message_complete = false;
+        bool body_in_place = false;
+        bool streaming_body_ = false;
+        int body_error_ = 0;
         std::string header_field;
         std::string header_value;
+#ifdef CROW_ENABLE_COMPRESSION
+        std::unique_ptr<compression::inflate_context> inflater_; ///< Created for the first compressed body, kept for the connection's next ones.
+        bool decoding_body_ = false;
+        size_t max_decoded_size_ = 0;
+#endif
 
         Handler* handler_; ///< This is currently an HTTP connection object (\ref crow.Connection).
     };
@@ -8997,6 +12716,9 @@ namespace crow
 #include <string>
 #include <vector>
 #include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <memory>
 
 
 namespace crow
@@ -9021,6 +12743,68 @@ namespace crow
         /// Multipart header map (key is header key).
         using mph_map = std::unordered_multimap<std::string, header, ci_hash, ci_key_eq>;
 
+        /// The data of a part that was written to a temporary file while the request was read (see \ref crow::Crow::stream_multipart())
+
+        ///
+        /// The file is removed along with the last part referring to it, unless it was moved with \ref move_to().
+        class temp_file
+        {
+        public:
+            explicit temp_file(std::string path):
+              path_(std::move(path))
+            {}
+
+            temp_file(const temp_file&) = delete;
+            temp_file& operator=(const temp_file&) = delete;
+
+            ~temp_file()
+            {
+                if (!kept_)
+                {
+                    std::error_code ec;
+                    std::filesystem::remove(path_, ec);
+                }
+            }
+
+            const std::string& path() const { return path_; }
+
+            uint64_t size() const { return size_; }
+
+            /// Move the file to destination (replacing it), it's kept from then on.
+            bool move_to(const std::string& destination)
+            {
+                std::error_code ec;
+                std::filesystem::rename(path_, destination, ec);
+                if (ec)
+                {
+                    // Renaming fails across file systems
+                    if (!std::filesystem::copy_file(path_, destination, std::filesystem::copy_options::overwrite_existing, ec))
+                        return false;
+                    std::filesystem::remove(path_, ec);
+                }
+                path_ = destination;
+                kept_ = true;
+                return true;
+            }
+
+            /// Read the whole file into memory.
+            std::string read() const
+            {
+                std::ifstream in(path_, std::ios::binary);
+                std::string data(static_cast<size_t>(size_), '\0');
+                in.read(&data[0], data.size());
+                data.resize(static_cast<size_t>(in.gcount()));
+                return data;
+            }
+
+        private:
+            friend class stream_parser;
+
+            std::string path_;
+            uint64_t size_ = 0;
+            bool kept_ = false;
+        };
+
         /// Find and return the value object associated with the key. (returns an empty class if nothing is found)
         template<typename O, typename T>
         inline const O& get_header_value_object(const T& headers, const std::string& key)
@@ -9046,8 +12830,9 @@ namespace crow
         /// It is usually separated from other sections by a `boundary`
         struct part
         {
-            mph_map headers;  ///< (optional) The first part before the data, Contains information regarding the type of data and encoding
-            std::string body; ///< The actual data in the part
+            mph_map headers;                 ///< (optional) The first part before the data, Contains information regarding the type of data and encoding
+            std::string body;                ///< The actual data in the part
+            std::shared_ptr<temp_file> file; ///< The data, if it was written to disk while the request was read (\ref body is empty then)
 
             operator int() const { return std::stoi(body); }    ///< Returns \ref body as integer
             operator double() const { return std::stod(body); } ///< Returns \ref body as double
@@ -9137,7 +12922,14 @@ namespace crow
               headers(req.headers),
               boundary(get_boundary(get_header_value("Content-Type")))
             {
-                if (!boundary.empty())
+                if (req.multipart_message)
+                {
+                    // Parsed while the request was read, files stay on disk
+                    content_type = req.multipart_message->content_type;
+                    parts = req.multipart_message->parts;
+                    part_map = req.multipart_message->part_map;
+                }
+                else if (!boundary.empty())
                 {
                     content_type = "multipart/form-data; boundary=" + boundary;
                     parse_body(req.body);
@@ -9265,6 +13057,349 @@ namespace crow
                 return (padding + string + padding);
             }
         };
+
+        /// Limits for parsing multipart bodies as they arrive, see \ref crow::Crow::stream_multipart()
+        struct stream_settings
+        {
+            size_t memory_limit = 64 * 1024; ///< Larger parts are written to a file, as are all parts with a filename.
+            uint64_t max_size = 0;           ///< Larger bodies are rejected with 413 Payload Too Large, 0 for no limit.
+            std::string directory;           ///< Where files are written, the system's temporary directory if empty.
+        };
+
+        /// Parses a `multipart/form-data` body fed in pieces as it's read from the connection.
+
+        ///
+        /// Only an incomplete delimiter or part head is carried from one piece to the next, part data goes straight
+        /// to memory or, for files and large fields, to a \ref temp_file.
+        class stream_parser
+        {
+        public:
+            /// Prepare for a new body, returns false if the request isn't `multipart/form-data` with a usable boundary.
+            bool start(const ci_map& headers, const stream_settings& settings)
+            {
+                const std::string& content_type = get_header_value(headers, "Content-Type");
+                constexpr std::string_view form_data = "multipart/form-data";
+                if (!ci_key_eq()(std::string_view(content_type).substr(0, form_data.size()), form_data))
+                    return false;
+
+                auto boundary = find_boundary(content_type);
+                if (boundary.empty() || boundary.size() > 70)
+                    return false;
+
+                // Whatever an interrupted body left behind
+                abort();
+                settings_ = &settings;
+                delimiter_ = "\r\n--";
+                delimiter_ += boundary;
+                // The first delimiter doesn't have to follow a line break
+                buffer_ = crlf;
+                state_ = state::Preamble;
+                received_ = 0;
+                message_ = std::make_shared<message>(headers, std::string(boundary), std::vector<part>{});
+                return true;
+            }
+
+            /// Parse the next piece of the body, returns 0 or the status code to reject the request with.
+            int feed(const char* data, size_t size)
+            {
+                received_ += size;
+                if (settings_->max_size && received_ > settings_->max_size)
+                    return fail(413);
+
+                // Top up what's carried over until it's parsed, then continue in place
+                while (!buffer_.empty() && size > 0)
+                {
+                    size_t carried = buffer_.size();
+                    size_t take = std::min(size, std::max<size_t>(delimiter_.size(), 256));
+                    buffer_.append(data, take);
+
+                    size_t consumed;
+                    if (int status = process(buffer_.data(), buffer_.size(), consumed))
+                        return fail(status);
+                    if (consumed >= carried)
+                    {
+                        data += consumed - carried;
+                        size -= consumed - carried;
+                        buffer_.clear();
+                        break;
+                    }
+                    buffer_.erase(0, consumed);
+                    data += take;
+                    size -= take;
+                }
+
+                if (buffer_.empty() && size > 0)
+                {
+                    size_t consumed;
+                    if (int status = process(data, size, consumed))
+                        return fail(status);
+                    buffer_.assign(data + consumed, size - consumed);
+                }
+                return 0;
+            }
+
+            /// The body is complete, returns 0 or the status code to reject the request with.
+            int finish()
+            {
+                if (state_ != state::Epilogue)
+                    return fail(400);
+                buffer_.clear();
+                return 0;
+            }
+
+            /// The message parsed since \ref start(), once \ref finish() succeeded.
+            std::shared_ptr<message> release()
+            {
+                return std::move(message_);
+            }
+
+            /// Drop a body that won't be finished, closing and removing the files written for it.
+            void abort()
+            {
+                // A spilled file is closed before its part removes it
+                if (file_.is_open())
+                    file_.close();
+                file_.clear();
+                current_ = part();
+                message_.reset();
+                buffer_.clear();
+                state_ = state::Epilogue;
+            }
+
+        private:
+            enum class state
+            {
+                Preamble,
+                Boundary,
+                Head,
+                Body,
+                Epilogue,
+            };
+
+            static constexpr size_t max_head_size = 16 * 1024;
+
+            static std::string_view find_boundary(std::string_view content_type)
+            {
+                constexpr std::string_view boundary_text = "boundary=";
+                size_t found = content_type.find(boundary_text);
+                if (found == std::string_view::npos)
+                    return {};
+                auto boundary = content_type.substr(found + boundary_text.size());
+                if (!boundary.empty() && boundary[0] == '"')
+                    return boundary.substr(1, boundary.find('"', 1) - 1);
+                return boundary.substr(0, std::min(boundary.find(';'), boundary.find(' ')));
+            }
+
+            /// Parse as much of data as can be, consumed is set to where more data is needed.
+            int process(const char* data, size_t size, size_t& consumed)
+            {
+                size_t i = 0;
+                while (i < size)
+                {
+                    std::string_view rest(data + i, size - i);
+                    switch (state_)
+                    {
+                        case state::Preamble:
+                        case state::Body:
+                        {
+                            size_t found = rest.find(delimiter_);
+                            if (found == std::string_view::npos)
+                            {
+                                // Keep what could be the start of a delimiter
+                                size_t safe = rest.size() >= delimiter_.size() ? rest.size() - delimiter_.size() + 1 : 0;
+                                if (state_ == state::Body)
+                                    if (int status = write(rest.data(), safe))
+                                        return status;
+                                consumed = i + safe;
+                                return 0;
+                            }
+                            if (state_ == state::Body)
+                            {
+                                if (int status = write(rest.data(), found))
+                                    return status;
+                                if (int status = end_part())
+                                    return status;
+                            }
+                            i += found + delimiter_.size();
+                            state_ = state::Boundary;
+                            break;
+                        }
+                        case state::Boundary:
+                            // "--" ends the message, a line break (possibly after some whitespace) starts a part
+                            if (rest[0] == ' ' || rest[0] == '\t')
+                            {
+                                i++;
+                                break;
+                            }
+                            if (rest.size() < 2)
+                            {
+                                consumed = i;
+                                return 0;
+                            }
+                            if (rest[0] == '-' && rest[1] == '-')
+                                state_ = state::Epilogue;
+                            else if (rest[0] == '\r' && rest[1] == '\n')
+                                state_ = state::Head;
+                            else
+                                return 400;
+                            i += 2;
+                            break;
+                        case state::Head:
+                        {
+                            size_t end = rest.substr(0, 2) == crlf ? 0 : rest.find("\r\n\r\n");
+                            if (end == std::string_view::npos)
+                            {
+                                if (rest.size() > max_head_size)
+                                    return 400;
+                                consumed = i;
+                                return 0;
+                            }
+                            if (int status = begin_part(rest.substr(0, end)))
+                                return status;
+                            i += end == 0 ? 2 : end + 4;
+                            state_ = state::Body;
+                            break;
+                        }
+                        case state::Epilogue:
+                            i = size;
+                            break;
+                    }
+                }
+                consumed = i;
+                return 0;
+            }
+
+            int begin_part(std::string_view head)
+            {
+                current_ = part();
+                while (!head.empty())
+                {
+                    size_t line_end = head.find(crlf);
+                    parse_header_line(head.substr(0, line_end));
+                    head = line_end == std::string_view::npos ? std::string_view() : head.substr(line_end + 2);
+                }
+
+                const auto& disposition = current_.get_header_object("Content-Disposition");
+                if (disposition.params.count("filename"))
+                    return open_file();
+                return 0;
+            }
+
+            void parse_header_line(std::string_view line)
+            {
+                size_t colon = line.find(':');
+                if (colon == std::string_view::npos)
+                    return;
+
+                header value;
+                auto trim = [](std::string_view text) {
+                    while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+                        text.remove_prefix(1);
+                    while (!text.empty() && (text.back() == ' ' || text.back() == '\t'))
+                        text.remove_suffix(1);
+                    if (text.size() > 1 && text.front() == '"' && text.back() == '"')
+                        text = text.substr(1, text.size() - 2);
+                    return text;
+                };
+
+                auto rest = line.substr(colon + 1);
+                size_t semicolon = rest.find(';');
+                value.value = std::string(trim(rest.substr(0, semicolon)));
+                while (semicolon != std::string_view::npos)
+                {
+                    rest = rest.substr(semicolon + 1);
+                    semicolon = rest.find(';');
+                    auto param = rest.substr(0, semicolon);
+                    size_t equals = param.find('=');
+                    if (equals != std::string_view::npos)
+                        value.params.emplace(std::string(trim(param.substr(0, equals))), std::string(trim(param.substr(equals + 1))));
+                }
+                current_.headers.emplace(std::string(trim(line.substr(0, colon))), std::move(value));
+            }
+
+            int open_file()
+            {
+                std::string directory = settings_->directory;
+                if (directory.empty())
+                {
+                    std::error_code ec;
+                    directory = std::filesystem::temp_directory_path(ec).string();
+                }
+
+                auto path = utility::join_path(directory, "crow-upload-" + utility::random_alphanum(16));
+                file_.open(path, std::ios::binary | std::ios::trunc);
+                if (!file_)
+                {
+                    CROW_LOG_ERROR << "Could not create " << path << " for a multipart upload";
+                    return 500;
+                }
+                current_.file = std::make_shared<temp_file>(std::move(path));
+                return 0;
+            }
+
+            int write(const char* data, size_t size)
+            {
+                if (size == 0)
+                    return 0;
+                if (!current_.file && current_.body.size() + size > settings_->memory_limit)
+                {
+                    // Too large to keep in memory after all
+                    if (int status = open_file())
+                        return status;
+                    file_.write(current_.body.data(), current_.body.size());
+                    current_.file->size_ = current_.body.size();
+                    std::string().swap(current_.body);
+                }
+
+                if (!current_.file)
+                {
+                    current_.body.append(data, size);
+                    return 0;
+                }
+                if (!file_.write(data, size))
+                {
+                    CROW_LOG_ERROR << "Could not write " << current_.file->path();
+                    return 500;
+                }
+                current_.file->size_ += size;
+                return 0;
+            }
+
+            int end_part()
+            {
+                if (current_.file)
+                {
+                    file_.close();
+                    if (file_.fail())
+                    {
+                        CROW_LOG_ERROR << "Could not write " << current_.file->path();
+                        return 500;
+                    }
+                }
+
+                const auto& params = current_.get_header_object("Content-Disposition").params;
+                auto name = params.find("name");
+                message_->part_map.emplace(name != params.end() ? name->second : std::string(), current_);
+                message_->parts.push_back(std::move(current_));
+                current_ = part();
+                return 0;
+            }
+
+            int fail(int status)
+            {
+                abort();
+                return status;
+            }
+
+            const stream_settings* settings_ = nullptr;
+            std::string delimiter_;
+            std::string buffer_;
+            state state_ = state::Epilogue;
+            uint64_t received_ = 0;
+            part current_;
+            std::ofstream file_;
+            std::shared_ptr<message> message_;
+        };
     } // namespace multipart
 } // namespace crow
 
@@ -9452,7 +13587,10 @@ namespace crow
               headers(req.headers),
               boundary(get_boundary(get_header_value("Content-Type")))
             {
-                parse_body(req.body);
+                if (req.multipart_message)
+                    view_parts(*req.multipart_message);
+                else
+                    parse_body(req.body);
             }
 
         private:
@@ -9473,6 +13611,27 @@ namespace crow
                 return to_return;
             }
 
+            /// View the parts of a message parsed while the request was read, bodies written to files are empty
+            void view_parts(const message& streamed)
+            {
+                for (const part& item : streamed.parts)
+                {
+                    part_view viewed{{}, item.body};
+                    for (const auto& [header_key, header_value] : item.headers)
+                    {
+                        header_view value{header_value.value, {}};
+                        for (const auto& [param_key, param_value] : header_value.params)
+                            value.params.emplace(param_key, param_value);
+                        viewed.headers.emplace(header_key, std::move(value));
+                    }
+
+                    const auto& params = viewed.get_header_object("Content-Disposition").params;
+                    auto name = params.find("name");
+                    part_map.emplace(name != params.end() ? name->second : std::string_view(), viewed);
+                    parts.push_back(std::move(viewed));
+                }
+            }
+
             void parse_body(std::string_view body)
             {
                 const std::string delimiter = dd + boundary;
@@ -9599,15 +13758,24 @@ namespace crow
     template<typename Adaptor, typename Handler, typename... Middlewares>
     class Connection;
 
+    template<typename Adaptor, typename Handler, typename... Middlewares>
+    class HTTP2Connection;
+
     class Router;
 
+    struct ResponseCache;
+
     /// HTTP response
     struct response
     {
         template<typename Adaptor, typename Handler, typename... Middlewares>
         friend class crow::Connection;
 
+        template<typename Adaptor, typename Handler, typename... Middlewares>
+        friend class crow::HTTP2Connection;
+
         friend class Router;
+        friend struct ResponseCache;
 
         int code{200};    ///< The Status code for the response.
         std::string body; ///< The actual payload containing the response data.
@@ -9716,6 +13884,20 @@ namespace crow
             set_header("Content-Type", std::move(value.content_type));
         }
 
+        /// A JSON body. Large documents are kept as they are and serialized while they're sent, see \ref json_body().
+        template<typename Value, typename std::enable_if<std::is_same<Value, json::wvalue>::value, int>::type = 0>
+        response(Value&& value)
+        {
+            set_json_body(std::move(value));
+        }
+
+        template<typename Value, typename std::enable_if<std::is_same<Value, json::wvalue>::value, int>::type = 0>
+        response(int code_, Value&& value):
+          code(code_)
+        {
+            set_json_body(std::move(value));
+        }
+
         response(response&& r)
         {
             *this = std::move(r);
@@ -9738,6 +13920,8 @@ namespace crow
         response& operator=(response&& r) noexcept
         {
             body = std::move(r.body);
+            json_body_ = std::move(r.json_body_);
+            json_length_ = r.json_length_;
             code = r.code;
             headers = std::move(r.headers);
             completed_ = r.completed_;
@@ -9754,9 +13938,12 @@ namespace crow
         void clear()
         {
             body.clear();
+            json_body_.reset();
             code = 200;
             headers.clear();
             completed_ = false;
+            skip_body = false;
+            manual_length_header = false;
             file_info = static_file_info{};
         }
 
@@ -9802,6 +13989,7 @@ namespace crow
 
         void write(const std::string& body_part)
         {
+            dump_json_body();
             body += body_part;
         }
 
@@ -9813,15 +14001,18 @@ namespace crow
                 completed_ = true;
                 if (skip_body)
                 {
+                    dump_json_body();
                     set_header("Content-Length", std::to_string(body.size()));
                     body = "";
                     manual_length_header = true;
                 }
                 if (complete_request_handler_)
                 {
-                    complete_request_handler_();
-                    manual_length_header = false;
-                    skip_body = false;
+                    // The connection resets the handler while completing the request, so it can't be called in place.
+                    // It also clears the response (flags included) once it's sent, possibly on another thread, so nothing may be touched afterwards.
+                    auto complete_request_handler = std::move(complete_request_handler_);
+                    complete_request_handler_ = nullptr;
+                    complete_request_handler();
                 }
             }
         }
@@ -9829,6 +14020,7 @@ namespace crow
         /// Same as end() except it adds a body part right before ending.
         void end(const std::string& body_part)
         {
+            dump_json_body();
             body += body_part;
             end();
         }
@@ -9890,11 +14082,50 @@ namespace crow
             }
         }
 
+        /// A large JSON body that hasn't been serialized yet, null if the body is in \ref body.
+
+        ///
+        /// The connection writes such a document to the socket as it's serialized, without building it in memory first, so
+        /// middleware sees an empty \ref body. Use \ref dump_json_body() for a body that can be read or changed.
+        const json::wvalue* json_body() const
+        {
+            return json_body_.get();
+        }
+
+        /// Serialize a JSON body that's been kept as it is (see \ref json_body()) into \ref body.
+        void dump_json_body()
+        {
+            if (!json_body_)
+                return;
+            body.clear();
+            body.reserve(json_length_);
+            json_body_->dump_to(body);
+            json_body_.reset();
+        }
+
     private:
+        /// Documents estimated to be at least this big are serialized when they're sent.
+        static constexpr size_t deferred_json_size = 64 * 1024;
+
+        void set_json_body(json::wvalue&& value)
+        {
+            set_header("Content-Type", value.content_type);
+            json_length_ = value.estimate_length();
+            if (json_length_ >= deferred_json_size)
+            {
+                json_body_.reset(new json::wvalue(std::move(value)));
+                return;
+            }
+            body.reserve(json_length_);
+            value.dump_to(body);
+        }
+
         bool completed_{};
         std::function<void()> complete_request_handler_;
         std::function<bool()> is_alive_helper_;
         static_file_info file_info;
+        std::unique_ptr<json::wvalue> json_body_;
+        size_t json_length_ = 0; ///< Estimated length of the serialized JSON body.
     };
 } // namespace crow
 
@@ -10151,7 +14382,7 @@ namespace crow
         void before_handle(request& req, response& res, context& ctx)
         {
             // TODO(dranikpg): remove copies, use string_view with c++17
-            int count = req.headers.count("Cookie");
+            int count = req.headers.count(known_header::Cookie);
             if (!count)
                 return;
             if (count > 1)
@@ -10229,13 +14460,29 @@ namespace crow
 
 #include <unordered_map>
 #include <unordered_set>
-#include <set>
+#include <string_view>
 #include <queue>
 
 #include <memory>
 #include <string>
 #include <cstdio>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <stdexcept>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <fstream>
 #include <sstream>
@@ -10338,57 +14585,164 @@ namespace crow
         }
 
         /// Expiration tracker keeps track of soonest-to-expire keys
+        ///
+        /// \details Entries live on an intrusive list ordered by expiration time,
+        /// indexed by a map of views into the entries' own keys.
+        /// Stores refresh with a fixed timeout, so new times land at the tail
+        /// and add(), remove() and pop_first() are O(1) without copying the key.
         struct ExpirationTracker
         {
-            using DataPair = std::pair<uint64_t /*time*/, std::string /*key*/>;
+            using DataPair = std::pair<uint64_t /*time*/, std::string_view /*key*/>;
+
+            ExpirationTracker() = default;
+
+            ExpirationTracker(const ExpirationTracker& other)
+            {
+                for (const auto& p : other)
+                    add(p.second, p.first);
+            }
+
+            ExpirationTracker& operator=(const ExpirationTracker& other)
+            {
+                if (this != &other)
+                    *this = ExpirationTracker(other);
+                return *this;
+            }
+
+            ExpirationTracker(ExpirationTracker&& other) noexcept:
+              index_(std::move(other.index_)), head_(other.head_), tail_(other.tail_)
+            {
+                other.index_.clear();
+                other.head_ = other.tail_ = nullptr;
+            }
+
+            ExpirationTracker& operator=(ExpirationTracker&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    index_ = std::move(other.index_);
+                    head_ = other.head_;
+                    tail_ = other.tail_;
+                    other.index_.clear();
+                    other.head_ = other.tail_ = nullptr;
+                }
+                return *this;
+            }
 
             /// Add key with time to tracker.
             /// If the key is already present, it will be updated
-            void add(std::string key, uint64_t time)
+            void add(std::string_view key, uint64_t time)
             {
-                auto it = times_.find(key);
-                if (it != times_.end()) remove(key);
-                times_[key] = time;
-                queue_.insert({time, std::move(key)});
+                entry* e;
+                auto it = index_.find(key);
+                if (it != index_.end())
+                {
+                    e = it->second.get();
+                    unlink(e);
+                }
+                else
+                {
+                    auto owned = std::unique_ptr<entry>(new entry{0, std::string(key), nullptr, nullptr});
+                    e = owned.get();
+                    index_.emplace(e->key, std::move(owned));
+                }
+                e->time = time;
+                link(e);
             }
 
-            void remove(const std::string& key)
+            void remove(std::string_view key)
             {
-                auto it = times_.find(key);
-                if (it != times_.end())
+                auto it = index_.find(key);
+                if (it != index_.end())
                 {
-                    queue_.erase({it->second, key});
-                    times_.erase(it);
+                    unlink(it->second.get());
+                    index_.erase(it);
                 }
             }
 
             /// Get expiration time of soonest-to-expire entry
             uint64_t peek_first() const
             {
-                if (queue_.empty()) return std::numeric_limits<uint64_t>::max();
-                return queue_.begin()->first;
+                if (!head_) return std::numeric_limits<uint64_t>::max();
+                return head_->time;
             }
 
             std::string pop_first()
             {
-                auto it = times_.find(queue_.begin()->second);
-                auto key = it->first;
-                times_.erase(it);
-                queue_.erase(queue_.begin());
+                entry* e = head_;
+                unlink(e);
+                auto it = index_.find(e->key);
+                std::string key = std::move(e->key);
+                index_.erase(it);
                 return key;
             }
 
-            using iterator = typename std::set<DataPair>::const_iterator;
+        private:
+            struct entry
+            {
+                uint64_t time;
+                std::string key;
+                entry* prev;
+                entry* next;
+            };
+
+        public:
+            struct iterator
+            {
+                DataPair operator*() const { return {e->time, e->key}; }
+
+                iterator& operator++()
+                {
+                    e = e->next;
+                    return *this;
+                }
+
+                bool operator==(const iterator& other) const { return e == other.e; }
+                bool operator!=(const iterator& other) const { return e != other.e; }
+
+                const entry* e;
+            };
 
-            iterator begin() const { return queue_.cbegin(); }
+            iterator begin() const { return {head_}; }
 
-            iterator end() const { return queue_.cend(); }
+            iterator end() const { return {nullptr}; }
 
         private:
-            std::set<DataPair> queue_;
-            std::unordered_map<std::string, uint64_t> times_;
+            /// Insert in time order, searching from the tail where new entries belong
+            void link(entry* e)
+            {
+                entry* after = tail_;
+                while (after && after->time > e->time)
+                    after = after->prev;
+
+                e->prev = after;
+                e->next = after ? after->next : head_;
+                (e->next ? e->next->prev : tail_) = e;
+                (after ? after->next : head_) = e;
+            }
+
+            void unlink(entry* e)
+            {
+                (e->prev ? e->prev->next : head_) = e->next;
+                (e->next ? e->next->prev : tail_) = e->prev;
+                e->prev = e->next = nullptr;
+            }
+
+            std::unordered_map<std::string_view, std::unique_ptr<entry>> index_;
+            entry* head_ = nullptr;
+            entry* tail_ = nullptr;
         };
 
+        /// Stores that declare `static constexpr bool thread_safe = true` synchronize
+        /// themselves across different session ids. All others are serialized by the middleware.
+        template<typename Store, typename = void>
+        struct is_thread_safe_store : std::false_type
+        {};
+
+        template<typename Store>
+        struct is_thread_safe_store<Store, std::void_t<decltype(Store::thread_safe)>> : std::bool_constant<Store::thread_safe>
+        {};
+
         /// CachedSessions are shared across requests
         struct CachedSession
         {
@@ -10402,7 +14756,7 @@ namespace crow
             bool requested_refresh;
 
             // number of references held - used for correctly destroying the cache.
-            // No need to be atomic, all SessionMiddleware accesses are synchronized
+            // No need to be atomic, it is guarded by the SessionMiddleware shard lock
             int referrers;
             std::recursive_mutex mutex;
         };
@@ -10533,7 +14887,9 @@ namespace crow
           Ts... ts):
           id_length_(id_length),
           cookie_(cookie),
-          store_(std::forward<Ts>(ts)...), mutex_(new std::mutex{})
+          store_(std::forward<Ts>(ts)...),
+          shards_(new shard[shard_count]),
+          store_mutex_(new std::mutex{})
         {}
 
         template<typename... Ts>
@@ -10547,26 +14903,29 @@ namespace crow
         template<typename AllContext>
         void before_handle(request& /*req*/, response& /*res*/, context& ctx, AllContext& all_ctx)
         {
-            lock l(*mutex_);
-
             auto& cookies = all_ctx.template get<CookieParser>();
             auto session_id = load_id(cookies);
             if (session_id == "") return;
 
+            auto& s = shard_for(session_id);
+            lock l(s.mutex);
+
             // search entry in cache
-            auto it = cache_.find(session_id);
-            if (it != cache_.end())
+            auto it = s.cache.find(session_id);
+            if (it != s.cache.end())
             {
                 it->second->referrers++;
                 ctx.node = it->second;
                 return;
             }
 
+            auto sl = lock_store();
+
             // check this is a valid entry before loading
             if (!store_.contains(session_id)) return;
 
             auto node = std::make_shared<session::CachedSession>();
-            node->session_id = session_id;
+            node->session_id = std::move(session_id);
             node->referrers = 1;
 
             try
@@ -10579,41 +14938,50 @@ namespace crow
                 return;
             }
 
-            ctx.node = node;
-            cache_[session_id] = node;
+            // the cache key is a view into the node's own id
+            s.cache.emplace(node->session_id, node);
+            ctx.node = std::move(node);
         }
 
         template<typename AllContext>
         void after_handle(request& /*req*/, response& /*res*/, context& ctx, AllContext& all_ctx)
         {
-            lock l(*mutex_);
-            if (!ctx.node || --ctx.node->referrers > 0) return;
-            ctx.node->requested_refresh |= ctx.node->session_id == "";
+            if (!ctx.node) return;
+            auto& node = *ctx.node;
 
-            // generate new id
-            if (ctx.node->session_id == "")
+            // a new session is only visible to this request, so its id can be chosen unlocked
+            bool created = node.session_id == "";
+            if (created)
             {
+                node.requested_refresh = true;
+
                 // check for requested id
-                ctx.node->session_id = std::move(ctx.node->requested_session_id);
-                if (ctx.node->session_id == "")
+                node.session_id = std::move(node.requested_session_id);
+                if (node.session_id == "")
                 {
-                    ctx.node->session_id = utility::random_alphanum(id_length_);
+                    node.session_id = utility::random_alphanum(id_length_);
                 }
             }
-            else
+
+            auto& s = shard_for(node.session_id);
+            lock l(s.mutex);
+            if (!created)
             {
-                cache_.erase(ctx.node->session_id);
+                if (--node.referrers > 0) return;
+                s.cache.erase(node.session_id);
             }
 
-            if (ctx.node->requested_refresh)
+            if (node.requested_refresh)
             {
                 auto& cookies = all_ctx.template get<CookieParser>();
-                store_id(cookies, ctx.node->session_id);
+                store_id(cookies, node.session_id);
             }
 
+            auto sl = lock_store();
+
             try
             {
-                store_.save(*ctx.node);
+                store_.save(node);
             }
             catch (...)
             {
@@ -10640,8 +15008,33 @@ namespace crow
 
         void store_id(CookieParser::context& cookies, const std::string& session_id)
         {
-            cookie_.value(session_id);
-            cookies.set_cookie(cookie_);
+            // the prototype is shared between shards, so work on a copy
+            auto cookie = cookie_;
+            cookie.value(session_id);
+            cookies.set_cookie(std::move(cookie));
+        }
+
+        static constexpr size_t shard_count = 16;
+
+        /// Sessions currently referenced by requests, keyed by views into CachedSession::session_id
+        struct shard
+        {
+            std::mutex mutex;
+            std::unordered_map<std::string_view, std::shared_ptr<session::CachedSession>> cache;
+        };
+
+        shard& shard_for(std::string_view session_id)
+        {
+            return shards_[std::hash<std::string_view>{}(session_id) & (shard_count - 1)];
+        }
+
+        /// Serialize store access unless the store synchronizes itself
+        std::unique_lock<std::mutex> lock_store()
+        {
+            if constexpr (session::is_thread_safe_store<Store>::value)
+                return {};
+            else
+                return std::unique_lock<std::mutex>(*store_mutex_);
         }
 
     private:
@@ -10653,34 +15046,64 @@ namespace crow
         Store store_;
 
         // mutexes are immovable
-        std::unique_ptr<std::mutex> mutex_;
-        std::unordered_map<std::string, std::shared_ptr<session::CachedSession>> cache_;
+        std::unique_ptr<shard[]> shards_;
+        std::unique_ptr<std::mutex> store_mutex_;
     };
 
     /// InMemoryStore stores all entries in memory
+    ///
+    /// \details Entries are split into shards with their own locks,
+    /// so sessions with different ids don't contend.
     struct InMemoryStore
     {
+        static constexpr bool thread_safe = true;
+
+        InMemoryStore():
+          shards_(new shard[shard_count])
+        {}
+
         // Load a value into the session cache.
         // A load is always followed by a save, no loads happen consecutively
         void load(session::CachedSession& cn)
         {
+            auto& s = shard_for(cn.session_id);
+            std::lock_guard<std::mutex> l(s.mutex);
             // load & stores happen sequentially, so moving is safe
-            cn.entries = std::move(entries[cn.session_id]);
+            cn.entries = std::move(s.entries[cn.session_id]);
         }
 
         // Persist session data
         void save(session::CachedSession& cn)
         {
-            entries[cn.session_id] = std::move(cn.entries);
+            auto& s = shard_for(cn.session_id);
+            std::lock_guard<std::mutex> l(s.mutex);
+            s.entries[cn.session_id] = std::move(cn.entries);
             // cn.dirty is a list of changed keys since the last load
         }
 
         bool contains(const std::string& key)
         {
-            return entries.count(key) > 0;
+            auto& s = shard_for(key);
+            std::lock_guard<std::mutex> l(s.mutex);
+            return s.entries.count(key) > 0;
+        }
+
+    private:
+        static constexpr size_t shard_count = 16;
+
+        struct shard
+        {
+            std::mutex mutex;
+            std::unordered_map<std::string, std::unordered_map<std::string, session::multi_value>> entries;
+        };
+
+        shard& shard_for(const std::string& key)
+        {
+            return shards_[std::hash<std::string>{}(key) & (shard_count - 1)];
         }
 
-        std::unordered_map<std::string, std::unordered_map<std::string, session::multi_value>> entries;
+        // mutexes are immovable
+        std::unique_ptr<shard[]> shards_;
     };
 
     // FileStore stores all data as json files in a folder.
@@ -10782,2431 +15205,6245 @@ namespace crow
         session::ExpirationTracker expirations_;
     };
 
-} // namespace crow
-
-
-
-namespace crow
-{
     namespace detail
     {
-
-
-        template<typename... Middlewares>
-        struct partial_context : public black_magic::pop_back<Middlewares...>::template rebind<partial_context>, public black_magic::last_element_type<Middlewares...>::type::context
+        /// A file read and written at explicit offsets, so reads can run alongside appends
+        class positional_file
         {
-            using parent_context = typename black_magic::pop_back<Middlewares...>::template rebind<::crow::detail::partial_context>;
-            template<int N>
-            using partial = typename std::conditional<N == sizeof...(Middlewares) - 1, partial_context, typename parent_context::template partial<N>>::type;
+        public:
+            positional_file() = default;
+            positional_file(const positional_file&) = delete;
+            positional_file& operator=(const positional_file&) = delete;
 
-            template<typename T>
-            typename T::context& get()
+            ~positional_file()
             {
-                return static_cast<typename T::context&>(*this);
+                close();
             }
-        };
 
+            bool open(const std::string& path, bool truncate = false)
+            {
+                close();
+#ifdef _WIN32
+                handle_ = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                        truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+                return handle_ != INVALID_HANDLE_VALUE;
+#else
+                fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0600);
+                return fd_ >= 0;
+#endif
+            }
 
+            void close()
+            {
+#ifdef _WIN32
+                if (handle_ != INVALID_HANDLE_VALUE) ::CloseHandle(handle_);
+                handle_ = INVALID_HANDLE_VALUE;
+#else
+                if (fd_ >= 0) ::close(fd_);
+                fd_ = -1;
+#endif
+            }
 
-        template<>
-        struct partial_context<>
-        {
-            template<int>
-            using partial = partial_context;
-        };
+            uint64_t size() const
+            {
+#ifdef _WIN32
+                LARGE_INTEGER size;
+                return ::GetFileSizeEx(handle_, &size) ? uint64_t(size.QuadPart) : 0;
+#else
+                struct stat st;
+                return ::fstat(fd_, &st) == 0 ? uint64_t(st.st_size) : 0;
+#endif
+            }
 
+            bool read(uint64_t offset, void* data, size_t size) const
+            {
+                auto* out = static_cast<char*>(data);
+                while (size > 0)
+                {
+#ifdef _WIN32
+                    OVERLAPPED ov{};
+                    ov.Offset = DWORD(offset);
+                    ov.OffsetHigh = DWORD(offset >> 32);
+                    DWORD n = 0;
+                    if (!::ReadFile(handle_, out, DWORD(std::min<size_t>(size, 1 << 30)), &n, &ov) || n == 0) return false;
+#else
+                    auto n = ::pread(fd_, out, size, off_t(offset));
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) return false;
+#endif
+                    out += n;
+                    offset += n;
+                    size -= n;
+                }
+                return true;
+            }
 
-        template<typename... Middlewares>
-        struct context : private partial_context<Middlewares...>
-        //struct context : private Middlewares::context... // simple but less type-safe
-        {
-            template<typename CallCriteria, int N, typename Context, typename Container>
-            friend typename std::enable_if<(N == 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res);
-            template<typename CallCriteria, int N, typename Context, typename Container>
-            friend typename std::enable_if<(N > 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res);
+            bool write(uint64_t offset, const void* data, size_t size)
+            {
+                auto* in = static_cast<const char*>(data);
+                while (size > 0)
+                {
+#ifdef _WIN32
+                    OVERLAPPED ov{};
+                    ov.Offset = DWORD(offset);
+                    ov.OffsetHigh = DWORD(offset >> 32);
+                    DWORD n = 0;
+                    if (!::WriteFile(handle_, in, DWORD(std::min<size_t>(size, 1 << 30)), &n, &ov) || n == 0) return false;
+#else
+                    auto n = ::pwrite(fd_, in, size, off_t(offset));
+                    if (n < 0 && errno == EINTR) continue;
+                    if (n <= 0) return false;
+#endif
+                    in += n;
+                    offset += n;
+                    size -= n;
+                }
+                return true;
+            }
 
-            template<typename CallCriteria, int N, typename Context, typename Container>
-            friend typename std::enable_if<(N < std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
-              middleware_call_helper(const CallCriteria& cc, Container& middlewares, request& req, response& res, Context& ctx);
+            bool truncate(uint64_t size)
+            {
+#ifdef _WIN32
+                FILE_END_OF_FILE_INFO info;
+                info.EndOfFile.QuadPart = LONGLONG(size);
+                return ::SetFileInformationByHandle(handle_, FileEndOfFileInfo, &info, sizeof(info));
+#else
+                return ::ftruncate(fd_, off_t(size)) == 0;
+#endif
+            }
 
-            template<typename T>
-            typename T::context& get()
+            /// Flush written data to the disk
+            bool sync()
             {
-                return static_cast<typename T::context&>(*this);
+#ifdef _WIN32
+                return ::FlushFileBuffers(handle_);
+#elif defined(__APPLE__)
+                return ::fsync(fd_) == 0;
+#else
+                return ::fdatasync(fd_) == 0;
+#endif
             }
 
-            template<int N>
-            using partial = typename partial_context<Middlewares...>::template partial<N>;
+        private:
+#ifdef _WIN32
+            HANDLE handle_ = INVALID_HANDLE_VALUE;
+#else
+            int fd_ = -1;
+#endif
         };
-    } // namespace detail
-} // namespace crow
 
+        /// A file mapped read-write into memory
+        class mapped_file
+        {
+        public:
+            mapped_file() = default;
+            mapped_file(const mapped_file&) = delete;
+            mapped_file& operator=(const mapped_file&) = delete;
+
+            ~mapped_file()
+            {
+                unmap();
+            }
+
+            /// Map the whole file, growing it to at least `size` bytes first
+            bool map(const std::string& path, size_t size)
+            {
+                unmap();
+#ifdef _WIN32
+                file_ = ::CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                                      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+                LARGE_INTEGER current;
+                if (file_ == INVALID_HANDLE_VALUE || !::GetFileSizeEx(file_, &current)) return fail();
+                size_ = std::max(size, size_t(current.QuadPart));
+                if (size_ == 0) return fail();
+                mapping_ = ::CreateFileMappingA(file_, nullptr, PAGE_READWRITE, DWORD(uint64_t(size_) >> 32), DWORD(size_), nullptr);
+                if (!mapping_) return fail();
+                data_ = static_cast<char*>(::MapViewOfFile(mapping_, FILE_MAP_ALL_ACCESS, 0, 0, size_));
+                return data_ ? true : fail();
+#else
+                fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+                struct stat st;
+                if (fd_ < 0 || ::fstat(fd_, &st) != 0) return fail();
+                size_ = std::max(size, size_t(st.st_size));
+                if (size_ == 0) return fail();
+                if (size_t(st.st_size) < size_ && ::ftruncate(fd_, off_t(size_)) != 0) return fail();
+                void* data = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+                if (data == MAP_FAILED) return fail();
+                data_ = static_cast<char*>(data);
+                return true;
+#endif
+            }
 
+            void unmap()
+            {
+#ifdef _WIN32
+                if (data_) ::UnmapViewOfFile(data_);
+                if (mapping_) ::CloseHandle(mapping_);
+                if (file_ != INVALID_HANDLE_VALUE) ::CloseHandle(file_);
+                mapping_ = nullptr;
+                file_ = INVALID_HANDLE_VALUE;
+#else
+                if (data_) ::munmap(data_, size_);
+                if (fd_ >= 0) ::close(fd_);
+                fd_ = -1;
+#endif
+                data_ = nullptr;
+                size_ = 0;
+            }
 
-#include <tuple>
-#include <type_traits>
-#include <iostream>
-#include <utility>
+            /// Write dirty pages back and wait for them to reach the disk
+            bool flush()
+            {
+                if (!data_) return false;
+#ifdef _WIN32
+                return ::FlushViewOfFile(data_, 0) && ::FlushFileBuffers(file_);
+#else
+                return ::msync(data_, size_, MS_SYNC) == 0;
+#endif
+            }
 
-namespace crow // NOTE: Already documented in "crow/app.h"
-{
+            char* data() const { return data_; }
 
-    /// Local middleware should extend ILocalMiddleware
-    struct ILocalMiddleware
-    {
-        using call_global = std::false_type;
-    };
+            size_t size() const { return size_; }
 
-    namespace detail
-    {
-        template<typename MW>
-        struct check_before_handle_arity_3_const
-        {
-            template<typename T, void (T::*)(request&, response&, typename MW::context&) const = &T::before_handle>
-            struct get
-            {};
-        };
+        private:
+            bool fail()
+            {
+                unmap();
+                return false;
+            }
 
-        template<typename MW>
-        struct check_before_handle_arity_3
-        {
-            template<typename T, void (T::*)(request&, response&, typename MW::context&) = &T::before_handle>
-            struct get
-            {};
+#ifdef _WIN32
+            HANDLE file_ = INVALID_HANDLE_VALUE;
+            HANDLE mapping_ = nullptr;
+#else
+            int fd_ = -1;
+#endif
+            char* data_ = nullptr;
+            size_t size_ = 0;
         };
 
-        template<typename MW>
-        struct check_after_handle_arity_3_const
+        /// Atomically move a closed file over another one
+        inline bool replace_file(const std::string& from, const std::string& to)
         {
-            template<typename T, void (T::*)(request&, response&, typename MW::context&) const = &T::after_handle>
-            struct get
-            {};
-        };
+#ifdef _WIN32
+            return ::MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+            return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+        }
 
-        template<typename MW>
-        struct check_after_handle_arity_3
+        /// Session log with its index, shared by all copies of a LogStore
+        ///
+        /// \details The log starts with a header holding its generation, followed by records
+        /// (header, session id and the session as json). The index is an open addressing table of
+        /// id hashes pointing at the latest record of every session. It remembers the log generation
+        /// and length it describes; if either doesn't match the log on startup, it's rebuilt by
+        /// scanning the log.
+        ///
+        /// mutex_ guards the index and appends, maintenance_mutex_ serializes syncs and compactions
+        /// and remap_mutex_ keeps the index mapped while it's being flushed.
+        class log_store
         {
-            template<typename T, void (T::*)(request&, response&, typename MW::context&) = &T::after_handle>
-            struct get
-            {};
-        };
+        public:
+            log_store(const std::string& folder, uint64_t expiration_seconds, std::chrono::milliseconds sync_interval):
+              log_path_(utility::join_path(folder, "sessions.log")),
+              index_path_(utility::join_path(folder, "sessions.idx")),
+              expiration_seconds_(expiration_seconds),
+              sync_interval_(sync_interval)
+            {
+                open();
+                worker_ = std::thread([this] {
+                    run();
+                });
+            }
 
-        template<typename MW>
-        struct check_global_call_false
-        {
-            template<typename T, typename std::enable_if<T::call_global::value == false, bool>::type = true>
-            struct get
-            {};
-        };
+            ~log_store()
+            {
+                {
+                    std::lock_guard<std::mutex> l(mutex_);
+                    stopping_ = true;
+                }
+                cv_.notify_one();
+                worker_.join();
+                sync();
+            }
 
-        template<typename T>
-        struct is_before_handle_arity_3_impl
-        {
-            template<typename C>
-            static std::true_type f(typename check_before_handle_arity_3_const<T>::template get<C>*);
+            bool contains(const std::string& key)
+            {
+                auto h = hash(key);
+                std::lock_guard<std::mutex> l(mutex_);
+                slot* s = find(key, h);
+                if (!s) return false;
+                if (s->expires <= clock_time())
+                {
+                    erase(*s);
+                    return false;
+                }
+                return true;
+            }
 
-            template<typename C>
-            static std::true_type f(typename check_before_handle_arity_3<T>::template get<C>*);
+            void load(session::CachedSession& cn)
+            {
+                auto h = hash(cn.session_id);
+                record_header rh;
+                std::string body;
+                {
+                    std::lock_guard<std::mutex> l(mutex_);
+                    slot* s = find(cn.session_id, h);
+                    if (!s) return;
+                    body.resize(s->size - sizeof(rh));
+                    if (!log_.read(s->offset, &rh, sizeof(rh)) || !log_.read(s->offset + sizeof(rh), &body[0], body.size()))
+                        throw std::runtime_error("Could not read session record");
+                }
 
-            template<typename C>
-            static std::false_type f(...);
+                if (checksum(body) != rh.checksum)
+                {
+                    CROW_LOG_WARNING << "Session record of " << cn.session_id << " is corrupted";
+                    return;
+                }
 
-        public:
-            static const bool value = decltype(f<T>(nullptr))::value;
-        };
+                auto value = json::load(body.data() + rh.key_size, rh.value_size);
+                if (!value) return;
+                for (const auto& p : value)
+                    cn.entries[p.key()] = session::multi_value::from_json(p);
+            }
 
-        template<typename T>
-        struct is_after_handle_arity_3_impl
-        {
-            template<typename C>
-            static std::true_type f(typename check_after_handle_arity_3_const<T>::template get<C>*);
+            void save(session::CachedSession& cn)
+            {
+                // build the record before locking
+                std::string record;
+                if (!cn.dirty.empty())
+                {
+                    json::wvalue jw;
+                    for (const auto& p : cn.entries)
+                        jw[p.first] = p.second.json();
+                    auto value = jw.dump();
+
+                    record.resize(sizeof(record_header) + cn.session_id.size() + value.size());
+                    std::memcpy(&record[sizeof(record_header)], cn.session_id.data(), cn.session_id.size());
+                    std::memcpy(&record[sizeof(record_header) + cn.session_id.size()], value.data(), value.size());
+
+                    record_header rh{record_magic, 0, uint32_t(cn.session_id.size()), uint32_t(value.size()), 0};
+                    rh.checksum = checksum(std::string_view(record).substr(sizeof(record_header)));
+                    std::memcpy(&record[0], &rh, sizeof(rh));
+                }
 
-            template<typename C>
-            static std::true_type f(typename check_after_handle_arity_3<T>::template get<C>*);
+                auto h = hash(cn.session_id);
+                std::lock_guard<std::mutex> l(mutex_);
+                auto now = clock_time();
+                slot* s = find(cn.session_id, h);
+                if (s && s->expires <= now)
+                {
+                    erase(*s);
+                    s = nullptr;
+                }
 
-            template<typename C>
-            static std::false_type f(...);
+                uint64_t expires = (cn.requested_refresh || !s) ? now + expiration_seconds_ : s->expires;
+                if (record.empty())
+                {
+                    // only the expiration changed, which lives in the index alone
+                    if (s && s->expires != expires)
+                    {
+                        s->expires = expires;
+                        pending_ = true;
+                    }
+                    return;
+                }
 
-        public:
-            static constexpr bool value = decltype(f<T>(nullptr))::value;
-        };
+                std::memcpy(&record[offsetof(record_header, expires)], &expires, sizeof(expires));
+                if (!log_.write(log_end_, record.data(), record.size()))
+                    throw std::runtime_error("Could not append to session log " + log_path_);
 
-        template<typename MW>
-        struct is_middleware_global
-        {
-            template<typename C>
-            static std::false_type f(typename check_global_call_false<MW>::template get<C>*);
+                if (s)
+                    live_bytes_ -= s->size;
+                else
+                    s = &insert(h);
+                s->offset = log_end_;
+                s->size = uint32_t(record.size());
+                s->expires = expires;
+                live_bytes_ += record.size();
+                log_end_ += record.size();
+                header().log_end = log_end_;
+                pending_ = true;
+            }
 
-            template<typename C>
-            static std::true_type f(...);
+            /// Flush the log, then the index
+            void sync()
+            {
+                std::lock_guard<std::mutex> m(maintenance_mutex_);
+                {
+                    std::lock_guard<std::mutex> l(mutex_);
+                    if (!pending_) return;
+                    pending_ = false;
+                }
 
-            static const bool value = decltype(f<MW>(nullptr))::value;
-        };
+                if (!log_.sync()) CROW_LOG_ERROR << "Could not sync session log " << log_path_;
+                std::lock_guard<std::mutex> r(remap_mutex_);
+                if (!index_.flush()) CROW_LOG_ERROR << "Could not sync session index " << index_path_;
+            }
 
-        template<typename MW, typename Context, typename ParentContext>
-        typename std::enable_if<!is_before_handle_arity_3_impl<MW>::value>::type
-          before_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
-        {
-            mw.before_handle(req, res, ctx.template get<MW>(), ctx);
-        }
+            /// Rewrite the log with only the latest record of every live session.
+            ///
+            /// \details Records are copied without holding the lock. Whatever was appended meanwhile
+            /// is copied as-is under the lock right before the new log replaces the old one.
+            void compact()
+            {
+                std::lock_guard<std::mutex> m(maintenance_mutex_);
 
-        template<typename MW, typename Context, typename ParentContext>
-        typename std::enable_if<is_before_handle_arity_3_impl<MW>::value>::type
-          before_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
-        {
-            mw.before_handle(req, res, ctx.template get<MW>());
-        }
+                struct moved_record
+                {
+                    uint64_t from, to, expires;
+                    uint32_t size;
+                };
+                std::vector<moved_record> records;
+                uint64_t snapshot_end, next_generation;
+                {
+                    std::lock_guard<std::mutex> l(mutex_);
+                    auto now = clock_time();
+                    auto* s = slots();
+                    for (uint64_t i = 0; i < header().capacity; i++)
+                    {
+                        if (s[i].state != slot_used) continue;
+                        if (s[i].expires <= now)
+                            erase(s[i]);
+                        else
+                            records.push_back({s[i].offset, 0, s[i].expires, s[i].size});
+                    }
+                    snapshot_end = log_end_;
+                    next_generation = generation_ + 1;
+                }
 
-        template<typename MW, typename Context, typename ParentContext>
-        typename std::enable_if<!is_after_handle_arity_3_impl<MW>::value>::type
-          after_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
-        {
-            mw.after_handle(req, res, ctx.template get<MW>(), ctx);
-        }
+                std::sort(records.begin(), records.end(), [](const moved_record& a, const moved_record& b) {
+                    return a.from < b.from;
+                });
 
-        template<typename MW, typename Context, typename ParentContext>
-        typename std::enable_if<is_after_handle_arity_3_impl<MW>::value>::type
-          after_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
-        {
-            mw.after_handle(req, res, ctx.template get<MW>());
-        }
+                auto compact_path = log_path_ + ".compact";
+                positional_file out;
+                log_header lh{log_magic, next_generation};
+                if (!out.open(compact_path, true) || !out.write(0, &lh, sizeof(lh)))
+                    throw std::runtime_error("Could not create " + compact_path);
 
+                uint64_t end = sizeof(lh);
+                std::string buffer;
+                for (auto& r : records)
+                {
+                    buffer.resize(r.size);
+                    if (!log_.read(r.from, &buffer[0], r.size))
+                        throw std::runtime_error("Could not read session log " + log_path_);
+                    // refreshes only touched the index, bring the record up to date
+                    std::memcpy(&buffer[offsetof(record_header, expires)], &r.expires, sizeof(r.expires));
+                    if (!out.write(end, buffer.data(), buffer.size()))
+                        throw std::runtime_error("Could not write " + compact_path);
+                    r.to = end;
+                    end += r.size;
+                }
+                out.sync();
 
-        template<typename CallCriteria,
-                 int N, typename Context, typename Container>
-        typename std::enable_if<(N < std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
-          middleware_call_helper(const CallCriteria& cc, Container& middlewares, request& req, response& res, Context& ctx)
-        {
+                std::lock_guard<std::mutex> l(mutex_);
+                for (uint64_t offset = snapshot_end; offset < log_end_;)
+                {
+                    buffer.resize(std::min<uint64_t>(log_end_ - offset, 64 * 1024));
+                    if (!log_.read(offset, &buffer[0], buffer.size()) || !out.write(end + offset - snapshot_end, buffer.data(), buffer.size()))
+                        throw std::runtime_error("Could not write " + compact_path);
+                    offset += buffer.size();
+                }
+                out.sync();
+                out.close();
+
+                log_.close();
+                bool replaced = replace_file(compact_path, log_path_);
+                if (!log_.open(log_path_))
+                    throw std::runtime_error("Could not open session log " + log_path_);
+                if (!replaced)
+                    throw std::runtime_error("Could not replace session log " + log_path_);
+
+                std::unordered_map<uint64_t, uint64_t> relocated;
+                relocated.reserve(records.size());
+                for (const auto& r : records)
+                    relocated.emplace(r.from, r.to);
+
+                auto* s = slots();
+                for (uint64_t i = 0; i < header().capacity; i++)
+                {
+                    if (s[i].state != slot_used) continue;
+                    if (s[i].offset >= snapshot_end)
+                    {
+                        s[i].offset = s[i].offset - snapshot_end + end;
+                        continue;
+                    }
+                    auto it = relocated.find(s[i].offset);
+                    if (it != relocated.end())
+                        s[i].offset = it->second;
+                    else
+                        erase(s[i]);
+                }
 
-            using CurrentMW = typename std::tuple_element<N, typename std::remove_reference<Container>::type>::type;
+                log_end_ = end + (log_end_ - snapshot_end);
+                generation_ = next_generation;
+                header().generation = generation_;
+                header().log_end = log_end_;
+                pending_ = true;
 
-            if (!cc.template enabled<CurrentMW>(N))
-            {
-                return middleware_call_helper<CallCriteria, N + 1, Context, Container>(cc, middlewares, req, res, ctx);
+                CROW_LOG_INFO << "Compacted session log from " << snapshot_end << " to " << end << " bytes";
             }
 
-            using parent_context_t = typename Context::template partial<N - 1>;
-            before_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
-            if (res.is_completed())
+        private:
+            static constexpr uint64_t log_magic = 0x31474f4c53534343;   // "CCSSLOG1"
+            static constexpr uint64_t index_magic = 0x3158444953534343; // "CCSSIDX1"
+            static constexpr uint32_t record_magic = 0x52535343;        // "CSSR"
+
+            static constexpr uint64_t min_capacity = 1024;
+            static constexpr uint64_t sweep_batch = 4096;
+            static constexpr uint64_t compaction_min_bytes = 1024 * 1024;
+
+            struct log_header
             {
-                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
-                return true;
-            }
+                uint64_t magic;
+                uint64_t generation;
+            };
 
-            if (middleware_call_helper<CallCriteria, N + 1, Context, Container>(cc, middlewares, req, res, ctx))
+            struct record_header
             {
-                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
-                return true;
-            }
+                uint32_t magic;
+                uint32_t checksum; // of the id and the value
+                uint32_t key_size;
+                uint32_t value_size;
+                uint64_t expires;
+            };
 
-            return false;
-        }
+            struct index_header
+            {
+                uint64_t magic;
+                uint64_t generation;
+                uint64_t log_end;
+                uint64_t capacity;
+                uint64_t used;
+                uint64_t deleted;
+                uint64_t reserved[2];
+            };
 
-        template<typename CallCriteria, int N, typename Context, typename Container>
-        typename std::enable_if<(N >= std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
-          middleware_call_helper(const CallCriteria& /*cc*/, Container& /*middlewares*/, request& /*req*/, response& /*res*/, Context& /*ctx*/)
-        {
-            return false;
-        }
+            enum : uint32_t
+            {
+                slot_empty = 0,
+                slot_used,
+                slot_deleted
+            };
 
-        template<typename CallCriteria, int N, typename Context, typename Container>
-        typename std::enable_if<(N < 0)>::type
-          after_handlers_call_helper(const CallCriteria& /*cc*/, Container& /*middlewares*/, Context& /*context*/, request& /*req*/, response& /*res*/)
-        {
-        }
+            struct slot
+            {
+                uint64_t hash;
+                uint64_t offset;
+                uint64_t expires;
+                uint32_t size;
+                uint32_t state;
+            };
 
-        template<typename CallCriteria, int N, typename Context, typename Container>
-        typename std::enable_if<(N == 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res)
-        {
-            using parent_context_t = typename Context::template partial<N - 1>;
-            using CurrentMW = typename std::tuple_element<N, typename std::remove_reference<Container>::type>::type;
-            if (cc.template enabled<CurrentMW>(N))
+            static uint64_t hash(std::string_view key)
             {
-                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+                uint64_t h = 14695981039346656037ull;
+                for (unsigned char c : key)
+                    h = (h ^ c) * 1099511628211ull;
+                return h;
             }
-        }
 
-        template<typename CallCriteria, int N, typename Context, typename Container>
-        typename std::enable_if<(N > 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res)
-        {
-            using parent_context_t = typename Context::template partial<N - 1>;
-            using CurrentMW = typename std::tuple_element<N, typename std::remove_reference<Container>::type>::type;
-            if (cc.template enabled<CurrentMW>(N))
+            static uint32_t checksum(std::string_view data)
             {
-                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+                uint32_t h = 2166136261u;
+                for (unsigned char c : data)
+                    h = (h ^ c) * 16777619u;
+                return h;
             }
-            after_handlers_call_helper<CallCriteria, N - 1, Context, Container>(cc, middlewares, ctx, req, res);
-        }
 
-        // A CallCriteria that accepts only global middleware
-        struct middleware_call_criteria_only_global
-        {
-            template<typename MW>
-            constexpr bool enabled(int) const
+            static uint64_t clock_time()
             {
-                return is_middleware_global<MW>::value;
+                // wall clock, the log outlives the process
+                return std::chrono::duration_cast<std::chrono::seconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                  .count();
             }
-        };
-
-        template<typename F, typename... Args>
-        typename std::enable_if<black_magic::CallHelper<F, black_magic::S<Args...>>::value, void>::type
-          wrapped_handler_call(crow::request& /*req*/, crow::response& res, const F& f, Args&&... args)
-        {
-            static_assert(!std::is_same<void, decltype(f(std::declval<Args>()...))>::value,
-                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
 
-            res = crow::response(f(std::forward<Args>(args)...));
-            res.end();
-        }
+            static uint64_t capacity_for(uint64_t sessions)
+            {
+                uint64_t capacity = min_capacity;
+                while (capacity < sessions * 2)
+                    capacity *= 2;
+                return capacity;
+            }
 
-        template<typename F, typename... Args>
-        typename std::enable_if<
-          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
-            black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value,
-          void>::type
-          wrapped_handler_call(crow::request& req, crow::response& res, const F& f, Args&&... args)
-        {
-            static_assert(!std::is_same<void, decltype(f(std::declval<crow::request>(), std::declval<Args>()...))>::value,
-                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
+            index_header& header() { return *reinterpret_cast<index_header*>(index_.data()); }
 
-            res = crow::response(f(req, std::forward<Args>(args)...));
-            res.end();
-        }
+            slot* slots() { return reinterpret_cast<slot*>(index_.data() + sizeof(index_header)); }
 
-        template<typename F, typename... Args>
-        typename std::enable_if<
-          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
-            !black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value &&
-            black_magic::CallHelper<F, black_magic::S<crow::response&, Args...>>::value,
-          void>::type
-          wrapped_handler_call(crow::request& /*req*/, crow::response& res, const F& f, Args&&... args)
-        {
-            static_assert(std::is_same<void, decltype(f(std::declval<crow::response&>(), std::declval<Args>()...))>::value,
-                          "Handler function with response argument should have void return type");
+            void open()
+            {
+                log_header lh{};
+                if (!log_.open(log_path_))
+                    throw std::runtime_error("Could not open session log " + log_path_);
+                if (log_.size() < sizeof(lh) || !log_.read(0, &lh, sizeof(lh)) || lh.magic != log_magic)
+                {
+                    lh = {log_magic, 1};
+                    if (!log_.truncate(0) || !log_.write(0, &lh, sizeof(lh)))
+                        throw std::runtime_error("Could not initialize session log " + log_path_);
+                }
+                generation_ = lh.generation;
+                log_end_ = log_.size();
 
-            f(res, std::forward<Args>(args)...);
-        }
+                if (!map_index()) rebuild_index();
+                // drop anything past the last record the index knows of
+                log_.truncate(log_end_);
+            }
 
-        template<typename F, typename... Args>
-        typename std::enable_if<
-          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
-            !black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value &&
-            !black_magic::CallHelper<F, black_magic::S<crow::response&, Args...>>::value &&
-            black_magic::CallHelper<F, black_magic::S<const crow::request&, crow::response&, Args...>>::value,
-          void>::type
-          wrapped_handler_call(crow::request& req, crow::response& res, const F& f, Args&&... args)
-        {
-            static_assert(std::is_same<void, decltype(f(std::declval<crow::request&>(), std::declval<crow::response&>(), std::declval<Args>()...))>::value,
-                          "Handler function with response argument should have void return type");
+            /// Map an existing index, if it describes the current log
+            bool map_index()
+            {
+                if (!index_.map(index_path_, 0) || index_.size() < sizeof(index_header)) return false;
 
-            f(req, res, std::forward<Args>(args)...);
-        }
+                auto& h = header();
+                if (h.magic != index_magic || h.generation != generation_ || h.log_end > log_end_ ||
+                    h.capacity < min_capacity || (h.capacity & (h.capacity - 1)) ||
+                    index_.size() < sizeof(index_header) + h.capacity * sizeof(slot))
+                    return false;
 
-        // wrapped_handler_call transparently wraps a handler call behind (req, res, args...)
-        template<typename F, typename... Args>
-        typename std::enable_if<
-          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
-            !black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value &&
-            !black_magic::CallHelper<F, black_magic::S<crow::response&, Args...>>::value &&
-            !black_magic::CallHelper<F, black_magic::S<const crow::request&, crow::response&, Args...>>::value,
-          void>::type
-          wrapped_handler_call(crow::request& req, crow::response& res, const F& f, Args&&... args)
-        {
-            static_assert(std::is_same<void, decltype(f(std::declval<crow::request&>(), std::declval<crow::response&>(), std::declval<Args>()...))>::value,
-                          "Handler function with response argument should have void return type");
+                log_end_ = h.log_end;
+                live_bytes_ = 0;
+                auto* s = slots();
+                for (uint64_t i = 0; i < h.capacity; i++)
+                {
+                    if (s[i].state != slot_used) continue;
+                    if (s[i].offset + s[i].size > log_end_) return false;
+                    live_bytes_ += s[i].size;
+                }
+                return true;
+            }
 
-            f(req, res, std::forward<Args>(args)...);
-        }
+            /// Recover the index by scanning the log, stopping at the first damaged record
+            void rebuild_index()
+            {
+                std::unordered_map<std::string, slot> latest;
+                uint64_t offset = sizeof(log_header);
+                record_header rh;
+                std::string body;
+                while (offset + sizeof(rh) <= log_end_ && log_.read(offset, &rh, sizeof(rh)) && rh.magic == record_magic)
+                {
+                    uint64_t size = sizeof(rh) + uint64_t(rh.key_size) + rh.value_size;
+                    if (offset + size > log_end_) break;
+                    body.resize(size - sizeof(rh));
+                    if (!log_.read(offset + sizeof(rh), &body[0], body.size()) || checksum(body) != rh.checksum) break;
+
+                    auto key = body.substr(0, rh.key_size);
+                    latest[key] = slot{hash(key), offset, rh.expires, uint32_t(size), slot_used};
+                    offset += size;
+                }
+                log_end_ = offset;
 
-        template<bool Reversed>
-        struct middleware_call_criteria_dynamic
-        {};
+                std::vector<slot> live;
+                auto now = clock_time();
+                for (const auto& p : latest)
+                    if (p.second.expires > now) live.push_back(p.second);
+                build_index(live, capacity_for(live.size()));
 
-        template<>
-        struct middleware_call_criteria_dynamic<false>
-        {
-            middleware_call_criteria_dynamic(const std::vector<int>& indices_):
-              indices(indices_), slider(0) {}
+                CROW_LOG_INFO << "Rebuilt session index from " << log_path_ << " (" << live.size() << " sessions)";
+            }
 
-            template<typename>
-            bool enabled(int mw_index) const
+            /// Write a fresh index next to the current one and swap it in
+            void build_index(const std::vector<slot>& entries, uint64_t capacity)
             {
-                if (slider < int(indices.size()) && indices[slider] == mw_index)
+                auto tmp_path = index_path_ + ".tmp";
+                std::remove(tmp_path.c_str());
+
+                mapped_file tmp;
+                if (!tmp.map(tmp_path, sizeof(index_header) + capacity * sizeof(slot)))
+                    throw std::runtime_error("Could not create session index " + tmp_path);
+                std::memset(tmp.data(), 0, tmp.size());
+
+                auto* h = reinterpret_cast<index_header*>(tmp.data());
+                auto* s = reinterpret_cast<slot*>(tmp.data() + sizeof(index_header));
+                h->magic = index_magic;
+                h->generation = generation_;
+                h->log_end = log_end_;
+                h->capacity = capacity;
+                h->used = entries.size();
+
+                live_bytes_ = 0;
+                for (const auto& e : entries)
                 {
-                    slider++;
-                    return true;
+                    uint64_t i = e.hash & (capacity - 1);
+                    while (s[i].state != slot_empty)
+                        i = (i + 1) & (capacity - 1);
+                    s[i] = e;
+                    live_bytes_ += e.size;
                 }
-                return false;
+                tmp.flush();
+                tmp.unmap();
+
+                std::lock_guard<std::mutex> r(remap_mutex_);
+                index_.unmap();
+                bool replaced = replace_file(tmp_path, index_path_);
+                if (!index_.map(index_path_, 0))
+                    throw std::runtime_error("Could not map session index " + index_path_);
+                if (!replaced)
+                    throw std::runtime_error("Could not replace session index " + index_path_);
             }
 
-        private:
-            const std::vector<int>& indices;
-            mutable int slider;
-        };
+            bool key_matches(const slot& s, std::string_view key)
+            {
+                char buffer[sizeof(record_header) + 64];
+                std::string large;
+                char* data = buffer;
+                if (key.size() > 64)
+                {
+                    large.resize(sizeof(record_header) + key.size());
+                    data = &large[0];
+                }
+                if (!log_.read(s.offset, data, sizeof(record_header) + key.size())) return false;
 
-        template<>
-        struct middleware_call_criteria_dynamic<true>
-        {
-            middleware_call_criteria_dynamic(const std::vector<int>& indices_):
-              indices(indices_), slider(int(indices_.size()) - 1) {}
+                record_header rh;
+                std::memcpy(&rh, data, sizeof(rh));
+                return rh.key_size == key.size() && std::memcmp(data + sizeof(rh), key.data(), key.size()) == 0;
+            }
 
-            template<typename>
-            bool enabled(int mw_index) const
+            slot* find(std::string_view key, uint64_t h)
             {
-                if (slider >= 0 && indices[slider] == mw_index)
+                auto mask = header().capacity - 1;
+                auto* s = slots();
+                for (uint64_t i = h & mask;; i = (i + 1) & mask)
                 {
-                    slider--;
-                    return true;
+                    if (s[i].state == slot_empty) return nullptr;
+                    if (s[i].state == slot_used && s[i].hash == h && key_matches(s[i], key)) return &s[i];
                 }
-                return false;
-            }
-
-        private:
-            const std::vector<int>& indices;
-            mutable int slider;
-        };
-
-    } // namespace detail
-} // namespace crow
-
-
-#include <cstdint>
-#include <utility>
-#include <tuple>
-#include <unordered_map>
-#include <memory>
-#include <vector>
-#include <algorithm>
-#include <type_traits>
-
-
-namespace crow // NOTE: Already documented in "crow/app.h"
-{
-
-    constexpr const uint16_t INVALID_BP_ID{((uint16_t)-1)};
-
-    namespace detail
-    {
-        /// Typesafe wrapper for storing lists of middleware as their indices in the App
-        struct middleware_indices
-        {
-            template<typename App>
-            void push()
-            {}
-
-            template<typename App, typename MW, typename... Middlewares>
-            void push()
-            {
-                using MwContainer = typename App::mw_container_t;
-                static_assert(black_magic::has_type<MW, MwContainer>::value, "Middleware must be present in app");
-                static_assert(std::is_base_of<crow::ILocalMiddleware, MW>::value, "Middleware must extend ILocalMiddleware");
-                int idx = black_magic::tuple_index<MW, MwContainer>::value;
-                indices_.push_back(idx);
-                push<App, Middlewares...>();
             }
 
-            void merge_front(const detail::middleware_indices& other)
+            /// Claim a slot for a hash that isn't present yet
+            slot& insert(uint64_t h)
             {
-                indices_.insert(indices_.begin(), other.indices_.cbegin(), other.indices_.cend());
-            }
+                auto& hd = header();
+                if ((hd.used + hd.deleted + 1) * 10 > hd.capacity * 7)
+                {
+                    std::vector<slot> entries;
+                    entries.reserve(hd.used);
+                    for (uint64_t i = 0; i < hd.capacity; i++)
+                        if (slots()[i].state == slot_used) entries.push_back(slots()[i]);
+                    build_index(entries, capacity_for(entries.size() + 1));
+                }
 
-            void merge_back(const detail::middleware_indices& other)
-            {
-                indices_.insert(indices_.end(), other.indices_.cbegin(), other.indices_.cend());
+                auto& current = header();
+                auto mask = current.capacity - 1;
+                auto* s = slots();
+                uint64_t i = h & mask;
+                while (s[i].state == slot_used)
+                    i = (i + 1) & mask;
+                if (s[i].state == slot_deleted) current.deleted--;
+                current.used++;
+                s[i].hash = h;
+                s[i].state = slot_used;
+                return s[i];
             }
 
-            void pop_back(const detail::middleware_indices& other)
+            void erase(slot& s)
             {
-                indices_.resize(indices_.size() - other.indices_.size());
+                s.state = slot_deleted;
+                header().used--;
+                header().deleted++;
+                live_bytes_ -= s.size;
+                pending_ = true;
             }
 
-            bool empty() const
+            /// Evict a batch of expired sessions, resuming where the last sweep ended
+            void sweep_expired()
             {
-                return indices_.empty();
+                auto now = clock_time();
+                auto capacity = header().capacity;
+                for (uint64_t n = 0; n < sweep_batch && n < capacity; n++)
+                {
+                    slot& s = slots()[sweep_cursor_++ & (capacity - 1)];
+                    if (s.state == slot_used && s.expires <= now) erase(s);
+                }
             }
 
-            // Sorts indices and filters out duplicates to allow fast lookups with traversal
-            void pack()
+            void run()
             {
-                std::sort(indices_.begin(), indices_.end());
-                indices_.erase(std::unique(indices_.begin(), indices_.end()), indices_.end());
-            }
+                while (true)
+                {
+                    bool should_compact;
+                    {
+                        std::unique_lock<std::mutex> l(mutex_);
+                        if (cv_.wait_for(l, sync_interval_, [this] {
+                                return stopping_;
+                            }))
+                            return;
+                        sweep_expired();
+                        should_compact = log_end_ > compaction_min_bytes && log_end_ - sizeof(log_header) > 2 * live_bytes_;
+                    }
 
-            const std::vector<int>& indices()
-            {
-                return indices_;
+                    try
+                    {
+                        sync();
+                        if (should_compact)
+                        {
+                            compact();
+                            sync();
+                        }
+                    }
+                    catch (const std::exception& e)
+                    {
+                        CROW_LOG_ERROR << "Session log maintenance failed: " << e.what();
+                    }
+                }
             }
 
-        private:
-            std::vector<int> indices_;
+            std::string log_path_;
+            std::string index_path_;
+            uint64_t expiration_seconds_;
+            std::chrono::milliseconds sync_interval_;
+
+            positional_file log_;
+            mapped_file index_;
+            uint64_t generation_ = 0;
+            uint64_t log_end_ = 0;
+            uint64_t live_bytes_ = 0;
+            uint64_t sweep_cursor_ = 0;
+            bool pending_ = false;
+            bool stopping_ = false;
+
+            std::mutex mutex_;
+            std::mutex maintenance_mutex_;
+            std::mutex remap_mutex_;
+            std::condition_variable cv_;
+            std::thread worker_;
         };
     } // namespace detail
 
-    /// A base class for all rules.
-
+    /// LogStore keeps all sessions in an append-only log with a memory mapped hash index.
     ///
-    /// Used to provide a common interface for code dealing with different types of rules.<br>
-    /// A Rule provides a URL, allowed HTTP methods, and handlers.
-    class BaseRule
+    /// \details Saves append a record and point the index at it, refreshes only touch the index.
+    /// A background thread syncs both files every `sync_interval`, evicts expired sessions
+    /// and rewrites the log once less than half of it is still in use.
+    /// On startup only the index is mapped, the log is scanned only if they don't match.
+    struct LogStore
     {
-    public:
-        BaseRule(std::string rule):
-          rule_(std::move(rule))
-        {}
+        static constexpr bool thread_safe = true;
 
-        virtual ~BaseRule()
+        LogStore(const std::string& folder,
+                 uint64_t expiration_seconds = /*month*/ 30 * 24 * 60 * 60,
+                 std::chrono::milliseconds sync_interval = std::chrono::seconds(1)):
+          store_(new detail::log_store(folder, expiration_seconds, sync_interval))
         {}
 
-        virtual void validate() = 0;
-
-        void set_added()
+        void load(session::CachedSession& cn)
         {
-            added_ = true;
+            store_->load(cn);
         }
 
-        bool is_added()
+        void save(session::CachedSession& cn)
         {
-            return added_;
+            store_->save(cn);
         }
 
-        std::unique_ptr<BaseRule> upgrade()
+        bool contains(const std::string& key)
         {
-            if (rule_to_upgrade_)
-                return std::move(rule_to_upgrade_);
-            return {};
+            return store_->contains(key);
         }
 
-        virtual void handle(request&, response&, const routing_params&) = 0;
-        virtual void handle_upgrade(const request&, response& res, SocketAdaptor&&)
+        /// Write everything saved so far to the disk
+        void sync()
         {
-            res = response(404);
-            res.end();
-        }
-#ifdef CROW_ENABLE_SSL
-        virtual void handle_upgrade(const request&, response& res, SSLAdaptor&&)
-        {
-            res = response(404);
-            res.end();
+            store_->sync();
         }
-#endif
 
-        uint32_t get_methods()
+        /// Drop overwritten and expired records from the log
+        void compact()
         {
-            return methods_;
+            store_->compact();
         }
 
-        template<typename F>
-        void foreach_method(F f)
+    private:
+        std::unique_ptr<detail::log_store> store_;
+    };
+
+} // namespace crow
+
+
+
+namespace crow
+{
+    namespace detail
+    {
+
+
+        template<typename... Middlewares>
+        struct partial_context : public black_magic::pop_back<Middlewares...>::template rebind<partial_context>, public black_magic::last_element_type<Middlewares...>::type::context
         {
-            for (uint32_t method = 0, method_bit = 1; method < static_cast<uint32_t>(HTTPMethod::InternalMethodCount); method++, method_bit <<= 1)
+            using parent_context = typename black_magic::pop_back<Middlewares...>::template rebind<::crow::detail::partial_context>;
+            template<int N>
+            using partial = typename std::conditional<N == sizeof...(Middlewares) - 1, partial_context, typename parent_context::template partial<N>>::type;
+
+            template<typename T>
+            typename T::context& get()
             {
-                if (methods_ & method_bit)
-                    f(method);
+                return static_cast<typename T::context&>(*this);
             }
-        }
+        };
 
-        std::string custom_templates_base;
 
-        const std::string& rule() { return rule_; }
 
-    protected:
-        uint32_t methods_{1 << static_cast<int>(HTTPMethod::Get)};
+        template<>
+        struct partial_context<>
+        {
+            template<int>
+            using partial = partial_context;
+        };
 
-        std::string rule_;
-        std::string name_;
-        bool added_{false};
 
-        std::unique_ptr<BaseRule> rule_to_upgrade_;
+        template<typename... Middlewares>
+        struct context : private partial_context<Middlewares...>
+        //struct context : private Middlewares::context... // simple but less type-safe
+        {
+            template<typename CallCriteria, int N, typename Context, typename Container>
+            friend typename std::enable_if<(N == 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res);
+            template<typename CallCriteria, int N, typename Context, typename Container>
+            friend typename std::enable_if<(N > 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res);
 
-        detail::middleware_indices mw_indices_;
+            template<typename CallCriteria, int N, typename Context, typename Container>
+            friend typename std::enable_if<(N < std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
+              middleware_call_helper(const CallCriteria& cc, Container& middlewares, request& req, response& res, Context& ctx);
 
-        friend class Router;
-        friend class Blueprint;
-        template<typename T>
-        friend struct RuleParameterTraits;
-    };
+            template<typename T>
+            typename T::context& get()
+            {
+                return static_cast<typename T::context&>(*this);
+            }
+
+            template<int N>
+            using partial = typename partial_context<Middlewares...>::template partial<N>;
+        };
+    } // namespace detail
+} // namespace crow
+
+
+
+#include <tuple>
+#include <type_traits>
+#include <iostream>
+#include <utility>
+
+namespace crow // NOTE: Already documented in "crow/app.h"
+{
 
+    /// Local middleware should extend ILocalMiddleware
+    struct ILocalMiddleware
+    {
+        using call_global = std::false_type;
+    };
 
     namespace detail
     {
-        namespace routing_handler_call_helper
+        template<typename MW>
+        struct check_before_handle_arity_3_const
         {
-            template<typename T, int Pos>
-            struct call_pair
-            {
-                using type = T;
-                static const int pos = Pos;
-            };
-
-            template<typename H1>
-            struct call_params
-            {
-                H1& handler;
-                const routing_params& params;
-                request& req;
-                response& res;
-            };
+            template<typename T, void (T::*)(request&, response&, typename MW::context&) const = &T::before_handle>
+            struct get
+            {};
+        };
 
-            template<typename F, int NInt, int NUint, int NDouble, int NString, typename S1, typename S2>
-            struct call
+        template<typename MW>
+        struct check_before_handle_arity_3
+        {
+            template<typename T, void (T::*)(request&, response&, typename MW::context&) = &T::before_handle>
+            struct get
             {};
+        };
 
-            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
-            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<int64_t, Args1...>, black_magic::S<Args2...>>
-            {
-                void operator()(F cparams)
-                {
-                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<int64_t, NInt>>;
-                    call<F, NInt + 1, NUint, NDouble, NString, black_magic::S<Args1...>, pushed>()(cparams);
-                }
-            };
+        template<typename MW>
+        struct check_after_handle_arity_3_const
+        {
+            template<typename T, void (T::*)(request&, response&, typename MW::context&) const = &T::after_handle>
+            struct get
+            {};
+        };
 
-            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
+        template<typename MW>
+        struct check_after_handle_arity_3
+        {
+            template<typename T, void (T::*)(request&, response&, typename MW::context&) = &T::after_handle>
+            struct get
+            {};
+        };
+
+        template<typename MW>
+        struct check_global_call_false
+        {
+            template<typename T, typename std::enable_if<T::call_global::value == false, bool>::type = true>
+            struct get
+            {};
+        };
+
+        template<typename T>
+        struct is_before_handle_arity_3_impl
+        {
+            template<typename C>
+            static std::true_type f(typename check_before_handle_arity_3_const<T>::template get<C>*);
+
+            template<typename C>
+            static std::true_type f(typename check_before_handle_arity_3<T>::template get<C>*);
+
+            template<typename C>
+            static std::false_type f(...);
+
+        public:
+            static const bool value = decltype(f<T>(nullptr))::value;
+        };
+
+        template<typename T>
+        struct is_after_handle_arity_3_impl
+        {
+            template<typename C>
+            static std::true_type f(typename check_after_handle_arity_3_const<T>::template get<C>*);
+
+            template<typename C>
+            static std::true_type f(typename check_after_handle_arity_3<T>::template get<C>*);
+
+            template<typename C>
+            static std::false_type f(...);
+
+        public:
+            static constexpr bool value = decltype(f<T>(nullptr))::value;
+        };
+
+        template<typename MW>
+        struct is_middleware_global
+        {
+            template<typename C>
+            static std::false_type f(typename check_global_call_false<MW>::template get<C>*);
+
+            template<typename C>
+            static std::true_type f(...);
+
+            static const bool value = decltype(f<MW>(nullptr))::value;
+        };
+
+        template<typename MW, typename Context, typename ParentContext>
+        typename std::enable_if<!is_before_handle_arity_3_impl<MW>::value>::type
+          before_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
+        {
+            mw.before_handle(req, res, ctx.template get<MW>(), ctx);
+        }
+
+        template<typename MW, typename Context, typename ParentContext>
+        typename std::enable_if<is_before_handle_arity_3_impl<MW>::value>::type
+          before_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
+        {
+            mw.before_handle(req, res, ctx.template get<MW>());
+        }
+
+        template<typename MW, typename Context, typename ParentContext>
+        typename std::enable_if<!is_after_handle_arity_3_impl<MW>::value>::type
+          after_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
+        {
+            mw.after_handle(req, res, ctx.template get<MW>(), ctx);
+        }
+
+        template<typename MW, typename Context, typename ParentContext>
+        typename std::enable_if<is_after_handle_arity_3_impl<MW>::value>::type
+          after_handler_call(MW& mw, request& req, response& res, Context& ctx, ParentContext& /*parent_ctx*/)
+        {
+            mw.after_handle(req, res, ctx.template get<MW>());
+        }
+
+
+        template<typename CallCriteria,
+                 int N, typename Context, typename Container>
+        typename std::enable_if<(N < std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
+          middleware_call_helper(const CallCriteria& cc, Container& middlewares, request& req, response& res, Context& ctx)
+        {
+
+            using CurrentMW = typename std::tuple_element<N, typename std::remove_reference<Container>::type>::type;
+
+            if (!cc.template enabled<CurrentMW>(N))
+            {
+                return middleware_call_helper<CallCriteria, N + 1, Context, Container>(cc, middlewares, req, res, ctx);
+            }
+
+            using parent_context_t = typename Context::template partial<N - 1>;
+            before_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+            if (res.is_completed())
+            {
+                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+                return true;
+            }
+
+            if (middleware_call_helper<CallCriteria, N + 1, Context, Container>(cc, middlewares, req, res, ctx))
+            {
+                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+                return true;
+            }
+
+            return false;
+        }
+
+        template<typename CallCriteria, int N, typename Context, typename Container>
+        typename std::enable_if<(N >= std::tuple_size<typename std::remove_reference<Container>::type>::value), bool>::type
+          middleware_call_helper(const CallCriteria& /*cc*/, Container& /*middlewares*/, request& /*req*/, response& /*res*/, Context& /*ctx*/)
+        {
+            return false;
+        }
+
+        template<typename CallCriteria, int N, typename Context, typename Container>
+        typename std::enable_if<(N < 0)>::type
+          after_handlers_call_helper(const CallCriteria& /*cc*/, Container& /*middlewares*/, Context& /*context*/, request& /*req*/, response& /*res*/)
+        {
+        }
+
+        template<typename CallCriteria, int N, typename Context, typename Container>
+        typename std::enable_if<(N == 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res)
+        {
+            using parent_context_t = typename Context::template partial<N - 1>;
+            using CurrentMW = typename std::tuple_element<N, typename std::remove_reference<Container>::type>::type;
+            if (cc.template enabled<CurrentMW>(N))
+            {
+                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+            }
+        }
+
+        template<typename CallCriteria, int N, typename Context, typename Container>
+        typename std::enable_if<(N > 0)>::type after_handlers_call_helper(const CallCriteria& cc, Container& middlewares, Context& ctx, request& req, response& res)
+        {
+            using parent_context_t = typename Context::template partial<N - 1>;
+            using CurrentMW = typename std::tuple_element<N, typename std::remove_reference<Container>::type>::type;
+            if (cc.template enabled<CurrentMW>(N))
+            {
+                after_handler_call<CurrentMW, Context, parent_context_t>(std::get<N>(middlewares), req, res, ctx, static_cast<parent_context_t&>(ctx));
+            }
+            after_handlers_call_helper<CallCriteria, N - 1, Context, Container>(cc, middlewares, ctx, req, res);
+        }
+
+        // A CallCriteria that accepts only global middleware
+        struct middleware_call_criteria_only_global
+        {
+            template<typename MW>
+            constexpr bool enabled(int) const
+            {
+                return is_middleware_global<MW>::value;
+            }
+        };
+
+        template<typename F, typename... Args>
+        typename std::enable_if<black_magic::CallHelper<F, black_magic::S<Args...>>::value, void>::type
+          wrapped_handler_call(crow::request& /*req*/, crow::response& res, const F& f, Args&&... args)
+        {
+            static_assert(!std::is_same<void, decltype(f(std::declval<Args>()...))>::value,
+                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
+
+            res = crow::response(f(std::forward<Args>(args)...));
+            res.end();
+        }
+
+        template<typename F, typename... Args>
+        typename std::enable_if<
+          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
+            black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value,
+          void>::type
+          wrapped_handler_call(crow::request& req, crow::response& res, const F& f, Args&&... args)
+        {
+            static_assert(!std::is_same<void, decltype(f(std::declval<crow::request>(), std::declval<Args>()...))>::value,
+                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
+
+            res = crow::response(f(req, std::forward<Args>(args)...));
+            res.end();
+        }
+
+        template<typename F, typename... Args>
+        typename std::enable_if<
+          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
+            !black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value &&
+            black_magic::CallHelper<F, black_magic::S<crow::response&, Args...>>::value,
+          void>::type
+          wrapped_handler_call(crow::request& /*req*/, crow::response& res, const F& f, Args&&... args)
+        {
+            static_assert(std::is_same<void, decltype(f(std::declval<crow::response&>(), std::declval<Args>()...))>::value,
+                          "Handler function with response argument should have void return type");
+
+            f(res, std::forward<Args>(args)...);
+        }
+
+        template<typename F, typename... Args>
+        typename std::enable_if<
+          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
+            !black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value &&
+            !black_magic::CallHelper<F, black_magic::S<crow::response&, Args...>>::value &&
+            black_magic::CallHelper<F, black_magic::S<const crow::request&, crow::response&, Args...>>::value,
+          void>::type
+          wrapped_handler_call(crow::request& req, crow::response& res, const F& f, Args&&... args)
+        {
+            static_assert(std::is_same<void, decltype(f(std::declval<crow::request&>(), std::declval<crow::response&>(), std::declval<Args>()...))>::value,
+                          "Handler function with response argument should have void return type");
+
+            f(req, res, std::forward<Args>(args)...);
+        }
+
+        // wrapped_handler_call transparently wraps a handler call behind (req, res, args...)
+        template<typename F, typename... Args>
+        typename std::enable_if<
+          !black_magic::CallHelper<F, black_magic::S<Args...>>::value &&
+            !black_magic::CallHelper<F, black_magic::S<crow::request&, Args...>>::value &&
+            !black_magic::CallHelper<F, black_magic::S<crow::response&, Args...>>::value &&
+            !black_magic::CallHelper<F, black_magic::S<const crow::request&, crow::response&, Args...>>::value,
+          void>::type
+          wrapped_handler_call(crow::request& req, crow::response& res, const F& f, Args&&... args)
+        {
+            static_assert(std::is_same<void, decltype(f(std::declval<crow::request&>(), std::declval<crow::response&>(), std::declval<Args>()...))>::value,
+                          "Handler function with response argument should have void return type");
+
+            f(req, res, std::forward<Args>(args)...);
+        }
+
+        template<bool Reversed>
+        struct middleware_call_criteria_dynamic
+        {};
+
+        template<>
+        struct middleware_call_criteria_dynamic<false>
+        {
+            middleware_call_criteria_dynamic(const std::vector<int>& indices_):
+              indices(indices_), slider(0) {}
+
+            template<typename>
+            bool enabled(int mw_index) const
+            {
+                if (slider < int(indices.size()) && indices[slider] == mw_index)
+                {
+                    slider++;
+                    return true;
+                }
+                return false;
+            }
+
+        private:
+            const std::vector<int>& indices;
+            mutable int slider;
+        };
+
+        template<>
+        struct middleware_call_criteria_dynamic<true>
+        {
+            middleware_call_criteria_dynamic(const std::vector<int>& indices_):
+              indices(indices_), slider(int(indices_.size()) - 1) {}
+
+            template<typename>
+            bool enabled(int mw_index) const
+            {
+                if (slider >= 0 && indices[slider] == mw_index)
+                {
+                    slider--;
+                    return true;
+                }
+                return false;
+            }
+
+        private:
+            const std::vector<int>& indices;
+            mutable int slider;
+        };
+
+    } // namespace detail
+} // namespace crow
+
+
+#include <cstdint>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <charconv>
+#include <string_view>
+#include <utility>
+#include <tuple>
+#include <unordered_map>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+
+namespace crow // NOTE: Already documented in "crow/app.h"
+{
+
+    constexpr const uint16_t INVALID_BP_ID{((uint16_t)-1)};
+
+    namespace detail
+    {
+        /// Typesafe wrapper for storing lists of middleware as their indices in the App
+        struct middleware_indices
+        {
+            template<typename App>
+            void push()
+            {}
+
+            template<typename App, typename MW, typename... Middlewares>
+            void push()
+            {
+                using MwContainer = typename App::mw_container_t;
+                static_assert(black_magic::has_type<MW, MwContainer>::value, "Middleware must be present in app");
+                static_assert(std::is_base_of<crow::ILocalMiddleware, MW>::value, "Middleware must extend ILocalMiddleware");
+                int idx = black_magic::tuple_index<MW, MwContainer>::value;
+                indices_.push_back(idx);
+                push<App, Middlewares...>();
+            }
+
+            void merge_front(const detail::middleware_indices& other)
+            {
+                indices_.insert(indices_.begin(), other.indices_.cbegin(), other.indices_.cend());
+            }
+
+            void merge_back(const detail::middleware_indices& other)
+            {
+                indices_.insert(indices_.end(), other.indices_.cbegin(), other.indices_.cend());
+            }
+
+            void pop_back(const detail::middleware_indices& other)
+            {
+                indices_.resize(indices_.size() - other.indices_.size());
+            }
+
+            bool empty() const
+            {
+                return indices_.empty();
+            }
+
+            // Sorts indices and filters out duplicates to allow fast lookups with traversal
+            void pack()
+            {
+                std::sort(indices_.begin(), indices_.end());
+                indices_.erase(std::unique(indices_.begin(), indices_.end()), indices_.end());
+            }
+
+            const std::vector<int>& indices()
+            {
+                return indices_;
+            }
+
+        private:
+            std::vector<int> indices_;
+        };
+    } // namespace detail
+
+    /// A base class for all rules.
+
+    ///
+    /// Used to provide a common interface for code dealing with different types of rules.<br>
+    /// A Rule provides a URL, allowed HTTP methods, and handlers.
+    class BaseRule
+    {
+    public:
+        BaseRule(std::string rule):
+          rule_(std::move(rule))
+        {}
+
+        virtual ~BaseRule()
+        {}
+
+        virtual void validate() = 0;
+
+        void set_added()
+        {
+            added_ = true;
+        }
+
+        bool is_added()
+        {
+            return added_;
+        }
+
+        std::unique_ptr<BaseRule> upgrade()
+        {
+            if (rule_to_upgrade_)
+                return std::move(rule_to_upgrade_);
+            return {};
+        }
+
+        virtual void handle(request&, response&, const routing_params&) = 0;
+        virtual void handle_upgrade(const request&, response& res, SocketAdaptor&&)
+        {
+            res = response(404);
+            res.end();
+        }
+#ifdef CROW_ENABLE_SSL
+        virtual void handle_upgrade(const request&, response& res, SSLAdaptor&&)
+        {
+            res = response(404);
+            res.end();
+        }
+#endif
+
+        uint32_t get_methods()
+        {
+            return methods_;
+        }
+
+        template<typename F>
+        void foreach_method(F f)
+        {
+            for (uint32_t method = 0, method_bit = 1; method < static_cast<uint32_t>(HTTPMethod::InternalMethodCount); method++, method_bit <<= 1)
+            {
+                if (methods_ & method_bit)
+                    f(method);
+            }
+        }
+
+        std::string custom_templates_base;
+
+        const std::string& rule() { return rule_; }
+
+    protected:
+        uint32_t methods_{1 << static_cast<int>(HTTPMethod::Get)};
+
+        std::string rule_;
+        std::string name_;
+        bool added_{false};
+
+        std::unique_ptr<BaseRule> rule_to_upgrade_;
+
+        detail::middleware_indices mw_indices_;
+
+        friend class Router;
+        friend class Blueprint;
+        template<typename T>
+        friend struct RuleParameterTraits;
+    };
+
+
+    namespace detail
+    {
+        namespace routing_handler_call_helper
+        {
+            template<typename T, int Pos>
+            struct call_pair
+            {
+                using type = T;
+                static const int pos = Pos;
+            };
+
+            template<typename H1>
+            struct call_params
+            {
+                H1& handler;
+                const routing_params& params;
+                request& req;
+                response& res;
+            };
+
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename S1, typename S2>
+            struct call
+            {};
+
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
+            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<int64_t, Args1...>, black_magic::S<Args2...>>
+            {
+                void operator()(F cparams)
+                {
+                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<int64_t, NInt>>;
+                    call<F, NInt + 1, NUint, NDouble, NString, black_magic::S<Args1...>, pushed>()(cparams);
+                }
+            };
+
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
             struct call<F, NInt, NUint, NDouble, NString, black_magic::S<uint64_t, Args1...>, black_magic::S<Args2...>>
             {
-                void operator()(F cparams)
+                void operator()(F cparams)
+                {
+                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<uint64_t, NUint>>;
+                    call<F, NInt, NUint + 1, NDouble, NString, black_magic::S<Args1...>, pushed>()(cparams);
+                }
+            };
+
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
+            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<double, Args1...>, black_magic::S<Args2...>>
+            {
+                void operator()(F cparams)
+                {
+                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<double, NDouble>>;
+                    call<F, NInt, NUint, NDouble + 1, NString, black_magic::S<Args1...>, pushed>()(cparams);
+                }
+            };
+
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
+            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<std::string, Args1...>, black_magic::S<Args2...>>
+            {
+                void operator()(F cparams)
+                {
+                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<std::string, NString>>;
+                    call<F, NInt, NUint, NDouble, NString + 1, black_magic::S<Args1...>, pushed>()(cparams);
+                }
+            };
+
+            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1>
+            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<>, black_magic::S<Args1...>>
+            {
+                void operator()(F cparams)
+                {
+                    cparams.handler(
+                      cparams.req,
+                      cparams.res,
+                      cparams.params.template get<typename Args1::type>(Args1::pos)...);
+                }
+            };
+
+            template<typename Func, typename... ArgsWrapped>
+            struct Wrapped
+            {
+                template<typename... Args>
+                void set_(Func f, typename std::enable_if<!std::is_same<typename std::tuple_element<0, std::tuple<Args..., void>>::type, const request&>::value, int>::type = 0)
+                {
+                    handler_ = ([f = std::move(f)](const request&, response& res, Args... args) {
+                        res = response(f(args...));
+                        res.end();
+                    });
+                }
+
+                template<typename Req, typename... Args>
+                struct req_handler_wrapper
+                {
+                    req_handler_wrapper(Func fun):
+                      f(std::move(fun))
+                    {
+                    }
+
+                    void operator()(const request& req, response& res, Args... args)
+                    {
+                        res = response(f(req, args...));
+                        res.end();
+                    }
+
+                    Func f;
+                };
+
+                template<typename... Args>
+                void set_(Func f, typename std::enable_if<
+                                    std::is_same<typename std::tuple_element<0, std::tuple<Args..., void>>::type, const request&>::value &&
+                                      !std::is_same<typename std::tuple_element<1, std::tuple<Args..., void, void>>::type, response&>::value,
+                                    int>::type = 0)
+                {
+                    handler_ = req_handler_wrapper<Args...>(std::move(f));
+                    /*handler_ = (
+                        [f = std::move(f)]
+                        (const request& req, response& res, Args... args){
+                             res = response(f(req, args...));
+                             res.end();
+                        });*/
+                }
+
+                template<typename... Args>
+                void set_(Func f, typename std::enable_if<
+                                    std::is_same<typename std::tuple_element<0, std::tuple<Args..., void>>::type, const request&>::value &&
+                                      std::is_same<typename std::tuple_element<1, std::tuple<Args..., void, void>>::type, response&>::value,
+                                    int>::type = 0)
+                {
+                    handler_ = std::move(f);
+                }
+
+                template<typename... Args>
+                struct handler_type_helper
+                {
+                    using type = std::function<void(const crow::request&, crow::response&, Args...)>;
+                    using args_type = black_magic::S<typename black_magic::promote_t<Args>...>;
+                };
+
+                template<typename... Args>
+                struct handler_type_helper<const request&, Args...>
+                {
+                    using type = std::function<void(const crow::request&, crow::response&, Args...)>;
+                    using args_type = black_magic::S<typename black_magic::promote_t<Args>...>;
+                };
+
+                template<typename... Args>
+                struct handler_type_helper<const request&, response&, Args...>
+                {
+                    using type = std::function<void(const crow::request&, crow::response&, Args...)>;
+                    using args_type = black_magic::S<typename black_magic::promote_t<Args>...>;
+                };
+
+                typename handler_type_helper<ArgsWrapped...>::type handler_;
+
+                void operator()(request& req, response& res, const routing_params& params)
+                {
+                    detail::routing_handler_call_helper::call<
+                      detail::routing_handler_call_helper::call_params<
+                        decltype(handler_)>,
+                      0, 0, 0, 0,
+                      typename handler_type_helper<ArgsWrapped...>::args_type,
+                      black_magic::S<>>()(
+                      detail::routing_handler_call_helper::call_params<
+                        decltype(handler_)>{handler_, params, req, res});
+                }
+            };
+
+        } // namespace routing_handler_call_helper
+    }     // namespace detail
+
+
+    class CatchallRule
+    {
+    public:
+        /// @cond SKIP
+        CatchallRule() {}
+
+        template<typename Func>
+        typename std::enable_if<black_magic::CallHelper<Func, black_magic::S<>>::value, void>::type
+          operator()(Func&& f)
+        {
+            static_assert(!std::is_same<void, decltype(f())>::value,
+                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
+
+            handler_ = ([f = std::move(f)](const request&, response& res) {
+                res = response(f());
+                res.end();
+            });
+        }
+
+        template<typename Func>
+        typename std::enable_if<
+          !black_magic::CallHelper<Func, black_magic::S<>>::value &&
+            black_magic::CallHelper<Func, black_magic::S<crow::request>>::value,
+          void>::type
+          operator()(Func&& f)
+        {
+            static_assert(!std::is_same<void, decltype(f(std::declval<crow::request>()))>::value,
+                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
+
+            handler_ = ([f = std::move(f)](const request& req, response& res) {
+                res = response(f(req));
+                res.end();
+            });
+        }
+
+        template<typename Func>
+        typename std::enable_if<
+          !black_magic::CallHelper<Func, black_magic::S<>>::value &&
+            !black_magic::CallHelper<Func, black_magic::S<crow::request>>::value &&
+            black_magic::CallHelper<Func, black_magic::S<crow::response&>>::value,
+          void>::type
+          operator()(Func&& f)
+        {
+            static_assert(std::is_same<void, decltype(f(std::declval<crow::response&>()))>::value,
+                          "Handler function with response argument should have void return type");
+            handler_ = ([f = std::move(f)](const request&, response& res) {
+                f(res);
+            });
+        }
+
+        template<typename Func>
+        typename std::enable_if<
+          !black_magic::CallHelper<Func, black_magic::S<>>::value &&
+            !black_magic::CallHelper<Func, black_magic::S<crow::request>>::value &&
+            !black_magic::CallHelper<Func, black_magic::S<crow::response&>>::value,
+          void>::type
+          operator()(Func&& f)
+        {
+            static_assert(std::is_same<void, decltype(f(std::declval<crow::request>(), std::declval<crow::response&>()))>::value,
+                          "Handler function with response argument should have void return type");
+
+            handler_ = std::move(f);
+        }
+        /// @endcond
+        bool has_handler()
+        {
+            return (handler_ != nullptr);
+        }
+
+    protected:
+        friend class Router;
+
+    private:
+        std::function<void(const crow::request&, crow::response&)> handler_;
+    };
+
+
+    /// A rule dealing with websockets.
+
+    ///
+    /// Provides the interface for the user to put in the necessary handlers for a websocket to work.
+    template<typename App>
+    class WebSocketRule : public BaseRule
+    {
+        using self_t = WebSocketRule;
+
+    public:
+        WebSocketRule(std::string rule, App* app):
+          BaseRule(std::move(rule)),
+          app_(app),
+          max_payload_(UINT64_MAX)
+        {}
+
+        void validate() override
+        {}
+
+        void handle(request&, response& res, const routing_params&) override
+        {
+            res = response(404);
+            res.end();
+        }
+
+        void handle_upgrade(const request& req, response&, SocketAdaptor&& adaptor) override
+        {
+            max_payload_ = max_payload_override_ ? max_payload_ : app_->websocket_max_payload();
+            new crow::websocket::Connection<SocketAdaptor, App>(req, std::move(adaptor), app_, max_payload_, subprotocols_, open_handler_, message_handler_, close_handler_, error_handler_, accept_handler_, mirror_protocols_, deflate_ ? &deflate_settings_ : nullptr, send_limit_);
+        }
+#ifdef CROW_ENABLE_SSL
+        void handle_upgrade(const request& req, response&, SSLAdaptor&& adaptor) override
+        {
+            new crow::websocket::Connection<SSLAdaptor, App>(req, std::move(adaptor), app_, max_payload_, subprotocols_, open_handler_, message_handler_, close_handler_, error_handler_, accept_handler_, mirror_protocols_, deflate_ ? &deflate_settings_ : nullptr, send_limit_);
+        }
+#endif
+
+        /// Override the global payload limit for this single WebSocket rule
+        self_t& max_payload(uint64_t max_payload)
+        {
+            max_payload_ = max_payload;
+            max_payload_override_ = true;
+            return *this;
+        }
+
+        self_t& subprotocols(const std::vector<std::string>& subprotocols)
+        {
+            subprotocols_ = subprotocols;
+            return *this;
+        }
+
+        template<typename Func>
+        self_t& onopen(Func f)
+        {
+            open_handler_ = f;
+            return *this;
+        }
+
+        template<typename Func>
+        self_t& onmessage(Func f)
+        {
+            message_handler_ = f;
+            return *this;
+        }
+
+        template<typename Func>
+        self_t& onclose(Func f)
+        {
+            close_handler_ = f;
+            return *this;
+        }
+
+        template<typename Func>
+        self_t& onerror(Func f)
+        {
+            error_handler_ = f;
+            return *this;
+        }
+
+        template<typename Func>
+        self_t& onaccept(Func f)
+        {
+            accept_handler_ = f;
+            return *this;
+        }
+
+        self_t& mirrorprotocols(bool mirror_protocols = true)
+        {
+            mirror_protocols_ = mirror_protocols;
+            return *this;
+        }
+
+        /// Limit the bytes each connection may have waiting to be sent, so a client that doesn't keep up can't take up more memory than that.
+        self_t& send_queue_limit(size_t max_bytes, websocket::overflow_policy policy = websocket::overflow_policy::DropOldest)
+        {
+            send_limit_ = std::make_shared<websocket::send_limit>(max_bytes, policy);
+            return *this;
+        }
+
+        /// The messages dropped and connections closed by the send queue limit, over all connections of this route.
+        websocket::overflow_stats overflow_stats() const
+        {
+            return send_limit_ ? send_limit_->stats() : websocket::overflow_stats{};
+        }
+
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Compress the messages of clients that offer the permessage-deflate extension (RFC 7692).
+        self_t& permessage_deflate(websocket::deflate_settings settings = {})
+        {
+            deflate_settings_ = settings;
+            deflate_ = true;
+            return *this;
+        }
+#endif
+
+    protected:
+        App* app_;
+        std::function<void(crow::websocket::connection&)> open_handler_;
+        std::function<void(crow::websocket::connection&, const std::string&, bool)> message_handler_;
+        std::function<void(crow::websocket::connection&, const std::string&, uint16_t)> close_handler_;
+        std::function<void(crow::websocket::connection&, const std::string&)> error_handler_;
+        std::function<bool(const crow::request&, void**)> accept_handler_;
+        bool mirror_protocols_ = false;
+        uint64_t max_payload_;
+        bool max_payload_override_ = false;
+        std::vector<std::string> subprotocols_;
+        bool deflate_ = false;
+        websocket::deflate_settings deflate_settings_;
+        std::shared_ptr<websocket::send_limit> send_limit_;
+    };
+
+    /// Allows the user to assign parameters using functions.
+
+    ///
+    /// `rule.name("name").methods(HTTPMethod::POST)`
+    template<typename T>
+    struct RuleParameterTraits
+    {
+        using self_t = T;
+
+        template<typename App>
+        WebSocketRule<App>& websocket(App* app)
+        {
+            auto p = new WebSocketRule<App>(static_cast<self_t*>(this)->rule_, app);
+            static_cast<self_t*>(this)->rule_to_upgrade_.reset(p);
+            return *p;
+        }
+
+        self_t& name(std::string name) noexcept
+        {
+            static_cast<self_t*>(this)->name_ = std::move(name);
+            return static_cast<self_t&>(*this);
+        }
+
+        self_t& methods(HTTPMethod method)
+        {
+            static_cast<self_t*>(this)->methods_ = 1 << static_cast<int>(method);
+            return static_cast<self_t&>(*this);
+        }
+
+        template<typename... MethodArgs>
+        self_t& methods(HTTPMethod method, MethodArgs... args_method)
+        {
+            methods(args_method...);
+            static_cast<self_t*>(this)->methods_ |= 1 << static_cast<int>(method);
+            return static_cast<self_t&>(*this);
+        }
+
+        /// Enable local middleware for this handler
+        template<typename App, typename... Middlewares>
+        self_t& middlewares()
+        {
+            static_cast<self_t*>(this)->mw_indices_.template push<App, Middlewares...>();
+            return static_cast<self_t&>(*this);
+        }
+    };
+
+    /// A rule that can change its parameters during runtime.
+    class DynamicRule : public BaseRule, public RuleParameterTraits<DynamicRule>
+    {
+    public:
+        DynamicRule(std::string rule):
+          BaseRule(std::move(rule))
+        {}
+
+        void validate() override
+        {
+            if (!erased_handler_)
+            {
+                throw std::runtime_error(name_ + (!name_.empty() ? ": " : "") + "no handler for url " + rule_);
+            }
+        }
+
+        void handle(request& req, response& res, const routing_params& params) override
+        {
+            if (!custom_templates_base.empty())
+                mustache::set_base(custom_templates_base);
+            else if (mustache::detail::get_template_base_directory_ref() != "templates")
+                mustache::set_base("templates");
+            erased_handler_(req, res, params);
+        }
+
+        template<typename Func>
+        void operator()(Func f)
+        {
+#ifdef CROW_MSVC_WORKAROUND
+            using function_t = utility::function_traits<decltype(&Func::operator())>;
+#else
+            using function_t = utility::function_traits<Func>;
+#endif
+            erased_handler_ = wrap(std::move(f), black_magic::gen_seq<function_t::arity>());
+        }
+
+        // enable_if Arg1 == request && Arg2 == response
+        // enable_if Arg1 == request && Arg2 != resposne
+        // enable_if Arg1 != request
+#ifdef CROW_MSVC_WORKAROUND
+        template<typename Func, size_t... Indices>
+#else
+        template<typename Func, unsigned... Indices>
+#endif
+        std::function<void(request&, response&, const routing_params&)>
+          wrap(Func f, black_magic::seq<Indices...>)
+        {
+#ifdef CROW_MSVC_WORKAROUND
+            using function_t = utility::function_traits<decltype(&Func::operator())>;
+#else
+            using function_t = utility::function_traits<Func>;
+#endif
+            if (!black_magic::is_parameter_tag_compatible(
+                  black_magic::get_parameter_tag_runtime(rule_.c_str()),
+                  black_magic::compute_parameter_tag_from_args_list<
+                    typename function_t::template arg<Indices>...>::value))
+            {
+                throw std::runtime_error("route_dynamic: Handler type is mismatched with URL parameters: " + rule_);
+            }
+            auto ret = detail::routing_handler_call_helper::Wrapped<Func, typename function_t::template arg<Indices>...>();
+            ret.template set_<
+              typename function_t::template arg<Indices>...>(std::move(f));
+            return ret;
+        }
+
+        template<typename Func>
+        void operator()(std::string name, Func&& f)
+        {
+            name_ = std::move(name);
+            (*this).template operator()<Func>(std::forward(f));
+        }
+
+    private:
+        std::function<void(request&, response&, const routing_params&)> erased_handler_;
+    };
+
+    /// Default rule created when CROW_ROUTE is called.
+    template<typename... Args>
+    class TaggedRule : public BaseRule, public RuleParameterTraits<TaggedRule<Args...>>
+    {
+    public:
+        using self_t = TaggedRule<Args...>;
+
+        TaggedRule(std::string rule):
+          BaseRule(std::move(rule))
+        {}
+
+        void validate() override
+        {
+            if (rule_.at(0) != '/')
+                throw std::runtime_error("Internal error: Routes must start with a '/'");
+
+            if (!handler_)
+            {
+                throw std::runtime_error(name_ + (!name_.empty() ? ": " : "") + "no handler for url " + rule_);
+            }
+        }
+
+        template<typename Func>
+        void operator()(Func&& f)
+        {
+            handler_ = ([f = std::move(f)](request& req, response& res, Args... args) {
+                detail::wrapped_handler_call(req, res, f, std::forward<Args>(args)...);
+            });
+        }
+
+        template<typename Func>
+        void operator()(std::string name, Func&& f)
+        {
+            name_ = std::move(name);
+            (*this).template operator()<Func>(std::forward(f));
+        }
+
+        void handle(request& req, response& res, const routing_params& params) override
+        {
+            if (!custom_templates_base.empty())
+                mustache::set_base(custom_templates_base);
+            else if (mustache::detail::get_template_base_directory_ref() != mustache::detail::get_global_template_base_directory_ref())
+                mustache::set_base(mustache::detail::get_global_template_base_directory_ref());
+
+            detail::routing_handler_call_helper::call<
+              detail::routing_handler_call_helper::call_params<decltype(handler_)>,
+              0, 0, 0, 0,
+              black_magic::S<Args...>,
+              black_magic::S<>>()(
+              detail::routing_handler_call_helper::call_params<decltype(handler_)>{handler_, params, req, res});
+        }
+
+    private:
+        std::function<void(crow::request&, crow::response&, Args...)> handler_;
+    };
+
+    const int RULE_SPECIAL_REDIRECT_SLASH = 1;
+
+
+    /// A search tree.
+    class Trie
+    {
+    public:
+        struct Node
+        {
+            uint16_t rule_index{};
+            // Assign the index to the maximum 32 unsigned integer value by default so that any other number (specifically 0) is a valid BP id.
+            uint16_t blueprint_index{INVALID_BP_ID};
+            std::string key;
+            ParamType param = ParamType::MAX; // MAX = No param.
+            std::vector<Node> children;
+
+            bool IsSimpleNode() const
+            {
+                return !rule_index &&
+                       blueprint_index == INVALID_BP_ID &&
+                       children.size() < 2 &&
+                       param == ParamType::MAX &&
+                       std::all_of(std::begin(children), std::end(children), [](const Node& x) {
+                           return x.param == ParamType::MAX;
+                       });
+            }
+
+            Node& add_child_node()
+            {
+                children.emplace_back();
+                return children.back();
+            }
+        };
+
+
+        Trie()
+        {}
+
+        /// Check whether or not the trie is empty.
+        bool is_empty()
+        {
+            return head_.children.empty();
+        }
+
+        void optimize()
+        {
+            for (auto& child : head_.children)
+            {
+                optimizeNode(child);
+            }
+        }
+
+
+    private:
+        void optimizeNode(Node& node)
+        {
+            if (node.children.empty())
+                return;
+            if (node.IsSimpleNode())
+            {
+                auto children_temp = std::move(node.children);
+                auto& child_temp = children_temp[0];
+                node.key += child_temp.key;
+                node.rule_index = child_temp.rule_index;
+                node.blueprint_index = child_temp.blueprint_index;
+                node.children = std::move(child_temp.children);
+                optimizeNode(node);
+            }
+            else
+            {
+                for (auto& child : node.children)
+                {
+                    optimizeNode(child);
+                }
+            }
+        }
+
+        void debug_node_print(const Node& node, int level)
+        {
+            if (node.param != ParamType::MAX)
+            {
+                switch (node.param)
+                {
+                    case ParamType::INT:
+                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
+                                       << "<int>";
+                        break;
+                    case ParamType::UINT:
+                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
+                                       << "<uint>";
+                        break;
+                    case ParamType::DOUBLE:
+                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
+                                       << "<double>";
+                        break;
+                    case ParamType::STRING:
+                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
+                                       << "<string>";
+                        break;
+                    case ParamType::PATH:
+                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
+                                       << "<path>";
+                        break;
+                    default:
+                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
+                                       << "<ERROR>";
+                        break;
+                }
+            }
+            else
+                CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ " << node.key;
+
+            for (const auto& child : node.children)
+            {
+                debug_node_print(child, level + 1);
+            }
+        }
+
+    public:
+        void debug_print()
+        {
+            CROW_LOG_DEBUG << "└➙ ROOT";
+            for (const auto& child : head_.children)
+                debug_node_print(child, 1);
+        }
+
+        void validate()
+        {
+            if (!head_.IsSimpleNode())
+                throw std::runtime_error("Internal error: Trie header should be simple!");
+            optimize();
+            compile();
+        }
+
+        //Rule_index, Blueprint_index, routing_params
+        routing_handle_result find(const std::string& req_url, const Node& node, unsigned pos = 0, routing_params* params = nullptr, std::vector<uint16_t>* blueprints = nullptr) const
+        {
+            //start params as an empty struct
+            routing_params empty;
+            if (params == nullptr)
+                params = &empty;
+            //same for blueprint vector
+            std::vector<uint16_t> MT;
+            if (blueprints == nullptr)
+                blueprints = &MT;
+
+            uint16_t found{};               //The rule index to be found
+            std::vector<uint16_t> found_BP; //The Blueprint indices to be found
+            routing_params match_params;    //supposedly the final matched parameters
+
+            auto update_found = [&found, &found_BP, &match_params](routing_handle_result& ret) {
+                found_BP = std::move(ret.blueprint_indices);
+                if (ret.rule_index && (!found || found > ret.rule_index))
+                {
+                    found = ret.rule_index;
+                    match_params = std::move(ret.r_params);
+                }
+            };
+
+            //if the function was called on a node at the end of the string (the last recursion), return the nodes rule index, and whatever params were passed to the function
+            if (pos == req_url.size())
+            {
+                found_BP = std::move(*blueprints);
+                return routing_handle_result{node.rule_index, *blueprints, *params};
+            }
+
+            bool found_fragment = false;
+            const char* const begin = req_url.data() + pos;
+            const char* const end = req_url.data() + req_url.size();
+
+            for (const auto& child : node.children)
+            {
+                if (child.param != ParamType::MAX)
+                {
+                    if (child.param == ParamType::INT)
+                    {
+                        int64_t value;
+                        if (const char* eptr = parse_number(begin, end, value))
+                        {
+                            found_fragment = true;
+                            params->int_params.push_back(value);
+                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
+                            auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
+                            update_found(ret);
+                            params->int_params.pop_back();
+                            if (!blueprints->empty()) blueprints->pop_back();
+                        }
+                    }
+
+                    else if (child.param == ParamType::UINT)
+                    {
+                        uint64_t value;
+                        if (const char* eptr = parse_number(begin, end, value))
+                        {
+                            found_fragment = true;
+                            params->uint_params.push_back(value);
+                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
+                            auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
+                            update_found(ret);
+                            params->uint_params.pop_back();
+                            if (!blueprints->empty()) blueprints->pop_back();
+                        }
+                    }
+
+                    else if (child.param == ParamType::DOUBLE)
+                    {
+                        double value;
+                        if (const char* eptr = parse_number(begin, end, value))
+                        {
+                            found_fragment = true;
+                            params->double_params.push_back(value);
+                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
+                            auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
+                            update_found(ret);
+                            params->double_params.pop_back();
+                            if (!blueprints->empty()) blueprints->pop_back();
+                        }
+                    }
+
+                    else if (child.param == ParamType::STRING)
+                    {
+                        size_t epos = pos;
+                        for (; epos < req_url.size(); epos++)
+                        {
+                            if (req_url[epos] == '/')
+                                break;
+                        }
+
+                        if (epos != pos)
+                        {
+                            found_fragment = true;
+                            params->string_params.push_back(std::string_view(begin, epos - pos));
+                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
+                            auto ret = find(req_url, child, epos, params, blueprints);
+                            update_found(ret);
+                            params->string_params.pop_back();
+                            if (!blueprints->empty()) blueprints->pop_back();
+                        }
+                    }
+
+                    else if (child.param == ParamType::PATH)
+                    {
+                        size_t epos = req_url.size();
+
+                        if (epos != pos)
+                        {
+                            found_fragment = true;
+                            params->string_params.push_back(std::string_view(begin, epos - pos));
+                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
+                            auto ret = find(req_url, child, epos, params, blueprints);
+                            update_found(ret);
+                            params->string_params.pop_back();
+                            if (!blueprints->empty()) blueprints->pop_back();
+                        }
+                    }
+                }
+
+                else
+                {
+                    const std::string& fragment = child.key;
+                    if (req_url.compare(pos, fragment.size(), fragment) == 0)
+                    {
+                        found_fragment = true;
+                        if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
+                        auto ret = find(req_url, child, pos + fragment.size(), params, blueprints);
+                        update_found(ret);
+                        if (!blueprints->empty()) blueprints->pop_back();
+                    }
+                }
+            }
+
+            if (!found_fragment)
+                found_BP = std::move(*blueprints);
+
+            return routing_handle_result{found, found_BP, match_params}; //Called after all the recursions have been done
+        }
+
+        /// Find the rule matching a URL, along with its parameters.
+        ///
+        /// Once validated, the trie is looked up through its compiled form, which doesn't allocate.
+        /// The node tree is only walked again when nothing matched and blueprints are involved, since their catchall rules need the blueprint indices.
+        routing_handle_result find(const std::string& req_url) const
+        {
+            if (!compiled_)
+                return find(req_url, head_);
+
+            routing_handle_result result;
+            if (find_static(req_url, result.rule_index))
+                return result;
+
+            routing_params params;
+            match(req_url, 0, 0, params, result);
+            if (!result.rule_index && has_blueprints_)
+                return find(req_url, head_);
+            return result;
+        }
+
+        //This functions assumes any blueprint info passed is valid
+        void add(const std::string& url, uint16_t rule_index, unsigned bp_prefix_length = 0, uint16_t blueprint_index = INVALID_BP_ID)
+        {
+            auto idx = &head_;
+
+            bool has_blueprint = bp_prefix_length != 0 && blueprint_index != INVALID_BP_ID;
+
+            for (unsigned i = 0; i < url.size(); i++)
+            {
+                char c = url[i];
+                if (c == '<')
+                {
+                    static struct ParamTraits
+                    {
+                        ParamType type;
+                        std::string name;
+                    } paramTraits[] =
+                      {
+                        {ParamType::INT, "<int>"},
+                        {ParamType::UINT, "<uint>"},
+                        {ParamType::DOUBLE, "<float>"},
+                        {ParamType::DOUBLE, "<double>"},
+                        {ParamType::STRING, "<str>"},
+                        {ParamType::STRING, "<string>"},
+                        {ParamType::PATH, "<path>"},
+                      };
+
+                    for (const auto& x : paramTraits)
+                    {
+                        if (url.compare(i, x.name.size(), x.name) == 0)
+                        {
+                            bool found = false;
+                            for (auto& child : idx->children)
+                            {
+                                if (child.param == x.type)
+                                {
+                                    idx = &child;
+                                    i += x.name.size();
+                                    found = true;
+                                    break;
+                                }
+                            }
+                            if (found)
+                                break;
+
+                            auto new_node_idx = &idx->add_child_node();
+                            new_node_idx->param = x.type;
+                            idx = new_node_idx;
+                            i += x.name.size();
+                            break;
+                        }
+                    }
+
+                    i--;
+                }
+                else
+                {
+                    //This part assumes the tree is unoptimized (every node has a max 1 character key)
+                    bool piece_found = false;
+                    for (auto& child : idx->children)
+                    {
+                        if (child.key[0] == c)
+                        {
+                            idx = &child;
+                            piece_found = true;
+                            break;
+                        }
+                    }
+                    if (!piece_found)
+                    {
+                        auto new_node_idx = &idx->add_child_node();
+                        new_node_idx->key = c;
+                        //The assumption here is that you'd only need to add a blueprint index if the tree didn't have the BP prefix.
+                        if (has_blueprint && i == bp_prefix_length)
+                            new_node_idx->blueprint_index = blueprint_index;
+                        idx = new_node_idx;
+                    }
+                }
+            }
+
+            //check if the last node already has a value (exact url already in Trie)
+            if (idx->rule_index)
+                throw std::runtime_error("handler already exists for " + url);
+            idx->rule_index = rule_index;
+            compiled_ = false;
+        }
+
+    private:
+        /// A node of the compiled trie, children are stored next to each other and keys live in a single buffer.
+        struct compiled_node
+        {
+            uint32_t key_offset{};
+            uint32_t key_size{};
+            uint32_t first_child{};
+            uint16_t child_count{};
+            uint16_t rule_index{};
+            ParamType param = ParamType::MAX;
+        };
+
+        /// An entry of the static route table.
+        struct static_route
+        {
+            uint32_t key_offset{};
+            uint32_t key_size{};
+            uint16_t rule_index{};
+        };
+
+        static const char* parse_number(const char* first, const char* last, int64_t& value)
+        {
+            // from_chars doesn't take a plus sign, strtoll did
+            if (*first == '+' && (++first == last || *first < '0' || *first > '9'))
+                return nullptr;
+            auto result = std::from_chars(first, last, value);
+            return result.ec == std::errc() ? result.ptr : nullptr;
+        }
+
+        static const char* parse_number(const char* first, const char* last, uint64_t& value)
+        {
+            if (*first == '+' && (++first == last || *first < '0' || *first > '9'))
+                return nullptr;
+            auto result = std::from_chars(first, last, value);
+            return result.ec == std::errc() ? result.ptr : nullptr;
+        }
+
+        static const char* parse_number(const char* first, const char* last, double& value)
+        {
+            char c = *first;
+            if (!((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.'))
+                return nullptr;
+#ifdef __cpp_lib_to_chars
+            if (c == '+' && (++first == last || *first == '+' || *first == '-'))
+                return nullptr;
+            auto result = std::from_chars(first, last, value);
+            return result.ec == std::errc() ? result.ptr : nullptr;
+#else
+            char* eptr;
+            errno = 0;
+            value = strtod(first, &eptr);
+            return errno != ERANGE && eptr != first ? eptr : nullptr;
+#endif
+        }
+
+        static uint64_t hash_url(const char* data, size_t size)
+        {
+            uint64_t hash = 14695981039346656037ull;
+            for (size_t i = 0; i < size; i++)
+            {
+                hash ^= static_cast<unsigned char>(data[i]);
+                hash *= 1099511628211ull;
+            }
+            return hash;
+        }
+
+        static size_t hash_slot(uint64_t hash, uint32_t seed, size_t mask)
+        {
+            hash += seed * 0x9e3779b97f4a7c15ull;
+            hash ^= hash >> 33;
+            hash *= 0xff51afd7ed558ccdull;
+            hash ^= hash >> 33;
+            return static_cast<size_t>(hash) & mask;
+        }
+
+        /// Flatten the (optimized) node tree and build the static route table.
+        void compile()
+        {
+            nodes_.clear();
+            keys_.clear();
+            static_seeds_.clear();
+            static_routes_.clear();
+            has_blueprints_ = false;
+
+            nodes_.emplace_back();
+            compile_node(head_, 0);
+            build_static_table();
+            compiled_ = true;
+        }
+
+        void compile_node(const Node& node, uint32_t index)
+        {
+            if (node.blueprint_index != INVALID_BP_ID)
+                has_blueprints_ = true;
+
+            uint32_t first_child = static_cast<uint32_t>(nodes_.size());
+            compiled_node& compiled = nodes_[index];
+            compiled.key_offset = static_cast<uint32_t>(keys_.size());
+            compiled.key_size = static_cast<uint32_t>(node.key.size());
+            compiled.first_child = first_child;
+            compiled.child_count = static_cast<uint16_t>(node.children.size());
+            compiled.rule_index = node.rule_index;
+            compiled.param = node.param;
+            keys_ += node.key;
+
+            nodes_.resize(first_child + node.children.size());
+            for (size_t i = 0; i < node.children.size(); i++)
+                compile_node(node.children[i], first_child + static_cast<uint32_t>(i));
+        }
+
+        /// Build a perfect hash table (hash and displace) of the routes without parameters.
+        ///
+        /// A route only goes in if the compiled trie would pick it for its own URL, a parameterized rule registered earlier takes precedence otherwise.
+        void build_static_table()
+        {
+            std::vector<std::pair<std::string, uint16_t>> routes;
+            std::string path;
+            collect_static_routes(0, path, routes);
+            if (routes.empty())
+                return;
+
+            size_t bucket_count = 1, table_size = 2;
+            while (bucket_count < routes.size())
+                bucket_count <<= 1;
+            while (table_size < 2 * routes.size())
+                table_size <<= 1;
+
+            std::vector<std::vector<size_t>> buckets(bucket_count);
+            std::vector<uint64_t> hashes(routes.size());
+            for (size_t i = 0; i < routes.size(); i++)
+            {
+                hashes[i] = hash_url(routes[i].first.data(), routes[i].first.size());
+                buckets[hash_slot(hashes[i], 0, bucket_count - 1)].push_back(i);
+            }
+
+            std::vector<size_t> order(bucket_count);
+            for (size_t i = 0; i < bucket_count; i++)
+                order[i] = i;
+            std::sort(order.begin(), order.end(), [&buckets](size_t a, size_t b) {
+                return buckets[a].size() > buckets[b].size();
+            });
+
+            std::vector<uint32_t> seeds(bucket_count);
+            std::vector<bool> taken(table_size);
+            std::vector<size_t> slots;
+            for (size_t b : order)
+            {
+                const auto& bucket = buckets[b];
+                if (bucket.empty())
+                    break;
+
+                bool placed = false;
+                for (uint32_t seed = 1; seed < (1u << 16) && !placed; seed++)
+                {
+                    slots.clear();
+                    placed = true;
+                    for (size_t route : bucket)
+                    {
+                        size_t slot = hash_slot(hashes[route], seed, table_size - 1);
+                        if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+                        {
+                            placed = false;
+                            break;
+                        }
+                        slots.push_back(slot);
+                    }
+                    if (placed)
+                    {
+                        seeds[b] = seed;
+                        for (size_t slot : slots)
+                            taken[slot] = true;
+                    }
+                }
+                if (!placed)
+                {
+                    CROW_LOG_DEBUG << "Could not build a perfect hash of the static routes, they'll go through the trie";
+                    return;
+                }
+            }
+
+            static_seeds_ = std::move(seeds);
+            static_routes_.resize(table_size);
+            for (size_t i = 0; i < routes.size(); i++)
+            {
+                static_route& entry = static_routes_[hash_slot(hashes[i], static_seeds_[hash_slot(hashes[i], 0, bucket_count - 1)], table_size - 1)];
+                entry.key_offset = static_cast<uint32_t>(keys_.size());
+                entry.key_size = static_cast<uint32_t>(routes[i].first.size());
+                entry.rule_index = routes[i].second;
+                keys_ += routes[i].first;
+            }
+        }
+
+        void collect_static_routes(uint32_t index, std::string& path, std::vector<std::pair<std::string, uint16_t>>& routes) const
+        {
+            const compiled_node& node = nodes_[index];
+            if (node.param != ParamType::MAX)
+                return;
+
+            size_t length = path.size();
+            path.append(keys_, node.key_offset, node.key_size);
+            if (node.rule_index)
+            {
+                routing_handle_result result{0, {}, {}};
+                routing_params params;
+                match(path, 0, 0, params, result);
+                if (result.rule_index == node.rule_index)
+                    routes.emplace_back(path, node.rule_index);
+            }
+            for (uint32_t i = node.first_child; i < node.first_child + node.child_count; i++)
+                collect_static_routes(i, path, routes);
+            path.resize(length);
+        }
+
+        bool find_static(const std::string& req_url, uint16_t& rule_index) const
+        {
+            if (static_routes_.empty())
+                return false;
+
+            uint64_t hash = hash_url(req_url.data(), req_url.size());
+            uint32_t seed = static_seeds_[hash_slot(hash, 0, static_seeds_.size() - 1)];
+            const static_route& route = static_routes_[hash_slot(hash, seed, static_routes_.size() - 1)];
+            if (!route.rule_index || route.key_size != req_url.size() ||
+                std::memcmp(keys_.data() + route.key_offset, req_url.data(), req_url.size()) != 0)
+                return false;
+            rule_index = route.rule_index;
+            return true;
+        }
+
+        /// Walk the compiled trie, keeping the matching rule with the lowest index (the one registered first).
+        void match(const std::string& req_url, uint32_t index, size_t pos, routing_params& params, routing_handle_result& best) const
+        {
+            const compiled_node& node = nodes_[index];
+            if (pos == req_url.size())
+            {
+                if (node.rule_index && (!best.rule_index || node.rule_index < best.rule_index))
+                {
+                    best.rule_index = node.rule_index;
+                    best.r_params = params;
+                }
+                return;
+            }
+
+            const char* const begin = req_url.data() + pos;
+            const char* const end = req_url.data() + req_url.size();
+            for (uint32_t i = node.first_child; i < node.first_child + node.child_count; i++)
+            {
+                const compiled_node& child = nodes_[i];
+                switch (child.param)
+                {
+                    case ParamType::MAX:
+                        // Keys are never empty below the root, checking the first character skips most siblings cheaply
+                        if (child.key_size <= static_cast<size_t>(end - begin) && *begin == keys_[child.key_offset] &&
+                            std::memcmp(begin, keys_.data() + child.key_offset, child.key_size) == 0)
+                            match(req_url, i, pos + child.key_size, params, best);
+                        break;
+                    case ParamType::INT:
+                    {
+                        int64_t value;
+                        if (const char* eptr = parse_number(begin, end, value))
+                        {
+                            params.int_params.push_back(value);
+                            match(req_url, i, eptr - req_url.data(), params, best);
+                            params.int_params.pop_back();
+                        }
+                        break;
+                    }
+                    case ParamType::UINT:
+                    {
+                        uint64_t value;
+                        if (const char* eptr = parse_number(begin, end, value))
+                        {
+                            params.uint_params.push_back(value);
+                            match(req_url, i, eptr - req_url.data(), params, best);
+                            params.uint_params.pop_back();
+                        }
+                        break;
+                    }
+                    case ParamType::DOUBLE:
+                    {
+                        double value;
+                        if (const char* eptr = parse_number(begin, end, value))
+                        {
+                            params.double_params.push_back(value);
+                            match(req_url, i, eptr - req_url.data(), params, best);
+                            params.double_params.pop_back();
+                        }
+                        break;
+                    }
+                    case ParamType::STRING:
+                    {
+                        const char* eptr = static_cast<const char*>(std::memchr(begin, '/', end - begin));
+                        if (!eptr)
+                            eptr = end;
+                        if (eptr != begin)
+                        {
+                            params.string_params.push_back(std::string_view(begin, eptr - begin));
+                            match(req_url, i, eptr - req_url.data(), params, best);
+                            params.string_params.pop_back();
+                        }
+                        break;
+                    }
+                    case ParamType::PATH:
+                        params.string_params.push_back(std::string_view(begin, end - begin));
+                        match(req_url, i, req_url.size(), params, best);
+                        params.string_params.pop_back();
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        Node head_;
+
+        bool compiled_{};
+        bool has_blueprints_{};
+        std::vector<compiled_node> nodes_;
+        std::string keys_;
+        std::vector<uint32_t> static_seeds_;
+        std::vector<static_route> static_routes_;
+    };
+
+    /// A blueprint can be considered a smaller section of a Crow app, specifically where the router is concerned.
+
+    ///
+    /// You can use blueprints to assign a common prefix to rules' prefix, set custom static and template folders, and set a custom catchall route.
+    /// You can also assign nest blueprints for maximum Compartmentalization.
+    class Blueprint
+    {
+    public:
+        Blueprint(const std::string& prefix):
+          prefix_(prefix),
+          static_dir_(prefix),
+          templates_dir_(prefix){};
+
+        Blueprint(const std::string& prefix, const std::string& static_dir):
+          prefix_(prefix), static_dir_(static_dir){};
+
+        Blueprint(const std::string& prefix, const std::string& static_dir, const std::string& templates_dir):
+          prefix_(prefix), static_dir_(static_dir), templates_dir_(templates_dir){};
+
+        /*
+        Blueprint(Blueprint& other)
+        {
+            prefix_ = std::move(other.prefix_);
+            all_rules_ = std::move(other.all_rules_);
+        }
+
+        Blueprint(const Blueprint& other)
+        {
+            prefix_ = other.prefix_;
+            all_rules_ = other.all_rules_;
+        }
+*/
+        Blueprint(Blueprint&& value)
+        {
+            *this = std::move(value);
+        }
+
+        Blueprint& operator=(const Blueprint& value) = delete;
+
+        Blueprint& operator=(Blueprint&& value) noexcept
+        {
+            prefix_ = std::move(value.prefix_);
+            static_dir_ = std::move(value.static_dir_);
+            templates_dir_ = std::move(value.templates_dir_);
+            all_rules_ = std::move(value.all_rules_);
+            catchall_rule_ = std::move(value.catchall_rule_);
+            blueprints_ = std::move(value.blueprints_);
+            mw_indices_ = std::move(value.mw_indices_);
+            return *this;
+        }
+
+        bool operator==(const Blueprint& value)
+        {
+            return value.prefix() == prefix_;
+        }
+
+        bool operator!=(const Blueprint& value)
+        {
+            return value.prefix() != prefix_;
+        }
+
+        std::string prefix() const
+        {
+            return prefix_;
+        }
+
+        std::string static_dir() const
+        {
+            return static_dir_;
+        }
+
+        void set_added()
+        {
+            added_ = true;
+        }
+
+        bool is_added()
+        {
+            return added_;
+        }
+
+        DynamicRule& new_rule_dynamic(const std::string& rule)
+        {
+            std::string new_rule = '/' + prefix_ + rule;
+            auto ruleObject = new DynamicRule(std::move(new_rule));
+            ruleObject->custom_templates_base = templates_dir_;
+            all_rules_.emplace_back(ruleObject);
+
+            return *ruleObject;
+        }
+
+        template<uint64_t N>
+        typename black_magic::arguments<N>::type::template rebind<TaggedRule>& new_rule_tagged(const std::string& rule)
+        {
+            std::string new_rule = '/' + prefix_ + rule;
+            using RuleT = typename black_magic::arguments<N>::type::template rebind<TaggedRule>;
+
+            auto ruleObject = new RuleT(std::move(new_rule));
+            ruleObject->custom_templates_base = templates_dir_;
+            all_rules_.emplace_back(ruleObject);
+
+            return *ruleObject;
+        }
+
+        void register_blueprint(Blueprint& blueprint)
+        {
+            if (blueprints_.empty() || std::find(blueprints_.begin(), blueprints_.end(), &blueprint) == blueprints_.end())
+            {
+                apply_blueprint(blueprint);
+                blueprints_.emplace_back(&blueprint);
+            }
+            else
+                throw std::runtime_error("blueprint \"" + blueprint.prefix_ + "\" already exists in blueprint \"" + prefix_ + '\"');
+        }
+
+
+        CatchallRule& catchall_rule()
+        {
+            return catchall_rule_;
+        }
+
+        template<typename App, typename... Middlewares>
+        void middlewares()
+        {
+            mw_indices_.push<App, Middlewares...>();
+        }
+
+    private:
+        void apply_blueprint(Blueprint& blueprint)
+        {
+
+            blueprint.prefix_ = prefix_ + '/' + blueprint.prefix_;
+            blueprint.static_dir_ = static_dir_ + '/' + blueprint.static_dir_;
+            blueprint.templates_dir_ = templates_dir_ + '/' + blueprint.templates_dir_;
+            for (auto& rule : blueprint.all_rules_)
+            {
+                std::string new_rule = '/' + prefix_ + rule->rule_;
+                rule->rule_ = new_rule;
+            }
+            for (Blueprint* bp_child : blueprint.blueprints_)
+            {
+                Blueprint& bp_ref = *bp_child;
+                apply_blueprint(bp_ref);
+            }
+        }
+
+        std::string prefix_;
+        std::string static_dir_;
+        std::string templates_dir_;
+        std::vector<std::unique_ptr<BaseRule>> all_rules_;
+        CatchallRule catchall_rule_;
+        std::vector<Blueprint*> blueprints_;
+        detail::middleware_indices mw_indices_;
+        bool added_{false};
+
+        friend class Router;
+    };
+
+    /// Handles matching requests to existing rules and upgrade requests.
+    class Router
+    {
+    public:
+        bool using_ssl;
+
+        Router() : using_ssl(false)
+        {}
+
+        DynamicRule& new_rule_dynamic(const std::string& rule)
+        {
+            auto ruleObject = new DynamicRule(rule);
+            all_rules_.emplace_back(ruleObject);
+
+            return *ruleObject;
+        }
+
+        template<uint64_t N>
+        typename black_magic::arguments<N>::type::template rebind<TaggedRule>& new_rule_tagged(const std::string& rule)
+        {
+            using RuleT = typename black_magic::arguments<N>::type::template rebind<TaggedRule>;
+
+            auto ruleObject = new RuleT(rule);
+            all_rules_.emplace_back(ruleObject);
+
+            return *ruleObject;
+        }
+
+        CatchallRule& catchall_rule()
+        {
+            return catchall_rule_;
+        }
+
+        void internal_add_rule_object(const std::string& rule, BaseRule* ruleObject)
+        {
+            internal_add_rule_object(rule, ruleObject, INVALID_BP_ID, blueprints_);
+        }
+
+        void internal_add_rule_object(const std::string& rule, BaseRule* ruleObject, const uint16_t& BP_index, std::vector<Blueprint*>& blueprints)
+        {
+            bool has_trailing_slash = false;
+            std::string rule_without_trailing_slash;
+            if (rule.size() > 1 && rule.back() == '/')
+            {
+                has_trailing_slash = true;
+                rule_without_trailing_slash = rule;
+                rule_without_trailing_slash.pop_back();
+            }
+
+            ruleObject->mw_indices_.pack();
+
+            ruleObject->foreach_method([&](int method) {
+                per_methods_[method].rules.emplace_back(ruleObject);
+                per_methods_[method].trie.add(rule, per_methods_[method].rules.size() - 1, BP_index != INVALID_BP_ID ? blueprints[BP_index]->prefix().length() : 0, BP_index);
+
+                // directory case:
+                //   request to '/about' url matches '/about/' rule
+                if (has_trailing_slash)
+                {
+                    per_methods_[method].trie.add(rule_without_trailing_slash, RULE_SPECIAL_REDIRECT_SLASH, BP_index != INVALID_BP_ID ? blueprints[BP_index]->prefix().length() : 0, BP_index);
+                }
+            });
+
+            ruleObject->set_added();
+        }
+
+        void register_blueprint(Blueprint& blueprint)
+        {
+            if (std::find(blueprints_.begin(), blueprints_.end(), &blueprint) == blueprints_.end())
+            {
+                blueprints_.emplace_back(&blueprint);
+            }
+            else
+                throw std::runtime_error("blueprint \"" + blueprint.prefix_ + "\" already exists in router");
+        }
+
+        void get_recursive_child_methods(Blueprint* blueprint, std::vector<HTTPMethod>& methods)
+        {
+            //we only need to deal with children if the blueprint has absolutely no methods (meaning its index won't be added to the trie)
+            if (blueprint->static_dir_.empty() && blueprint->all_rules_.empty())
+            {
+                for (Blueprint* bp : blueprint->blueprints_)
+                {
+                    get_recursive_child_methods(bp, methods);
+                }
+            }
+            else if (!blueprint->static_dir_.empty())
+                methods.emplace_back(HTTPMethod::Get);
+            for (auto& rule : blueprint->all_rules_)
+            {
+                rule->foreach_method([&methods](unsigned method) {
+                    HTTPMethod method_final = static_cast<HTTPMethod>(method);
+                    if (std::find(methods.begin(), methods.end(), method_final) == methods.end())
+                        methods.emplace_back(method_final);
+                });
+            }
+        }
+
+        void validate_bp()
+        {
+            //Take all the routes from the registered blueprints and add them to `all_rules_` to be processed.
+            detail::middleware_indices blueprint_mw;
+            validate_bp(blueprints_, blueprint_mw);
+        }
+
+        void validate_bp(std::vector<Blueprint*> blueprints, detail::middleware_indices& current_mw)
+        {
+            for (unsigned i = 0; i < blueprints.size(); i++)
+            {
+                Blueprint* blueprint = blueprints[i];
+
+                if (blueprint->is_added()) continue;
+
+                if (blueprint->static_dir_ == "" && blueprint->all_rules_.empty())
+                {
+                    std::vector<HTTPMethod> methods;
+                    get_recursive_child_methods(blueprint, methods);
+                    for (HTTPMethod x : methods)
+                    {
+                        int method_index = static_cast<int>(x);
+                        per_methods_[method_index].trie.add(blueprint->prefix(), 0, blueprint->prefix().length(), method_index);
+                    }
+                }
+
+                current_mw.merge_back(blueprint->mw_indices_);
+                for (auto& rule : blueprint->all_rules_)
+                {
+                    if (rule && !rule->is_added())
+                    {
+                        auto upgraded = rule->upgrade();
+                        if (upgraded)
+                            rule = std::move(upgraded);
+                        rule->validate();
+                        rule->mw_indices_.merge_front(current_mw);
+                        internal_add_rule_object(rule->rule(), rule.get(), i, blueprints);
+                    }
+                }
+                validate_bp(blueprint->blueprints_, current_mw);
+                current_mw.pop_back(blueprint->mw_indices_);
+                blueprint->set_added();
+            }
+        }
+
+        void validate()
+        {
+            for (auto& rule : all_rules_)
+            {
+                if (rule && !rule->is_added())
+                {
+                    auto upgraded = rule->upgrade();
+                    if (upgraded)
+                        rule = std::move(upgraded);
+                    rule->validate();
+                    internal_add_rule_object(rule->rule(), rule.get());
+                }
+            }
+            for (auto& per_method : per_methods_)
+            {
+                per_method.trie.validate();
+            }
+        }
+
+        // TODO maybe add actual_method
+        template<typename Adaptor>
+        void handle_upgrade(const request& req, response& res, Adaptor&& adaptor)
+        {
+            if (req.method >= HTTPMethod::InternalMethodCount)
+                return;
+
+            auto& per_method = per_methods_[static_cast<int>(req.method)];
+            auto& rules = per_method.rules;
+            unsigned rule_index = per_method.trie.find(req.url).rule_index;
+
+            if (!rule_index)
+            {
+                for (auto& method : per_methods_)
+                {
+                    if (method.trie.find(req.url).rule_index)
+                    {
+                        CROW_LOG_DEBUG << "Cannot match method " << req.url << " " << method_name(req.method);
+                        res = response(405);
+                        res.end();
+                        return;
+                    }
+                }
+
+                CROW_LOG_INFO << "Cannot match rules " << req.url;
+                res = response(404);
+                res.end();
+                return;
+            }
+
+            if (rule_index >= rules.size())
+                throw std::runtime_error("Trie internal structure corrupted!");
+
+            if (rule_index == RULE_SPECIAL_REDIRECT_SLASH)
+            {
+                CROW_LOG_INFO << "Redirecting to a url with trailing slash: " << req.url;
+                res = response(301);
+                res.add_header("Location", req.url + "/");
+                res.end();
+                return;
+            }
+
+            CROW_LOG_DEBUG << "Matched rule (upgrade) '" << rules[rule_index]->rule_ << "' " << static_cast<uint32_t>(req.method) << " / " << rules[rule_index]->get_methods();
+
+            try
+            {
+                rules[rule_index]->handle_upgrade(req, res, std::move(adaptor));
+            }
+            catch (...)
+            {
+                exception_handler_(res);
+                res.end();
+                return;
+            }
+        }
+
+        void get_found_bp(std::vector<uint16_t>& bp_i, std::vector<Blueprint*>& blueprints, std::vector<Blueprint*>& found_bps, uint16_t index = 0)
+        {
+            // This statement makes 3 assertions:
+            // 1. The index is above 0.
+            // 2. The index does not lie outside the given blueprint list.
+            // 3. The next blueprint we're adding has a prefix that starts the same as the already added blueprint + a slash (the rest is irrelevant).
+            //
+            // This is done to prevent a blueprint that has a prefix of "bp_prefix2" to be assumed as a child of one that has "bp_prefix".
+            //
+            // If any of the assertions is untrue, we delete the last item added, and continue using the blueprint list of the blueprint found before, the topmost being the router's list
+            auto verify_prefix = [&bp_i, &index, &blueprints, &found_bps]() {
+                return index > 0 &&
+                       bp_i[index] < blueprints.size() &&
+                       blueprints[bp_i[index]]->prefix().substr(0, found_bps[index - 1]->prefix().length() + 1).compare(std::string(found_bps[index - 1]->prefix() + '/')) == 0;
+            };
+            if (index < bp_i.size())
+            {
+
+                if (verify_prefix())
                 {
-                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<uint64_t, NUint>>;
-                    call<F, NInt, NUint + 1, NDouble, NString, black_magic::S<Args1...>, pushed>()(cparams);
+                    found_bps.push_back(blueprints[bp_i[index]]);
+                    get_found_bp(bp_i, found_bps.back()->blueprints_, found_bps, ++index);
                 }
-            };
+                else
+                {
+                    if (found_bps.size() < 2)
+                    {
+                        found_bps.clear();
+                        found_bps.push_back(blueprints_[bp_i[index]]);
+                    }
+                    else
+                    {
+                        found_bps.pop_back();
+                        Blueprint* last_element = found_bps.back();
+                        found_bps.push_back(last_element->blueprints_[bp_i[index]]);
+                    }
+                    get_found_bp(bp_i, found_bps.back()->blueprints_, found_bps, ++index);
+                }
+            }
+        }
 
-            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
-            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<double, Args1...>, black_magic::S<Args2...>>
+        /// Is used to handle errors, you insert the error code, found route, request, and response. and it'll either call the appropriate catchall route (considering the blueprint system) and send you a status string (which is mainly used for debug messages), or just set the response code to the proper error code.
+        std::string get_error(unsigned short code, routing_handle_result& found, const request& req, response& res)
+        {
+            res.code = code;
+            std::vector<Blueprint*> bps_found;
+            get_found_bp(found.blueprint_indices, blueprints_, bps_found);
+            for (int i = bps_found.size() - 1; i > 0; i--)
+            {
+                std::vector<uint16_t> bpi = found.blueprint_indices;
+                if (bps_found[i]->catchall_rule().has_handler())
+                {
+                    try
+                    {
+                        bps_found[i]->catchall_rule().handler_(req, res);
+                    }
+                    catch (...)
+                    {
+                        exception_handler_(res);
+                    }
+#ifdef CROW_ENABLE_DEBUG
+                    return std::string("Redirected to Blueprint \"" + bps_found[i]->prefix() + "\" Catchall rule");
+#else
+                    return std::string();
+#endif
+                }
+            }
+            if (catchall_rule_.has_handler())
+            {
+                try
+                {
+                    catchall_rule_.handler_(req, res);
+                }
+                catch (...)
+                {
+                    exception_handler_(res);
+                }
+#ifdef CROW_ENABLE_DEBUG
+                return std::string("Redirected to global Catchall rule");
+#else
+                return std::string();
+#endif
+            }
+            return std::string();
+        }
+
+        std::unique_ptr<routing_handle_result> handle_initial(request& req, response& res)
+        {
+            HTTPMethod method_actual = req.method;
+
+            std::unique_ptr<routing_handle_result> found{
+              new routing_handle_result(
+                0,
+                std::vector<uint16_t>(),
+                routing_params(),
+                HTTPMethod::InternalMethodCount)}; // This is always returned to avoid a null pointer dereference.
+
+            // NOTE(EDev): This most likely will never run since the parser should handle this situation and close the connection before it gets here.
+            if (CROW_UNLIKELY(req.method >= HTTPMethod::InternalMethodCount))
+                return found;
+            else if (req.method == HTTPMethod::Head)
+            {
+                *found = per_methods_[static_cast<int>(method_actual)].trie.find(req.url);
+                // support HEAD requests using GET if not defined as method for the requested URL
+                if (!found->rule_index)
+                {
+                    method_actual = HTTPMethod::Get;
+                    *found = per_methods_[static_cast<int>(method_actual)].trie.find(req.url);
+                    if (!found->rule_index) // If a route is still not found, return a 404 without executing the rest of the HEAD specific code.
+                    {
+                        CROW_LOG_DEBUG << "Cannot match rules " << req.url;
+                        res = response(404); //TODO(EDev): Should this redirect to catchall?
+                        res.end();
+                        return found;
+                    }
+                }
+
+                res.skip_body = true;
+                found->method = method_actual;
+                return found;
+            }
+            else if (req.method == HTTPMethod::Options)
+            {
+                std::string allow = "OPTIONS, HEAD";
+
+                if (req.url == "/*")
+                {
+                    for (int i = 0; i < static_cast<int>(HTTPMethod::InternalMethodCount); i++)
+                    {
+                        if (static_cast<int>(HTTPMethod::Head) == i)
+                            continue; // HEAD is always allowed
+
+                        if (!per_methods_[i].trie.is_empty())
+                        {
+                            allow.append(", ");
+                            allow.append(method_name(static_cast<HTTPMethod>(i)));
+                        }
+                    }
+#ifdef CROW_RETURNS_OK_ON_HTTP_OPTIONS_REQUEST
+                    res = response(crow::status::OK);
+#else
+                    res = response(crow::status::NO_CONTENT);
+#endif
+
+                    res.set_header("Allow", allow);
+                    res.end();
+                    found->method = method_actual;
+                    return found;
+                }
+                else
+                {
+                    bool rules_matched = false;
+                    for (int i = 0; i < static_cast<int>(HTTPMethod::InternalMethodCount); i++)
+                    {
+                        if (per_methods_[i].trie.find(req.url).rule_index)
+                        {
+                            rules_matched = true;
+
+                            if (static_cast<int>(HTTPMethod::Head) == i)
+                                continue; // HEAD is always allowed
+
+                            allow.append(", ");
+                            allow.append(method_name(static_cast<HTTPMethod>(i)));
+                        }
+                    }
+                    if (rules_matched)
+                    {
+#ifdef CROW_RETURNS_OK_ON_HTTP_OPTIONS_REQUEST
+                        res = response(crow::status::OK);
+#else
+                        res = response(crow::status::NO_CONTENT);
+#endif
+                        res.set_header("Allow", allow);
+                        res.end();
+                        found->method = method_actual;
+                        return found;
+                    }
+                    else
+                    {
+                        CROW_LOG_DEBUG << "Cannot match rules " << req.url;
+                        res = response(404); //TODO(EDev): Should this redirect to catchall?
+                        res.end();
+                        return found;
+                    }
+                }
+            }
+            else // Every request that isn't a HEAD or OPTIONS request
+            {
+                *found = per_methods_[static_cast<int>(method_actual)].trie.find(req.url);
+                // TODO(EDev): maybe ending the else here would allow the requests coming from above (after removing the return statement) to be checked on whether they actually point to a route
+                if (!found->rule_index)
+                {
+                    for (auto& per_method : per_methods_)
+                    {
+                        if (per_method.trie.find(req.url).rule_index) //Route found, but in another method
+                        {
+                            const std::string error_message(get_error(405, *found, req, res));
+                            CROW_LOG_DEBUG << "Cannot match method " << req.url << " " << method_name(method_actual) << ". " << error_message;
+                            res.end();
+                            return found;
+                        }
+                    }
+                    //Route does not exist anywhere
+
+                    const std::string error_message(get_error(404, *found, req, res));
+                    CROW_LOG_DEBUG << "Cannot match rules " << req.url << ". " << error_message;
+                    res.end();
+                    return found;
+                }
+
+                found->method = method_actual;
+                return found;
+            }
+        }
+
+        template<typename App>
+        void handle(request& req, response& res, const routing_handle_result& found)
+        {
+            HTTPMethod method_actual = found.method;
+            auto& rules = per_methods_[static_cast<int>(method_actual)].rules;
+            unsigned rule_index = found.rule_index;
+
+            if (rule_index >= rules.size())
+                throw std::runtime_error("Trie internal structure corrupted!");
+
+            if (rule_index == RULE_SPECIAL_REDIRECT_SLASH)
+            {
+                CROW_LOG_INFO << "Redirecting to a url with trailing slash: " << req.url;
+                res = response(301);
+                res.add_header("Location", req.url + "/");
+                res.end();
+                return;
+            }
+
+            CROW_LOG_DEBUG << "Matched rule '" << rules[rule_index]->rule_ << "' " << static_cast<uint32_t>(req.method) << " / " << rules[rule_index]->get_methods();
+
+            try
+            {
+                BaseRule& rule = *rules[rule_index];
+                handle_rule<App>(rule, req, res, found.r_params);
+            }
+            catch (...)
             {
-                void operator()(F cparams)
-                {
-                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<double, NDouble>>;
-                    call<F, NInt, NUint, NDouble + 1, NString, black_magic::S<Args1...>, pushed>()(cparams);
-                }
-            };
+                exception_handler_(res);
+                res.end();
+                return;
+            }
+        }
 
-            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1, typename... Args2>
-            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<std::string, Args1...>, black_magic::S<Args2...>>
+        template<typename App>
+        typename std::enable_if<std::tuple_size<typename App::mw_container_t>::value != 0, void>::type
+          handle_rule(BaseRule& rule, crow::request& req, crow::response& res, const crow::routing_params& rp)
+        {
+            if (!rule.mw_indices_.empty())
             {
-                void operator()(F cparams)
+                auto& ctx = *reinterpret_cast<typename App::context_t*>(req.middleware_context);
+                auto& container = *reinterpret_cast<typename App::mw_container_t*>(req.middleware_container);
+                detail::middleware_call_criteria_dynamic<false> crit_fwd(rule.mw_indices_.indices());
+
+                auto glob_completion_handler = std::move(res.complete_request_handler_);
+                res.complete_request_handler_ = [] {};
+
+                detail::middleware_call_helper<decltype(crit_fwd),
+                                               0, typename App::context_t, typename App::mw_container_t>(crit_fwd, container, req, res, ctx);
+
+                if (res.completed_)
                 {
-                    using pushed = typename black_magic::S<Args2...>::template push_back<call_pair<std::string, NString>>;
-                    call<F, NInt, NUint, NDouble, NString + 1, black_magic::S<Args1...>, pushed>()(cparams);
+                    glob_completion_handler();
+                    return;
                 }
-            };
 
-            template<typename F, int NInt, int NUint, int NDouble, int NString, typename... Args1>
-            struct call<F, NInt, NUint, NDouble, NString, black_magic::S<>, black_magic::S<Args1...>>
+                res.complete_request_handler_ = [&rule, &ctx, &container, &req, &res, glob_completion_handler] {
+                    detail::middleware_call_criteria_dynamic<true> crit_bwd(rule.mw_indices_.indices());
+
+                    detail::after_handlers_call_helper<
+                      decltype(crit_bwd),
+                      std::tuple_size<typename App::mw_container_t>::value - 1,
+                      typename App::context_t,
+                      typename App::mw_container_t>(crit_bwd, container, ctx, req, res);
+                    glob_completion_handler();
+                };
+            }
+            rule.handle(req, res, rp);
+        }
+
+        template<typename App>
+        typename std::enable_if<std::tuple_size<typename App::mw_container_t>::value == 0, void>::type
+          handle_rule(BaseRule& rule, crow::request& req, crow::response& res, const crow::routing_params& rp)
+        {
+            rule.handle(req, res, rp);
+        }
+
+        void debug_print()
+        {
+            for (int i = 0; i < static_cast<int>(HTTPMethod::InternalMethodCount); i++)
             {
-                void operator()(F cparams)
+                Trie& trie_ = per_methods_[i].trie;
+                if (!trie_.is_empty())
                 {
-                    cparams.handler(
-                      cparams.req,
-                      cparams.res,
-                      cparams.params.template get<typename Args1::type>(Args1::pos)...);
+                    CROW_LOG_DEBUG << method_name(static_cast<HTTPMethod>(i));
+                    trie_.debug_print();
                 }
-            };
+            }
+        }
 
-            template<typename Func, typename... ArgsWrapped>
-            struct Wrapped
+        std::vector<Blueprint*>& blueprints()
+        {
+            return blueprints_;
+        }
+
+        std::function<void(crow::response&)>& exception_handler()
+        {
+            return exception_handler_;
+        }
+
+        static void default_exception_handler(response& res)
+        {
+            // any uncaught exceptions become 500s
+            res = response(500);
+
+            try
             {
-                template<typename... Args>
-                void set_(Func f, typename std::enable_if<!std::is_same<typename std::tuple_element<0, std::tuple<Args..., void>>::type, const request&>::value, int>::type = 0)
-                {
-                    handler_ = ([f = std::move(f)](const request&, response& res, Args... args) {
-                        res = response(f(args...));
-                        res.end();
-                    });
-                }
+                throw;
+            }
+            catch (const bad_request& e)
+            {
+                res = response (400);
+                res.body = e.what();
+            }
+            catch (const std::exception& e)
+            {
+                CROW_LOG_ERROR << "An uncaught exception occurred: " << e.what();
+            }
+            catch (...)
+            {
+                CROW_LOG_ERROR << "An uncaught exception occurred. The type was unknown so no information was available.";
+            }
+        }
+
+    private:
+        CatchallRule catchall_rule_;
+
+        struct PerMethod
+        {
+            std::vector<BaseRule*> rules;
+            Trie trie;
+
+            // rule index 0, 1 has special meaning; preallocate it to avoid duplication.
+            PerMethod():
+              rules(2) {}
+        };
+        std::array<PerMethod, static_cast<int>(HTTPMethod::InternalMethodCount)> per_methods_;
+        std::vector<std::unique_ptr<BaseRule>> all_rules_;
+        std::vector<Blueprint*> blueprints_;
+        std::function<void(crow::response&)> exception_handler_ = &default_exception_handler;
+    };
+} // namespace crow
+
+
+namespace crow
+{
+    struct CORSHandler;
+
+    /// Used for tuning CORS policies
+    struct CORSRules
+    {
+        friend struct crow::CORSHandler;
+
+        /// Set Access-Control-Allow-Origin. Default is "*"
+        CORSRules& origin(const std::string& origin)
+        {
+            origin_ = origin;
+            return *this;
+        }
+
+        /// Set Access-Control-Allow-Methods. Default is "*"
+        CORSRules& methods(crow::HTTPMethod method)
+        {
+            add_list_item(methods_, crow::method_name(method));
+            return *this;
+        }
+
+        /// Set Access-Control-Allow-Methods. Default is "*"
+        template<typename... Methods>
+        CORSRules& methods(crow::HTTPMethod method, Methods... method_list)
+        {
+            add_list_item(methods_, crow::method_name(method));
+            methods(method_list...);
+            return *this;
+        }
+
+        /// Set Access-Control-Allow-Headers. Default is "*"
+        CORSRules& headers(const std::string& header)
+        {
+            add_list_item(headers_, header);
+            return *this;
+        }
+
+        /// Set Access-Control-Allow-Headers. Default is "*"
+        template<typename... Headers>
+        CORSRules& headers(const std::string& header, Headers... header_list)
+        {
+            add_list_item(headers_, header);
+            headers(header_list...);
+            return *this;
+        }
+
+        /// Set Access-Control-Expose-Headers. Default is none
+        CORSRules& expose(const std::string& header)
+        {
+            add_list_item(exposed_headers_, header);
+            return *this;
+        }
+
+        /// Set Access-Control-Expose-Headers. Default is none
+        template<typename... Headers>
+        CORSRules& expose(const std::string& header, Headers... header_list)
+        {
+            add_list_item(exposed_headers_, header);
+            expose(header_list...);
+            return *this;
+        }
+
+        /// Set Access-Control-Max-Age. Default is none
+        CORSRules& max_age(int max_age)
+        {
+            max_age_ = std::to_string(max_age);
+            return *this;
+        }
+
+        /// Enable Access-Control-Allow-Credentials
+        CORSRules& allow_credentials()
+        {
+            allow_credentials_ = true;
+            return *this;
+        }
+
+        /// Ignore CORS and don't send any headers
+        void ignore()
+        {
+            ignore_ = true;
+        }
+
+        /// Handle CORS on specific prefix path
+        CORSRules& prefix(const std::string& prefix);
+
+        /// Handle CORS for specific blueprint
+        CORSRules& blueprint(const Blueprint& bp);
+
+        /// Global CORS policy
+        CORSRules& global();
+
+    private:
+        CORSRules() = delete;
+        CORSRules(CORSHandler* handler):
+          handler_(handler) {}
+
+        /// build comma separated list
+        void add_list_item(std::string& list, const std::string& val)
+        {
+            if (list == "*") list = "";
+            if (list.size() > 0) list += ", ";
+            list += val;
+        }
+
+        /// Set header `key` to `value` if it is not set
+        void set_header_no_override(const std::string& key, const std::string& value, crow::response& res)
+        {
+            if (value.size() == 0) return;
+            if (!get_header_value(res.headers, key).empty()) return;
+            res.add_header(key, value);
+        }
+
+        /// Set response headers
+        void apply(const request& req, response& res)
+        {
+            if (ignore_) return;
 
-                template<typename Req, typename... Args>
-                struct req_handler_wrapper
+            set_header_no_override("Access-Control-Allow-Methods", methods_, res);
+            set_header_no_override("Access-Control-Allow-Headers", headers_, res);
+            set_header_no_override("Access-Control-Expose-Headers", exposed_headers_, res);
+            set_header_no_override("Access-Control-Max-Age", max_age_, res);
+
+            bool origin_set = false;
+
+            if (req.method != HTTPMethod::Options)
+            {
+                if (allow_credentials_)
                 {
-                    req_handler_wrapper(Func fun):
-                      f(std::move(fun))
+                    set_header_no_override("Access-Control-Allow-Credentials", "true", res);
+                    if (origin_ == "*")
                     {
+                        set_header_no_override("Access-Control-Allow-Origin", req.get_header_value("Origin"), res);
+                        origin_set = true;
                     }
+                }
+            }
 
-                    void operator()(const request& req, response& res, Args... args)
-                    {
-                        res = response(f(req, args...));
-                        res.end();
-                    }
+            if( !origin_set){
+                set_header_no_override("Access-Control-Allow-Origin", origin_, res);
+            }
+        }
 
-                    Func f;
-                };
+        bool ignore_ = false;
+        // TODO: support multiple origins that are dynamically selected
+        std::string origin_ = "*";
+        std::string methods_ = "*";
+        std::string headers_ = "*";
+        std::string exposed_headers_;
+        std::string max_age_;
+        bool allow_credentials_ = false;
 
-                template<typename... Args>
-                void set_(Func f, typename std::enable_if<
-                                    std::is_same<typename std::tuple_element<0, std::tuple<Args..., void>>::type, const request&>::value &&
-                                      !std::is_same<typename std::tuple_element<1, std::tuple<Args..., void, void>>::type, response&>::value,
-                                    int>::type = 0)
-                {
-                    handler_ = req_handler_wrapper<Args...>(std::move(f));
-                    /*handler_ = (
-                        [f = std::move(f)]
-                        (const request& req, response& res, Args... args){
-                             res = response(f(req, args...));
-                             res.end();
-                        });*/
-                }
+        CORSHandler* handler_;
+    };
 
-                template<typename... Args>
-                void set_(Func f, typename std::enable_if<
-                                    std::is_same<typename std::tuple_element<0, std::tuple<Args..., void>>::type, const request&>::value &&
-                                      std::is_same<typename std::tuple_element<1, std::tuple<Args..., void, void>>::type, response&>::value,
-                                    int>::type = 0)
-                {
-                    handler_ = std::move(f);
-                }
+    /// CORSHandler is a global middleware for setting CORS headers.
 
-                template<typename... Args>
-                struct handler_type_helper
-                {
-                    using type = std::function<void(const crow::request&, crow::response&, Args...)>;
-                    using args_type = black_magic::S<typename black_magic::promote_t<Args>...>;
-                };
+    ///
+    /// By default, it sets Access-Control-Allow-Origin/Methods/Headers to "*".
+    /// The default behaviour can be changed with the `global()` cors rule.
+    /// Additional rules for prexies can be added with `prefix()`.
+    struct CORSHandler
+    {
+        struct context
+        {};
 
-                template<typename... Args>
-                struct handler_type_helper<const request&, Args...>
-                {
-                    using type = std::function<void(const crow::request&, crow::response&, Args...)>;
-                    using args_type = black_magic::S<typename black_magic::promote_t<Args>...>;
-                };
+        void before_handle(crow::request& /*req*/, crow::response& /*res*/, context& /*ctx*/)
+        {}
 
-                template<typename... Args>
-                struct handler_type_helper<const request&, response&, Args...>
-                {
-                    using type = std::function<void(const crow::request&, crow::response&, Args...)>;
-                    using args_type = black_magic::S<typename black_magic::promote_t<Args>...>;
-                };
+        void after_handle(crow::request& req, crow::response& res, context& /*ctx*/)
+        {
+            auto& rule = find_rule(req.url);
+            rule.apply(req, res);
+        }
 
-                typename handler_type_helper<ArgsWrapped...>::type handler_;
+        /// Handle CORS on a specific prefix path
+        CORSRules& prefix(const std::string& prefix)
+        {
+            rules.emplace_back(prefix, CORSRules(this));
+            return rules.back().second;
+        }
 
-                void operator()(request& req, response& res, const routing_params& params)
+        /// Handle CORS for a specific blueprint
+        CORSRules& blueprint(const Blueprint& bp)
+        {
+            rules.emplace_back(bp.prefix(), CORSRules(this));
+            return rules.back().second;
+        }
+
+        /// Get the global CORS policy
+        CORSRules& global()
+        {
+            return default_;
+        }
+
+    private:
+        CORSRules& find_rule(const std::string& path)
+        {
+            // TODO: use a trie in case of many rules
+            for (auto& rule : rules)
+            {
+                // Check if path starts with a rules prefix
+                if (path.rfind(rule.first, 0) == 0)
                 {
-                    detail::routing_handler_call_helper::call<
-                      detail::routing_handler_call_helper::call_params<
-                        decltype(handler_)>,
-                      0, 0, 0, 0,
-                      typename handler_type_helper<ArgsWrapped...>::args_type,
-                      black_magic::S<>>()(
-                      detail::routing_handler_call_helper::call_params<
-                        decltype(handler_)>{handler_, params, req, res});
+                    return rule.second;
                 }
-            };
+            }
+            return default_;
+        }
 
-        } // namespace routing_handler_call_helper
-    }     // namespace detail
+        std::vector<std::pair<std::string, CORSRules>> rules;
+        CORSRules default_ = CORSRules(this);
+    };
 
+    inline CORSRules& CORSRules::prefix(const std::string& prefix)
+    {
+        return handler_->prefix(prefix);
+    }
 
-    class CatchallRule
+    inline CORSRules& CORSRules::blueprint(const Blueprint& bp)
     {
-    public:
-        /// @cond SKIP
-        CatchallRule() {}
+        return handler_->blueprint(bp);
+    }
 
-        template<typename Func>
-        typename std::enable_if<black_magic::CallHelper<Func, black_magic::S<>>::value, void>::type
-          operator()(Func&& f)
-        {
-            static_assert(!std::is_same<void, decltype(f())>::value,
-                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
+    inline CORSRules& CORSRules::global()
+    {
+        return handler_->global();
+    }
 
-            handler_ = ([f = std::move(f)](const request&, response& res) {
-                res = response(f());
-                res.end();
-            });
-        }
+} // namespace crow
 
-        template<typename Func>
-        typename std::enable_if<
-          !black_magic::CallHelper<Func, black_magic::S<>>::value &&
-            black_magic::CallHelper<Func, black_magic::S<crow::request>>::value,
-          void>::type
-          operator()(Func&& f)
-        {
-            static_assert(!std::is_same<void, decltype(f(std::declval<crow::request>()))>::value,
-                          "Handler function cannot have void return type; valid return types: string, int, crow::response, crow::returnable");
 
-            handler_ = ([f = std::move(f)](const request& req, response& res) {
-                res = response(f(req));
-                res.end();
-            });
-        }
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
-        template<typename Func>
-        typename std::enable_if<
-          !black_magic::CallHelper<Func, black_magic::S<>>::value &&
-            !black_magic::CallHelper<Func, black_magic::S<crow::request>>::value &&
-            black_magic::CallHelper<Func, black_magic::S<crow::response&>>::value,
-          void>::type
-          operator()(Func&& f)
+namespace crow
+{
+    struct ResponseCache;
+
+    /// Caching policy for a set of URLs, see \ref ResponseCache.
+    struct CacheRules
+    {
+        friend struct crow::ResponseCache;
+
+        /// How long a response is served from the cache. Zero (the default) disables caching.
+        CacheRules& ttl(std::chrono::milliseconds ttl)
         {
-            static_assert(std::is_same<void, decltype(f(std::declval<crow::response&>()))>::value,
-                          "Handler function with response argument should have void return type");
-            handler_ = ([f = std::move(f)](const request&, response& res) {
-                f(res);
-            });
+            ttl_ = ttl;
+            return *this;
         }
 
-        template<typename Func>
-        typename std::enable_if<
-          !black_magic::CallHelper<Func, black_magic::S<>>::value &&
-            !black_magic::CallHelper<Func, black_magic::S<crow::request>>::value &&
-            !black_magic::CallHelper<Func, black_magic::S<crow::response&>>::value,
-          void>::type
-          operator()(Func&& f)
+        /// How long after the TTL a stale response is still served while a fresh one is generated.
+        CacheRules& stale_while_revalidate(std::chrono::milliseconds window)
         {
-            static_assert(std::is_same<void, decltype(f(std::declval<crow::request>(), std::declval<crow::response&>()))>::value,
-                          "Handler function with response argument should have void return type");
-
-            handler_ = std::move(f);
+            stale_ = window;
+            return *this;
         }
-        /// @endcond
-        bool has_handler()
+
+        /// Keep a separate response for every value of a request header.
+
+        ///
+        /// Requests carrying an `Authorization` header are only cached if it's listed here.
+        CacheRules& vary(const std::string& header)
         {
-            return (handler_ != nullptr);
+            vary_.push_back(header);
+            return *this;
         }
 
-    protected:
-        friend class Router;
-
     private:
-        std::function<void(const crow::request&, crow::response&)> handler_;
+        std::chrono::milliseconds ttl_{0};
+        std::chrono::milliseconds stale_{0};
+        std::vector<std::string> vary_;
     };
 
-
-    /// A rule dealing with websockets.
+    /// ResponseCache is a global middleware serving whole responses (status, headers and body) to GET and HEAD requests from memory.
 
     ///
-    /// Provides the interface for the user to put in the necessary handlers for a websocket to work.
-    template<typename App>
-    class WebSocketRule : public BaseRule
+    /// Nothing is cached until a rule with a TTL matches the URL, rules are set with `route()` (exact path) and `prefix()`, the first match wins.
+    /// Responses are keyed by URL (query string included) and the values of the rule's `vary()` headers.
+    /// Only `200` responses are stored, unless they set a cookie, come from a static file or have `Cache-Control: no-store` or `private`.
+    ///
+    /// Entries live in LRU lists split across shards (each with its own lock) and are evicted once they exceed the byte budget.
+    /// When a rule allows stale responses, the first request past the TTL gets the stale one too and the route is run again in the background.
+    /// That needs \ref revalidate_with(), otherwise that first request goes through the handler while the others keep getting the stale response.
+    ///
+    /// Handlers that change the data call \ref invalidate() or \ref invalidate_prefix().
+    /// Middlewares listed before this one run on every request, those after it are skipped for cached responses.
+    struct ResponseCache
     {
-        using self_t = WebSocketRule;
-
-    public:
-        WebSocketRule(std::string rule, App* app):
-          BaseRule(std::move(rule)),
-          app_(app),
-          max_payload_(UINT64_MAX)
-        {}
+        struct context
+        {
+            std::string key;
+            const CacheRules* rules{};
+            uint64_t generation{};
+            bool store{};
+        };
 
-        void validate() override
+        struct statistics
+        {
+            uint64_t hits;
+            uint64_t stale_hits;
+            uint64_t misses;
+            uint64_t evictions;
+            size_t bytes;
+            size_t entries;
+        };
+
+        ResponseCache():
+          shards_(new shard[shard_count])
         {}
 
-        void handle(request&, response& res, const routing_params&) override
+        void before_handle(request& req, response& res, context& ctx)
         {
-            res = response(404);
+            if (req.method != HTTPMethod::Get && req.method != HTTPMethod::Head)
+                return;
+            const CacheRules& rules = find_rule(req.url);
+            if (rules.ttl_.count() == 0)
+                return;
+            if (req.headers.count("Authorization") && !varies_on(rules, "Authorization"))
+                return;
+
+            ctx.key = req.raw_url;
+            for (const auto& header : rules.vary_)
+            {
+                ctx.key += '\n';
+                ctx.key += req.get_header_value(header);
+            }
+            ctx.rules = &rules;
+            ctx.generation = generation_.load(std::memory_order_acquire);
+
+            std::shared_ptr<const cached_response> cached;
+            bool stale = false, refresh = false;
+            auto now = std::chrono::steady_clock::now();
+            shard& s = shard_for(ctx.key);
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                auto it = s.index.find(ctx.key);
+                if (it != s.index.end())
+                {
+                    entry& e = *it->second;
+                    if (now < e.expires)
+                        cached = e.response;
+                    else if (now < e.stale_until)
+                    {
+                        stale = true;
+                        if (!e.refreshing)
+                        {
+                            e.refreshing = true;
+                            refresh = true;
+                        }
+                        if (!refresh || refresher_)
+                            cached = e.response;
+                    }
+                    else
+                        s.erase(it->second);
+
+                    if (cached)
+                        s.lru.splice(s.lru.begin(), s.lru, it->second);
+                }
+            }
+
+            if (!cached)
+            {
+                // Stale entries without a refresher get refreshed by the request that noticed first
+                misses_.fetch_add(1, std::memory_order_relaxed);
+                ctx.store = req.method == HTTPMethod::Get;
+                return;
+            }
+
+            (stale ? stale_hits_ : hits_).fetch_add(1, std::memory_order_relaxed);
+            res.code = cached->code;
+            res.headers = cached->headers;
+            res.body = cached->body;
+            res.set_header("Age", std::to_string(std::chrono::duration_cast<std::chrono::seconds>(now - cached->stored).count()));
             res.end();
+
+            if (refresh)
+                revalidate(req, ctx);
         }
 
-        void handle_upgrade(const request& req, response&, SocketAdaptor&& adaptor) override
+        void after_handle(request& req, response& res, context& ctx)
         {
-            max_payload_ = max_payload_override_ ? max_payload_ : app_->websocket_max_payload();
-            new crow::websocket::Connection<SocketAdaptor, App>(req, std::move(adaptor), app_, max_payload_, subprotocols_, open_handler_, message_handler_, close_handler_, error_handler_, accept_handler_, mirror_protocols_);
+            if (!ctx.store)
+                return;
+            if (!store(ctx, req.url, res))
+                done_refreshing(ctx.key);
         }
-#ifdef CROW_ENABLE_SSL
-        void handle_upgrade(const request& req, response&, SSLAdaptor&& adaptor) override
+
+        /// Set the caching policy of an exact path.
+        CacheRules& route(const std::string& path)
         {
-            new crow::websocket::Connection<SSLAdaptor, App>(req, std::move(adaptor), app_, max_payload_, subprotocols_, open_handler_, message_handler_, close_handler_, error_handler_, accept_handler_, mirror_protocols_);
+            rules_.emplace_back(rule{path, false, {}});
+            return rules_.back().rules;
         }
-#endif
 
-        /// Override the global payload limit for this single WebSocket rule
-        self_t& max_payload(uint64_t max_payload)
+        /// Set the caching policy of every path starting with a prefix.
+        CacheRules& prefix(const std::string& prefix)
         {
-            max_payload_ = max_payload;
-            max_payload_override_ = true;
-            return *this;
+            rules_.emplace_back(rule{prefix, true, {}});
+            return rules_.back().rules;
         }
 
-        self_t& subprotocols(const std::vector<std::string>& subprotocols)
+        /// Set the caching policy of paths no other rule matches (disabled by default).
+        CacheRules& global()
         {
-            subprotocols_ = subprotocols;
-            return *this;
+            return default_;
         }
 
-        template<typename Func>
-        self_t& onopen(Func f)
+        /// Limit the memory taken by cached responses (64 MiB by default).
+        ResponseCache& max_bytes(size_t bytes)
         {
-            open_handler_ = f;
+            max_bytes_ = bytes;
             return *this;
         }
 
-        template<typename Func>
-        self_t& onmessage(Func f)
+        /// Regenerate stale responses in the background by running the app's route with a copy of the request.
+
+        ///
+        /// The copy goes through the route's own middlewares but not the global ones, and runs on the thread that served the stale response.
+        template<typename App>
+        ResponseCache& revalidate_with(App& app)
         {
-            message_handler_ = f;
+            refresher_ = [&app](const request& original, std::function<void(request&, response&)> done) {
+                struct state
+                {
+                    request req;
+                    response res;
+                    typename App::context_t ctx;
+                };
+                auto st = std::make_shared<state>();
+                st->req.method = HTTPMethod::Get;
+                st->req.raw_url = original.raw_url;
+                st->req.url = original.url;
+                st->req.url_params = original.url_params;
+                st->req.headers = original.headers;
+                st->req.remote_ip_address = original.remote_ip_address;
+                st->req.http_ver_major = original.http_ver_major;
+                st->req.http_ver_minor = original.http_ver_minor;
+                st->req.middleware_context = static_cast<void*>(&st->ctx);
+                st->req.middleware_container = original.middleware_container;
+                st->req.io_context = original.io_context;
+
+                asio::post(*original.io_context, [&app, st, done = std::move(done)]() mutable {
+                    st->res.complete_request_handler_ = [st, done = std::move(done)] {
+                        done(st->req, st->res);
+                    };
+                    app.handle_full(st->req, st->res);
+                });
+            };
             return *this;
         }
 
-        template<typename Func>
-        self_t& onclose(Func f)
+        /// Drop the cached responses of a path, whatever their query string.
+        void invalidate(const std::string& path)
         {
-            close_handler_ = f;
-            return *this;
+            invalidate_if([&path](const std::string& p) {
+                return p == path;
+            });
         }
 
-        template<typename Func>
-        self_t& onerror(Func f)
+        /// Drop the cached responses of every path starting with a prefix.
+        void invalidate_prefix(const std::string& prefix)
         {
-            error_handler_ = f;
-            return *this;
+            invalidate_if([&prefix](const std::string& p) {
+                return p.compare(0, prefix.size(), prefix) == 0;
+            });
         }
 
-        template<typename Func>
-        self_t& onaccept(Func f)
+        /// Drop every cached response.
+        void clear()
         {
-            accept_handler_ = f;
-            return *this;
+            invalidate_if([](const std::string&) {
+                return true;
+            });
         }
 
-        self_t& mirrorprotocols(bool mirror_protocols = true)
+        statistics stats() const
         {
-            mirror_protocols_ = mirror_protocols;
-            return *this;
+            statistics result{hits_.load(std::memory_order_relaxed), stale_hits_.load(std::memory_order_relaxed),
+                              misses_.load(std::memory_order_relaxed), evictions_.load(std::memory_order_relaxed), 0, 0};
+            for (size_t i = 0; i < shard_count; i++)
+            {
+                std::lock_guard<std::mutex> lock(shards_[i].mutex);
+                result.bytes += shards_[i].bytes;
+                result.entries += shards_[i].index.size();
+            }
+            return result;
         }
 
-    protected:
-        App* app_;
-        std::function<void(crow::websocket::connection&)> open_handler_;
-        std::function<void(crow::websocket::connection&, const std::string&, bool)> message_handler_;
-        std::function<void(crow::websocket::connection&, const std::string&, uint16_t)> close_handler_;
-        std::function<void(crow::websocket::connection&, const std::string&)> error_handler_;
-        std::function<bool(const crow::request&, void**)> accept_handler_;
-        bool mirror_protocols_ = false;
-        uint64_t max_payload_;
-        bool max_payload_override_ = false;
-        std::vector<std::string> subprotocols_;
-    };
+    private:
+        static constexpr size_t shard_count = 16;
 
-    /// Allows the user to assign parameters using functions.
+        struct cached_response
+        {
+            int code;
+            ci_map headers;
+            std::string body;
+            std::chrono::steady_clock::time_point stored;
+        };
 
-    ///
-    /// `rule.name("name").methods(HTTPMethod::POST)`
-    template<typename T>
-    struct RuleParameterTraits
-    {
-        using self_t = T;
+        struct entry
+        {
+            std::string key;
+            std::string path;
+            std::shared_ptr<const cached_response> response;
+            std::chrono::steady_clock::time_point expires;
+            std::chrono::steady_clock::time_point stale_until;
+            size_t size;
+            bool refreshing;
+        };
 
-        template<typename App>
-        WebSocketRule<App>& websocket(App* app)
+        struct shard
         {
-            auto p = new WebSocketRule<App>(static_cast<self_t*>(this)->rule_, app);
-            static_cast<self_t*>(this)->rule_to_upgrade_.reset(p);
-            return *p;
-        }
+            mutable std::mutex mutex;
+            std::list<entry> lru; ///< Most recently used first.
+            std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+            size_t bytes{};
 
-        self_t& name(std::string name) noexcept
+            void erase(std::list<entry>::iterator it)
+            {
+                bytes -= it->size;
+                index.erase(it->key);
+                lru.erase(it);
+            }
+        };
+
+        struct rule
         {
-            static_cast<self_t*>(this)->name_ = std::move(name);
-            return static_cast<self_t&>(*this);
-        }
+            std::string path;
+            bool is_prefix;
+            CacheRules rules;
+        };
 
-        self_t& methods(HTTPMethod method)
+        const CacheRules& find_rule(const std::string& path) const
         {
-            static_cast<self_t*>(this)->methods_ = 1 << static_cast<int>(method);
-            return static_cast<self_t&>(*this);
+            for (const auto& r : rules_)
+            {
+                if (r.is_prefix ? path.compare(0, r.path.size(), r.path) == 0 : path == r.path)
+                    return r.rules;
+            }
+            return default_;
         }
 
-        template<typename... MethodArgs>
-        self_t& methods(HTTPMethod method, MethodArgs... args_method)
+        static bool varies_on(const CacheRules& rules, const char* header)
         {
-            methods(args_method...);
-            static_cast<self_t*>(this)->methods_ |= 1 << static_cast<int>(method);
-            return static_cast<self_t&>(*this);
+            for (const auto& h : rules.vary_)
+            {
+                if (utility::string_equals(h, header))
+                    return true;
+            }
+            return false;
         }
 
-        /// Enable local middleware for this handler
-        template<typename App, typename... Middlewares>
-        self_t& middlewares()
+        static bool has_directive(const std::string& value, std::string_view directive)
         {
-            static_cast<self_t*>(this)->mw_indices_.template push<App, Middlewares...>();
-            return static_cast<self_t&>(*this);
+            for (size_t i = 0; i + directive.size() <= value.size(); i++)
+            {
+                if (utility::string_equals(std::string_view(value).substr(i, directive.size()), directive))
+                    return true;
+            }
+            return false;
         }
-    };
 
-    /// A rule that can change its parameters during runtime.
-    class DynamicRule : public BaseRule, public RuleParameterTraits<DynamicRule>
-    {
-    public:
-        DynamicRule(std::string rule):
-          BaseRule(std::move(rule))
-        {}
+        shard& shard_for(const std::string& key)
+        {
+            return shards_[std::hash<std::string>()(key) % shard_count];
+        }
 
-        void validate() override
+        bool store(const context& ctx, const std::string& path, response& res)
         {
-            if (!erased_handler_)
+            if (res.code != 200 || res.is_static_type() || res.headers.count("Set-Cookie"))
+                return false;
+            const std::string& cache_control = res.get_header_value("Cache-Control");
+            if (has_directive(cache_control, "no-store") || has_directive(cache_control, "private"))
+                return false;
+            // Responses generated before an invalidation may already be out of date
+            if (generation_.load(std::memory_order_acquire) != ctx.generation)
+                return false;
+
+            res.dump_json_body();
+            auto cached = std::make_shared<cached_response>();
+            cached->code = res.code;
+            cached->headers = res.headers;
+            cached->body = res.body;
+            cached->stored = std::chrono::steady_clock::now();
+
+            size_t size = sizeof(entry) + 2 * ctx.key.size() + path.size() + cached->body.size();
+            for (const auto& header : cached->headers)
+                size += header.first.size() + header.second.size();
+            size_t budget = max_bytes_ / shard_count;
+            if (size > budget)
+                return false;
+
+            shard& s = shard_for(ctx.key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = s.index.find(ctx.key);
+            if (it != s.index.end())
+                s.erase(it->second);
+            while (s.bytes + size > budget && !s.lru.empty())
             {
-                throw std::runtime_error(name_ + (!name_.empty() ? ": " : "") + "no handler for url " + rule_);
+                s.erase(std::prev(s.lru.end()));
+                evictions_.fetch_add(1, std::memory_order_relaxed);
             }
+
+            s.lru.push_front(entry{ctx.key, path, std::move(cached), {}, {}, size, false});
+            entry& e = s.lru.front();
+            e.expires = e.response->stored + ctx.rules->ttl_;
+            e.stale_until = e.expires + ctx.rules->stale_;
+            s.index.emplace(e.key, s.lru.begin());
+            s.bytes += size;
+            return true;
         }
 
-        void handle(request& req, response& res, const routing_params& params) override
+        void done_refreshing(const std::string& key)
         {
-            if (!custom_templates_base.empty())
-                mustache::set_base(custom_templates_base);
-            else if (mustache::detail::get_template_base_directory_ref() != "templates")
-                mustache::set_base("templates");
-            erased_handler_(req, res, params);
+            shard& s = shard_for(key);
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto it = s.index.find(key);
+            if (it != s.index.end())
+                it->second->refreshing = false;
         }
 
-        template<typename Func>
-        void operator()(Func f)
+        void revalidate(const request& req, const context& ctx)
         {
-#ifdef CROW_MSVC_WORKAROUND
-            using function_t = utility::function_traits<decltype(&Func::operator())>;
-#else
-            using function_t = utility::function_traits<Func>;
-#endif
-            erased_handler_ = wrap(std::move(f), black_magic::gen_seq<function_t::arity>());
+            if (!req.io_context)
+            {
+                done_refreshing(ctx.key);
+                return;
+            }
+            context refresh_ctx = ctx;
+            refresh_ctx.generation = generation_.load(std::memory_order_acquire);
+            refresher_(req, [this, refresh_ctx](request& r, response& res) {
+                if (!store(refresh_ctx, r.url, res))
+                    done_refreshing(refresh_ctx.key);
+            });
         }
 
-        // enable_if Arg1 == request && Arg2 == response
-        // enable_if Arg1 == request && Arg2 != resposne
-        // enable_if Arg1 != request
-#ifdef CROW_MSVC_WORKAROUND
-        template<typename Func, size_t... Indices>
-#else
-        template<typename Func, unsigned... Indices>
-#endif
-        std::function<void(request&, response&, const routing_params&)>
-          wrap(Func f, black_magic::seq<Indices...>)
+        template<typename Predicate>
+        void invalidate_if(Predicate predicate)
         {
-#ifdef CROW_MSVC_WORKAROUND
-            using function_t = utility::function_traits<decltype(&Func::operator())>;
-#else
-            using function_t = utility::function_traits<Func>;
-#endif
-            if (!black_magic::is_parameter_tag_compatible(
-                  black_magic::get_parameter_tag_runtime(rule_.c_str()),
-                  black_magic::compute_parameter_tag_from_args_list<
-                    typename function_t::template arg<Indices>...>::value))
+            generation_.fetch_add(1, std::memory_order_acq_rel);
+            for (size_t i = 0; i < shard_count; i++)
             {
-                throw std::runtime_error("route_dynamic: Handler type is mismatched with URL parameters: " + rule_);
+                shard& s = shards_[i];
+                std::lock_guard<std::mutex> lock(s.mutex);
+                for (auto it = s.lru.begin(); it != s.lru.end();)
+                {
+                    auto next = std::next(it);
+                    if (predicate(it->path))
+                        s.erase(it);
+                    it = next;
+                }
             }
-            auto ret = detail::routing_handler_call_helper::Wrapped<Func, typename function_t::template arg<Indices>...>();
-            ret.template set_<
-              typename function_t::template arg<Indices>...>(std::move(f));
-            return ret;
         }
 
-        template<typename Func>
-        void operator()(std::string name, Func&& f)
+        std::vector<rule> rules_;
+        CacheRules default_;
+        size_t max_bytes_ = 64 * 1024 * 1024;
+        std::unique_ptr<shard[]> shards_;
+        std::atomic<uint64_t> generation_{0};
+        std::function<void(const request&, std::function<void(request&, response&)>)> refresher_;
+        std::atomic<uint64_t> hits_{0}, stale_hits_{0}, misses_{0}, evictions_{0};
+    };
+} // namespace crow
+
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace crow
+{
+    struct RateLimiter;
+
+    /// Request rate allowed to each client for a set of URLs, see \ref RateLimiter.
+    struct RateLimitRules
+    {
+        friend struct crow::RateLimiter;
+
+        /// Allow a number of requests per period on average. Zero (the default) disables limiting.
+        RateLimitRules& rate(double requests, std::chrono::milliseconds period = std::chrono::seconds(1))
         {
-            name_ = std::move(name);
-            (*this).template operator()<Func>(std::forward(f));
+            interval_ = requests > 0 ? static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(period).count() / requests) : 0;
+            return *this;
+        }
+
+        /// How many requests can be made at once after a quiet period (1 by default).
+        RateLimitRules& burst(unsigned requests)
+        {
+            burst_ = requests ? requests : 1;
+            return *this;
         }
 
     private:
-        std::function<void(request&, response&, const routing_params&)> erased_handler_;
+        uint64_t interval_{0}; ///< Time a token takes to come back, in nanoseconds.
+        unsigned burst_{1};
     };
 
-    /// Default rule created when CROW_ROUTE is called.
-    template<typename... Args>
-    class TaggedRule : public BaseRule, public RuleParameterTraits<TaggedRule<Args...>>
-    {
-    public:
-        using self_t = TaggedRule<Args...>;
+    /// RateLimiter is a global middleware answering `429 Too Many Requests` (with `Retry-After`) to clients going over their rate.
+
+    ///
+    /// Each client (by remote IP, or a header set with `client_header()` when behind a proxy) gets a token bucket per route class.
+    /// Classes are set with `route()` (exact path) and `prefix()`, the first match wins, `global()` applies to every other path.
+    ///
+    /// A bucket is stored as the time it'll be full again (the "theoretical arrival time" of GCRA), so taking a token and refilling it lazily
+    /// is a single compare and swap. Buckets live in a fixed size table of cache line sized groups, without any lock.
+    /// A bucket that's full again is the same as no bucket at all, so idle ones are dropped from time to time and their slots reused.
+    /// Under heavy contention on a single client, or when a group overflows, a few requests may be let through that shouldn't have been.
+    ///
+    /// List it first, so that nothing else runs for rejected requests.
+    struct RateLimiter
+    {
+        struct context
+        {};
+
+        RateLimiter()
+        {
+            capacity(64 * 1024);
+        }
+
+        void before_handle(request& req, response& res, context& /*ctx*/)
+        {
+            size_t rule_index;
+            const RateLimitRules& rules = find_rule(req.url, rule_index);
+            if (!rules.interval_)
+                return;
+
+            std::string_view client = req.remote_ip_address;
+            if (!client_header_.empty())
+            {
+                const std::string& forwarded = req.get_header_value(client_header_);
+                if (auto forwarded_for = forwarded_client(forwarded); !forwarded_for.empty())
+                    client = forwarded_for;
+            }
+
+            uint64_t now = clock();
+            uint64_t retry = take(key(client, rule_index), rules, now);
+            if (!retry)
+                return;
 
-        TaggedRule(std::string rule):
-          BaseRule(std::move(rule))
+            rejected_.fetch_add(1, std::memory_order_relaxed);
+            res.code = 429;
+            res.set_header("Retry-After", std::to_string((retry + 999999999) / 1000000000));
+            res.end();
+        }
+
+        void after_handle(request& /*req*/, response& /*res*/, context& /*ctx*/)
         {}
 
-        void validate() override
+        /// Set the rate of an exact path.
+        RateLimitRules& route(const std::string& path)
         {
-            if (rule_.at(0) != '/')
-                throw std::runtime_error("Internal error: Routes must start with a '/'");
+            rules_.emplace_back(rule{path, false, {}});
+            return rules_.back().rules;
+        }
 
-            if (!handler_)
-            {
-                throw std::runtime_error(name_ + (!name_.empty() ? ": " : "") + "no handler for url " + rule_);
-            }
+        /// Set the rate of every path starting with a prefix.
+        RateLimitRules& prefix(const std::string& prefix)
+        {
+            rules_.emplace_back(rule{prefix, true, {}});
+            return rules_.back().rules;
         }
 
-        template<typename Func>
-        void operator()(Func&& f)
+        /// Set the rate of paths no other rule matches (unlimited by default).
+        RateLimitRules& global()
         {
-            handler_ = ([f = std::move(f)](request& req, response& res, Args... args) {
-                detail::wrapped_handler_call(req, res, f, std::forward<Args>(args)...);
-            });
+            return default_;
         }
 
-        template<typename Func>
-        void operator()(std::string name, Func&& f)
+        /// Identify clients by the address a header (like `X-Forwarded-For`) got from the outermost of `trusted_proxies` proxies, when there is one.
+
+        ///
+        /// Proxies append the address they got the request from, so the addresses are counted from the right, the ones before are up to the client.
+        /// Only use this behind proxies that set the header, clients could pick their own key otherwise.
+        RateLimiter& client_header(const std::string& header, unsigned trusted_proxies = 1)
         {
-            name_ = std::move(name);
-            (*this).template operator()<Func>(std::forward(f));
+            client_header_ = header;
+            trusted_proxies_ = std::max(trusted_proxies, 1u);
+            return *this;
         }
 
-        void handle(request& req, response& res, const routing_params& params) override
+        /// Set how many buckets can be tracked at once (65536 by default), before the app runs.
+        RateLimiter& capacity(size_t buckets)
         {
-            if (!custom_templates_base.empty())
-                mustache::set_base(custom_templates_base);
-            else if (mustache::detail::get_template_base_directory_ref() != mustache::detail::get_global_template_base_directory_ref())
-                mustache::set_base(mustache::detail::get_global_template_base_directory_ref());
+            size_t groups = 1;
+            while (groups * group_size < buckets)
+                groups <<= 1;
+            group_mask_ = groups - 1;
+            groups_.reset(new group[groups]);
+            shard_size_ = groups < shard_count ? 1 : groups / shard_count;
+            for (auto& s : shards_)
+                s.next_sweep.store(0, std::memory_order_relaxed);
+            return *this;
+        }
 
-            detail::routing_handler_call_helper::call<
-              detail::routing_handler_call_helper::call_params<decltype(handler_)>,
-              0, 0, 0, 0,
-              black_magic::S<Args...>,
-              black_magic::S<>>()(
-              detail::routing_handler_call_helper::call_params<decltype(handler_)>{handler_, params, req, res});
+        /// Drop buckets that have been full for this long (one minute by default).
+        RateLimiter& idle_timeout(std::chrono::milliseconds timeout)
+        {
+            idle_ = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(timeout).count());
+            return *this;
+        }
+
+        /// How many requests have been turned away.
+        uint64_t rejected() const
+        {
+            return rejected_.load(std::memory_order_relaxed);
         }
 
     private:
-        std::function<void(crow::request&, crow::response&, Args...)> handler_;
-    };
+        static constexpr size_t group_size = 4;
+        static constexpr size_t shard_count = 16;
 
-    const int RULE_SPECIAL_REDIRECT_SLASH = 1;
+        struct slot
+        {
+            std::atomic<uint64_t> key{0};     ///< 0 when free.
+            std::atomic<uint64_t> arrival{0}; ///< When the bucket is full again, in nanoseconds since the limiter was created.
+        };
 
+        struct alignas(64) group
+        {
+            slot slots[group_size];
+        };
 
-    /// A search tree.
-    class Trie
-    {
-    public:
-        struct Node
+        /// Groups are swept a shard at a time, by whichever request notices it's due.
+        struct alignas(64) shard
         {
-            uint16_t rule_index{};
-            // Assign the index to the maximum 32 unsigned integer value by default so that any other number (specifically 0) is a valid BP id.
-            uint16_t blueprint_index{INVALID_BP_ID};
-            std::string key;
-            ParamType param = ParamType::MAX; // MAX = No param.
-            std::vector<Node> children;
+            std::atomic<uint64_t> next_sweep{0};
+        };
 
-            bool IsSimpleNode() const
-            {
-                return !rule_index &&
-                       blueprint_index == INVALID_BP_ID &&
-                       children.size() < 2 &&
-                       param == ParamType::MAX &&
-                       std::all_of(std::begin(children), std::end(children), [](const Node& x) {
-                           return x.param == ParamType::MAX;
-                       });
-            }
+        struct rule
+        {
+            std::string path;
+            bool is_prefix;
+            RateLimitRules rules;
+        };
 
-            Node& add_child_node()
+        const RateLimitRules& find_rule(const std::string& path, size_t& index) const
+        {
+            for (index = 0; index < rules_.size(); index++)
             {
-                children.emplace_back();
-                return children.back();
+                const auto& r = rules_[index];
+                if (r.is_prefix ? path.compare(0, r.path.size(), r.path) == 0 : path == r.path)
+                    return r.rules;
             }
-        };
-
-
-        Trie()
-        {}
+            return default_;
+        }
 
-        /// Check whether or not the trie is empty.
-        bool is_empty()
+        uint64_t clock() const
         {
-            return head_.children.empty();
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch_).count());
         }
 
-        void optimize()
+        /// The `trusted_proxies_`th address from the right of a comma separated list, or the first one if there are fewer.
+        std::string_view forwarded_client(std::string_view forwarded) const
         {
-            for (auto& child : head_.children)
+            size_t end = forwarded.size();
+            for (unsigned hop = 1; hop < trusted_proxies_ && end != 0; hop++)
             {
-                optimizeNode(child);
+                size_t comma = forwarded.rfind(',', end - 1);
+                if (comma == std::string_view::npos)
+                    break;
+                end = comma;
             }
+            size_t comma = end != 0 ? forwarded.rfind(',', end - 1) : std::string_view::npos;
+            auto client = forwarded.substr(comma == std::string_view::npos ? 0 : comma + 1, end - (comma == std::string_view::npos ? 0 : comma + 1));
+            while (!client.empty() && (client.front() == ' ' || client.front() == '\t'))
+                client.remove_prefix(1);
+            while (!client.empty() && (client.back() == ' ' || client.back() == '\t'))
+                client.remove_suffix(1);
+            return client;
         }
 
+        static uint64_t key(std::string_view client, size_t rule_index)
+        {
+            uint64_t hash = std::hash<std::string_view>()(client) ^ ((rule_index + 1) * 0x9e3779b97f4a7c15ull);
+            hash ^= hash >> 29;
+            hash *= 0xbf58476d1ce4e5b9ull;
+            hash ^= hash >> 32;
+            return hash ? hash : 1;
+        }
 
-    private:
-        void optimizeNode(Node& node)
+        /// Take a token from a client's bucket, returns 0 if there was one or how many nanoseconds until there is.
+        uint64_t take(uint64_t k, const RateLimitRules& rules, uint64_t now)
         {
-            if (node.children.empty())
-                return;
-            if (node.IsSimpleNode())
-            {
-                auto children_temp = std::move(node.children);
-                auto& child_temp = children_temp[0];
-                node.key += child_temp.key;
-                node.rule_index = child_temp.rule_index;
-                node.blueprint_index = child_temp.blueprint_index;
-                node.children = std::move(child_temp.children);
-                optimizeNode(node);
-            }
-            else
+            size_t group_index = k & group_mask_;
+            maybe_sweep(group_index / shard_size_, now);
+
+            slot& s = find_slot(groups_[group_index], k, now);
+            uint64_t tolerance = rules.interval_ * rules.burst_;
+            uint64_t arrival = s.arrival.load(std::memory_order_relaxed);
+            for (bool checked = false;;)
             {
-                for (auto& child : node.children)
+                uint64_t next = (arrival > now ? arrival : now) + rules.interval_;
+                if (next - now > tolerance)
                 {
-                    optimizeNode(child);
+                    // Other requests may have updated the bucket long after this one read the time (if its thread was preempted)
+                    if (checked)
+                        return next - now - tolerance;
+                    now = clock();
+                    checked = true;
+                    continue;
                 }
+                if (s.arrival.compare_exchange_weak(arrival, next, std::memory_order_relaxed))
+                    return 0;
+                now = clock();
             }
         }
 
-        void debug_node_print(const Node& node, int level)
+        /// Find the slot of a key, claiming one if it doesn't have any.
+
+        ///
+        /// A claimed slot keeps its previous arrival time, which is in the past (the bucket is full) unless the group was full of busy clients.
+        slot& find_slot(group& g, uint64_t k, uint64_t now)
         {
-            if (node.param != ParamType::MAX)
+            for (;;)
             {
-                switch (node.param)
+                slot* empty = nullptr;
+                slot* oldest = &g.slots[0];
+                for (auto& s : g.slots)
                 {
-                    case ParamType::INT:
-                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
-                                       << "<int>";
-                        break;
-                    case ParamType::UINT:
-                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
-                                       << "<uint>";
-                        break;
-                    case ParamType::DOUBLE:
-                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
-                                       << "<double>";
-                        break;
-                    case ParamType::STRING:
-                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
-                                       << "<string>";
-                        break;
-                    case ParamType::PATH:
-                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
-                                       << "<path>";
-                        break;
-                    default:
-                        CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ "
-                                       << "<ERROR>";
-                        break;
+                    uint64_t current = s.key.load(std::memory_order_acquire);
+                    if (current == k)
+                        return s;
+                    if (!current)
+                    {
+                        if (!empty)
+                            empty = &s;
+                    }
+                    else if (s.arrival.load(std::memory_order_relaxed) < oldest->arrival.load(std::memory_order_relaxed))
+                        oldest = &s;
                 }
-            }
-            else
-                CROW_LOG_DEBUG << std::string(3 * level, ' ') << "└➝ " << node.key;
 
-            for (const auto& child : node.children)
-            {
-                debug_node_print(child, level + 1);
+                slot* target = empty ? empty : oldest;
+                uint64_t expected = empty ? 0 : target->key.load(std::memory_order_relaxed);
+                if (target->key.compare_exchange_strong(expected, k, std::memory_order_acq_rel))
+                {
+                    // Took over a busy client's bucket, start from a full one
+                    if (target->arrival.load(std::memory_order_relaxed) > now)
+                        target->arrival.store(0, std::memory_order_relaxed);
+                    return *target;
+                }
             }
         }
 
-    public:
-        void debug_print()
+        void maybe_sweep(size_t shard_index, uint64_t now)
         {
-            CROW_LOG_DEBUG << "└➙ ROOT";
-            for (const auto& child : head_.children)
-                debug_node_print(child, 1);
+            auto& next_sweep = shards_[shard_index].next_sweep;
+            uint64_t due = next_sweep.load(std::memory_order_relaxed);
+            if (now < due || !next_sweep.compare_exchange_strong(due, now + idle_, std::memory_order_relaxed))
+                return;
+
+            size_t first = shard_index * shard_size_;
+            size_t last = CROW_MIN(first + shard_size_, group_mask_ + 1);
+            for (size_t i = first; i < last; i++)
+            {
+                for (auto& s : groups_[i].slots)
+                {
+                    uint64_t current = s.key.load(std::memory_order_relaxed);
+                    if (current && s.arrival.load(std::memory_order_relaxed) + idle_ < now)
+                        s.key.compare_exchange_strong(current, 0, std::memory_order_relaxed);
+                }
+            }
         }
 
-        void validate()
+        std::vector<rule> rules_;
+        RateLimitRules default_;
+        std::string client_header_;
+        unsigned trusted_proxies_{1};
+        std::chrono::steady_clock::time_point epoch_ = std::chrono::steady_clock::now();
+        uint64_t idle_ = 60ull * 1000000000ull;
+        std::unique_ptr<group[]> groups_;
+        size_t group_mask_{};
+        size_t shard_size_{1};
+        shard shards_[shard_count];
+        std::atomic<uint64_t> rejected_{0};
+    };
+} // namespace crow
+
+
+#include <atomic>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+
+namespace crow
+{
+    namespace detail
+    {
+        /// The HTTP/1.1 status line of a code (CRLF included), or an empty one if Crow doesn't know the code.
+        inline std::string_view status_line(int code)
         {
-            if (!head_.IsSimpleNode())
-                throw std::runtime_error("Internal error: Trie header should be simple!");
-            optimize();
-        }
+            // TODO(EDev): HTTP version in status codes should be dynamic
+            // Keep in sync with common.h/status
+            switch (code)
+            {
+                case status::CONTINUE: return "HTTP/1.1 100 Continue\r\n";
+                case status::SWITCHING_PROTOCOLS: return "HTTP/1.1 101 Switching Protocols\r\n";
+
+                case status::OK: return "HTTP/1.1 200 OK\r\n";
+                case status::CREATED: return "HTTP/1.1 201 Created\r\n";
+                case status::ACCEPTED: return "HTTP/1.1 202 Accepted\r\n";
+                case status::NON_AUTHORITATIVE_INFORMATION: return "HTTP/1.1 203 Non-Authoritative Information\r\n";
+                case status::NO_CONTENT: return "HTTP/1.1 204 No Content\r\n";
+                case status::RESET_CONTENT: return "HTTP/1.1 205 Reset Content\r\n";
+                case status::PARTIAL_CONTENT: return "HTTP/1.1 206 Partial Content\r\n";
+
+                case status::MULTIPLE_CHOICES: return "HTTP/1.1 300 Multiple Choices\r\n";
+                case status::MOVED_PERMANENTLY: return "HTTP/1.1 301 Moved Permanently\r\n";
+                case status::FOUND: return "HTTP/1.1 302 Found\r\n";
+                case status::SEE_OTHER: return "HTTP/1.1 303 See Other\r\n";
+                case status::NOT_MODIFIED: return "HTTP/1.1 304 Not Modified\r\n";
+                case status::TEMPORARY_REDIRECT: return "HTTP/1.1 307 Temporary Redirect\r\n";
+                case status::PERMANENT_REDIRECT: return "HTTP/1.1 308 Permanent Redirect\r\n";
+
+                case status::BAD_REQUEST: return "HTTP/1.1 400 Bad Request\r\n";
+                case status::UNAUTHORIZED: return "HTTP/1.1 401 Unauthorized\r\n";
+                case status::FORBIDDEN: return "HTTP/1.1 403 Forbidden\r\n";
+                case status::NOT_FOUND: return "HTTP/1.1 404 Not Found\r\n";
+                case status::METHOD_NOT_ALLOWED: return "HTTP/1.1 405 Method Not Allowed\r\n";
+                case status::NOT_ACCEPTABLE: return "HTTP/1.1 406 Not Acceptable\r\n";
+                case status::PROXY_AUTHENTICATION_REQUIRED: return "HTTP/1.1 407 Proxy Authentication Required\r\n";
+                case status::CONFLICT: return "HTTP/1.1 409 Conflict\r\n";
+                case status::GONE: return "HTTP/1.1 410 Gone\r\n";
+                case status::PAYLOAD_TOO_LARGE: return "HTTP/1.1 413 Payload Too Large\r\n";
+                case status::UNSUPPORTED_MEDIA_TYPE: return "HTTP/1.1 415 Unsupported Media Type\r\n";
+                case status::RANGE_NOT_SATISFIABLE: return "HTTP/1.1 416 Range Not Satisfiable\r\n";
+                case status::EXPECTATION_FAILED: return "HTTP/1.1 417 Expectation Failed\r\n";
+                case status::PRECONDITION_REQUIRED: return "HTTP/1.1 428 Precondition Required\r\n";
+                case status::TOO_MANY_REQUESTS: return "HTTP/1.1 429 Too Many Requests\r\n";
+                case status::UNAVAILABLE_FOR_LEGAL_REASONS: return "HTTP/1.1 451 Unavailable For Legal Reasons\r\n";
+
+                case status::INTERNAL_SERVER_ERROR: return "HTTP/1.1 500 Internal Server Error\r\n";
+                case status::NOT_IMPLEMENTED: return "HTTP/1.1 501 Not Implemented\r\n";
+                case status::BAD_GATEWAY: return "HTTP/1.1 502 Bad Gateway\r\n";
+                case status::SERVICE_UNAVAILABLE: return "HTTP/1.1 503 Service Unavailable\r\n";
+                case status::GATEWAY_TIMEOUT: return "HTTP/1.1 504 Gateway Timeout\r\n";
+                case status::VARIANT_ALSO_NEGOTIATES: return "HTTP/1.1 506 Variant Also Negotiates\r\n";
+
+                default: return {};
+            }
+        }
+
+        /// The current time formatted for the Date header, shared by every thread.
 
-        //Rule_index, Blueprint_index, routing_params
-        routing_handle_result find(const std::string& req_url, const Node& node, unsigned pos = 0, routing_params* params = nullptr, std::vector<uint16_t>* blueprints = nullptr) const
+        ///
+        /// Servers \ref update() it once per second and readers get the latest version through an atomic pointer, without taking any lock.
+        /// Versions are written to a ring of slots large enough that a slot is only rewritten a minute after it was published,
+        /// so whatever \ref value() and \ref line() return has to be used right away.
+        class date_header
         {
-            //start params as an empty struct
-            routing_params empty;
-            if (params == nullptr)
-                params = &empty;
-            //same for blueprint vector
-            std::vector<uint16_t> MT;
-            if (blueprints == nullptr)
-                blueprints = &MT;
+        public:
+            static date_header& instance()
+            {
+                static date_header date;
+                return date;
+            }
 
-            uint16_t found{};               //The rule index to be found
-            std::vector<uint16_t> found_BP; //The Blueprint indices to be found
-            routing_params match_params;    //supposedly the final matched parameters
+            /// Just the date, e.g. `Sun, 06 Nov 1994 08:49:37 GMT`.
+            std::string_view value() const
+            {
+                const slot* current = current_.load(std::memory_order_acquire);
+                return std::string_view(current->text + value_offset, current->size - value_offset - 2);
+            }
 
-            auto update_found = [&found, &found_BP, &match_params](routing_handle_result& ret) {
-                found_BP = std::move(ret.blueprint_indices);
-                if (ret.rule_index && (!found || found > ret.rule_index))
-                {
-                    found = ret.rule_index;
-                    match_params = std::move(ret.r_params);
-                }
+            /// The whole header line, `Date: <value>\r\n`.
+            std::string_view line() const
+            {
+                const slot* current = current_.load(std::memory_order_acquire);
+                return std::string_view(current->text, current->size);
+            }
+
+            /// Publish the current time if it has changed since the last update.
+            void update()
+            {
+                std::time_t now = std::time(nullptr);
+                if (current_.load(std::memory_order_acquire)->time == now)
+                    return;
+
+                std::lock_guard<std::mutex> lock(update_mutex_);
+                if (current_.load(std::memory_order_relaxed)->time == now)
+                    return;
+
+                next_ = (next_ + 1) % slot_count;
+                format(slots_[next_], now);
+                current_.store(&slots_[next_], std::memory_order_release);
+            }
+
+        private:
+            struct slot
+            {
+                std::time_t time{};
+                char text[64];
+                size_t size{};
             };
 
-            //if the function was called on a node at the end of the string (the last recursion), return the nodes rule index, and whatever params were passed to the function
-            if (pos == req_url.size())
-            {
-                found_BP = std::move(*blueprints);
-                return routing_handle_result{node.rule_index, *blueprints, *params};
-            }
+            static constexpr size_t slot_count = 64;
+            static constexpr size_t value_offset = sizeof("Date: ") - 1;
+
+            date_header()
+            {
+                format(slots_[0], std::time(nullptr));
+                current_.store(&slots_[0], std::memory_order_release);
+            }
+
+            static void format(slot& s, std::time_t time)
+            {
+                tm my_tm;
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+                gmtime_s(&my_tm, &time);
+#else
+                gmtime_r(&time, &my_tm);
+#endif
+                s.time = time;
+                s.size = strftime(s.text, sizeof(s.text), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &my_tm);
+            }
+
+            slot slots_[slot_count];
+            size_t next_{};
+            std::atomic<const slot*> current_{};
+            std::mutex update_mutex_;
+        };
+
+        /// Response header lines that are the same for every response of a server, serialized once when the server is created.
+        struct static_headers
+        {
+            static_headers(const std::string& server_name_):
+              server_name(server_name_),
+              server(server_name_.empty() ? std::string() : "Server: " + server_name_ + "\r\n")
+            {}
+
+            std::string server_name;
+            std::string server; ///< `Server: <name>\r\n`, empty if the name is.
+            static constexpr std::string_view keep_alive = "Connection: Keep-Alive\r\n";
+        };
+
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Pick the algorithm to compress a response with, if it should be compressed at all.
+
+        ///
+        /// Responses that opted out, are below the minimum size, or already have a "Content-Encoding" or
+        /// "Content-Length" (which compressing would make wrong) are left alone.
+        inline bool choose_encoding(const request& req, const response& res, size_t body_size, const compression::settings& options, compression::algorithm& algo)
+        {
+            if (!res.compressed || body_size == 0 || body_size < options.min_size ||
+                res.headers.count(known_header::ContentEncoding) || res.headers.count(known_header::ContentLength))
+                return false;
+
+            auto accept_encoding = req.headers.find(known_header::AcceptEncoding);
+            return accept_encoding != req.headers.end() && compression::negotiate(accept_encoding->second, options.preferred, algo);
+        }
 
-            bool found_fragment = false;
+        inline void set_encoding_headers(response& res, compression::algorithm algo)
+        {
+            res.set_header("Content-Encoding", compression::encoding_name(algo));
+            if (!res.headers.count("Vary"))
+                res.set_header("Vary", "Accept-Encoding");
+        }
 
-            for (const auto& child : node.children)
+        /// Replace a response's body with its compressed version.
+        inline void compress_body(response& res, compression::algorithm algo, const compression::settings& options)
+        {
+            static constexpr size_t max_retained_buffer = 1 << 20;
+
+            // Swapped with the body, so that the next one compressed on this thread reuses its storage.
+            thread_local std::string compressed;
+            compressed.clear();
+            if (!compression::compress(algo, options, res.body.data(), res.body.size(), compressed))
             {
-                if (child.param != ParamType::MAX)
-                {
-                    if (child.param == ParamType::INT)
-                    {
-                        char c = req_url[pos];
-                        if ((c >= '0' && c <= '9') || c == '+' || c == '-')
-                        {
-                            char* eptr;
-                            errno = 0;
-                            long long int value = strtoll(req_url.data() + pos, &eptr, 10);
-                            if (errno != ERANGE && eptr != req_url.data() + pos)
-                            {
-                                found_fragment = true;
-                                params->int_params.push_back(value);
-                                if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                                auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
-                                update_found(ret);
-                                params->int_params.pop_back();
-                                if (!blueprints->empty()) blueprints->pop_back();
-                            }
-                        }
-                    }
+                CROW_LOG_WARNING << "Could not compress a response body with " << compression::encoding_name(algo) << ", sending it as it is";
+                return;
+            }
 
-                    else if (child.param == ParamType::UINT)
-                    {
-                        char c = req_url[pos];
-                        if ((c >= '0' && c <= '9') || c == '+')
-                        {
-                            char* eptr;
-                            errno = 0;
-                            unsigned long long int value = strtoull(req_url.data() + pos, &eptr, 10);
-                            if (errno != ERANGE && eptr != req_url.data() + pos)
-                            {
-                                found_fragment = true;
-                                params->uint_params.push_back(value);
-                                if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                                auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
-                                update_found(ret);
-                                params->uint_params.pop_back();
-                                if (!blueprints->empty()) blueprints->pop_back();
-                            }
-                        }
-                    }
+            res.body.swap(compressed);
+            if (compressed.capacity() > max_retained_buffer)
+                std::string().swap(compressed);
+            set_encoding_headers(res, algo);
+        }
+#endif
+    } // namespace detail
+} // namespace crow
 
-                    else if (child.param == ParamType::DOUBLE)
-                    {
-                        char c = req_url[pos];
-                        if ((c >= '0' && c <= '9') || c == '+' || c == '-' || c == '.')
-                        {
-                            char* eptr;
-                            errno = 0;
-                            double value = strtod(req_url.data() + pos, &eptr);
-                            if (errno != ERANGE && eptr != req_url.data() + pos)
-                            {
-                                found_fragment = true;
-                                params->double_params.push_back(value);
-                                if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                                auto ret = find(req_url, child, eptr - req_url.data(), params, blueprints);
-                                update_found(ret);
-                                params->double_params.pop_back();
-                                if (!blueprints->empty()) blueprints->pop_back();
-                            }
-                        }
-                    }
 
-                    else if (child.param == ParamType::STRING)
-                    {
-                        size_t epos = pos;
-                        for (; epos < req_url.size(); epos++)
-                        {
-                            if (req_url[epos] == '/')
-                                break;
-                        }
+#ifdef CROW_USE_BOOST
+#include <boost/asio.hpp>
+#ifdef CROW_ENABLE_SSL
+#include <boost/asio/ssl.hpp>
+#endif
+#else
+#ifndef ASIO_STANDALONE
+#define ASIO_STANDALONE
+#endif
+#include <asio.hpp>
+#ifdef CROW_ENABLE_SSL
+#include <asio/ssl.hpp>
+#endif
+#endif
 
-                        if (epos != pos)
-                        {
-                            found_fragment = true;
-                            params->string_params.push_back(req_url.substr(pos, epos - pos));
-                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                            auto ret = find(req_url, child, epos, params, blueprints);
-                            update_found(ret);
-                            params->string_params.pop_back();
-                            if (!blueprints->empty()) blueprints->pop_back();
-                        }
-                    }
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-                    else if (child.param == ParamType::PATH)
-                    {
-                        size_t epos = req_url.size();
 
-                        if (epos != pos)
-                        {
-                            found_fragment = true;
-                            params->string_params.push_back(req_url.substr(pos, epos - pos));
-                            if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                            auto ret = find(req_url, child, epos, params, blueprints);
-                            update_found(ret);
-                            params->string_params.pop_back();
-                            if (!blueprints->empty()) blueprints->pop_back();
-                        }
-                    }
-                }
+namespace crow // NOTE: Already documented in "crow/app.h"
+{
+#ifdef CROW_USE_BOOST
+    namespace asio = boost::asio;
+    using error_code = boost::system::error_code;
+#else
+    using error_code = asio::error_code;
+#endif
 
-                else
-                {
-                    const std::string& fragment = child.key;
-                    if (req_url.compare(pos, fragment.size(), fragment) == 0)
-                    {
-                        found_fragment = true;
-                        if (child.blueprint_index != INVALID_BP_ID) blueprints->push_back(child.blueprint_index);
-                        auto ret = find(req_url, child, pos + fragment.size(), params, blueprints);
-                        update_found(ret);
-                        if (!blueprints->empty()) blueprints->pop_back();
-                    }
-                }
-            }
+    /**
+     * \namespace crow::http2
+     * \brief HTTP/2 framing (RFC 9113) and HPACK header compression (RFC 7541).
+     *
+     * Used by \ref HTTP2Connection.
+     */
+    namespace http2
+    {
+        /// Sent by the client as the very first bytes of an HTTP/2 connection.
+        constexpr std::string_view connection_preface{"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"};
+
+        constexpr size_t frame_header_size = 9;
+        constexpr uint32_t default_window_size = 65535;
+        constexpr uint32_t default_max_frame_size = 16384;
+        constexpr uint32_t max_window_size = 0x7fffffff;
+
+        enum class frame_type : uint8_t
+        {
+            Data = 0x0,
+            Headers = 0x1,
+            Priority = 0x2,
+            RstStream = 0x3,
+            Settings = 0x4,
+            PushPromise = 0x5,
+            Ping = 0x6,
+            GoAway = 0x7,
+            WindowUpdate = 0x8,
+            Continuation = 0x9,
+        };
 
-            if (!found_fragment)
-                found_BP = std::move(*blueprints);
+        namespace frame_flag
+        {
+            constexpr uint8_t EndStream = 0x1;
+            constexpr uint8_t Ack = 0x1;
+            constexpr uint8_t EndHeaders = 0x4;
+            constexpr uint8_t Padded = 0x8;
+            constexpr uint8_t Priority = 0x20;
+        } // namespace frame_flag
 
-            return routing_handle_result{found, found_BP, match_params}; //Called after all the recursions have been done
-        }
+        enum class settings_id : uint16_t
+        {
+            HeaderTableSize = 0x1,
+            EnablePush = 0x2,
+            MaxConcurrentStreams = 0x3,
+            InitialWindowSize = 0x4,
+            MaxFrameSize = 0x5,
+            MaxHeaderListSize = 0x6,
+        };
 
-        routing_handle_result find(const std::string& req_url) const
+        // Codes taken from https://www.rfc-editor.org/rfc/rfc9113#section-7
+        enum class error : uint32_t
+        {
+            NoError = 0x0,
+            ProtocolError = 0x1,
+            InternalError = 0x2,
+            FlowControlError = 0x3,
+            SettingsTimeout = 0x4,
+            StreamClosed = 0x5,
+            FrameSizeError = 0x6,
+            RefusedStream = 0x7,
+            Cancel = 0x8,
+            CompressionError = 0x9,
+            ConnectError = 0xa,
+            EnhanceYourCalm = 0xb,
+            InadequateSecurity = 0xc,
+            Http11Required = 0xd,
+        };
+
+#ifdef CROW_ENABLE_SSL
+        /// ALPN protocol selection for SSL connections, prefers `h2` over `http/1.1`.
+        inline int alpn_select_callback(SSL*, const unsigned char** out, unsigned char* outlen, const unsigned char* in, unsigned int inlen, void*)
         {
-            return find(req_url, head_);
+            static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+            if (SSL_select_next_proto(const_cast<unsigned char**>(out), outlen, protocols, sizeof(protocols) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+                return SSL_TLSEXT_ERR_NOACK;
+            return SSL_TLSEXT_ERR_OK;
         }
+#endif
 
-        //This functions assumes any blueprint info passed is valid
-        void add(const std::string& url, uint16_t rule_index, unsigned bp_prefix_length = 0, uint16_t blueprint_index = INVALID_BP_ID)
+        namespace hpack
         {
-            auto idx = &head_;
+            struct huffman_symbol
+            {
+                uint32_t code;
+                uint8_t length;
+            };
 
-            bool has_blueprint = bp_prefix_length != 0 && blueprint_index != INVALID_BP_ID;
+            /// The Huffman code from RFC 7541 Appendix B, indexed by symbol (256 is EOS).
+            inline const huffman_symbol* huffman_table()
+            {
+                // clang-format off
+                static const huffman_symbol table[257] = {
+                  {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+                  {0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+                  {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+                  {0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+                  {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+                  {0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+                  {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+                  {0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+                  {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+                  {0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+                  {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+                  {0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+                  {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+                  {0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+                  {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+                  {0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+                  {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+                  {0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+                  {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+                  {0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+                  {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+                  {0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+                  {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+                  {0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+                  {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+                  {0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+                  {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+                  {0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+                  {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+                  {0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+                  {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+                  {0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+                  {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+                  {0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+                  {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+                  {0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+                  {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+                  {0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+                  {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+                  {0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+                  {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+                  {0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+                  {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+                };
+                // clang-format on
+                return table;
+            }
 
-            for (unsigned i = 0; i < url.size(); i++)
+            /// Binary tree over \ref huffman_table(), built once and used to decode Huffman encoded strings bit by bit.
+            struct huffman_tree
             {
-                char c = url[i];
-                if (c == '<')
+                struct node
                 {
-                    static struct ParamTraits
-                    {
-                        ParamType type;
-                        std::string name;
-                    } paramTraits[] =
-                      {
-                        {ParamType::INT, "<int>"},
-                        {ParamType::UINT, "<uint>"},
-                        {ParamType::DOUBLE, "<float>"},
-                        {ParamType::DOUBLE, "<double>"},
-                        {ParamType::STRING, "<str>"},
-                        {ParamType::STRING, "<string>"},
-                        {ParamType::PATH, "<path>"},
-                      };
+                    int16_t children[2]{-1, -1};
+                    int16_t symbol{-1};
+                };
 
-                    for (const auto& x : paramTraits)
+                huffman_tree()
+                {
+                    nodes.emplace_back();
+                    const huffman_symbol* table = huffman_table();
+                    for (int16_t symbol = 0; symbol < 257; symbol++)
                     {
-                        if (url.compare(i, x.name.size(), x.name) == 0)
+                        size_t current = 0;
+                        for (int bit = table[symbol].length - 1; bit >= 0; bit--)
                         {
-                            bool found = false;
-                            for (auto& child : idx->children)
+                            int direction = (table[symbol].code >> bit) & 1;
+                            if (nodes[current].children[direction] < 0)
                             {
-                                if (child.param == x.type)
-                                {
-                                    idx = &child;
-                                    i += x.name.size();
-                                    found = true;
-                                    break;
-                                }
+                                nodes[current].children[direction] = static_cast<int16_t>(nodes.size());
+                                nodes.emplace_back();
                             }
-                            if (found)
-                                break;
-
-                            auto new_node_idx = &idx->add_child_node();
-                            new_node_idx->param = x.type;
-                            idx = new_node_idx;
-                            i += x.name.size();
-                            break;
+                            current = nodes[current].children[direction];
                         }
+                        nodes[current].symbol = symbol;
                     }
-
-                    i--;
                 }
-                else
+
+                static const huffman_tree& get()
                 {
-                    //This part assumes the tree is unoptimized (every node has a max 1 character key)
-                    bool piece_found = false;
-                    for (auto& child : idx->children)
-                    {
-                        if (child.key[0] == c)
-                        {
-                            idx = &child;
-                            piece_found = true;
-                            break;
-                        }
-                    }
-                    if (!piece_found)
-                    {
-                        auto new_node_idx = &idx->add_child_node();
-                        new_node_idx->key = c;
-                        //The assumption here is that you'd only need to add a blueprint index if the tree didn't have the BP prefix.
-                        if (has_blueprint && i == bp_prefix_length)
-                            new_node_idx->blueprint_index = blueprint_index;
-                        idx = new_node_idx;
-                    }
+                    static huffman_tree tree;
+                    return tree;
                 }
-            }
-
-            //check if the last node already has a value (exact url already in Trie)
-            if (idx->rule_index)
-                throw std::runtime_error("handler already exists for " + url);
-            idx->rule_index = rule_index;
-        }
-
-    private:
-        Node head_;
-    };
-
-    /// A blueprint can be considered a smaller section of a Crow app, specifically where the router is concerned.
-
-    ///
-    /// You can use blueprints to assign a common prefix to rules' prefix, set custom static and template folders, and set a custom catchall route.
-    /// You can also assign nest blueprints for maximum Compartmentalization.
-    class Blueprint
-    {
-    public:
-        Blueprint(const std::string& prefix):
-          prefix_(prefix),
-          static_dir_(prefix),
-          templates_dir_(prefix){};
-
-        Blueprint(const std::string& prefix, const std::string& static_dir):
-          prefix_(prefix), static_dir_(static_dir){};
-
-        Blueprint(const std::string& prefix, const std::string& static_dir, const std::string& templates_dir):
-          prefix_(prefix), static_dir_(static_dir), templates_dir_(templates_dir){};
-
-        /*
-        Blueprint(Blueprint& other)
-        {
-            prefix_ = std::move(other.prefix_);
-            all_rules_ = std::move(other.all_rules_);
-        }
 
-        Blueprint(const Blueprint& other)
-        {
-            prefix_ = other.prefix_;
-            all_rules_ = other.all_rules_;
-        }
-*/
-        Blueprint(Blueprint&& value)
-        {
-            *this = std::move(value);
-        }
+                std::vector<node> nodes;
+            };
 
-        Blueprint& operator=(const Blueprint& value) = delete;
+            /// Decode a Huffman encoded string literal, returns false if the input is malformed.
+            inline bool huffman_decode(const uint8_t* data, size_t length, std::string& out)
+            {
+                const auto& nodes = huffman_tree::get().nodes;
+                size_t current = 0;
+                int padding_length = 0;
+                bool padding_ones = true;
 
-        Blueprint& operator=(Blueprint&& value) noexcept
-        {
-            prefix_ = std::move(value.prefix_);
-            static_dir_ = std::move(value.static_dir_);
-            templates_dir_ = std::move(value.templates_dir_);
-            all_rules_ = std::move(value.all_rules_);
-            catchall_rule_ = std::move(value.catchall_rule_);
-            blueprints_ = std::move(value.blueprints_);
-            mw_indices_ = std::move(value.mw_indices_);
-            return *this;
-        }
+                for (size_t i = 0; i < length; i++)
+                {
+                    for (int bit = 7; bit >= 0; bit--)
+                    {
+                        int direction = (data[i] >> bit) & 1;
+                        int16_t next = nodes[current].children[direction];
+                        if (next < 0)
+                            return false;
 
-        bool operator==(const Blueprint& value)
-        {
-            return value.prefix() == prefix_;
-        }
+                        current = next;
+                        padding_length++;
+                        padding_ones = padding_ones && direction;
 
-        bool operator!=(const Blueprint& value)
-        {
-            return value.prefix() != prefix_;
-        }
+                        if (nodes[current].symbol >= 0)
+                        {
+                            if (nodes[current].symbol == 256) // EOS is never part of the string
+                                return false;
+                            out.push_back(static_cast<char>(nodes[current].symbol));
+                            current = 0;
+                            padding_length = 0;
+                            padding_ones = true;
+                        }
+                    }
+                }
 
-        std::string prefix() const
-        {
-            return prefix_;
-        }
+                // Leftover bits have to be a (shorter than 8 bits) prefix of EOS, which is all ones
+                return padding_length < 8 && padding_ones;
+            }
 
-        std::string static_dir() const
-        {
-            return static_dir_;
-        }
+            /// The HPACK static table (RFC 7541 Appendix A), index 1 is the first element.
+            inline const std::array<std::pair<std::string_view, std::string_view>, 61>& static_table()
+            {
+                // clang-format off
+                static const std::array<std::pair<std::string_view, std::string_view>, 61> table = {{
+                  {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"}, {":path", "/index.html"},
+                  {":scheme", "http"}, {":scheme", "https"}, {":status", "200"}, {":status", "204"}, {":status", "206"},
+                  {":status", "304"}, {":status", "400"}, {":status", "404"}, {":status", "500"}, {"accept-charset", ""},
+                  {"accept-encoding", "gzip, deflate"}, {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+                  {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""}, {"content-disposition", ""},
+                  {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""}, {"content-location", ""}, {"content-range", ""},
+                  {"content-type", ""}, {"cookie", ""}, {"date", ""}, {"etag", ""}, {"expect", ""},
+                  {"expires", ""}, {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+                  {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""}, {"link", ""},
+                  {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""}, {"proxy-authorization", ""}, {"range", ""},
+                  {"referer", ""}, {"refresh", ""}, {"retry-after", ""}, {"server", ""}, {"set-cookie", ""},
+                  {"strict-transport-security", ""}, {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+                  {"www-authenticate", ""}}};
+                // clang-format on
+                return table;
+            }
 
-        void set_added()
-        {
-            added_ = true;
-        }
+            /// The dynamic table kept in sync between an encoder and the peer's decoder (or vice versa).
+            class dynamic_table
+            {
+            public:
+                /// Per entry overhead, see RFC 7541 Section 4.1.
+                static constexpr size_t entry_overhead = 32;
 
-        bool is_added()
-        {
-            return added_;
-        }
+                void add(std::string name, std::string value)
+                {
+                    size_t size = name.size() + value.size() + entry_overhead;
+                    if (size > max_size_)
+                    {
+                        // Adding an entry larger than the table just empties it
+                        evict(0);
+                        return;
+                    }
 
-        DynamicRule& new_rule_dynamic(const std::string& rule)
-        {
-            std::string new_rule = '/' + prefix_ + rule;
-            auto ruleObject = new DynamicRule(std::move(new_rule));
-            ruleObject->custom_templates_base = templates_dir_;
-            all_rules_.emplace_back(ruleObject);
+                    evict(max_size_ - size);
+                    entries_.emplace_front(std::move(name), std::move(value));
+                    size_ += size;
+                }
 
-            return *ruleObject;
-        }
+                void set_max_size(size_t max_size)
+                {
+                    max_size_ = max_size;
+                    evict(max_size_);
+                }
 
-        template<uint64_t N>
-        typename black_magic::arguments<N>::type::template rebind<TaggedRule>& new_rule_tagged(const std::string& rule)
-        {
-            std::string new_rule = '/' + prefix_ + rule;
-            using RuleT = typename black_magic::arguments<N>::type::template rebind<TaggedRule>;
+                size_t max_size() const
+                {
+                    return max_size_;
+                }
 
-            auto ruleObject = new RuleT(std::move(new_rule));
-            ruleObject->custom_templates_base = templates_dir_;
-            all_rules_.emplace_back(ruleObject);
+                size_t count() const
+                {
+                    return entries_.size();
+                }
 
-            return *ruleObject;
-        }
+                /// Get an entry, 0 being the most recently added one.
+                const std::pair<std::string, std::string>& at(size_t index) const
+                {
+                    return entries_[index];
+                }
 
-        void register_blueprint(Blueprint& blueprint)
-        {
-            if (blueprints_.empty() || std::find(blueprints_.begin(), blueprints_.end(), &blueprint) == blueprints_.end())
+            private:
+                void evict(size_t target_size)
+                {
+                    while (size_ > target_size && !entries_.empty())
+                    {
+                        size_ -= entries_.back().first.size() + entries_.back().second.size() + entry_overhead;
+                        entries_.pop_back();
+                    }
+                }
+
+                std::deque<std::pair<std::string, std::string>> entries_;
+                size_t size_{0};
+                size_t max_size_{4096};
+            };
+
+            /// Decode an integer with an N-bit prefix (RFC 7541 Section 5.1).
+            inline bool decode_integer(const uint8_t*& p, const uint8_t* end, uint8_t prefix_bits, uint64_t& value)
             {
-                apply_blueprint(blueprint);
-                blueprints_.emplace_back(&blueprint);
-            }
-            else
-                throw std::runtime_error("blueprint \"" + blueprint.prefix_ + "\" already exists in blueprint \"" + prefix_ + '\"');
-        }
+                if (p == end)
+                    return false;
 
+                const uint8_t max_prefix = static_cast<uint8_t>((1 << prefix_bits) - 1);
+                value = *p++ & max_prefix;
+                if (value < max_prefix)
+                    return true;
 
-        CatchallRule& catchall_rule()
-        {
-            return catchall_rule_;
-        }
+                for (unsigned shift = 0; p != end && shift <= 56; shift += 7)
+                {
+                    uint8_t byte = *p++;
+                    value += static_cast<uint64_t>(byte & 0x7f) << shift;
+                    if (!(byte & 0x80))
+                        return true;
+                }
+                return false;
+            }
 
-        template<typename App, typename... Middlewares>
-        void middlewares()
-        {
-            mw_indices_.push<App, Middlewares...>();
-        }
+            /// Encode an integer with an N-bit prefix, the bits above the prefix in the first byte are taken from `flags`.
+            inline void encode_integer(std::string& out, uint8_t flags, uint8_t prefix_bits, uint64_t value)
+            {
+                const uint8_t max_prefix = static_cast<uint8_t>((1 << prefix_bits) - 1);
+                if (value < max_prefix)
+                {
+                    out.push_back(static_cast<char>(flags | value));
+                    return;
+                }
 
-    private:
-        void apply_blueprint(Blueprint& blueprint)
-        {
+                out.push_back(static_cast<char>(flags | max_prefix));
+                value -= max_prefix;
+                while (value >= 0x80)
+                {
+                    out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                    value >>= 7;
+                }
+                out.push_back(static_cast<char>(value));
+            }
 
-            blueprint.prefix_ = prefix_ + '/' + blueprint.prefix_;
-            blueprint.static_dir_ = static_dir_ + '/' + blueprint.static_dir_;
-            blueprint.templates_dir_ = templates_dir_ + '/' + blueprint.templates_dir_;
-            for (auto& rule : blueprint.all_rules_)
+            /// Decode a (possibly Huffman encoded) string literal (RFC 7541 Section 5.2).
+            inline bool decode_string(const uint8_t*& p, const uint8_t* end, std::string& out)
             {
-                std::string new_rule = '/' + prefix_ + rule->rule_;
-                rule->rule_ = new_rule;
+                if (p == end)
+                    return false;
+
+                bool huffman = *p & 0x80;
+                uint64_t length;
+                if (!decode_integer(p, end, 7, length) || length > static_cast<uint64_t>(end - p))
+                    return false;
+
+                out.clear();
+                bool ok = true;
+                if (huffman)
+                    ok = huffman_decode(p, static_cast<size_t>(length), out);
+                else
+                    out.assign(reinterpret_cast<const char*>(p), static_cast<size_t>(length));
+                p += length;
+                return ok;
             }
-            for (Blueprint* bp_child : blueprint.blueprints_)
+
+            /// Encode a string literal, always as raw octets.
+            inline void encode_string(std::string& out, std::string_view value)
             {
-                Blueprint& bp_ref = *bp_child;
-                apply_blueprint(bp_ref);
+                encode_integer(out, 0x00, 7, value.size());
+                out.append(value.data(), value.size());
             }
-        }
 
-        std::string prefix_;
-        std::string static_dir_;
-        std::string templates_dir_;
-        std::vector<std::unique_ptr<BaseRule>> all_rules_;
-        CatchallRule catchall_rule_;
-        std::vector<Blueprint*> blueprints_;
-        detail::middleware_indices mw_indices_;
-        bool added_{false};
+            enum class decode_result
+            {
+                Ok,
+                ListTooLarge,     ///< The header list is larger than allowed, the block was still decoded to keep the table in sync.
+                CompressionError, ///< Fatal for the whole connection.
+            };
 
-        friend class Router;
-    };
+            /// Decodes request header blocks.
+            class decoder
+            {
+            public:
+                /// Decode a complete header block.
 
-    /// Handles matching requests to existing rules and upgrade requests.
-    class Router
-    {
-    public:
-        bool using_ssl;
+                ///
+                /// The header list size is counted as in SETTINGS_MAX_HEADER_LIST_SIZE (names, values and 32 octets per field), once it goes over `max_list_size` the
+                /// remaining fields only update the dynamic table.
+                decode_result decode(const uint8_t* data, size_t length, std::vector<std::pair<std::string, std::string>>& headers, size_t max_list_size)
+                {
+                    const uint8_t* p = data;
+                    const uint8_t* end = data + length;
+                    bool field_seen = false;
+                    size_t list_size = 0;
+
+                    // Fields only count (and are only kept) while the list fits
+                    auto fits = [&](size_t name_size, size_t value_size) {
+                        list_size += name_size + value_size + dynamic_table::entry_overhead;
+                        return list_size <= max_list_size;
+                    };
 
-        Router() : using_ssl(false)
-        {}
+                    while (p != end)
+                    {
+                        uint8_t first = *p;
+                        if (first & 0x80) // Indexed header field
+                        {
+                            uint64_t index;
+                            std::string_view name, value;
+                            if (!decode_integer(p, end, 7, index) || !lookup(index, name, value))
+                                return decode_result::CompressionError;
+                            if (fits(name.size(), value.size()))
+                                headers.emplace_back(name, value);
+                            field_seen = true;
+                        }
+                        else if ((first & 0xe0) == 0x20) // Dynamic table size update, only allowed at the start of a block
+                        {
+                            uint64_t size;
+                            if (field_seen || !decode_integer(p, end, 5, size) || size > max_table_size_)
+                                return decode_result::CompressionError;
+                            table_.set_max_size(static_cast<size_t>(size));
+                        }
+                        else // Literal header field with incremental indexing (01), without indexing (0000) or never indexed (0001)
+                        {
+                            bool indexing = (first & 0xc0) == 0x40;
+                            uint64_t index;
+                            std::string name, value;
+                            if (!decode_integer(p, end, indexing ? 6 : 4, index))
+                                return decode_result::CompressionError;
+                            if (index)
+                            {
+                                std::string_view indexed_name, indexed_value;
+                                if (!lookup(index, indexed_name, indexed_value))
+                                    return decode_result::CompressionError;
+                                name = indexed_name;
+                            }
+                            else if (!decode_string(p, end, name))
+                                return decode_result::CompressionError;
+                            if (!decode_string(p, end, value))
+                                return decode_result::CompressionError;
+
+                            bool keep = fits(name.size(), value.size());
+                            if (indexing)
+                                table_.add(name, value);
+                            if (keep)
+                                headers.emplace_back(std::move(name), std::move(value));
+                            field_seen = true;
+                        }
+                    }
+                    return list_size <= max_list_size ? decode_result::Ok : decode_result::ListTooLarge;
+                }
 
-        DynamicRule& new_rule_dynamic(const std::string& rule)
-        {
-            auto ruleObject = new DynamicRule(rule);
-            all_rules_.emplace_back(ruleObject);
+            private:
+                bool lookup(uint64_t index, std::string_view& name, std::string_view& value) const
+                {
+                    const auto& statics = static_table();
+                    if (index == 0)
+                        return false;
+                    if (index <= statics.size())
+                    {
+                        name = statics[index - 1].first;
+                        value = statics[index - 1].second;
+                        return true;
+                    }
 
-            return *ruleObject;
-        }
+                    index -= statics.size() + 1;
+                    if (index >= table_.count())
+                        return false;
+                    name = table_.at(static_cast<size_t>(index)).first;
+                    value = table_.at(static_cast<size_t>(index)).second;
+                    return true;
+                }
 
-        template<uint64_t N>
-        typename black_magic::arguments<N>::type::template rebind<TaggedRule>& new_rule_tagged(const std::string& rule)
-        {
-            using RuleT = typename black_magic::arguments<N>::type::template rebind<TaggedRule>;
+                dynamic_table table_;
+                size_t max_table_size_{4096}; ///< Our SETTINGS_HEADER_TABLE_SIZE, which is the default.
+            };
 
-            auto ruleObject = new RuleT(rule);
-            all_rules_.emplace_back(ruleObject);
+            /// Encodes response header blocks, referring to the static table and a dynamic table of its own where possible.
+            class encoder
+            {
+            public:
+                /// Apply the peer's SETTINGS_HEADER_TABLE_SIZE, the change is signalled at the start of the next block.
+                void set_max_table_size(size_t size)
+                {
+                    size = std::min<size_t>(size, 4096);
+                    if (size != table_.max_size())
+                    {
+                        table_.set_max_size(size);
+                        size_update_pending_ = true;
+                    }
+                }
 
-            return *ruleObject;
-        }
+                /// Has to be called before the first field of every header block.
+                void start_block(std::string& out)
+                {
+                    if (size_update_pending_)
+                    {
+                        encode_integer(out, 0x20, 5, table_.max_size());
+                        size_update_pending_ = false;
+                    }
+                }
 
-        CatchallRule& catchall_rule()
-        {
-            return catchall_rule_;
-        }
+                /// Encode a header field, `name` has to be in lower case.
 
-        void internal_add_rule_object(const std::string& rule, BaseRule* ruleObject)
-        {
-            internal_add_rule_object(rule, ruleObject, INVALID_BP_ID, blueprints_);
-        }
+                ///
+                /// Values that change with every response (such as content-length) should not be indexed, they'd only push useful entries out of the table.
+                void encode(std::string& out, std::string_view name, std::string_view value, bool index = true)
+                {
+                    const auto& statics = static_table();
+                    uint64_t name_index = 0;
 
-        void internal_add_rule_object(const std::string& rule, BaseRule* ruleObject, const uint16_t& BP_index, std::vector<Blueprint*>& blueprints)
-        {
-            bool has_trailing_slash = false;
-            std::string rule_without_trailing_slash;
-            if (rule.size() > 1 && rule.back() == '/')
-            {
-                has_trailing_slash = true;
-                rule_without_trailing_slash = rule;
-                rule_without_trailing_slash.pop_back();
-            }
+                    for (size_t i = 0; i < statics.size(); i++)
+                    {
+                        if (statics[i].first != name)
+                            continue;
+                        if (statics[i].second == value)
+                        {
+                            encode_integer(out, 0x80, 7, i + 1);
+                            return;
+                        }
+                        if (!name_index)
+                            name_index = i + 1;
+                    }
+                    for (size_t i = 0; i < table_.count(); i++)
+                    {
+                        const auto& entry = table_.at(i);
+                        if (entry.first != name)
+                            continue;
+                        if (entry.second == value)
+                        {
+                            encode_integer(out, 0x80, 7, statics.size() + 1 + i);
+                            return;
+                        }
+                        if (!name_index)
+                            name_index = statics.size() + 1 + i;
+                    }
+
+                    if (index)
+                        encode_integer(out, 0x40, 6, name_index);
+                    else
+                        encode_integer(out, 0x00, 4, name_index);
+                    if (!name_index)
+                        encode_string(out, name);
+                    encode_string(out, value);
+
+                    if (index)
+                        table_.add(std::string(name), std::string(value));
+                }
+
+            private:
+                dynamic_table table_;
+                bool size_update_pending_{false};
+            };
+        } // namespace hpack
+    }     // namespace http2
+
+    /// An HTTP/2 connection.
+
+    ///
+    /// Takes over the socket from \ref Connection once a client sends the HTTP/2 connection preface (h2c with prior knowledge) or negotiates `h2` through ALPN.
+    /// Every stream is handled as a separate request, going through the same router and middlewares as HTTP/1 requests.
+    template<typename Adaptor, typename Handler, typename... Middlewares>
+    class HTTP2Connection : public std::enable_shared_from_this<HTTP2Connection<Adaptor, Handler, Middlewares...>>
+    {
+        /// A single request / response exchange.
+        struct stream
+        {
+            uint32_t id;
+            request req;
+            response res;
+            detail::context<Middlewares...> ctx;
+            std::unique_ptr<routing_handle_result> found;
+            bool need_to_call_after_handlers{};
+            bool request_complete{}; ///< The client sent END_STREAM.
+            bool response_started{}; ///< The response's HEADERS were sent.
+            bool reset{};            ///< The stream was reset, any response still in the works gets dropped.
+            int64_t send_window;
+            uint32_t recv_unacknowledged{};
+            std::chrono::steady_clock::time_point start; ///< When the request was complete, for the access log.
+
+            std::string body; ///< Response body waiting for flow control window.
+            size_t body_offset{};
+            std::unique_ptr<std::ifstream> file; ///< Used instead of \ref body for static files.
+            uint64_t file_remaining{};
+#ifdef CROW_ENABLE_COMPRESSION
+            std::unique_ptr<compression::inflate_context> inflater; ///< Decompresses the request body, if it's compressed.
+#endif
+            std::unique_ptr<multipart::stream_parser> multipart; ///< Parses a multipart request body as it arrives.
+        };
+
+        static constexpr uint32_t max_concurrent_streams = 100;
+        static constexpr uint32_t local_window_size = 1 << 20;
+        static constexpr size_t max_buffered_write = 1 << 20;
+        static constexpr uint32_t max_header_list_size = 64 * 1024; ///< Our SETTINGS_MAX_HEADER_LIST_SIZE, also the limit on a header block.
+        static constexpr uint64_t max_drained_body = local_window_size;  ///< See \ref discard_data().
+
+    public:
+        HTTP2Connection(
+          Adaptor&& adaptor,
+          Handler* handler,
+          const detail::static_headers& static_headers,
+          std::tuple<Middlewares...>* middlewares,
+          detail::task_timer& task_timer,
+          std::atomic<unsigned int>& queue_length):
+          adaptor_(std::move(adaptor)),
+          handler_(handler),
+          static_headers_(static_headers),
+          middlewares_(middlewares),
+          task_timer_(task_timer),
+          queue_length_(queue_length)
+        {
+            // Counted as a connection of its thread for as long as it lives, same as the one it took over from
+            queue_length_++;
+        }
 
-            ruleObject->mw_indices_.pack();
+        ~HTTP2Connection()
+        {
+            queue_length_--;
+        }
 
-            ruleObject->foreach_method([&](int method) {
-                per_methods_[method].rules.emplace_back(ruleObject);
-                per_methods_[method].trie.add(rule, per_methods_[method].rules.size() - 1, BP_index != INVALID_BP_ID ? blueprints[BP_index]->prefix().length() : 0, BP_index);
+        /// Start with whatever the HTTP/1 connection already read from the socket (which includes the connection preface).
+        void start(const char* data, size_t length)
+        {
+            CROW_LOG_DEBUG << this << " switched to HTTP/2";
 
-                // directory case:
-                //   request to '/about' url matches '/about/' rule
-                if (has_trailing_slash)
-                {
-                    per_methods_[method].trie.add(rule_without_trailing_slash, RULE_SPECIAL_REDIRECT_SLASH, BP_index != INVALID_BP_ID ? blueprints[BP_index]->prefix().length() : 0, BP_index);
-                }
-            });
+            // Our half of the connection preface, with a larger receive window than the default
+            std::string settings;
+            append_setting(settings, http2::settings_id::MaxConcurrentStreams, max_concurrent_streams);
+            append_setting(settings, http2::settings_id::InitialWindowSize, local_window_size);
+            append_setting(settings, http2::settings_id::MaxHeaderListSize, max_header_list_size);
+            write_frame(http2::frame_type::Settings, 0, 0, settings);
+            write_window_update(0, local_window_size - http2::default_window_size);
 
-            ruleObject->set_added();
+            process_input(data, length);
         }
 
-        void register_blueprint(Blueprint& blueprint)
+    private:
+        void do_read()
         {
-            if (std::find(blueprints_.begin(), blueprints_.end(), &blueprint) == blueprints_.end())
-            {
-                blueprints_.emplace_back(&blueprint);
-            }
-            else
-                throw std::runtime_error("blueprint \"" + blueprint.prefix_ + "\" already exists in router");
+            auto self = this->shared_from_this();
+            adaptor_.socket().async_read_some(
+              asio::buffer(buffer_),
+              [self](const error_code& ec, std::size_t bytes_transferred) {
+                  if (!ec)
+                  {
+                      self->process_input(self->buffer_.data(), bytes_transferred);
+                  }
+                  else
+                  {
+                      CROW_LOG_DEBUG << self << " from read(h2) with description: \"" << ec.message() << '\"';
+                      self->close();
+                  }
+              });
         }
 
-        void get_recursive_child_methods(Blueprint* blueprint, std::vector<HTTPMethod>& methods)
+        /// Handle every complete frame in the input, then send whatever they produced and read more.
+        void process_input(const char* data, size_t length)
         {
-            //we only need to deal with children if the blueprint has absolutely no methods (meaning its index won't be added to the trie)
-            if (blueprint->static_dir_.empty() && blueprint->all_rules_.empty())
+            input_.append(data, length);
+            size_t offset = 0;
+
+            if (!preface_received_)
             {
-                for (Blueprint* bp : blueprint->blueprints_)
+                size_t compared = std::min(input_.size(), http2::connection_preface.size());
+                if (input_.compare(0, compared, http2::connection_preface.data(), compared) != 0)
                 {
-                    get_recursive_child_methods(bp, methods);
+                    close();
+                    return;
+                }
+                if (compared == http2::connection_preface.size())
+                {
+                    preface_received_ = true;
+                    offset = compared;
                 }
             }
-            else if (!blueprint->static_dir_.empty())
-                methods.emplace_back(HTTPMethod::Get);
-            for (auto& rule : blueprint->all_rules_)
+
+            while (preface_received_ && !close_after_write_ && input_.size() - offset >= http2::frame_header_size)
             {
-                rule->foreach_method([&methods](unsigned method) {
-                    HTTPMethod method_final = static_cast<HTTPMethod>(method);
-                    if (std::find(methods.begin(), methods.end(), method_final) == methods.end())
-                        methods.emplace_back(method_final);
-                });
+                const uint8_t* header = reinterpret_cast<const uint8_t*>(input_.data() + offset);
+                uint32_t payload_length = (header[0] << 16) | (header[1] << 8) | header[2];
+                if (payload_length > http2::default_max_frame_size)
+                {
+                    connection_error(http2::error::FrameSizeError);
+                    break;
+                }
+                if (input_.size() - offset - http2::frame_header_size < payload_length)
+                    break;
+
+                handle_frame(static_cast<http2::frame_type>(header[3]), header[4], read_uint32(header + 5) & 0x7fffffff, header + http2::frame_header_size, payload_length);
+                offset += http2::frame_header_size + payload_length;
             }
-        }
+            input_.erase(0, offset);
 
-        void validate_bp()
-        {
-            //Take all the routes from the registered blueprints and add them to `all_rules_` to be processed.
-            detail::middleware_indices blueprint_mw;
-            validate_bp(blueprints_, blueprint_mw);
+            if (streams_.empty())
+                start_deadline();
+            else
+                cancel_deadline_timer();
+
+            flush();
+            if (!close_after_write_ && adaptor_.is_open())
+                do_read();
         }
 
-        void validate_bp(std::vector<Blueprint*> blueprints, detail::middleware_indices& current_mw)
+        void handle_frame(http2::frame_type type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length)
         {
-            for (unsigned i = 0; i < blueprints.size(); i++)
+            // A header block can't be interleaved with any other frame
+            if (header_block_stream_ && (type != http2::frame_type::Continuation || stream_id != header_block_stream_))
             {
-                Blueprint* blueprint = blueprints[i];
-
-                if (blueprint->is_added()) continue;
+                connection_error(http2::error::ProtocolError);
+                return;
+            }
 
-                if (blueprint->static_dir_ == "" && blueprint->all_rules_.empty())
-                {
-                    std::vector<HTTPMethod> methods;
-                    get_recursive_child_methods(blueprint, methods);
-                    for (HTTPMethod x : methods)
+            switch (type)
+            {
+                case http2::frame_type::Data:
+                    on_data(flags, stream_id, payload, length);
+                    break;
+                case http2::frame_type::Headers:
+                    on_headers(flags, stream_id, payload, length);
+                    break;
+                case http2::frame_type::Priority:
+                    if (stream_id == 0)
+                        connection_error(http2::error::ProtocolError);
+                    else if (length != 5)
+                        reset_stream(stream_id, http2::error::FrameSizeError);
+                    break;
+                case http2::frame_type::RstStream:
+                    if (stream_id == 0 || stream_id > last_stream_id_)
+                        connection_error(http2::error::ProtocolError);
+                    else if (length != 4)
+                        connection_error(http2::error::FrameSizeError);
+                    else
                     {
-                        int method_index = static_cast<int>(x);
-                        per_methods_[method_index].trie.add(blueprint->prefix(), 0, blueprint->prefix().length(), method_index);
+                        if (auto draining = find_draining(stream_id); draining != draining_streams_.end())
+                            draining_streams_.erase(draining);
+                        remove_stream(stream_id);
                     }
-                }
-
-                current_mw.merge_back(blueprint->mw_indices_);
-                for (auto& rule : blueprint->all_rules_)
-                {
-                    if (rule && !rule->is_added())
+                    break;
+                case http2::frame_type::Settings:
+                    on_settings(flags, stream_id, payload, length);
+                    break;
+                case http2::frame_type::PushPromise: // Clients can't push
+                    connection_error(http2::error::ProtocolError);
+                    break;
+                case http2::frame_type::Ping:
+                    if (stream_id != 0)
+                        connection_error(http2::error::ProtocolError);
+                    else if (length != 8)
+                        connection_error(http2::error::FrameSizeError);
+                    else if (!(flags & http2::frame_flag::Ack))
+                        write_frame(http2::frame_type::Ping, http2::frame_flag::Ack, 0, std::string_view(reinterpret_cast<const char*>(payload), length));
+                    break;
+                case http2::frame_type::GoAway:
+                    // Finish the streams that are in progress, then close
+                    goaway_received_ = true;
+                    if (streams_.empty())
+                        close_after_write_ = true;
+                    break;
+                case http2::frame_type::WindowUpdate:
+                    on_window_update(stream_id, payload, length);
+                    break;
+                case http2::frame_type::Continuation:
+                    if (!header_block_stream_)
                     {
-                        auto upgraded = rule->upgrade();
-                        if (upgraded)
-                            rule = std::move(upgraded);
-                        rule->validate();
-                        rule->mw_indices_.merge_front(current_mw);
-                        internal_add_rule_object(rule->rule(), rule.get(), i, blueprints);
+                        connection_error(http2::error::ProtocolError);
+                        break;
                     }
-                }
-                validate_bp(blueprint->blueprints_, current_mw);
-                current_mw.pop_back(blueprint->mw_indices_);
-                blueprint->set_added();
+                    // The block can't be skipped without losing the decoder's table, and it's never smaller than the header list it encodes
+                    if (header_block_.size() + length > max_header_list_size)
+                    {
+                        connection_error(http2::error::EnhanceYourCalm);
+                        break;
+                    }
+                    header_block_.append(reinterpret_cast<const char*>(payload), length);
+                    if (flags & http2::frame_flag::EndHeaders)
+                        on_header_block();
+                    break;
+                default: // Unknown frame types are ignored
+                    break;
             }
         }
 
-        void validate()
+        void on_settings(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length)
         {
-            for (auto& rule : all_rules_)
+            if (stream_id != 0)
             {
-                if (rule && !rule->is_added())
-                {
-                    auto upgraded = rule->upgrade();
-                    if (upgraded)
-                        rule = std::move(upgraded);
-                    rule->validate();
-                    internal_add_rule_object(rule->rule(), rule.get());
-                }
+                connection_error(http2::error::ProtocolError);
+                return;
             }
-            for (auto& per_method : per_methods_)
+            if (flags & http2::frame_flag::Ack)
             {
-                per_method.trie.validate();
+                if (length != 0)
+                    connection_error(http2::error::FrameSizeError);
+                return;
             }
-        }
-
-        // TODO maybe add actual_method
-        template<typename Adaptor>
-        void handle_upgrade(const request& req, response& res, Adaptor&& adaptor)
-        {
-            if (req.method >= HTTPMethod::InternalMethodCount)
+            if (length % 6 != 0)
+            {
+                connection_error(http2::error::FrameSizeError);
                 return;
+            }
 
-            auto& per_method = per_methods_[static_cast<int>(req.method)];
-            auto& rules = per_method.rules;
-            unsigned rule_index = per_method.trie.find(req.url).rule_index;
-
-            if (!rule_index)
+            for (uint32_t i = 0; i < length; i += 6)
             {
-                for (auto& method : per_methods_)
+                auto id = static_cast<http2::settings_id>((payload[i] << 8) | payload[i + 1]);
+                uint32_t value = read_uint32(payload + i + 2);
+                switch (id)
                 {
-                    if (method.trie.find(req.url).rule_index)
-                    {
-                        CROW_LOG_DEBUG << "Cannot match method " << req.url << " " << method_name(req.method);
-                        res = response(405);
-                        res.end();
-                        return;
-                    }
+                    case http2::settings_id::HeaderTableSize:
+                        encoder_.set_max_table_size(value);
+                        break;
+                    case http2::settings_id::EnablePush: // We never push
+                        if (value > 1)
+                        {
+                            connection_error(http2::error::ProtocolError);
+                            return;
+                        }
+                        break;
+                    case http2::settings_id::InitialWindowSize:
+                        if (value > http2::max_window_size)
+                        {
+                            connection_error(http2::error::FlowControlError);
+                            return;
+                        }
+                        for (auto& kv : streams_)
+                            kv.second->send_window += static_cast<int64_t>(value) - peer_initial_window_size_;
+                        peer_initial_window_size_ = value;
+                        break;
+                    case http2::settings_id::MaxFrameSize:
+                        if (value < http2::default_max_frame_size || value > 0xffffff)
+                        {
+                            connection_error(http2::error::ProtocolError);
+                            return;
+                        }
+                        peer_max_frame_size_ = value;
+                        break;
+                    default:
+                        break;
                 }
-
-                CROW_LOG_INFO << "Cannot match rules " << req.url;
-                res = response(404);
-                res.end();
-                return;
             }
 
-            if (rule_index >= rules.size())
-                throw std::runtime_error("Trie internal structure corrupted!");
+            write_frame(http2::frame_type::Settings, http2::frame_flag::Ack, 0, {});
+            send_data();
+        }
 
-            if (rule_index == RULE_SPECIAL_REDIRECT_SLASH)
+        void on_window_update(uint32_t stream_id, const uint8_t* payload, uint32_t length)
+        {
+            if (length != 4)
             {
-                CROW_LOG_INFO << "Redirecting to a url with trailing slash: " << req.url;
-                res = response(301);
-                res.add_header("Location", req.url + "/");
-                res.end();
+                connection_error(http2::error::FrameSizeError);
                 return;
             }
 
-            CROW_LOG_DEBUG << "Matched rule (upgrade) '" << rules[rule_index]->rule_ << "' " << static_cast<uint32_t>(req.method) << " / " << rules[rule_index]->get_methods();
-
-            try
-            {
-                rules[rule_index]->handle_upgrade(req, res, std::move(adaptor));
-            }
-            catch (...)
+            uint32_t increment = read_uint32(payload) & 0x7fffffff;
+            if (stream_id == 0)
             {
-                exception_handler_(res);
-                res.end();
-                return;
+                conn_send_window_ += increment;
+                if (increment == 0)
+                    connection_error(http2::error::ProtocolError);
+                else if (conn_send_window_ > http2::max_window_size)
+                    connection_error(http2::error::FlowControlError);
             }
-        }
-
-        void get_found_bp(std::vector<uint16_t>& bp_i, std::vector<Blueprint*>& blueprints, std::vector<Blueprint*>& found_bps, uint16_t index = 0)
-        {
-            // This statement makes 3 assertions:
-            // 1. The index is above 0.
-            // 2. The index does not lie outside the given blueprint list.
-            // 3. The next blueprint we're adding has a prefix that starts the same as the already added blueprint + a slash (the rest is irrelevant).
-            //
-            // This is done to prevent a blueprint that has a prefix of "bp_prefix2" to be assumed as a child of one that has "bp_prefix".
-            //
-            // If any of the assertions is untrue, we delete the last item added, and continue using the blueprint list of the blueprint found before, the topmost being the router's list
-            auto verify_prefix = [&bp_i, &index, &blueprints, &found_bps]() {
-                return index > 0 &&
-                       bp_i[index] < blueprints.size() &&
-                       blueprints[bp_i[index]]->prefix().substr(0, found_bps[index - 1]->prefix().length() + 1).compare(std::string(found_bps[index - 1]->prefix() + '/')) == 0;
-            };
-            if (index < bp_i.size())
+            else
             {
-
-                if (verify_prefix())
-                {
-                    found_bps.push_back(blueprints[bp_i[index]]);
-                    get_found_bp(bp_i, found_bps.back()->blueprints_, found_bps, ++index);
-                }
-                else
-                {
-                    if (found_bps.size() < 2)
-                    {
-                        found_bps.clear();
-                        found_bps.push_back(blueprints_[bp_i[index]]);
-                    }
-                    else
-                    {
-                        found_bps.pop_back();
-                        Blueprint* last_element = found_bps.back();
-                        found_bps.push_back(last_element->blueprints_[bp_i[index]]);
-                    }
-                    get_found_bp(bp_i, found_bps.back()->blueprints_, found_bps, ++index);
-                }
+                auto it = streams_.find(stream_id);
+                if (it == streams_.end())
+                    return; // Streams we already closed can still receive updates
+                it->second->send_window += increment;
+                if (increment == 0)
+                    reset_stream(stream_id, http2::error::ProtocolError);
+                else if (it->second->send_window > http2::max_window_size)
+                    reset_stream(stream_id, http2::error::FlowControlError);
             }
+            send_data();
         }
 
-        /// Is used to handle errors, you insert the error code, found route, request, and response. and it'll either call the appropriate catchall route (considering the blueprint system) and send you a status string (which is mainly used for debug messages), or just set the response code to the proper error code.
-        std::string get_error(unsigned short code, routing_handle_result& found, const request& req, response& res)
+        void on_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length)
         {
-            res.code = code;
-            std::vector<Blueprint*> bps_found;
-            get_found_bp(found.blueprint_indices, blueprints_, bps_found);
-            for (int i = bps_found.size() - 1; i > 0; i--)
+            if (stream_id == 0 || (stream_id & 1) == 0)
             {
-                std::vector<uint16_t> bpi = found.blueprint_indices;
-                if (bps_found[i]->catchall_rule().has_handler())
-                {
-                    try
-                    {
-                        bps_found[i]->catchall_rule().handler_(req, res);
-                    }
-                    catch (...)
-                    {
-                        exception_handler_(res);
-                    }
-#ifdef CROW_ENABLE_DEBUG
-                    return std::string("Redirected to Blueprint \"" + bps_found[i]->prefix() + "\" Catchall rule");
-#else
-                    return std::string();
-#endif
-                }
+                connection_error(http2::error::ProtocolError);
+                return;
             }
-            if (catchall_rule_.has_handler())
+
+            uint32_t start = 0, padding = 0;
+            if (flags & http2::frame_flag::Padded)
             {
-                try
-                {
-                    catchall_rule_.handler_(req, res);
-                }
-                catch (...)
+                if (length < 1)
                 {
-                    exception_handler_(res);
+                    connection_error(http2::error::FrameSizeError);
+                    return;
                 }
-#ifdef CROW_ENABLE_DEBUG
-                return std::string("Redirected to global Catchall rule");
-#else
-                return std::string();
-#endif
+                padding = payload[0];
+                start = 1;
             }
-            return std::string();
+            if (flags & http2::frame_flag::Priority)
+                start += 5;
+            if (start + padding > length)
+            {
+                connection_error(http2::error::ProtocolError);
+                return;
+            }
+
+            header_block_.assign(reinterpret_cast<const char*>(payload + start), length - start - padding);
+            header_block_stream_ = stream_id;
+            header_block_end_stream_ = flags & http2::frame_flag::EndStream;
+            if (flags & http2::frame_flag::EndHeaders)
+                on_header_block();
         }
 
-        std::unique_ptr<routing_handle_result> handle_initial(request& req, response& res)
+        /// A complete header block arrived, which either starts a new request or carries the trailers of one.
+        void on_header_block()
         {
-            HTTPMethod method_actual = req.method;
+            uint32_t stream_id = header_block_stream_;
+            header_block_stream_ = 0;
 
-            std::unique_ptr<routing_handle_result> found{
-              new routing_handle_result(
-                0,
-                std::vector<uint16_t>(),
-                routing_params(),
-                HTTPMethod::InternalMethodCount)}; // This is always returned to avoid a null pointer dereference.
+            // Has to be decoded even if the stream is refused, to keep the decoder's table in sync
+            std::vector<std::pair<std::string, std::string>> headers;
+            auto result = decoder_.decode(reinterpret_cast<const uint8_t*>(header_block_.data()), header_block_.size(), headers, max_header_list_size);
+            if (result == http2::hpack::decode_result::CompressionError)
+            {
+                connection_error(http2::error::CompressionError);
+                return;
+            }
+            // Only the stream is refused, the other ones can go on
+            bool too_large = result == http2::hpack::decode_result::ListTooLarge;
+            if (too_large)
+                CROW_LOG_DEBUG << this << " header list of stream " << stream_id << " is over " << max_header_list_size << " bytes";
 
-            // NOTE(EDev): This most likely will never run since the parser should handle this situation and close the connection before it gets here.
-            if (CROW_UNLIKELY(req.method >= HTTPMethod::InternalMethodCount))
-                return found;
-            else if (req.method == HTTPMethod::Head)
+            // Field names are lowercase in HTTP/2, a request with any other one is malformed
+            bool malformed = std::any_of(headers.begin(), headers.end(), [](const std::pair<std::string, std::string>& header) {
+                return std::any_of(header.first.begin(), header.first.end(), [](char c) {
+                    return c >= 'A' && c <= 'Z';
+                });
+            });
+
+            auto it = streams_.find(stream_id);
+            if (it != streams_.end())
             {
-                *found = per_methods_[static_cast<int>(method_actual)].trie.find(req.url);
-                // support HEAD requests using GET if not defined as method for the requested URL
-                if (!found->rule_index)
+                // Trailers (which are ignored) have to end the stream
+                if (too_large)
+                    reset_stream(stream_id, http2::error::EnhanceYourCalm);
+                else if (malformed || !header_block_end_stream_ || it->second->request_complete)
+                    reset_stream(stream_id, http2::error::ProtocolError);
+                else
                 {
-                    method_actual = HTTPMethod::Get;
-                    *found = per_methods_[static_cast<int>(method_actual)].trie.find(req.url);
-                    if (!found->rule_index) // If a route is still not found, return a 404 without executing the rest of the HEAD specific code.
-                    {
-                        CROW_LOG_DEBUG << "Cannot match rules " << req.url;
-                        res = response(404); //TODO(EDev): Should this redirect to catchall?
-                        res.end();
-                        return found;
-                    }
+                    it->second->request_complete = true;
+                    handle(it->second);
                 }
-
-                res.skip_body = true;
-                found->method = method_actual;
-                return found;
+                return;
             }
-            else if (req.method == HTTPMethod::Options)
+            if (stream_id <= last_stream_id_)
             {
-                std::string allow = "OPTIONS, HEAD";
+                connection_error(http2::error::StreamClosed);
+                return;
+            }
+            last_stream_id_ = stream_id;
 
-                if (req.url == "/*")
-                {
-                    for (int i = 0; i < static_cast<int>(HTTPMethod::InternalMethodCount); i++)
-                    {
-                        if (static_cast<int>(HTTPMethod::Head) == i)
-                            continue; // HEAD is always allowed
+            if (too_large)
+            {
+                reset_stream(stream_id, http2::error::EnhanceYourCalm);
+                return;
+            }
+            if (malformed)
+            {
+                reset_stream(stream_id, http2::error::ProtocolError);
+                return;
+            }
+            if (goaway_received_ || streams_.size() >= max_concurrent_streams)
+            {
+                reset_stream(stream_id, http2::error::RefusedStream);
+                return;
+            }
 
-                        if (!per_methods_[i].trie.is_empty())
-                        {
-                            allow.append(", ");
-                            allow.append(method_name(static_cast<HTTPMethod>(i)));
-                        }
-                    }
-#ifdef CROW_RETURNS_OK_ON_HTTP_OPTIONS_REQUEST
-                    res = response(crow::status::OK);
-#else
-                    res = response(crow::status::NO_CONTENT);
-#endif
+            auto s = std::make_shared<stream>();
+            s->id = stream_id;
+            s->send_window = peer_initial_window_size_;
 
-                    res.set_header("Allow", allow);
-                    res.end();
-                    found->method = method_actual;
-                    return found;
+            request& req = s->req;
+            std::string authority;
+            bool valid = true;
+            req.method = HTTPMethod::InternalMethodCount;
+            for (auto& header : headers)
+            {
+                if (header.first.empty() || header.first[0] != ':')
+                {
+                    req.headers.emplace(std::move(header.first), std::move(header.second));
                 }
-                else
+                else if (header.first == ":method")
                 {
-                    bool rules_matched = false;
                     for (int i = 0; i < static_cast<int>(HTTPMethod::InternalMethodCount); i++)
-                    {
-                        if (per_methods_[i].trie.find(req.url).rule_index)
-                        {
-                            rules_matched = true;
-
-                            if (static_cast<int>(HTTPMethod::Head) == i)
-                                continue; // HEAD is always allowed
-
-                            allow.append(", ");
-                            allow.append(method_name(static_cast<HTTPMethod>(i)));
-                        }
-                    }
-                    if (rules_matched)
-                    {
-#ifdef CROW_RETURNS_OK_ON_HTTP_OPTIONS_REQUEST
-                        res = response(crow::status::OK);
-#else
-                        res = response(crow::status::NO_CONTENT);
-#endif
-                        res.set_header("Allow", allow);
-                        res.end();
-                        found->method = method_actual;
-                        return found;
-                    }
-                    else
-                    {
-                        CROW_LOG_DEBUG << "Cannot match rules " << req.url;
-                        res = response(404); //TODO(EDev): Should this redirect to catchall?
-                        res.end();
-                        return found;
-                    }
+                        if (header.second == method_strings[i])
+                            req.method = static_cast<HTTPMethod>(i);
                 }
+                else if (header.first == ":path")
+                    req.raw_url = std::move(header.second);
+                else if (header.first == ":authority")
+                    authority = std::move(header.second);
+                else if (header.first != ":scheme")
+                    valid = false;
             }
-            else // Every request that isn't a HEAD or OPTIONS request
+            if (!valid || req.raw_url.empty() || req.method == HTTPMethod::InternalMethodCount)
             {
-                *found = per_methods_[static_cast<int>(method_actual)].trie.find(req.url);
-                // TODO(EDev): maybe ending the else here would allow the requests coming from above (after removing the return statement) to be checked on whether they actually point to a route
-                if (!found->rule_index)
-                {
-                    for (auto& per_method : per_methods_)
-                    {
-                        if (per_method.trie.find(req.url).rule_index) //Route found, but in another method
-                        {
-                            const std::string error_message(get_error(405, *found, req, res));
-                            CROW_LOG_DEBUG << "Cannot match method " << req.url << " " << method_name(method_actual) << ". " << error_message;
-                            res.end();
-                            return found;
-                        }
-                    }
-                    //Route does not exist anywhere
+                reset_stream(stream_id, http2::error::ProtocolError);
+                return;
+            }
 
-                    const std::string error_message(get_error(404, *found, req, res));
-                    CROW_LOG_DEBUG << "Cannot match rules " << req.url << ". " << error_message;
-                    res.end();
-                    return found;
-                }
+            if (!authority.empty() && !req.headers.count(known_header::Host))
+                req.headers.emplace("host", std::move(authority));
+            size_t query = req.raw_url.find('?');
+            req.url = req.raw_url.substr(0, query);
+            if (query != std::string::npos)
+                req.url_params = query_string(req.raw_url);
+            req.http_ver_major = 2;
+            req.http_ver_minor = 0;
+#ifdef CROW_ENABLE_COMPRESSION
+            if (!header_block_end_stream_ && handler_->request_decompression_limit())
+            {
+                auto content_encoding = req.headers.find(known_header::ContentEncoding);
+                if (content_encoding != req.headers.end() && compression::decodable(content_encoding->second))
+                    s->inflater.reset(new compression::inflate_context());
+            }
+#endif
+            // Compressed bodies are collected and decompressed as usual
+            if (const multipart::stream_settings* settings = handler_->multipart_streaming(); settings && !header_block_end_stream_ && !req.headers.count(known_header::ContentEncoding))
+            {
+                s->multipart.reset(new multipart::stream_parser());
+                if (!s->multipart->start(req.headers, *settings))
+                    s->multipart.reset();
+            }
 
-                found->method = method_actual;
-                return found;
+            streams_.emplace(stream_id, s);
+            if (header_block_end_stream_)
+            {
+                s->request_complete = true;
+                handle(s);
             }
         }
 
-        template<typename App>
-        void handle(request& req, response& res, routing_handle_result found)
+        void on_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, uint32_t length)
         {
-            HTTPMethod method_actual = found.method;
-            auto& rules = per_methods_[static_cast<int>(method_actual)].rules;
-            unsigned rule_index = found.rule_index;
-
-            if (rule_index >= rules.size())
-                throw std::runtime_error("Trie internal structure corrupted!");
-
-            if (rule_index == RULE_SPECIAL_REDIRECT_SLASH)
+            // Flow control counts the whole payload, padding included
+            conn_recv_unacknowledged_ += length;
+            if (conn_recv_unacknowledged_ > local_window_size)
             {
-                CROW_LOG_INFO << "Redirecting to a url with trailing slash: " << req.url;
-                res = response(301);
-                res.add_header("Location", req.url + "/");
-                res.end();
+                connection_error(http2::error::FlowControlError);
                 return;
             }
+            if (conn_recv_unacknowledged_ >= local_window_size / 2)
+            {
+                write_window_update(0, conn_recv_unacknowledged_);
+                conn_recv_unacknowledged_ = 0;
+            }
 
-            CROW_LOG_DEBUG << "Matched rule '" << rules[rule_index]->rule_ << "' " << static_cast<uint32_t>(req.method) << " / " << rules[rule_index]->get_methods();
-
-            try
+            if (stream_id == 0 || stream_id > last_stream_id_)
             {
-                BaseRule& rule = *rules[rule_index];
-                handle_rule<App>(rule, req, res, found.r_params);
+                connection_error(http2::error::ProtocolError);
+                return;
             }
-            catch (...)
+            if (auto draining = find_draining(stream_id); draining != draining_streams_.end())
             {
-                exception_handler_(res);
-                res.end();
+                discard_data(draining, flags, length);
                 return;
             }
-        }
-
-        template<typename App>
-        typename std::enable_if<std::tuple_size<typename App::mw_container_t>::value != 0, void>::type
-          handle_rule(BaseRule& rule, crow::request& req, crow::response& res, const crow::routing_params& rp)
-        {
-            if (!rule.mw_indices_.empty())
+            auto it = streams_.find(stream_id);
+            if (it == streams_.end() && was_reset(stream_id))
+                return; // Sent before the client got our RST_STREAM
+            if (it == streams_.end() || it->second->request_complete)
             {
-                auto& ctx = *reinterpret_cast<typename App::context_t*>(req.middleware_context);
-                auto& container = *reinterpret_cast<typename App::mw_container_t*>(req.middleware_container);
-                detail::middleware_call_criteria_dynamic<false> crit_fwd(rule.mw_indices_.indices());
-
-                auto glob_completion_handler = std::move(res.complete_request_handler_);
-                res.complete_request_handler_ = [] {};
+                reset_stream(stream_id, http2::error::StreamClosed);
+                return;
+            }
+            // The stream's window is what we advertised, less what arrived since our last WINDOW_UPDATE for it
+            if (it->second->recv_unacknowledged + length > local_window_size)
+            {
+                reset_stream(stream_id, http2::error::FlowControlError);
+                return;
+            }
 
-                detail::middleware_call_helper<decltype(crit_fwd),
-                                               0, typename App::context_t, typename App::mw_container_t>(crit_fwd, container, req, res, ctx);
+            uint32_t start = 0, padding = 0;
+            if (flags & http2::frame_flag::Padded)
+            {
+                padding = length ? payload[0] : 1;
+                start = 1;
+            }
+            if (start + padding > length)
+            {
+                connection_error(http2::error::ProtocolError);
+                return;
+            }
 
-                if (res.completed_)
+            auto s = it->second;
+            const char* data = reinterpret_cast<const char*>(payload + start);
+            size_t size = length - start - padding;
+            if (s->multipart)
+            {
+                int status = s->multipart->feed(data, size);
+                if (!status && (flags & http2::frame_flag::EndStream) && !(status = s->multipart->finish()))
+                    s->req.multipart_message = s->multipart->release();
+                if (status)
                 {
-                    glob_completion_handler();
+                    reject_stream(s, status);
                     return;
                 }
-
-                res.complete_request_handler_ = [&rule, &ctx, &container, &req, &res, glob_completion_handler] {
-                    detail::middleware_call_criteria_dynamic<true> crit_bwd(rule.mw_indices_.indices());
-
-                    detail::after_handlers_call_helper<
-                      decltype(crit_bwd),
-                      std::tuple_size<typename App::mw_container_t>::value - 1,
-                      typename App::context_t,
-                      typename App::mw_container_t>(crit_bwd, container, ctx, req, res);
-                    glob_completion_handler();
-                };
             }
-            rule.handle(req, res, rp);
+#ifdef CROW_ENABLE_COMPRESSION
+            else if (s->inflater)
+            {
+                auto result = s->inflater->decompress(data, size, s->req.body, handler_->request_decompression_limit());
+                if (result == compression::inflate_result::Ok && (flags & http2::frame_flag::EndStream))
+                {
+                    if (s->inflater->complete())
+                    {
+                        // The handler gets the body as if it had been sent as it is
+                        s->inflater.reset();
+                        s->req.headers.erase("Content-Encoding");
+                    }
+                    else
+                        result = compression::inflate_result::Corrupt;
+                }
+                if (result != compression::inflate_result::Ok)
+                {
+                    reject_stream(s, result == compression::inflate_result::TooLarge ? 413 : 400);
+                    return;
+                }
+            }
+#endif
+            else
+                s->req.body.append(data, size);
+            if (flags & http2::frame_flag::EndStream)
+            {
+                s->request_complete = true;
+                handle(s);
+            }
+            else if ((s->recv_unacknowledged += length) >= local_window_size / 2)
+            {
+                write_window_update(stream_id, s->recv_unacknowledged);
+                s->recv_unacknowledged = 0;
+            }
         }
 
-        template<typename App>
-        typename std::enable_if<std::tuple_size<typename App::mw_container_t>::value == 0, void>::type
-          handle_rule(BaseRule& rule, crow::request& req, crow::response& res, const crow::routing_params& rp)
+        /// Answer a request without handling it, when its body can't be taken.
+        void reject_stream(std::shared_ptr<stream> s, int code)
         {
-            rule.handle(req, res, rp);
+            s->request_complete = true;
+            if (draining_streams_.size() >= max_concurrent_streams)
+            {
+                // Too many clients that keep sending, the oldest one is asked to stop if it was answered
+                uint32_t oldest = draining_streams_.front().first;
+                draining_streams_.pop_front();
+                if (!streams_.count(oldest))
+                    reset_stream(oldest, http2::error::NoError);
+            }
+            draining_streams_.emplace_back(s->id, 0);
+            s->req.remote_ip_address = remote_ip();
+            s->start = std::chrono::steady_clock::now();
+            s->res = response(code);
+            complete_stream(s);
         }
 
-        void debug_print()
+        /// Run a complete request through the middlewares and router, same as \ref Connection::handle().
+        void handle(std::shared_ptr<stream> s)
         {
-            for (int i = 0; i < static_cast<int>(HTTPMethod::InternalMethodCount); i++)
+            request& req = s->req;
+            response& res = s->res;
+
+            req.middleware_context = static_cast<void*>(&s->ctx);
+            req.middleware_container = static_cast<void*>(middlewares_);
+            req.io_context = &adaptor_.get_io_context();
+            req.remote_ip_address = remote_ip();
+            s->start = std::chrono::steady_clock::now();
+
+            if (logger::get_access_log_format() == AccessLogFormat::None)
             {
-                Trie& trie_ = per_methods_[i].trie;
-                if (!trie_.is_empty())
-                {
-                    CROW_LOG_DEBUG << method_name(static_cast<HTTPMethod>(i));
-                    trie_.debug_print();
-                }
+                CROW_LOG_INFO << "Request: " << req.remote_ip_address << " " << this << " HTTP/2 (stream " << s->id << ") " << method_name(req.method) << " " << req.url;
+            }
+
+            s->found = handler_->handle_initial(req, res);
+            if (!s->found->rule_index)
+            {
+                s->need_to_call_after_handlers = true;
+                complete_stream(s);
+                return;
             }
-        }
 
-        std::vector<Blueprint*>& blueprints()
-        {
-            return blueprints_;
-        }
+            auto self = this->shared_from_this();
+            res.is_alive_helper_ = [self, s]() -> bool {
+                return !s->reset && self->adaptor_.is_open();
+            };
 
-        std::function<void(crow::response&)>& exception_handler()
-        {
-            return exception_handler_;
+            detail::middleware_call_helper<detail::middleware_call_criteria_only_global,
+                                           0, decltype(s->ctx), decltype(*middlewares_)>({}, *middlewares_, req, res, s->ctx);
+
+            if (!res.completed_)
+            {
+                // Responses completed on another thread are sent from the connection's own one
+                res.complete_request_handler_ = [self, s] {
+                    asio::dispatch(self->adaptor_.get_io_context(), [self, s] {
+                        self->complete_stream(s);
+                        self->flush();
+                    });
+                };
+                s->need_to_call_after_handlers = true;
+                handler_->handle(req, res, s->found);
+            }
+            else
+            {
+                complete_stream(s);
+            }
         }
 
-        static void default_exception_handler(response& res)
+        /// Call the after handle middleware and send the response's headers, the body follows as flow control allows.
+        void complete_stream(std::shared_ptr<stream> s)
         {
-            // any uncaught exceptions become 500s
-            res = response(500);
+            request& req = s->req;
+            response& res = s->res;
 
-            try
+            if (logger::get_access_log_format() == AccessLogFormat::None)
             {
-                throw;
+                CROW_LOG_INFO << "Response: " << this << ' ' << req.raw_url << ' ' << res.code << " (stream " << s->id << ')';
             }
-            catch (const bad_request& e)
+            res.is_alive_helper_ = nullptr;
+            res.complete_request_handler_ = nullptr;
+
+            if (s->need_to_call_after_handlers)
             {
-                res = response (400);
-                res.body = e.what();
+                s->need_to_call_after_handlers = false;
+
+                // call all after_handler of middlewares
+                detail::after_handlers_call_helper<
+                  detail::middleware_call_criteria_only_global,
+                  (static_cast<int>(sizeof...(Middlewares)) - 1),
+                  decltype(s->ctx),
+                  decltype(*middlewares_)>({}, *middlewares_, s->ctx, req, res);
             }
-            catch (const std::exception& e)
+            res.dump_json_body();
+#ifdef CROW_ENABLE_COMPRESSION
+            compression::algorithm algo;
+            if (handler_->compression_used() && detail::choose_encoding(req, res, res.body.size(), handler_->compression_settings(), algo))
+                detail::compress_body(res, algo, handler_->compression_settings());
+#endif
+
+            if (s->reset || !adaptor_.is_open())
             {
-                CROW_LOG_ERROR << "An uncaught exception occurred: " << e.what();
+                res.clear();
+                return;
             }
-            catch (...)
+
+            if (res.is_static_type())
             {
-                CROW_LOG_ERROR << "An uncaught exception occurred. The type was unknown so no information was available.";
+                if (res.file_info.statResult == 0)
+                {
+                    s->file.reset(new std::ifstream(res.file_info.path.c_str(), std::ios::in | std::ios::binary));
+                    s->file_remaining = res.file_info.statbuf.st_size;
+                }
             }
-        }
-
-    private:
-        CatchallRule catchall_rule_;
+            else
+            {
+                s->body = std::move(res.body);
+            }
+            bool end_stream = s->file ? s->file_remaining == 0 : s->body.empty();
 
-        struct PerMethod
-        {
-            std::vector<BaseRule*> rules;
-            Trie trie;
+            logger::log_access(req.remote_ip_address, method_name(req.method), req.raw_url, 2, 0, res.code,
+                               s->file ? s->file_remaining : s->body.size(), std::chrono::steady_clock::now() - s->start);
 
-            // rule index 0, 1 has special meaning; preallocate it to avoid duplication.
-            PerMethod():
-              rules(2) {}
-        };
-        std::array<PerMethod, static_cast<int>(HTTPMethod::InternalMethodCount)> per_methods_;
-        std::vector<std::unique_ptr<BaseRule>> all_rules_;
-        std::vector<Blueprint*> blueprints_;
-        std::function<void(crow::response&)> exception_handler_ = &default_exception_handler;
-    };
-} // namespace crow
+            std::string block;
+            block.reserve(256);
+            encoder_.start_block(block);
+            encoder_.encode(block, ":status", std::to_string(res.code));
 
+            std::string name;
+            for (auto& kv : res.headers)
+            {
+                name.assign(kv.first);
+                for (auto& c : name)
+                    c = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
 
-namespace crow
-{
-    struct CORSHandler;
+                // Connection specific headers are not allowed in HTTP/2
+                if (name == "connection" || name == "keep-alive" || name == "proxy-connection" || name == "transfer-encoding" || name == "upgrade")
+                    continue;
+                encoder_.encode(block, name, kv.second, name != "content-length" && name != "set-cookie" && name != "etag" && name != "last-modified");
+            }
+            if (!res.manual_length_header && !res.headers.count(known_header::ContentLength))
+                encoder_.encode(block, "content-length", std::to_string(s->file ? s->file_remaining : s->body.size()), false);
+            if (!res.headers.count(known_header::Server) && !static_headers_.server_name.empty())
+                encoder_.encode(block, "server", static_headers_.server_name);
+            if (!res.headers.count(known_header::Date))
+                encoder_.encode(block, "date", detail::date_header::instance().value());
+            res.clear();
 
-    /// Used for tuning CORS policies
-    struct CORSRules
-    {
-        friend struct crow::CORSHandler;
+            write_headers(s->id, block, end_stream);
+            s->response_started = true;
+            if (end_stream)
+                finish_stream(*s);
+            else
+                send_data();
+        }
 
-        /// Set Access-Control-Allow-Origin. Default is "*"
-        CORSRules& origin(const std::string& origin)
+        /// Send as much of the pending response bodies as the flow control windows allow.
+        void send_data()
         {
-            origin_ = origin;
-            return *this;
+            for (auto it = streams_.begin(); it != streams_.end() && conn_send_window_ > 0 && write_buffer_.size() < max_buffered_write;)
+            {
+                auto s = (it++)->second;
+                if (!s->response_started)
+                    continue;
+
+                while (conn_send_window_ > 0 && s->send_window > 0 && write_buffer_.size() < max_buffered_write)
+                {
+                    uint64_t remaining = s->file ? s->file_remaining : s->body.size() - s->body_offset;
+                    size_t length = static_cast<size_t>(std::min<uint64_t>({remaining, static_cast<uint64_t>(conn_send_window_), static_cast<uint64_t>(s->send_window), peer_max_frame_size_}));
+                    bool last = length == remaining;
+
+                    size_t frame_start = write_buffer_.size();
+                    write_frame_header(http2::frame_type::Data, last ? http2::frame_flag::EndStream : 0, s->id, length);
+                    if (s->file)
+                    {
+                        write_buffer_.resize(frame_start + http2::frame_header_size + length);
+                        s->file->read(&write_buffer_[frame_start + http2::frame_header_size], length);
+                        if (static_cast<size_t>(s->file->gcount()) != length)
+                        {
+                            // The file changed underneath us
+                            write_buffer_.resize(frame_start);
+                            reset_stream(s->id, http2::error::InternalError);
+                            break;
+                        }
+                        s->file_remaining -= length;
+                    }
+                    else
+                    {
+                        write_buffer_.append(s->body, s->body_offset, length);
+                        s->body_offset += length;
+                    }
+                    conn_send_window_ -= length;
+                    s->send_window -= length;
+
+                    if (last)
+                    {
+                        finish_stream(*s);
+                        break;
+                    }
+                }
+            }
         }
 
-        /// Set Access-Control-Allow-Methods. Default is "*"
-        CORSRules& methods(crow::HTTPMethod method)
+        void remove_stream(uint32_t stream_id)
         {
-            add_list_item(methods_, crow::method_name(method));
-            return *this;
+            auto it = streams_.find(stream_id);
+            if (it == streams_.end())
+                return;
+
+            it->second->reset = true;
+            streams_.erase(it);
+            if (goaway_received_ && streams_.empty())
+                close_after_write_ = true;
         }
 
-        /// Set Access-Control-Allow-Methods. Default is "*"
-        template<typename... Methods>
-        CORSRules& methods(crow::HTTPMethod method, Methods... method_list)
+        /// The response was sent completely.
+        void finish_stream(const stream& s)
         {
-            add_list_item(methods_, crow::method_name(method));
-            methods(method_list...);
-            return *this;
+            auto draining = find_draining(s.id);
+            if (draining != draining_streams_.end() && draining->second > max_drained_body)
+            {
+                draining_streams_.erase(draining);
+                reset_stream(s.id, http2::error::NoError);
+                return;
+            }
+            remove_stream(s.id);
         }
 
-        /// Set Access-Control-Allow-Headers. Default is "*"
-        CORSRules& headers(const std::string& header)
+        std::deque<std::pair<uint32_t, uint64_t>>::iterator find_draining(uint32_t stream_id)
         {
-            add_list_item(headers_, header);
-            return *this;
+            return std::find_if(draining_streams_.begin(), draining_streams_.end(), [stream_id](const auto& d) {
+                return d.first == stream_id;
+            });
         }
 
-        /// Set Access-Control-Allow-Headers. Default is "*"
-        template<typename... Headers>
-        CORSRules& headers(const std::string& header, Headers... header_list)
+        /// Drop the body of a request that was answered before the client sent all of it.
+
+        ///
+        /// Clients don't all show a response that's followed by RST_STREAM before they're done sending, so the body is taken (and its window credited) up to
+        /// \ref max_drained_body. Only then is the client asked to stop with RST_STREAM(NO_ERROR), which RFC 9113 Section 8.1 allows once the response is complete.
+        void discard_data(std::deque<std::pair<uint32_t, uint64_t>>::iterator draining, uint8_t flags, uint32_t length)
         {
-            add_list_item(headers_, header);
-            headers(header_list...);
-            return *this;
+            uint32_t stream_id = draining->first;
+            if (flags & http2::frame_flag::EndStream)
+            {
+                draining_streams_.erase(draining);
+                return;
+            }
+
+            draining->second += length;
+            if (draining->second > max_drained_body && !streams_.count(stream_id))
+            {
+                draining_streams_.erase(draining);
+                reset_stream(stream_id, http2::error::NoError);
+                return;
+            }
+            if (length)
+                write_window_update(stream_id, length);
         }
 
-        /// Set Access-Control-Expose-Headers. Default is none
-        CORSRules& expose(const std::string& header)
+        void reset_stream(uint32_t stream_id, http2::error code)
         {
-            add_list_item(exposed_headers_, header);
-            return *this;
+            std::string payload;
+            append_uint32(payload, static_cast<uint32_t>(code));
+            write_frame(http2::frame_type::RstStream, 0, stream_id, payload);
+            remove_stream(stream_id);
+
+            if (reset_streams_.size() >= max_concurrent_streams)
+                reset_streams_.pop_front();
+            reset_streams_.push_back(stream_id);
         }
 
-        /// Set Access-Control-Expose-Headers. Default is none
-        template<typename... Headers>
-        CORSRules& expose(const std::string& header, Headers... header_list)
+        /// Whether the stream is one of the last ones we reset, whose frames still in flight are ignored.
+        bool was_reset(uint32_t stream_id) const
         {
-            add_list_item(exposed_headers_, header);
-            expose(header_list...);
-            return *this;
+            return std::find(reset_streams_.begin(), reset_streams_.end(), stream_id) != reset_streams_.end();
         }
 
-        /// Set Access-Control-Max-Age. Default is none
-        CORSRules& max_age(int max_age)
+        /// Send GOAWAY and close the connection once it's written.
+        void connection_error(http2::error code)
         {
-            max_age_ = std::to_string(max_age);
-            return *this;
+            if (close_after_write_)
+                return;
+
+            CROW_LOG_DEBUG << this << " HTTP/2 connection error " << static_cast<uint32_t>(code);
+            std::string payload;
+            append_uint32(payload, last_stream_id_);
+            append_uint32(payload, static_cast<uint32_t>(code));
+            write_frame(http2::frame_type::GoAway, 0, 0, payload);
+            close_after_write_ = true;
         }
 
-        /// Enable Access-Control-Allow-Credentials
-        CORSRules& allow_credentials()
+        void write_frame_header(http2::frame_type type, uint8_t flags, uint32_t stream_id, size_t length)
         {
-            allow_credentials_ = true;
-            return *this;
+            char header[http2::frame_header_size] = {
+              static_cast<char>(length >> 16), static_cast<char>(length >> 8), static_cast<char>(length),
+              static_cast<char>(type), static_cast<char>(flags),
+              static_cast<char>(stream_id >> 24), static_cast<char>(stream_id >> 16), static_cast<char>(stream_id >> 8), static_cast<char>(stream_id)};
+            write_buffer_.append(header, http2::frame_header_size);
         }
 
-        /// Ignore CORS and don't send any headers
-        void ignore()
+        void write_frame(http2::frame_type type, uint8_t flags, uint32_t stream_id, std::string_view payload)
         {
-            ignore_ = true;
+            write_frame_header(type, flags, stream_id, payload.size());
+            write_buffer_.append(payload.data(), payload.size());
         }
 
-        /// Handle CORS on specific prefix path
-        CORSRules& prefix(const std::string& prefix);
-
-        /// Handle CORS for specific blueprint
-        CORSRules& blueprint(const Blueprint& bp);
-
-        /// Global CORS policy
-        CORSRules& global();
-
-    private:
-        CORSRules() = delete;
-        CORSRules(CORSHandler* handler):
-          handler_(handler) {}
-
-        /// build comma separated list
-        void add_list_item(std::string& list, const std::string& val)
+        /// Write a header block, split into CONTINUATION frames if it's larger than the peer's maximum frame size.
+        void write_headers(uint32_t stream_id, const std::string& block, bool end_stream)
         {
-            if (list == "*") list = "";
-            if (list.size() > 0) list += ", ";
-            list += val;
+            size_t offset = 0;
+            do
+            {
+                size_t length = std::min<size_t>(block.size() - offset, peer_max_frame_size_);
+                uint8_t flags = (offset + length == block.size()) ? http2::frame_flag::EndHeaders : 0;
+                if (offset == 0 && end_stream)
+                    flags |= http2::frame_flag::EndStream;
+                write_frame(offset == 0 ? http2::frame_type::Headers : http2::frame_type::Continuation, flags, stream_id, std::string_view(block).substr(offset, length));
+                offset += length;
+            } while (offset < block.size());
         }
 
-        /// Set header `key` to `value` if it is not set
-        void set_header_no_override(const std::string& key, const std::string& value, crow::response& res)
+        void write_window_update(uint32_t stream_id, uint32_t increment)
         {
-            if (value.size() == 0) return;
-            if (!get_header_value(res.headers, key).empty()) return;
-            res.add_header(key, value);
+            std::string payload;
+            append_uint32(payload, increment);
+            write_frame(http2::frame_type::WindowUpdate, 0, stream_id, payload);
         }
 
-        /// Set response headers
-        void apply(const request& req, response& res)
+        /// Start writing the buffered frames, unless a write is already in progress (its completion will pick them up).
+        void flush()
         {
-            if (ignore_) return;
-
-            set_header_no_override("Access-Control-Allow-Methods", methods_, res);
-            set_header_no_override("Access-Control-Allow-Headers", headers_, res);
-            set_header_no_override("Access-Control-Expose-Headers", exposed_headers_, res);
-            set_header_no_override("Access-Control-Max-Age", max_age_, res);
-
-            bool origin_set = false;
-
-            if (req.method != HTTPMethod::Options)
+            if (writing_)
+                return;
+            if (write_buffer_.empty())
             {
-                if (allow_credentials_)
-                {
-                    set_header_no_override("Access-Control-Allow-Credentials", "true", res);
-                    if (origin_ == "*")
-                    {
-                        set_header_no_override("Access-Control-Allow-Origin", req.get_header_value("Origin"), res);
-                        origin_set = true;
-                    }
-                }
+                if (close_after_write_)
+                    close();
+                return;
             }
-
-            if( !origin_set){
-                set_header_no_override("Access-Control-Allow-Origin", origin_, res);
+            if (!adaptor_.is_open())
+            {
+                write_buffer_.clear();
+                return;
             }
-        }
-
-        bool ignore_ = false;
-        // TODO: support multiple origins that are dynamically selected
-        std::string origin_ = "*";
-        std::string methods_ = "*";
-        std::string headers_ = "*";
-        std::string exposed_headers_;
-        std::string max_age_;
-        bool allow_credentials_ = false;
 
-        CORSHandler* handler_;
-    };
+            writing_ = true;
+            sending_buffer_.swap(write_buffer_);
+            write_buffer_.clear();
 
-    /// CORSHandler is a global middleware for setting CORS headers.
+            auto self = this->shared_from_this();
+            asio::async_write(
+              adaptor_.socket(), asio::buffer(sending_buffer_),
+              [self](const error_code& ec, std::size_t /*bytes_transferred*/) {
+                  self->writing_ = false;
+                  self->sending_buffer_.clear();
+                  if (ec)
+                  {
+                      CROW_LOG_DEBUG << self << " from write(h2) with description: \"" << ec.message() << '\"';
+                      self->close();
+                      return;
+                  }
 
-    ///
-    /// By default, it sets Access-Control-Allow-Origin/Methods/Headers to "*".
-    /// The default behaviour can be changed with the `global()` cors rule.
-    /// Additional rules for prexies can be added with `prefix()`.
-    struct CORSHandler
-    {
-        struct context
-        {};
+                  // Bodies held back to keep the write buffer small can go out now
+                  self->send_data();
+                  self->flush();
+              });
+        }
 
-        void before_handle(crow::request& /*req*/, crow::response& /*res*/, context& /*ctx*/)
-        {}
+        void close()
+        {
+            cancel_deadline_timer();
+            for (auto& kv : streams_)
+                kv.second->reset = true;
+            streams_.clear();
+            if (adaptor_.is_open())
+            {
+                adaptor_.shutdown_readwrite();
+                adaptor_.close();
+            }
+        }
 
-        void after_handle(crow::request& req, crow::response& res, context& /*ctx*/)
+        void cancel_deadline_timer()
         {
-            auto& rule = find_rule(req.url);
-            rule.apply(req, res);
+            task_timer_.cancel(deadline_);
         }
 
-        /// Handle CORS on a specific prefix path
-        CORSRules& prefix(const std::string& prefix)
+        /// Close the connection if it stays idle (no streams open) for too long.
+        void start_deadline()
         {
-            rules.emplace_back(prefix, CORSRules(this));
-            return rules.back().second;
+            task_timer_.schedule(deadline_);
         }
 
-        /// Handle CORS for a specific blueprint
-        CORSRules& blueprint(const Blueprint& bp)
+        void deadline_expired()
         {
-            rules.emplace_back(bp.prefix(), CORSRules(this));
-            return rules.back().second;
+            auto self = this->shared_from_this();
+            if (!adaptor_.is_open())
+            {
+                return;
+            }
+            adaptor_.shutdown_readwrite();
+            adaptor_.close();
         }
 
-        /// Get the global CORS policy
-        CORSRules& global()
+        /// The client's address, looked up and formatted once for all the streams of the connection.
+        const std::string& remote_ip()
         {
-            return default_;
+            if (remote_ip_.empty())
+                remote_ip_ = adaptor_.remote_endpoint().address().to_string();
+            return remote_ip_;
         }
 
-    private:
-        CORSRules& find_rule(const std::string& path)
+        static uint32_t read_uint32(const uint8_t* p)
         {
-            // TODO: use a trie in case of many rules
-            for (auto& rule : rules)
-            {
-                // Check if path starts with a rules prefix
-                if (path.rfind(rule.first, 0) == 0)
-                {
-                    return rule.second;
-                }
-            }
-            return default_;
+            return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
         }
 
-        std::vector<std::pair<std::string, CORSRules>> rules;
-        CORSRules default_ = CORSRules(this);
-    };
+        static void append_uint32(std::string& out, uint32_t value)
+        {
+            out.push_back(static_cast<char>(value >> 24));
+            out.push_back(static_cast<char>(value >> 16));
+            out.push_back(static_cast<char>(value >> 8));
+            out.push_back(static_cast<char>(value));
+        }
 
-    inline CORSRules& CORSRules::prefix(const std::string& prefix)
-    {
-        return handler_->prefix(prefix);
-    }
+        static void append_setting(std::string& out, http2::settings_id id, uint32_t value)
+        {
+            out.push_back(static_cast<char>(static_cast<uint16_t>(id) >> 8));
+            out.push_back(static_cast<char>(static_cast<uint16_t>(id)));
+            append_uint32(out, value);
+        }
 
-    inline CORSRules& CORSRules::blueprint(const Blueprint& bp)
-    {
-        return handler_->blueprint(bp);
-    }
+    private:
+        Adaptor adaptor_;
+        Handler* handler_;
 
-    inline CORSRules& CORSRules::global()
-    {
-        return handler_->global();
-    }
+        std::array<char, 16384> buffer_;
+        std::string input_;
+        bool preface_received_{};
+        std::string remote_ip_; ///< See \ref remote_ip().
+
+        http2::hpack::decoder decoder_;
+        http2::hpack::encoder encoder_;
+        std::string header_block_;
+        uint32_t header_block_stream_{}; ///< Stream of the header block waiting for CONTINUATION frames, 0 if none.
+        bool header_block_end_stream_{};
+        std::deque<uint32_t> reset_streams_; ///< The last streams we reset, see \ref was_reset().
+        std::deque<std::pair<uint32_t, uint64_t>> draining_streams_; ///< Streams answered before their body was complete, with the bytes dropped so far.
+
+        std::map<uint32_t, std::shared_ptr<stream>> streams_;
+        uint32_t last_stream_id_{};
+        bool goaway_received_{};
+
+        int64_t conn_send_window_{http2::default_window_size};
+        uint32_t conn_recv_unacknowledged_{};
+        uint32_t peer_initial_window_size_{http2::default_window_size};
+        uint32_t peer_max_frame_size_{http2::default_max_frame_size};
+
+        std::string write_buffer_;
+        std::string sending_buffer_;
+        bool writing_{};
+        bool close_after_write_{};
+
+        const detail::static_headers& static_headers_;
+        std::tuple<Middlewares...>* middlewares_;
+        detail::task_timer& task_timer_;
+        std::atomic<unsigned int>& queue_length_;
+        detail::task_timer::member_node<HTTP2Connection, &HTTP2Connection::deadline_expired> deadline_{*this};
+    };
 
 } // namespace crow
 
@@ -13222,6 +21459,7 @@ namespace crow
 
 #include <algorithm>
 #include <atomic>
+#include <charconv>
 #include <chrono>
 #include <memory>
 #include <vector>
@@ -13241,29 +21479,229 @@ namespace crow
     static std::atomic<int> connectionCount;
 #endif
 
+    namespace detail
+    {
+        /// A read buffer borrowed from a per thread pool, and given back to it when released.
+
+        ///
+        /// Connections only hold one while a request is being read, so idle keep-alive connections cost no buffer memory.
+        class pooled_buffer
+        {
+        public:
+            static constexpr size_t small_size = 4096;
+            static constexpr size_t large_size = 65536;
+            static constexpr size_t max_pooled = 64; ///< Per size and thread, anything more is freed.
+
+            pooled_buffer() = default;
+            pooled_buffer(const pooled_buffer&) = delete;
+            pooled_buffer& operator=(const pooled_buffer&) = delete;
+
+            ~pooled_buffer()
+            {
+                release();
+            }
+
+            /// Borrow a buffer of `size` bytes (either \ref small_size or \ref large_size), giving back the current one.
+            void acquire(size_t size)
+            {
+                release();
+                auto& free_buffers = pool(size);
+                if (!free_buffers.empty())
+                {
+                    data_ = std::move(free_buffers.back());
+                    free_buffers.pop_back();
+                }
+                else
+                {
+                    data_.reset(new char[size]);
+                }
+                size_ = size;
+            }
+
+            void release()
+            {
+                if (!data_)
+                    return;
+
+                auto& free_buffers = pool(size_);
+                if (free_buffers.size() < max_pooled)
+                    free_buffers.emplace_back(std::move(data_));
+                data_.reset();
+                size_ = 0;
+            }
+
+            char* data()
+            {
+                return data_.get();
+            }
+
+            size_t size() const
+            {
+                return size_;
+            }
+
+            explicit operator bool() const
+            {
+                return static_cast<bool>(data_);
+            }
+
+        private:
+            static std::vector<std::unique_ptr<char[]>>& pool(size_t size)
+            {
+                thread_local std::vector<std::unique_ptr<char[]>> small_buffers, large_buffers;
+                return size == small_size ? small_buffers : large_buffers;
+            }
+
+            std::unique_ptr<char[]> data_;
+            size_t size_{0};
+        };
+
+        /// Owns a reference to an object with a non-atomic, intrusive reference count (`add_ref()` and `release()`).
+
+        ///
+        /// Copies have to be made and destroyed on the object's own thread.
+        template<typename T>
+        class intrusive_ptr
+        {
+        public:
+            intrusive_ptr() = default;
+
+            explicit intrusive_ptr(T* p):
+              p_(p)
+            {
+                if (p_)
+                    p_->add_ref();
+            }
+
+            intrusive_ptr(const intrusive_ptr& other):
+              intrusive_ptr(other.p_)
+            {}
+
+            intrusive_ptr(intrusive_ptr&& other) noexcept:
+              p_(other.p_)
+            {
+                other.p_ = nullptr;
+            }
+
+            intrusive_ptr& operator=(intrusive_ptr other) noexcept
+            {
+                std::swap(p_, other.p_);
+                return *this;
+            }
+
+            ~intrusive_ptr()
+            {
+                if (p_)
+                    p_->release();
+            }
+
+            T* get() const
+            {
+                return p_;
+            }
+
+            T* operator->() const
+            {
+                return p_;
+            }
+
+            T& operator*() const
+            {
+                return *p_;
+            }
+
+            explicit operator bool() const
+            {
+                return p_ != nullptr;
+            }
+
+        private:
+            T* p_{nullptr};
+        };
+
+        /// Free list of finished connections belonging to one io_context, only ever used from that io_context's thread.
+        template<typename T>
+        class connection_pool
+        {
+        public:
+            static constexpr size_t max_pooled = 256;
+
+            connection_pool() = default;
+            connection_pool(const connection_pool&) = delete;
+            connection_pool& operator=(const connection_pool&) = delete;
+
+            ~connection_pool()
+            {
+                close();
+            }
+
+            /// Take a connection out of the pool, returns `nullptr` if there is none.
+            T* acquire()
+            {
+                if (free_.empty())
+                    return nullptr;
+                T* connection = free_.back();
+                free_.pop_back();
+                return connection;
+            }
+
+            /// Keep a finished connection for later use, or delete it if the pool is full or closed.
+            void recycle(T* connection)
+            {
+                if (closed_ || free_.size() >= max_pooled)
+                {
+                    delete connection;
+                    return;
+                }
+                free_.push_back(connection);
+            }
+
+            /// Delete every pooled connection, anything recycled afterwards is deleted right away.
+            void close()
+            {
+                closed_ = true;
+                for (T* connection : free_)
+                    delete connection;
+                free_.clear();
+            }
+
+        private:
+            std::vector<T*> free_;
+            bool closed_{false};
+        };
+    } // namespace detail
+
     /// An HTTP connection.
+
+    ///
+    /// Connections are reference counted without atomics (see \ref detail::intrusive_ptr) as they never leave their io_context's thread,
+    /// and are recycled through a \ref detail::connection_pool once finished.
     template<typename Adaptor, typename Handler, typename... Middlewares>
-    class Connection : public std::enable_shared_from_this<Connection<Adaptor, Handler, Middlewares...>>
+    class Connection
     {
         friend struct crow::response;
 
     public:
+        using pool_type = detail::connection_pool<Connection>;
+
         Connection(
           asio::io_context& io_context,
           Handler* handler,
-          const std::string& server_name,
+          const detail::static_headers& static_headers,
           std::tuple<Middlewares...>* middlewares,
-          std::function<std::string()>& get_cached_date_str_f,
           detail::task_timer& task_timer,
-          typename Adaptor::context* adaptor_ctx_,
-          std::atomic<unsigned int>& queue_length):
-          adaptor_(io_context, adaptor_ctx_),
+          typename Adaptor::context* adaptor_ctx,
+          std::atomic<unsigned int>& queue_length,
+          pool_type& pool):
+          io_context_(io_context),
+          adaptor_ctx_(adaptor_ctx),
+          pool_(pool),
+          adaptor_(io_context, adaptor_ctx),
           handler_(handler),
           parser_(this),
           req_(parser_.req),
-          server_name_(server_name),
+          static_headers_(static_headers),
           middlewares_(middlewares),
-          get_cached_date_str(get_cached_date_str_f),
           task_timer_(task_timer),
           res_stream_threshold_(handler->stream_threshold()),
           queue_length_(queue_length)
@@ -13288,12 +21726,45 @@ namespace crow
             return adaptor_.raw_socket();
         }
 
-        void start()
+        void add_ref()
         {
-            auto self = this->shared_from_this();
+            ++ref_count_;
+        }
+
+        /// Drop a reference, the last one sends the connection back to its pool.
+        void release()
+        {
+            if (--ref_count_ > 0)
+                return;
+
+            // Give back what's shared with other connections on this thread, the rest is reset on the next start()
+            cancel_deadline_timer();
+            buffer_.release();
+            // A client that left in the middle of an upload mustn't leave its file open until the next one
+            if (multipart_parser_)
+                multipart_parser_->abort();
+            queue_length_--;
+            pool_.recycle(this);
+        }
+
+        /// Start handling an accepted socket, on the connection's own thread.
+        void start(tcp::socket&& socket)
+        {
+            if (started_)
+                reset();
+            started_ = true;
+            adaptor_.raw_socket() = std::move(socket);
+
+            self_t self(this);
             adaptor_.start([self](const error_code& ec) {
                 if (!ec)
                 {
+                    if (self->handler_->http2_used() && self->adaptor_.alpn_protocol() == "h2")
+                    {
+                        self->start_http2(nullptr, 0);
+                        return;
+                    }
+
                     self->start_deadline();
                     self->parser_.clear();
 
@@ -13312,6 +21783,9 @@ namespace crow
             // if no route is found for the request method, return the response without parsing or processing anything further.
             if (!routing_handle_result_->rule_index)
             {
+                request_start_ = std::chrono::steady_clock::now();
+                if (logger::get_access_log_format() != AccessLogFormat::None)
+                    req_.remote_ip_address = remote_ip();
                 parser_.done();
                 need_to_call_after_handlers_ = true;
                 complete_request();
@@ -13323,18 +21797,50 @@ namespace crow
             // HTTP 1.1 Expect: 100-continue
             if (req_.http_ver_major == 1 && req_.http_ver_minor == 1 && get_header_value(req_.headers, "expect") == "100-continue")
             {
-                continue_requested = true;
+                // Responses to earlier pipelined requests have to go out before this one
+                flush_write_queue();
                 buffers_.clear();
                 static std::string expect_100_continue = "HTTP/1.1 100 Continue\r\n\r\n";
                 buffers_.emplace_back(expect_100_continue.data(), expect_100_continue.size());
                 do_write_sync(buffers_);
             }
+#ifdef CROW_ENABLE_COMPRESSION
+            if (size_t max_size = handler_->request_decompression_limit())
+            {
+                auto content_encoding = req_.headers.find(known_header::ContentEncoding);
+                if (content_encoding != req_.headers.end() && compression::decodable(content_encoding->second))
+                    parser_.decode_body(max_size);
+            }
+#endif
+            // Compressed bodies are collected and decompressed as usual
+            if (const multipart::stream_settings* settings = handler_->multipart_streaming(); settings && !req_.headers.count(known_header::ContentEncoding))
+            {
+                if (!multipart_parser_)
+                    multipart_parser_.reset(new multipart::stream_parser());
+                if (multipart_parser_->start(req_.headers, *settings))
+                    parser_.stream_body();
+            }
+        }
+
+        /// A piece of a body that's parsed as it arrives, see \ref HTTPParser::stream_body().
+        int handle_body(const char* data, size_t size)
+        {
+            return multipart_parser_->feed(data, size);
+        }
+
+        int handle_body_end()
+        {
+            if (int status = multipart_parser_->finish())
+                return status;
+            req_.multipart_message = multipart_parser_->release();
+            return 0;
         }
 
         void handle()
         {
             // TODO(EDev): cancel_deadline_timer should be looked into, it might be a good idea to add it to handle_url() and then restart the timer once everything passes
             cancel_deadline_timer();
+            request_start_ = std::chrono::steady_clock::now();
             bool is_invalid_request = false;
             add_keep_alive_ = false;
 
@@ -13344,14 +21850,14 @@ namespace crow
             req_.middleware_container = static_cast<void*>(middlewares_);
             req_.io_context = &adaptor_.get_io_context();
 
-            req_.remote_ip_address = adaptor_.remote_endpoint().address().to_string();
+            req_.remote_ip_address = remote_ip();
 
             add_keep_alive_ = req_.keep_alive;
             close_connection_ = req_.close_connection;
 
             if (req_.check_version(1, 1)) // HTTP/1.1
             {
-                if (!req_.headers.count("host"))
+                if (!req_.headers.count(known_header::Host))
                 {
                     is_invalid_request = true;
                     res = response(400);
@@ -13361,8 +21867,8 @@ namespace crow
                     // h2 or h2c headers
                     if (req_.get_header_value("upgrade").find("h2")==0)
                     {
-                        // TODO(ipkn): HTTP/2
-                        // currently, ignore upgrade header
+                        // HTTP/2 is only started with prior knowledge or through ALPN (see HTTP2Connection),
+                        // the upgrade header is ignored
                     }
                     else
                     {
@@ -13376,16 +21882,18 @@ namespace crow
                 }
             }
 
-            CROW_LOG_INFO << "Request: " << utility::lexical_cast<std::string>(adaptor_.remote_endpoint()) << " " << this << " HTTP/" << (char)(req_.http_ver_major + '0') << "." << (char)(req_.http_ver_minor + '0') << ' ' << method_name(req_.method) << " " << req_.url;
+            if (logger::get_access_log_format() == AccessLogFormat::None)
+            {
+                CROW_LOG_INFO << "Request: " << req_.remote_ip_address << " " << this << " HTTP/" << (char)(req_.http_ver_major + '0') << "." << (char)(req_.http_ver_minor + '0') << ' ' << method_name(req_.method) << " " << req_.url;
+            }
 
 
             need_to_call_after_handlers_ = false;
             if (!is_invalid_request)
             {
                 res.complete_request_handler_ = nullptr;
-                auto self = this->shared_from_this();
-                res.is_alive_helper_ = [self]() -> bool {
-                    return self->adaptor_.is_open();
+                res.is_alive_helper_ = [this]() -> bool {
+                    return adaptor_.is_open();
                 };
 
                 detail::middleware_call_helper<detail::middleware_call_criteria_only_global,
@@ -13393,13 +21901,17 @@ namespace crow
 
                 if (!res.completed_)
                 {
-                    res.complete_request_handler_ = [self] {
-                        self->complete_request();
+                    // The handler may complete the response on any thread, the connection stays alive
+                    // (without touching its reference count elsewhere) until that's back on its own one
+                    add_ref();
+                    res.complete_request_handler_ = [this] {
+                        asio::dispatch(io_context_, [this] {
+                            complete_request();
+                            release();
+                        });
                     };
                     need_to_call_after_handlers_ = true;
                     handler_->handle(req_, res, routing_handle_result_);
-                    if (add_keep_alive_)
-                        res.set_header("connection", "Keep-Alive");
                 }
                 else
                 {
@@ -13415,7 +21927,10 @@ namespace crow
         /// Call the after handle middleware and send the write the response to the connection.
         void complete_request()
         {
-            CROW_LOG_INFO << "Response: " << this << ' ' << req_.raw_url << ' ' << res.code << ' ' << close_connection_;
+            if (logger::get_access_log_format() == AccessLogFormat::None)
+            {
+                CROW_LOG_INFO << "Response: " << this << ' ' << req_.raw_url << ' ' << res.code << ' ' << close_connection_;
+            }
             res.is_alive_helper_ = nullptr;
 
             if (need_to_call_after_handlers_)
@@ -13429,31 +21944,31 @@ namespace crow
                   decltype(ctx_),
                   decltype(*middlewares_)>({}, *middlewares_, ctx_, req_, res);
             }
+
+            if (res.json_body_)
+            {
+                // Large documents are sent while they're serialized, which takes chunked encoding
+                if (res.json_length_ >= res_stream_threshold_ && req_.http_ver_major == 1 && req_.http_ver_minor >= 1 && !res.headers.count(known_header::ContentLength))
+                    res.set_header("Transfer-Encoding", "chunked");
+                else
+                    res.dump_json_body();
+            }
 #ifdef CROW_ENABLE_COMPRESSION
-            if (!res.body.empty() && handler_->compression_used())
+            compression::algorithm algo;
+            size_t body_size = res.json_body_ ? res.json_length_ : res.body.size();
+            if (handler_->compression_used() && detail::choose_encoding(req_, res, body_size, handler_->compression_settings(), algo))
             {
-                std::string accept_encoding = req_.get_header_value("Accept-Encoding");
-                if (!accept_encoding.empty() && res.compressed)
+                // Large bodies are compressed while they're sent, which takes chunked encoding
+                if (body_size >= res_stream_threshold_ && req_.http_ver_major == 1 && req_.http_ver_minor >= 1)
                 {
-                    switch (handler_->compression_algorithm())
-                    {
-                        case compression::DEFLATE:
-                            if (accept_encoding.find("deflate") != std::string::npos)
-                            {
-                                res.body = compression::compress_string(res.body, compression::algorithm::DEFLATE);
-                                res.set_header("Content-Encoding", "deflate");
-                            }
-                            break;
-                        case compression::GZIP:
-                            if (accept_encoding.find("gzip") != std::string::npos)
-                            {
-                                res.body = compression::compress_string(res.body, compression::algorithm::GZIP);
-                                res.set_header("Content-Encoding", "gzip");
-                            }
-                            break;
-                        default:
-                            break;
-                    }
+                    stream_algorithm_ = algo;
+                    compress_stream_ = true;
+                    detail::set_encoding_headers(res, algo);
+                    res.set_header("Transfer-Encoding", "chunked");
+                }
+                else
+                {
+                    detail::compress_body(res, algo, handler_->compression_settings());
                 }
             }
 #endif
@@ -13468,6 +21983,32 @@ namespace crow
             {
                 do_write_general();
             }
+
+            if (!processing_input_)
+            {
+                // The response was completed asynchronously, nothing else is going to send it
+                flush_write_queue();
+                parser_.clear();
+
+                if (close_connection_)
+                {
+                    adaptor_.shutdown_write();
+                    adaptor_.close();
+                    CROW_LOG_DEBUG << this << " from write (async)";
+                }
+                else if (need_to_start_read_after_complete_)
+                {
+                    need_to_start_read_after_complete_ = false;
+
+                    // Continue with any pipelined requests once the response's sender is done with the connection
+                    self_t self(this);
+                    asio::post(adaptor_.get_io_context(), [self] {
+                        std::string pipelined_input;
+                        pipelined_input.swap(self->pipelined_input_);
+                        self->process_input(pipelined_input.data(), pipelined_input.size());
+                    });
+                }
+            }
         }
 
     private:
@@ -13482,116 +22023,56 @@ namespace crow
                 //delete this;
                 return;
             }
-            // TODO(EDev): HTTP version in status codes should be dynamic
-            // Keep in sync with common.h/status
-            static std::unordered_map<int, std::string> statusCodes = {
-              {status::CONTINUE, "HTTP/1.1 100 Continue\r\n"},
-              {status::SWITCHING_PROTOCOLS, "HTTP/1.1 101 Switching Protocols\r\n"},
-
-              {status::OK, "HTTP/1.1 200 OK\r\n"},
-              {status::CREATED, "HTTP/1.1 201 Created\r\n"},
-              {status::ACCEPTED, "HTTP/1.1 202 Accepted\r\n"},
-              {status::NON_AUTHORITATIVE_INFORMATION, "HTTP/1.1 203 Non-Authoritative Information\r\n"},
-              {status::NO_CONTENT, "HTTP/1.1 204 No Content\r\n"},
-              {status::RESET_CONTENT, "HTTP/1.1 205 Reset Content\r\n"},
-              {status::PARTIAL_CONTENT, "HTTP/1.1 206 Partial Content\r\n"},
-
-              {status::MULTIPLE_CHOICES, "HTTP/1.1 300 Multiple Choices\r\n"},
-              {status::MOVED_PERMANENTLY, "HTTP/1.1 301 Moved Permanently\r\n"},
-              {status::FOUND, "HTTP/1.1 302 Found\r\n"},
-              {status::SEE_OTHER, "HTTP/1.1 303 See Other\r\n"},
-              {status::NOT_MODIFIED, "HTTP/1.1 304 Not Modified\r\n"},
-              {status::TEMPORARY_REDIRECT, "HTTP/1.1 307 Temporary Redirect\r\n"},
-              {status::PERMANENT_REDIRECT, "HTTP/1.1 308 Permanent Redirect\r\n"},
-
-              {status::BAD_REQUEST, "HTTP/1.1 400 Bad Request\r\n"},
-              {status::UNAUTHORIZED, "HTTP/1.1 401 Unauthorized\r\n"},
-              {status::FORBIDDEN, "HTTP/1.1 403 Forbidden\r\n"},
-              {status::NOT_FOUND, "HTTP/1.1 404 Not Found\r\n"},
-              {status::METHOD_NOT_ALLOWED, "HTTP/1.1 405 Method Not Allowed\r\n"},
-              {status::NOT_ACCEPTABLE, "HTTP/1.1 406 Not Acceptable\r\n"},
-              {status::PROXY_AUTHENTICATION_REQUIRED, "HTTP/1.1 407 Proxy Authentication Required\r\n"},
-              {status::CONFLICT, "HTTP/1.1 409 Conflict\r\n"},
-              {status::GONE, "HTTP/1.1 410 Gone\r\n"},
-              {status::PAYLOAD_TOO_LARGE, "HTTP/1.1 413 Payload Too Large\r\n"},
-              {status::UNSUPPORTED_MEDIA_TYPE, "HTTP/1.1 415 Unsupported Media Type\r\n"},
-              {status::RANGE_NOT_SATISFIABLE, "HTTP/1.1 416 Range Not Satisfiable\r\n"},
-              {status::EXPECTATION_FAILED, "HTTP/1.1 417 Expectation Failed\r\n"},
-              {status::PRECONDITION_REQUIRED, "HTTP/1.1 428 Precondition Required\r\n"},
-              {status::TOO_MANY_REQUESTS, "HTTP/1.1 429 Too Many Requests\r\n"},
-              {status::UNAVAILABLE_FOR_LEGAL_REASONS, "HTTP/1.1 451 Unavailable For Legal Reasons\r\n"},
-
-              {status::INTERNAL_SERVER_ERROR, "HTTP/1.1 500 Internal Server Error\r\n"},
-              {status::NOT_IMPLEMENTED, "HTTP/1.1 501 Not Implemented\r\n"},
-              {status::BAD_GATEWAY, "HTTP/1.1 502 Bad Gateway\r\n"},
-              {status::SERVICE_UNAVAILABLE, "HTTP/1.1 503 Service Unavailable\r\n"},
-              {status::GATEWAY_TIMEOUT, "HTTP/1.1 504 Gateway Timeout\r\n"},
-              {status::VARIANT_ALSO_NEGOTIATES, "HTTP/1.1 506 Variant Also Negotiates\r\n"},
-            };
-
-            static const std::string seperator = ": ";
-
-            buffers_.clear();
-            buffers_.reserve(4 * (res.headers.size() + 5) + 3);
-
-            if (!statusCodes.count(res.code))
+            auto status = detail::status_line(res.code);
+            if (status.empty())
             {
                 CROW_LOG_WARNING << this << " status code "
                                  << "(" << res.code << ")"
                                  << " not defined, returning 500 instead";
                 res.code = 500;
+                status = detail::status_line(res.code);
             }
 
-            auto& status = statusCodes.find(res.code)->second;
-            buffers_.emplace_back(status.data(), status.size());
+            if (res.code >= 400 && res.body.empty() && !res.json_body_)
+                res.body = status.substr(9);
 
-            if (res.code >= 400 && res.body.empty())
-                res.body = statusCodes[res.code].substr(9);
+            logger::log_access(req_.remote_ip_address, method_name(req_.method), req_.raw_url, req_.http_ver_major, req_.http_ver_minor, res.code,
+                               res.is_static_type() ? (res.file_info.statResult == 0 ? res.file_info.statbuf.st_size : 0) : res.body.size(),
+                               std::chrono::steady_clock::now() - request_start_);
+
+            // The status line and headers are serialized into the connection's output buffer, so that the response can be cleared
+            // while it waits there for the responses to any other pipelined requests.
+            output_ += status;
 
             for (auto& kv : res.headers)
             {
-                buffers_.emplace_back(kv.first.data(), kv.first.size());
-                buffers_.emplace_back(seperator.data(), seperator.size());
-                buffers_.emplace_back(kv.second.data(), kv.second.size());
-                buffers_.emplace_back(crlf.data(), crlf.size());
+                output_ += kv.first;
+                output_ += ": ";
+                output_ += kv.second;
+                output_ += crlf;
             }
 
-            if (!res.manual_length_header && !res.headers.count("content-length"))
-            {
-                content_length_ = std::to_string(res.body.size());
-                static std::string content_length_tag = "Content-Length: ";
-                buffers_.emplace_back(content_length_tag.data(), content_length_tag.size());
-                buffers_.emplace_back(content_length_.data(), content_length_.size());
-                buffers_.emplace_back(crlf.data(), crlf.size());
-            }
-            if (!res.headers.count("server") && !server_name_.empty())
-            {
-                static std::string server_tag = "Server: ";
-                buffers_.emplace_back(server_tag.data(), server_tag.size());
-                buffers_.emplace_back(server_name_.data(), server_name_.size());
-                buffers_.emplace_back(crlf.data(), crlf.size());
-            }
-            if (!res.headers.count("date"))
+            if (!res.manual_length_header && !res.headers.count(known_header::ContentLength) && !res.headers.count(known_header::TransferEncoding))
             {
-                static std::string date_tag = "Date: ";
-                date_str_ = get_cached_date_str();
-                buffers_.emplace_back(date_tag.data(), date_tag.size());
-                buffers_.emplace_back(date_str_.data(), date_str_.size());
-                buffers_.emplace_back(crlf.data(), crlf.size());
+                char length[24];
+                auto result = std::to_chars(length, length + sizeof(length), res.body.size());
+                output_ += "Content-Length: ";
+                output_.append(length, result.ptr);
+                output_ += crlf;
             }
+            if (!res.headers.count(known_header::Server))
+                output_ += static_headers_.server;
+            if (!res.headers.count(known_header::Date))
+                output_ += detail::date_header::instance().line();
             if (add_keep_alive_)
-            {
-                static std::string keep_alive_tag = "Connection: Keep-Alive";
-                buffers_.emplace_back(keep_alive_tag.data(), keep_alive_tag.size());
-                buffers_.emplace_back(crlf.data(), crlf.size());
-            }
+                output_ += detail::static_headers::keep_alive;
 
-            buffers_.emplace_back(crlf.data(), crlf.size());
+            output_ += crlf;
         }
 
         void do_write_static()
         {
-            asio::write(adaptor_.socket(), buffers_);
+            flush_write_queue(); // Write the response start / headers
 
             if (res.file_info.statResult == 0)
             {
@@ -13606,40 +22087,37 @@ namespace crow
                     is.read(buf, sizeof(buf));
                 }
             }
-            if (close_connection_)
-            {
-                adaptor_.shutdown_readwrite();
-                adaptor_.close();
-                CROW_LOG_DEBUG << this << " from write (static)";
-            }
 
             res.end();
             res.clear();
-            buffers_.clear();
-            parser_.clear();
         }
 
         void do_write_general()
         {
-            if (res.body.length() < res_stream_threshold_)
+            if (res.body.length() < res_stream_threshold_ && !res.json_body_)
             {
-                res_body_copy_.swap(res.body);
-                buffers_.emplace_back(res_body_copy_.data(), res_body_copy_.size());
-
-                do_write_sync(buffers_);
-
-                if (need_to_start_read_after_complete_)
-                {
-                    need_to_start_read_after_complete_ = false;
-                    start_deadline();
-                    do_read();
-                }
+                // Sent along with the responses to any other requests that came in the same read
+                if (res.body.size() <= max_inline_body)
+                    output_ += res.body;
+                else
+                    output_bodies_.emplace_back(output_.size(), std::move(res.body));
+                res.clear();
             }
             else
             {
-                asio::write(adaptor_.socket(), buffers_); // Write the response start / headers
+                flush_write_queue(); // Write the response start / headers
                 cancel_deadline_timer();
-                if (res.body.length() > 0)
+                if (res.json_body_)
+                {
+                    do_write_json();
+                }
+#ifdef CROW_ENABLE_COMPRESSION
+                else if (compress_stream_)
+                {
+                    do_write_compressed();
+                }
+#endif
+                else if (res.body.length() > 0)
                 {
                     std::vector<asio::const_buffer> buffers{1};
                     const uint8_t* data = reinterpret_cast<const uint8_t*>(res.body.data());
@@ -13652,164 +22130,435 @@ namespace crow
                         transferred += to_transfer;
                     }
                 }
-                if (close_connection_)
-                {
-                    adaptor_.shutdown_readwrite();
-                    adaptor_.close();
-                    CROW_LOG_DEBUG << this << " from write (res_stream)";
-                }
 
                 res.end();
                 res.clear();
-                buffers_.clear();
-                parser_.clear();
             }
         }
 
         void do_read()
         {
-            auto self = this->shared_from_this();
+            self_t self(this);
+            if (!buffer_)
+            {
+                // Idle connection, only borrow a buffer once there's something to read
+                adaptor_.async_wait_readable([self](const error_code& ec) {
+                    if (!ec)
+                    {
+                        self->buffer_.acquire(self->read_buffer_size_);
+                        self->do_read();
+                    }
+                    else
+                    {
+                        self->close_after_read_error(ec);
+                    }
+                });
+                return;
+            }
+            if (buffer_.size() != read_buffer_size_)
+                buffer_.acquire(read_buffer_size_);
+
             adaptor_.socket().async_read_some(
-              asio::buffer(buffer_),
+              asio::buffer(buffer_.data(), buffer_.size()),
               [self](const error_code& ec, std::size_t bytes_transferred) {
-                  bool error_while_reading = true;
                   if (!ec)
                   {
-                      bool ret = self->parser_.feed(self->buffer_.data(), bytes_transferred);
-                      if (ret && self->adaptor_.is_open())
-                      {
-                          error_while_reading = false;
-                      }
-                  }
-
-                  if (error_while_reading)
-                  {
-                      self->cancel_deadline_timer();
-                      self->parser_.done();
-                      self->adaptor_.shutdown_read();
-                      self->adaptor_.close();
-                      CROW_LOG_DEBUG << self << " from read(1) with description: \"" << http_errno_description(static_cast<http_errno>(self->parser_.http_errno)) << '\"';
-                  }
-                  else if (self->close_connection_)
-                  {
-                      self->cancel_deadline_timer();
-                      self->parser_.done();
-                      // adaptor will close after write
-                  }
-                  else if (!self->need_to_call_after_handlers_)
-                  {
-                      self->start_deadline();
-                      self->do_read();
+                      // A full buffer suggests there's more waiting, use a larger one until the connection goes idle
+                      if (bytes_transferred == self->buffer_.size())
+                          self->read_buffer_size_ = detail::pooled_buffer::large_size;
+                      self->process_input(self->buffer_.data(), bytes_transferred);
                   }
                   else
                   {
-                      // res will be completed later by user
-                      self->need_to_start_read_after_complete_ = true;
+                      self->close_after_read_error(ec);
                   }
               });
         }
 
-        void do_write()
+        /// Read the rest of a Content-Length delimited body straight into the end of the request's body.
+        void do_read_body()
         {
-            auto self = this->shared_from_this();
-            asio::async_write(
-              adaptor_.socket(), buffers_,
-              [self](const error_code& ec, std::size_t /*bytes_transferred*/) {
-                  self->res.clear();
-                  self->res_body_copy_.clear();
-                  if (!self->continue_requested)
-                  {
-                      self->parser_.clear();
-                  }
-                  else
-                  {
-                      self->continue_requested = false;
-                  }
+            std::string& body = req_.body;
+            size_t offset = body.size();
+            size_t length = static_cast<size_t>(std::min<uint64_t>(parser_.remaining_body_length(), max_body_read));
+            if (body.capacity() < offset + length)
+                body.reserve(std::max(offset + length, body.capacity() * 2));
+            body.resize(offset + length);
 
+            self_t self(this);
+            adaptor_.socket().async_read_some(
+              asio::buffer(&body[offset], length),
+              [self, offset](const error_code& ec, std::size_t bytes_transferred) {
+                  self->req_.body.resize(offset + bytes_transferred);
                   if (!ec)
                   {
-                      if (self->close_connection_)
-                      {
-                          self->adaptor_.shutdown_write();
-                          self->adaptor_.close();
-                          CROW_LOG_DEBUG << self << " from write(1)";
-                      }
+                      self->body_in_place_ = bytes_transferred;
+                      self->process_input(nullptr, 0);
                   }
                   else
                   {
-                      CROW_LOG_DEBUG << self << " from write(2)";
+                      self->close_after_read_error(ec);
                   }
               });
         }
 
-        inline void do_write_sync(std::vector<asio::const_buffer>& buffers)
+        void close_after_read_error(const error_code& ec)
         {
-            error_code ec;
-            asio::write(adaptor_.socket(), buffers, ec);
+            cancel_deadline_timer();
+            parser_.done();
+            adaptor_.shutdown_read();
+            adaptor_.close();
+            CROW_LOG_DEBUG << this << " from read(1) with description: \"" << ec.message() << '\"';
+        }
+
+        /// Handle every complete request in the data (in order), then send all of their responses with a single write.
+
+        ///
+        /// Stops early if a request is completed asynchronously, the rest of the data is kept until its response is sent.
+        void process_input(const char* data, size_t length)
+        {
+            if (!http2_checked_ && length > 0)
+            {
+                // A client with prior knowledge of HTTP/2 support starts with the connection preface
+                http2_checked_ = true;
+                size_t compared = std::min(length, http2::connection_preface.size());
+                if (handler_->http2_used() && http2::connection_preface.compare(0, compared, std::string_view(data, compared)) == 0)
+                {
+                    start_http2(data, length);
+                    return;
+                }
+            }
+
+            bool error_while_reading = false;
+            bool request_in_progress = false;
+
+            processing_input_ = true;
+            while (length > 0 || body_in_place_ > 0)
+            {
+                int parsed = 0;
+                bool ret;
+                if (body_in_place_ > 0)
+                {
+                    ret = parser_.feed_body_in_place(body_in_place_);
+                    body_in_place_ = 0;
+                }
+                else
+                {
+                    ret = parser_.feed(data, static_cast<int>(length), parsed);
+                }
+                if (!ret || !adaptor_.is_open())
+                {
+                    error_while_reading = true;
+                    break;
+                }
+
+                data += parsed;
+                length -= parsed;
+
+                // The rest of the request hasn't arrived yet
+                if (!parser_.is_message_complete())
+                {
+                    request_in_progress = true;
+                    break;
+                }
+
+                if (need_to_call_after_handlers_)
+                {
+                    // res will be completed later by user, the remaining requests have to wait for it
+                    pipelined_input_.assign(data, data + length);
+                    break;
+                }
+
+                parser_.clear();
+                if (close_connection_)
+                    break;
+            }
+            processing_input_ = false;
+
+            flush_write_queue();
 
-            this->res.clear();
-            this->res_body_copy_.clear();
-            if (this->continue_requested)
+            if (error_while_reading)
+            {
+                if (int status = parser_.body_error())
+                {
+                    // Tell the client why before closing, unlike with a malformed request there's a well formed one to answer
+                    std::string reply(detail::status_line(status));
+                    reply += "Content-Length: 0\r\nConnection: close\r\n\r\n";
+                    buffers_.clear();
+                    buffers_.emplace_back(reply.data(), reply.size());
+                    do_write_sync(buffers_);
+                }
+                cancel_deadline_timer();
+                parser_.done();
+                adaptor_.shutdown_read();
+                adaptor_.close();
+                CROW_LOG_DEBUG << this << " from read(1) with description: \"" << http_errno_description(static_cast<http_errno>(parser_.http_errno)) << '\"';
+            }
+            else if (need_to_call_after_handlers_)
+            {
+                // the response (and possibly the connection's shutdown) will be sent by complete_request()
+                need_to_start_read_after_complete_ = !close_connection_;
+            }
+            else if (close_connection_)
             {
-                this->continue_requested = false;
+                cancel_deadline_timer();
+                adaptor_.shutdown_write();
+                adaptor_.close();
+                CROW_LOG_DEBUG << this << " from write(1)";
             }
             else
             {
-                this->parser_.clear();
+                start_deadline();
+                if (parser_.remaining_body_length() > detail::pooled_buffer::small_size && !parser_.decoding_body() && !parser_.streaming_body())
+                {
+                    do_read_body();
+                }
+                else
+                {
+                    if (!request_in_progress)
+                    {
+                        // Between keep-alive requests
+                        buffer_.release();
+                        read_buffer_size_ = detail::pooled_buffer::small_size;
+                    }
+                    do_read();
+                }
+            }
+        }
+
+        /// Hand the socket over to an \ref HTTP2Connection, this connection ends here.
+        void start_http2(const char* data, size_t length)
+        {
+            cancel_deadline_timer();
+            auto connection = std::make_shared<HTTP2Connection<Adaptor, Handler, Middlewares...>>(
+              std::move(adaptor_), handler_, static_headers_, middlewares_, task_timer_, queue_length_);
+            connection->start(data, length);
+        }
+
+        /// Send every queued response (and status line / headers) with a single gather write.
+        void flush_write_queue()
+        {
+            if (output_.empty() && output_bodies_.empty())
+                return;
+
+            if (adaptor_.is_open())
+            {
+                buffers_.clear();
+                size_t position = 0;
+                for (auto& body : output_bodies_)
+                {
+                    if (body.first > position)
+                        buffers_.emplace_back(output_.data() + position, body.first - position);
+                    buffers_.emplace_back(body.second.data(), body.second.size());
+                    position = body.first;
+                }
+                if (output_.size() > position)
+                    buffers_.emplace_back(output_.data() + position, output_.size() - position);
+                do_write_sync(buffers_);
+            }
+            output_.clear();
+            output_bodies_.clear();
+            if (output_.capacity() > max_retained_output)
+                std::string().swap(output_);
+        }
+
+        /// Send one part of a body that goes out with chunked encoding, compressing it first if the body is compressed as it's sent.
+        bool write_body_chunk(const char* data, size_t size, bool finish)
+        {
+#ifdef CROW_ENABLE_COMPRESSION
+            if (compress_stream_)
+            {
+                output_.clear();
+                if (!compression::compress(stream_algorithm_, handler_->compression_settings(), data, size, output_, finish))
+                {
+                    CROW_LOG_ERROR << this << " failed to compress a streamed body with " << compression::encoding_name(stream_algorithm_);
+                    close_connection_ = true;
+                    return false;
+                }
+                data = output_.data();
+                size = output_.size();
+            }
+#endif
+            if (size > 0)
+            {
+                char size_line[24];
+                auto result = std::to_chars(size_line, size_line + sizeof(size_line) - 2, size, 16);
+                result.ptr[0] = '\r';
+                result.ptr[1] = '\n';
+                std::vector<asio::const_buffer> buffers{
+                  asio::buffer(size_line, result.ptr + 2 - size_line),
+                  asio::buffer(data, size),
+                  asio::buffer(finish ? "\r\n0\r\n\r\n" : "\r\n", finish ? 7 : 2)};
+                return do_write_sync(buffers);
+            }
+            else if (finish)
+            {
+                std::vector<asio::const_buffer> last{asio::buffer("0\r\n\r\n", 5)};
+                return do_write_sync(last);
+            }
+            return true;
+        }
+
+        /// Send a JSON body while it's serialized, a chunk at a time.
+        void do_write_json()
+        {
+            bool ok = true;
+            auto flush = [this, &ok](std::string& chunk) {
+                if (ok)
+                    ok = write_body_chunk(chunk.data(), chunk.size(), false);
+            };
+            json::detail::chunked_output<decltype(flush)> out(16384, flush);
+            res.json_body_->dump_to(out);
+            if (ok)
+                ok = write_body_chunk(out.finish().data(), out.finish().size(), true);
+            close_connection_ |= !ok;
+#ifdef CROW_ENABLE_COMPRESSION
+            // The thread's context goes on to its other responses, without what's pending of this one
+            if (!ok && compress_stream_)
+                compression::reset(stream_algorithm_, handler_->compression_settings());
+            compress_stream_ = false;
+#endif
+            output_.clear();
+        }
+
+#ifdef CROW_ENABLE_COMPRESSION
+        /// Send the body in chunks, compressing each part just before it's sent.
+        void do_write_compressed()
+        {
+            const char* data = res.body.data();
+            size_t length = res.body.length();
+
+            // The output buffer was just flushed, it holds each compressed chunk in turn
+            for (size_t transferred = 0; transferred < length;)
+            {
+                size_t to_transfer = CROW_MIN(16384UL, length - transferred);
+                bool finish = transferred + to_transfer == length;
+                if (!write_body_chunk(data + transferred, to_transfer, finish))
+                {
+                    // The thread's context goes on to its other responses, without what's pending of this one
+                    compression::reset(stream_algorithm_, handler_->compression_settings());
+                    break;
+                }
+                transferred += to_transfer;
             }
+            compress_stream_ = false;
+            output_.clear();
+        }
+#endif
+
+        inline bool do_write_sync(std::vector<asio::const_buffer>& buffers)
+        {
+            error_code ec;
+            asio::write(adaptor_.socket(), buffers, ec);
 
             if (ec)
             {
                 CROW_LOG_ERROR << ec << " - happened while sending buffers";
                 CROW_LOG_DEBUG << this << " from write (sync)(2)";
+                return false;
             }
+            return true;
         }
 
         void cancel_deadline_timer()
         {
-            CROW_LOG_DEBUG << this << " timer cancelled: " << &task_timer_ << ' ' << task_id_;
-            task_timer_.cancel(task_id_);
+            CROW_LOG_DEBUG << this << " timer cancelled: " << &task_timer_;
+            task_timer_.cancel(deadline_);
         }
 
         void start_deadline(/*int timeout = 5*/)
         {
-            cancel_deadline_timer();
+            task_timer_.schedule(deadline_);
+            CROW_LOG_DEBUG << this << " timer added: " << &task_timer_;
+        }
 
-            auto self = this->shared_from_this();
-            task_id_ = task_timer_.schedule([self] {
-                if (!self->adaptor_.is_open())
-                {
-                    return;
-                }
-                self->adaptor_.shutdown_readwrite();
-                self->adaptor_.close();
-            });
-            CROW_LOG_DEBUG << this << " timer added: " << &task_timer_ << ' ' << task_id_;
+        void deadline_expired()
+        {
+            self_t self(this);
+            if (!adaptor_.is_open())
+            {
+                return;
+            }
+            adaptor_.shutdown_readwrite();
+            adaptor_.close();
+        }
+
+        /// Get a recycled connection ready for a new socket, keeping the allocations it made so far.
+        void reset()
+        {
+            adaptor_ = Adaptor(io_context_, adaptor_ctx_);
+            parser_.reset();
+            if (multipart_parser_)
+                multipart_parser_->abort();
+            routing_handle_result_.reset();
+            res = response();
+            ctx_ = detail::context<Middlewares...>();
+            output_.clear();
+            output_bodies_.clear();
+            pipelined_input_.clear();
+            read_buffer_size_ = detail::pooled_buffer::small_size;
+            body_in_place_ = 0;
+            close_connection_ = false;
+            http2_checked_ = false;
+            processing_input_ = false;
+            need_to_call_after_handlers_ = false;
+            need_to_start_read_after_complete_ = false;
+            add_keep_alive_ = false;
+            remote_ip_.clear();
         }
 
     private:
+        using self_t = detail::intrusive_ptr<Connection>;
+
+        /// The client's address, looked up and formatted once for all the requests of the connection.
+        const std::string& remote_ip()
+        {
+            if (remote_ip_.empty())
+                remote_ip_ = adaptor_.remote_endpoint().address().to_string();
+            return remote_ip_;
+        }
+
+        static constexpr size_t max_body_read = 1024 * 1024;
+        static constexpr size_t max_inline_body = 4096;        ///< Larger bodies are sent from where they are instead of being copied to \ref output_.
+        static constexpr size_t max_retained_output = 65536;
+
+        asio::io_context& io_context_;
+        typename Adaptor::context* adaptor_ctx_;
+        pool_type& pool_;
+        unsigned int ref_count_{0};
+        bool started_{false};
+
         Adaptor adaptor_;
         Handler* handler_;
 
-        std::array<char, 4096> buffer_;
+        detail::pooled_buffer buffer_;
+        size_t read_buffer_size_{detail::pooled_buffer::small_size};
+        size_t body_in_place_{}; ///< Body bytes read by do_read_body(), waiting to be parsed.
 
         HTTPParser<Connection> parser_;
+        std::unique_ptr<multipart::stream_parser> multipart_parser_; ///< Created for the first streamed multipart body, kept for the connection's next ones.
         std::unique_ptr<routing_handle_result> routing_handle_result_;
         request& req_;
         response res;
 
         bool close_connection_ = false;
 
-        const std::string& server_name_;
+        const detail::static_headers& static_headers_;
         std::vector<asio::const_buffer> buffers_;
 
-        std::string content_length_;
-        std::string date_str_;
-        std::string res_body_copy_;
+        std::string output_;                                         ///< Status lines, headers and small bodies of the responses waiting to be sent.
+        std::vector<std::pair<size_t, std::string>> output_bodies_; ///< Larger bodies waiting to be sent, each with its position in \ref output_.
+        std::string pipelined_input_;
+        std::string remote_ip_; ///< See \ref remote_ip().
 
-        detail::task_timer::identifier_type task_id_{};
+        std::chrono::steady_clock::time_point request_start_{};
+#ifdef CROW_ENABLE_COMPRESSION
+        compression::algorithm stream_algorithm_{}; ///< How to compress the body being streamed, when \ref compress_stream_ is set.
+        bool compress_stream_{};
+#endif
 
-        bool continue_requested{};
+        bool http2_checked_{};
+        bool processing_input_{};
         bool need_to_call_after_handlers_{};
         bool need_to_start_read_after_complete_{};
         bool add_keep_alive_{};
@@ -13817,8 +22566,8 @@ namespace crow
         std::tuple<Middlewares...>* middlewares_;
         detail::context<Middlewares...> ctx_;
 
-        std::function<std::string()>& get_cached_date_str;
         detail::task_timer& task_timer_;
+        detail::task_timer::member_node<Connection, &Connection::deadline_expired> deadline_{*this};
 
         size_t res_stream_threshold_;
 
@@ -13873,14 +22622,16 @@ namespace crow // NOTE: Already documented in "crow/app.h"
              uint16_t concurrency = 1,
              uint8_t timeout = 5,
              typename Adaptor::context* adaptor_ctx = nullptr):
+          task_queue_length_pool_(concurrency - 1),
           acceptor_(io_context_,endpoint),
           signals_(io_context_),
           tick_timer_(io_context_),
+          date_timer_(io_context_),
           handler_(handler),
           concurrency_(concurrency),
           timeout_(timeout),
           server_name_(server_name),
-          task_queue_length_pool_(concurrency_ - 1),
+          static_headers_(server_name_),
           middlewares_(middlewares),
           adaptor_ctx_(adaptor_ctx)
         {}
@@ -13906,8 +22657,10 @@ namespace crow // NOTE: Already documented in "crow/app.h"
         {
             uint16_t worker_thread_count = concurrency_ - 1;
             for (int i = 0; i < worker_thread_count; i++)
+            {
                 io_context_pool_.emplace_back(new asio::io_context());
-            get_cached_date_str_pool_.resize(worker_thread_count);
+                connection_pools_.emplace_back(new connection_pool_t());
+            }
             task_timer_pool_.resize(worker_thread_count);
 
             std::vector<std::future<void>> v;
@@ -13916,38 +22669,13 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 v.push_back(
                   std::async(
                     std::launch::async, [this, i, &init_count] {
-                        // thread local date string get function
-                        auto last = std::chrono::steady_clock::now();
-
-                        std::string date_str;
-                        auto update_date_str = [&] {
-                            auto last_time_t = time(0);
-                            tm my_tm;
-
-#if defined(_MSC_VER) || defined(__MINGW32__)
-                            gmtime_s(&my_tm, &last_time_t);
-#else
-                            gmtime_r(&last_time_t, &my_tm);
-#endif
-                            date_str.resize(100);
-                            size_t date_str_sz = strftime(&date_str[0], 99, "%a, %d %b %Y %H:%M:%S GMT", &my_tm);
-                            date_str.resize(date_str_sz);
-                        };
-                        update_date_str();
-                        get_cached_date_str_pool_[i] = [&]() -> std::string {
-                            if (std::chrono::steady_clock::now() - last >= std::chrono::seconds(1))
-                            {
-                                last = std::chrono::steady_clock::now();
-                                update_date_str();
-                            }
-                            return date_str;
-                        };
-
                         // initializing task timers
                         detail::task_timer task_timer(*io_context_pool_[i]);
                         task_timer.set_default_timeout(timeout_);
                         task_timer_pool_[i] = &task_timer;
                         task_queue_length_pool_[i] = 0;
+                        // The task timer only waits while something is scheduled, keep the thread running until stop()
+                        auto work = asio::make_work_guard(*io_context_pool_[i]);
 
                         init_count++;
                         while (1)
@@ -13965,6 +22693,9 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                                 CROW_LOG_ERROR << "Worker Crash: An uncaught exception occurred: " << e.what();
                             }
                         }
+
+                        // Connections still referenced by pending handlers are deleted along with the io_context
+                        connection_pools_[i]->close();
                     }));
 
             if (tick_function_ && tick_interval_.count() > 0)
@@ -13978,6 +22709,8 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                   });
             }
 
+            update_date();
+
             handler_->port(acceptor_.local_endpoint().port());
 
 
@@ -14005,6 +22738,18 @@ namespace crow // NOTE: Already documented in "crow/app.h"
               .join();
         }
 
+        /// Publish the current Date header for every worker, and again every second.
+        void update_date()
+        {
+            detail::date_header::instance().update();
+            date_timer_.expires_after(std::chrono::seconds(1));
+            date_timer_.async_wait([this](const error_code& ec) {
+                if (ec)
+                    return;
+                update_date();
+            });
+        }
+
         void stop()
         {
             shutting_down_ = true; // Prevent the acceptor from taking new connections
@@ -14072,18 +22817,23 @@ namespace crow // NOTE: Already documented in "crow/app.h"
                 task_queue_length_pool_[context_idx]++;
                 CROW_LOG_DEBUG << &ic << " {" << context_idx << "} queue length: " << task_queue_length_pool_[context_idx];
 
-                auto p = std::make_shared<Connection<Adaptor, Handler, Middlewares...>>(
-                  ic, handler_, server_name_, middlewares_,
-                  get_cached_date_str_pool_[context_idx], *task_timer_pool_[context_idx], adaptor_ctx_, task_queue_length_pool_[context_idx]);
-
                 acceptor_.async_accept(
-                  p->socket(),
-                  [this, p, &ic, context_idx](error_code ec) {
+                  ic,
+                  [this, &ic, context_idx](error_code ec, tcp::socket socket) {
                       if (!ec)
                       {
+                          // Connections are created, recycled and reference counted on their own thread only
                           asio::post(ic,
-                            [p] {
-                                p->start();
+                            [this, &ic, context_idx, socket = std::move(socket)]() mutable {
+                                connection_t* connection = connection_pools_[context_idx]->acquire();
+                                if (!connection)
+                                {
+                                    connection = new connection_t(
+                                      ic, handler_, static_headers_, middlewares_,
+                                      *task_timer_pool_[context_idx], adaptor_ctx_, task_queue_length_pool_[context_idx],
+                                      *connection_pools_[context_idx]);
+                                }
+                                connection->start(std::move(socket));
                             });
                       }
                       else
@@ -14105,10 +22855,15 @@ namespace crow // NOTE: Already documented in "crow/app.h"
         }
 
     private:
+        using connection_t = Connection<Adaptor, Handler, Middlewares...>;
+        using connection_pool_t = typename connection_t::pool_type;
+
+        // Declared before the io_contexts so that they outlive any connection released while those are destroyed
+        std::vector<std::unique_ptr<connection_pool_t>> connection_pools_;
+        std::vector<std::atomic<unsigned int>> task_queue_length_pool_;
         std::vector<std::unique_ptr<asio::io_context>> io_context_pool_;
         asio::io_context io_context_;
         std::vector<detail::task_timer*> task_timer_pool_;
-        std::vector<std::function<std::string()>> get_cached_date_str_pool_;
         tcp::acceptor acceptor_;
         bool shutting_down_ = false;
         bool server_started_{false};
@@ -14117,12 +22872,13 @@ namespace crow // NOTE: Already documented in "crow/app.h"
         asio::signal_set signals_;
 
         asio::basic_waitable_timer<std::chrono::high_resolution_clock> tick_timer_;
+        asio::steady_timer date_timer_;
 
         Handler* handler_;
         uint16_t concurrency_{2};
         std::uint8_t timeout_;
         std::string server_name_;
-        std::vector<std::atomic<unsigned int>> task_queue_length_pool_;
+        detail::static_headers static_headers_;
 
         std::chrono::milliseconds tick_interval_;
         std::function<void()> tick_function_;
@@ -14507,6 +23263,22 @@ namespace crow
             return *this;
         }
 
+        /// \brief Write log messages from a background thread, so that logging never waits on the log handler
+        self_t& async_logging(bool enabled = true)
+        {
+            crow::logger::setAsync(enabled);
+            return *this;
+        }
+
+        /// \brief Log every response as a JSON or tab separated line, with its status, size and latency
+        ///
+        /// The access log replaces the Info level "Request" and "Response" messages, the lines go to the log handler's `log_access()`.
+        self_t& access_log(AccessLogFormat format)
+        {
+            crow::logger::setAccessLogFormat(format);
+            return *this;
+        }
+
         /// \brief Set the response body size (in bytes) beyond which Crow automatically streams responses (Default is 1MiB)
         ///
         /// Any streamed response is unaffected by Crow's timer, and therefore won't timeout before a response is fully sent.
@@ -14557,16 +23329,60 @@ namespace crow
 
 #ifdef CROW_ENABLE_COMPRESSION
 
+        /// \brief Compress response bodies, with the given algorithm whenever the client accepts it as much as the others
         self_t& use_compression(compression::algorithm algorithm)
         {
-            comp_algorithm_ = algorithm;
+            compression_settings_.preferred = algorithm;
             compression_used_ = true;
             return *this;
         }
 
+        /// \brief Set zlib's compression level (gzip and deflate), from 1 (fastest) to 9 (smallest)
+        self_t& compression_level(int level)
+        {
+            compression_settings_.level = level;
+            return *this;
+        }
+
+#ifdef CROW_ENABLE_ZSTD
+        /// \brief Set zstd's compression level (Default is 3)
+        self_t& zstd_compression_level(int level)
+        {
+            compression_settings_.zstd_level = level;
+            return *this;
+        }
+#endif
+
+        /// \brief Set the body size (in bytes) below which responses aren't compressed (Default is 0)
+        self_t& compression_min_size(size_t size)
+        {
+            compression_settings_.min_size = size;
+            return *this;
+        }
+
         compression::algorithm compression_algorithm()
         {
-            return comp_algorithm_;
+            return compression_settings_.preferred;
+        }
+
+        const compression::settings& compression_settings() const
+        {
+            return compression_settings_;
+        }
+
+        /// \brief Transparently decompress gzip and deflate request bodies (their "Content-Encoding" is removed)
+        ///
+        /// Requests whose body would decompress to more than max_size bytes are answered with 413 Payload Too Large.
+        self_t& decompress_requests(size_t max_size = 16 * 1024 * 1024)
+        {
+            request_decompression_limit_ = max_size;
+            return *this;
+        }
+
+        /// The largest decompressed request body allowed, 0 if request bodies aren't decompressed.
+        size_t request_decompression_limit() const
+        {
+            return request_decompression_limit_;
         }
 
         bool compression_used() const
@@ -14575,6 +23391,38 @@ namespace crow
         }
 #endif
 
+        /// \brief Accept HTTP/2 connections
+        ///
+        /// \details Clients can either start with HTTP/2 right away (prior knowledge) or negotiate `h2` through ALPN when SSL is used.
+        /// HTTP/1 clients are served as usual.
+        self_t& use_http2()
+        {
+            http2_used_ = true;
+            return *this;
+        }
+
+        bool http2_used() const
+        {
+            return http2_used_;
+        }
+
+        /// \brief Parse `multipart/form-data` request bodies as they arrive instead of collecting them in `req.body`
+        ///
+        /// \details Parts up to memory_limit bytes stay in memory, larger ones and all file parts are written to temporary files
+        /// in directory (the system's temporary directory if empty), see \ref request::multipart_message and \ref multipart::temp_file.
+        /// Bodies larger than max_size are answered with 413 Payload Too Large (0 for no limit).
+        self_t& stream_multipart(size_t memory_limit = 64 * 1024, uint64_t max_size = 0, std::string directory = {})
+        {
+            multipart_streaming_.reset(new multipart::stream_settings{memory_limit, max_size, std::move(directory)});
+            return *this;
+        }
+
+        /// The settings for parsing multipart bodies as they arrive, nullptr if they're collected in `req.body`.
+        const multipart::stream_settings* multipart_streaming() const
+        {
+            return multipart_streaming_.get();
+        }
+
         /// \brief Apply blueprints
         void add_blueprint()
         {
@@ -14640,6 +23488,8 @@ namespace crow
             if (ssl_used_)
             {
                 router_.using_ssl = true;
+                if (http2_used_)
+                    SSL_CTX_set_alpn_select_cb(ssl_context_.native_handle(), http2::alpn_select_callback, nullptr);
                 ssl_server_ = std::move(std::unique_ptr<ssl_server_t>(new ssl_server_t(this, endpoint, server_name_, &middlewares_, concurrency_, timeout_, &ssl_context_)));
                 ssl_server_->set_tick_function(tick_interval_, tick_function_);
                 ssl_server_->signal_clear();
@@ -14891,9 +23741,12 @@ namespace crow
         bool static_routes_added_{false};
 
 #ifdef CROW_ENABLE_COMPRESSION
-        compression::algorithm comp_algorithm_;
+        compression::settings compression_settings_;
+        size_t request_decompression_limit_{0};
         bool compression_used_{false};
 #endif
+        bool http2_used_{false};
+        std::unique_ptr<multipart::stream_settings> multipart_streaming_;
 
         std::chrono::milliseconds tick_interval_;
         std::function<void()> tick_function_;
@@ -4,9 +4,11 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 #include <cmath>
 #include <memory>
+#include <filesystem>
 #include "mysql_connection.h"
 #include <cppconn/driver.h>
 #include <cppconn/exception.h>
@@ -17,6 +19,12 @@
 // Use specific namespaces to avoid ambiguity
 using namespace std;
 
+// Uploaded place photos, served by the static route as /static/uploads/<file>
+const std::string UPLOAD_DIRECTORY = "static/uploads/";
+
+// Topics a single /ws/places connection can follow at once
+const size_t MAX_PLACE_SUBSCRIPTIONS = 64;
+
 // Helper function to get database connection
 sql::Connection* getConnection() {
 
@@ -115,6 +123,36 @@ crow::response executeQuery(T queryFunc) {
     }
 }
 
+// Helper function to push a place's new rating aggregate to the live feed, all map clients get it on "places"
+// and clients following the place on "place/<id>".
+// It runs once the rating is saved, so errors are only logged: the rating request already succeeded
+void publishRatingUpdate(crow::websocket::broadcaster& feed, int place_id) {
+    try {
+        std::unique_ptr<sql::Connection> con(getConnection());
+        if (!con) return;
+
+        unique_ptr<sql::PreparedStatement> pstmt(con->prepareStatement(
+            "SELECT AVG(stars) as average_rating, COUNT(rating_id) as review_count "
+            "FROM ratings WHERE place_id = ?"
+        ));
+        pstmt->setInt(1, place_id);
+        unique_ptr<sql::ResultSet> res(pstmt->executeQuery());
+        if (!res->next()) return;
+
+        crow::json::wvalue update;
+        update["type"] = "rating";
+        update["place_id"] = place_id;
+        update["average_rating"] = res->isNull("average_rating") ? 0.0 : static_cast<double>(res->getDouble("average_rating"));
+        update["review_count"] = res->getInt("review_count");
+
+        std::string message = update.dump();
+        feed.publish("places", message);
+        feed.publish("place/" + std::to_string(place_id), message);
+    } catch (std::exception& e) {
+        std::cerr << "Failed to publish the rating of place " << place_id << ": " << e.what() << std::endl;
+    }
+}
+
 int main() {
     try {
         // Test database connection at startup
@@ -129,11 +167,18 @@ int main() {
         // Change from SimpleApp to App with CORSHandler
         crow::App<crow::CORSHandler> app;
 
+        // Live rating updates for the map, see /ws/places
+        crow::websocket::broadcaster placeFeed;
+
         // Add a simple root route
         CROW_ROUTE(app, "/")([](){  
             return "Hello world";
         });
 
+        // Multipart bodies (place photos) are parsed as they arrive, with files going to disk instead of memory
+        std::filesystem::create_directories(UPLOAD_DIRECTORY);
+        app.stream_multipart(64 * 1024, 20 * 1024 * 1024);
+
         // CORS middleware
         auto& cors = app.get_middleware<crow::CORSHandler>();
         cors
@@ -350,33 +395,79 @@ int main() {
             }
         );
         
-        // Add a new place
+        // Add a new place, posted as JSON or, with a photo, as multipart/form-data
         CROW_ROUTE(app, "/api/places").methods("POST"_method)(
             [](const crow::request& req) {
-                auto x = crow::json::load(req.body);
-                if (!x) return crow::response(400, "Invalid JSON");
-                
-                if (!x.has("name") || !x.has("latitude") || !x.has("longitude")) {
-                    return crow::response(400, "Missing required fields");
+                std::string name, description, image_url, category;
+                std::string photo_path; // Where the uploaded photo was stored, if there was one
+                double latitude = 0, longitude = 0;
+
+                if (req.multipart_message) {
+                    const auto& parts = req.multipart_message->part_map;
+                    auto field = [&](const std::string& key) {
+                        auto it = parts.find(key);
+                        return it != parts.end() && !it->second.file ? it->second.body : std::string("");
+                    };
+
+                    if (field("name").empty() || field("latitude").empty() || field("longitude").empty()) {
+                        return crow::response(400, "Missing required fields");
+                    }
+                    try {
+                        latitude = std::stod(field("latitude"));
+                        longitude = std::stod(field("longitude"));
+                    } catch (const std::exception&) {
+                        return crow::response(400, "Invalid coordinates");
+                    }
+                    name = field("name");
+                    description = field("description");
+                    category = field("category");
+
+                    auto photo = parts.find("photo");
+                    if (photo != parts.end() && photo->second.file) {
+                        // The upload was already written to a temporary file, keep it under the static directory
+                        const auto& params = photo->second.get_header_object("Content-Disposition").params;
+                        auto filename = params.find("filename");
+                        std::string extension = filename != params.end() ? std::filesystem::path(filename->second).extension().string() : std::string("");
+                        std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+                        if (extension != ".jpg" && extension != ".jpeg" && extension != ".png" && extension != ".webp" && extension != ".gif") {
+                            return crow::response(415, "Unsupported photo type");
+                        }
+
+                        std::string file_name = crow::utility::random_alphanum(16) + extension;
+                        photo_path = UPLOAD_DIRECTORY + file_name;
+                        if (!photo->second.file->move_to(photo_path)) {
+                            return crow::response(500, "Could not store photo");
+                        }
+                        image_url = "/static/uploads/" + file_name;
+                    }
+                } else {
+                    auto x = crow::json::load(req.body);
+                    if (!x) return crow::response(400, "Invalid JSON");
+
+                    if (!x.has("name") || !x.has("latitude") || !x.has("longitude")) {
+                        return crow::response(400, "Missing required fields");
+                    }
+
+                    name = x["name"].s();
+                    description = x.has("description") ? std::string(x["description"].s()) : std::string("");
+                    image_url = x.has("image_url") ? std::string(x["image_url"].s()) : std::string("");
+                    category = x.has("category") ? std::string(x["category"].s()) : std::string("");
+                    latitude = x["latitude"].d();
+                    longitude = x["longitude"].d();
                 }
                 
-                return executeQuery([&](sql::Connection* con) {
+                auto response = executeQuery([&](sql::Connection* con) {
                     unique_ptr<sql::PreparedStatement> pstmt(con->prepareStatement(
                         "INSERT INTO places (name, description, image_url, category, latitude, longitude) "
                         "VALUES (?, ?, ?, ?, ?, ?)"
                     ));
                     
-                    std::string name = x["name"].s();
-                    std::string description = x.has("description") ? std::string(x["description"].s()) : std::string("");
-                    std::string image_url = x.has("image_url") ? std::string(x["image_url"].s()) : std::string("");
-                    std::string category = x.has("category") ? std::string(x["category"].s()) : std::string("");
-                    
                     pstmt->setString(1, name);
                     pstmt->setString(2, description);
                     pstmt->setString(3, image_url);
                     pstmt->setString(4, category);
-                    pstmt->setDouble(5, x["latitude"].d());
-                    pstmt->setDouble(6, x["longitude"].d());
+                    pstmt->setDouble(5, latitude);
+                    pstmt->setDouble(6, longitude);
                     
                     pstmt->executeUpdate();
                     
@@ -390,8 +481,18 @@ int main() {
                     result["success"] = true;
                     result["place_id"] = place_id;
                     result["message"] = "Place added successfully";
+                    if (!image_url.empty()) {
+                        result["image_url"] = image_url;
+                    }
                     return crow::response(201, result);
                 });
+
+                // No place refers to the photo if it couldn't be added
+                if (response.code >= 400 && !photo_path.empty()) {
+                    std::error_code ec;
+                    std::filesystem::remove(photo_path, ec);
+                }
+                return response;
             }
         );
 
@@ -399,7 +500,7 @@ int main() {
         
         // Add a rating to a place
         CROW_ROUTE(app, "/api/ratings").methods("POST"_method)(
-            [](const crow::request& req) {
+            [&placeFeed](const crow::request& req) {
                 auto x = crow::json::load(req.body);
                 if (!x) return crow::response(400, "Invalid JSON");
                 
@@ -412,7 +513,7 @@ int main() {
                     return crow::response(400, "Stars must be between 1 and 5");
                 }
                 
-                return executeQuery([&](sql::Connection* con) {
+                auto response = executeQuery([&](sql::Connection* con) {
                     // Check if user already rated this place
                     unique_ptr<sql::PreparedStatement> checkStmt(con->prepareStatement(
                         "SELECT rating_id FROM ratings WHERE user_id = ? AND place_id = ?"
@@ -462,6 +563,15 @@ int main() {
                         return crow::response(201, result);
                     }
                 });
+
+                // The live feed is updated after this response goes out, the client doesn't wait for it
+                if (response.code < 400) {
+                    int place_id = x["place_id"].i();
+                    asio::post(*req.io_context, [&placeFeed, place_id]() {
+                        publishRatingUpdate(placeFeed, place_id);
+                    });
+                }
+                return response;
             }
         );
         
@@ -726,6 +836,52 @@ int main() {
             }
         );
 
+        // -------------------- Live Updates --------------------
+
+        // Map clients get the rating updates of every place ("places"), and can follow single places
+        // by sending {"subscribe": "place/<id>"} and {"unsubscribe": "..."}.
+        // Each connection keeps its topics in its userdata, to cap how many it follows
+        auto& placesSocket = CROW_WEBSOCKET_ROUTE(app, "/ws/places");
+#ifdef CROW_ENABLE_COMPRESSION
+        // The JSON updates compress well, and are compressed once for all clients
+        placesSocket.permessage_deflate();
+#endif
+        // A map that falls behind only needs the latest updates, so older ones are dropped past 1 MiB
+        placesSocket
+            .send_queue_limit(1 << 20, crow::websocket::overflow_policy::DropOldest)
+            .onopen([&placeFeed](crow::websocket::connection& conn) {
+                conn.userdata(new std::set<std::string>{"places"});
+                placeFeed.subscribe(conn, "places");
+            })
+            .onclose([](crow::websocket::connection& conn, const std::string&, uint16_t) {
+                delete static_cast<std::set<std::string>*>(conn.userdata());
+                conn.userdata(nullptr);
+            })
+            .onmessage([&placeFeed](crow::websocket::connection& conn, const std::string& data, bool) {
+                auto* topics = static_cast<std::set<std::string>*>(conn.userdata());
+                auto x = crow::json::load(data);
+                if (!topics || !x || x.t() != crow::json::type::Object) return;
+
+                auto isTopic = [](const std::string& topic) {
+                    return topic == "places" || (topic.rfind("place/", 0) == 0 && topic.size() > 6 && topic.size() <= 16 &&
+                                                 std::all_of(topic.begin() + 6, topic.end(), [](unsigned char c) { return std::isdigit(c) != 0; }));
+                };
+                if (x.has("subscribe") && x["subscribe"].t() == crow::json::type::String && isTopic(x["subscribe"].s())) {
+                    std::string topic = x["subscribe"].s();
+                    if (topics->count(topic) == 0 && topics->size() >= MAX_PLACE_SUBSCRIPTIONS) {
+                        conn.send_text("{\"error\":\"Too many subscriptions\"}");
+                    } else {
+                        topics->insert(topic);
+                        placeFeed.subscribe(conn, topic);
+                    }
+                }
+                if (x.has("unsubscribe") && x["unsubscribe"].t() == crow::json::type::String) {
+                    std::string topic = x["unsubscribe"].s();
+                    topics->erase(topic);
+                    placeFeed.unsubscribe(conn, topic);
+                }
+            });
+
         // Start the server
         cout << "Starting Crow server on port 18080..." << endl;
         app.port(18080).multithreaded().run();